@@ -0,0 +1,63 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+// Released under MIT License
+// Copyright (c) 2020 Hernan Perrone (hernan.perrone@gmail.com)
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef FT_BENCH_H
+#define FT_BENCH_H
+
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Helpers for the benchmarks. Each benchmark is an executable printing one
+// line per case, built only with FT_BUILD_BENCH.
+
+/// Milliseconds each case is run for, at least
+static const double BENCH_MIN_MS = 500.0;
+
+/// @brief Runs fn, which handles n items per call, for BENCH_MIN_MS
+///
+/// Returns the items handled per second.
+template<typename Fn>
+static double benchRate(size_t n, Fn fn)
+{
+	auto start = std::chrono::steady_clock::now();
+	double elapsed_ms = 0;
+	size_t calls = 0;
+	do {
+		fn();
+		calls++;
+		elapsed_ms = std::chrono::duration<double, std::milli>(
+				std::chrono::steady_clock::now() - start).count();
+	} while (elapsed_ms < BENCH_MIN_MS);
+
+	return (double)(calls * n) * 1000.0 / elapsed_ms;
+}
+
+/// @brief Prints a case as: name, rate and unit
+static void benchReport(const std::string& name, double rate,
+		const std::string& unit)
+{
+	std::cout << std::left << std::setw(40) << name << std::right <<
+			std::setw(12) << std::fixed << std::setprecision(2) << rate <<
+			" " << unit << std::endl;
+}
+
+/// @brief Pseudo random bytes, the same on every run
+static std::vector<uint8_t> benchData(size_t len)
+{
+	std::vector<uint8_t> data(len);
+	uint64_t x = 0x9E3779B97F4A7C15ULL;
+	for (auto& b : data) {
+		x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+		b = (uint8_t)x;
+	}
+	return data;
+}
+
+#endif // FT_BENCH_H
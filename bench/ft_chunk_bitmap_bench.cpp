@@ -0,0 +1,94 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+// Released under MIT License
+// Copyright (c) 2020 Hernan Perrone (hernan.perrone@gmail.com)
+//////////////////////////////////////////////////////////////////////////////
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "ft_bench.hpp"
+#include "file/ft_chunk_bitmap.hpp"
+
+// Time to find the next missing chunk of files of 1M chunks and more, as the
+// server does after each chunk received (mark it, then search from the
+// first chunk), with the ChunkBitmap and with a scan of the bitmap bytes (as
+// FileMetadata::nextMissingChunk() did, without reading the file). Also the
+// time to summarize the bitmap when loaded, and to check it is full.
+//
+// usage: ft_chunk_bitmap_bench
+
+/// Chunks received one by one at the end of the file, as the scan is slow
+static const size_t TAIL_CHUNKS = 2000U;
+
+static size_t scanMissing(const std::vector<uint8_t>& bytes, size_t n_chunks)
+{
+	for (size_t pos = 0; pos < bytes.size(); pos++) {
+		if (bytes[pos] != 0xFF) {
+			for (size_t idx = pos * 8; idx < std::min(n_chunks, pos * 8 + 8);
+					idx++) {
+				if ((bytes[pos] & (0x80 >> (idx % 8))) == 0) {
+					return idx;
+				}
+			}
+		}
+	}
+	return UINT64_MAX;
+}
+
+static double elapsedUs(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double, std::micro>(
+			std::chrono::steady_clock::now() - start).count();
+}
+
+int main()
+{
+	for (size_t n_chunks : { 1U << 20, 1U << 22, 1U << 24 }) {
+		std::string name = std::to_string(n_chunks >> 20) + "M chunks, ";
+		size_t tail = n_chunks - TAIL_CHUNKS;
+
+		// All received but the tail
+		std::vector<uint8_t> bytes((n_chunks + 7) / 8, 0xFF);
+		for (size_t idx = tail; idx < n_chunks; idx++) {
+			bytes[idx / 8] &= (uint8_t)~(0x80 >> (idx % 8));
+		}
+		std::vector<uint8_t> scan_bytes = bytes;
+
+		auto start = std::chrono::steady_clock::now();
+		ft::file::ChunkBitmap bitmap(bytes.data(), n_chunks);
+		benchReport(name + "summarize", elapsedUs(start) / 1000, "ms");
+
+		start = std::chrono::steady_clock::now();
+		size_t sum = 0;
+		for (size_t idx = tail; idx < n_chunks; idx++) {
+			bitmap.mark(idx, 1, true);
+			sum += bitmap.find(0, false);
+		}
+		benchReport(name + "mark + next missing", elapsedUs(start) /
+				TAIL_CHUNKS, "us");
+
+		start = std::chrono::steady_clock::now();
+		for (size_t idx = tail; idx < n_chunks; idx++) {
+			scan_bytes[idx / 8] |= (uint8_t)(0x80 >> (idx % 8));
+			sum += scanMissing(scan_bytes, n_chunks);
+		}
+		benchReport(name + "mark + next missing, scan", elapsedUs(start) /
+				TAIL_CHUNKS, "us");
+
+		volatile bool full = false;
+		double rate = benchRate(1000, [&]() {
+			for (int i = 0; i < 1000; i++) {
+				full = bitmap.isFull();
+			}
+		});
+		benchReport(name + "is full", 1e9 / rate, "ns");
+
+		if (sum == 0 || !full) {
+			std::cout << "Unexpected result" << std::endl;
+		}
+	}
+
+	return 0;
+}
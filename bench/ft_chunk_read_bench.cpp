@@ -0,0 +1,103 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+// Released under MIT License
+// Copyright (c) 2020 Hernan Perrone (hernan.perrone@gmail.com)
+//////////////////////////////////////////////////////////////////////////////
+
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cryptlib.h>
+#include <blake2.h>
+
+#include "ft_bench.hpp"
+#include "file/ft_file.hpp"
+
+// Time per chunk read by the client, in order, with a stream opened and a
+// vector allocated and hashed per chunk (as FileLocal::getChunk() did), and
+// with FileLocal::getChunk() now (one descriptor and read ahead). Each way is
+// measured with the file in the page cache and out of it.
+//
+// usage: ft_chunk_read_bench [FILE_SIZE_MB]
+
+static void dropPageCache(const std::filesystem::path& path)
+{
+	int fd = open(path.c_str(), O_RDONLY);
+	(void)posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	close(fd);
+}
+
+/// Reads all the chunks once, reports the chunks/s and us per chunk
+static void benchChunks(const std::string& name, size_t n_chunks,
+		const std::function<size_t(size_t)>& read_chunk)
+{
+	auto start = std::chrono::steady_clock::now();
+	size_t total = 0;
+	for (size_t i = 0; i < n_chunks; i++) {
+		total += read_chunk(i);
+	}
+	double secs = std::chrono::duration<double>(
+			std::chrono::steady_clock::now() - start).count();
+	benchReport(name, n_chunks / secs, "chunks/s");
+	benchReport(name, secs * 1e6 / n_chunks, "us/chunk");
+	if (total == 0) {
+		std::cout << "Nothing read" << std::endl;
+	}
+}
+
+int main(int argc, char** argv)
+{
+	size_t size = (argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 256U) <<
+			20;
+	auto path = std::filesystem::temp_directory_path() /
+			"ft_chunk_read_bench.bin";
+	{
+		auto data = benchData(size);
+		std::ofstream out(path, std::ios::binary);
+		out.write((const char*)data.data(), data.size());
+	}
+	size_t n_chunks = size / ft::file::CHUNK_SIZE;
+
+	auto read_stream = [&](size_t idx) {
+		std::vector<uint8_t> data(ft::file::CHUNK_SIZE);
+		std::ifstream is(path, std::ios::in | std::ios::binary);
+		is.seekg(idx * ft::file::CHUNK_SIZE, std::ifstream::beg);
+		is.read((char*)data.data(), data.size());
+		is.close();
+
+		std::vector<uint8_t> hash(64);
+		CryptoPP::BLAKE2b blake_hash((unsigned int)64);
+		blake_hash.Update(data.data(), data.size());
+		blake_hash.TruncatedFinal(hash.data(), hash.size());
+		return data.size();
+	};
+
+	auto file = ft::file::File::makeLocalFile(path);
+	auto read_local = [&](size_t idx) {
+		return file->getChunk(idx)->data.size();
+	};
+
+	for (bool cached : { true, false }) {
+		std::string when = cached ? ", cached" : ", not cached";
+		if (!cached) {
+			dropPageCache(path);
+		}
+		benchChunks("stream per chunk" + when, n_chunks, read_stream);
+		if (!cached) {
+			dropPageCache(path);
+			file->dropCache();
+		}
+		benchChunks("FileLocal::getChunk()" + when, n_chunks, read_local);
+	}
+
+	std::filesystem::remove(path);
+	return 0;
+}
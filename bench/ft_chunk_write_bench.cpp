@@ -0,0 +1,100 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+// Released under MIT License
+// Copyright (c) 2020 Hernan Perrone (hernan.perrone@gmail.com)
+//////////////////////////////////////////////////////////////////////////////
+
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "ft_bench.hpp"
+#include "file/ft_fd_cache.hpp"
+#include "file/ft_file.hpp"
+
+// Chunks written per second on the disk of DIR, with a stream opened per
+// chunk and per mark (as FileRemote::saveChunk() and
+// FileMetadata::markChunk() did), with pwrite() through the FdCache, and
+// through FileRemote::saveChunk() (which also hashes the chunks in order).
+//
+// usage: ft_chunk_write_bench [DIR] [N_CHUNKS]
+
+int main(int argc, char** argv)
+{
+	std::filesystem::path dir = argc > 1 ? argv[1] :
+			std::filesystem::temp_directory_path() / "ft_chunk_write_bench";
+	size_t n_chunks = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 20000U;
+	size_t file_size = n_chunks * ft::file::CHUNK_SIZE;
+
+	std::filesystem::remove_all(dir);
+	std::filesystem::create_directories(dir);
+	auto data_path = dir / "data.bin";
+	auto meta_path = dir / ".data.bin.meta";
+	auto chunk = benchData(ft::file::CHUNK_SIZE);
+
+	auto create = [&]() {
+		std::filesystem::resize_file(data_path, 0);
+		std::filesystem::resize_file(data_path, file_size);
+		std::filesystem::resize_file(meta_path, 0);
+		std::filesystem::resize_file(meta_path, n_chunks / 8 + 1);
+	};
+	std::ofstream(data_path).close();
+	std::ofstream(meta_path).close();
+
+	create();
+	size_t idx = 0;
+	benchReport("fstream per chunk and mark", benchRate(1, [&]() {
+		std::fstream fs(data_path, std::ios::in | std::ios::out |
+				std::ios::binary);
+		fs.seekp(idx * ft::file::CHUNK_SIZE);
+		fs.write((const char*)chunk.data(), chunk.size());
+		fs.close();
+
+		std::fstream ms(meta_path, std::ios::in | std::ios::out |
+				std::ios::binary);
+		char b = 0;
+		ms.seekg(idx / 8);
+		ms.read(&b, 1);
+		b |= (char)(1 << (idx % 8));
+		ms.seekp(idx / 8);
+		ms.write(&b, 1);
+		ms.close();
+		idx = (idx + 1) % n_chunks;
+	}), "chunks/s");
+
+	create();
+	idx = 0;
+	ft::file::FdCache fd_cache(128);
+	benchReport("pwrite through the FdCache", benchRate(1, [&]() {
+		fd_cache.open(data_path)->write(chunk.data(), chunk.size(),
+				idx * ft::file::CHUNK_SIZE);
+		auto meta = fd_cache.open(meta_path);
+		uint8_t b = 0;
+		meta->read(&b, 1, idx / 8);
+		b |= (uint8_t)(1 << (idx % 8));
+		meta->write(&b, 1, idx / 8);
+		idx = (idx + 1) % n_chunks;
+	}), "chunks/s");
+
+	// Each run writes the whole file once, in order
+	ft::file::File::setLocalPathPrefix(dir);
+	std::vector<uint8_t> hash(ft::proto::HASH_SIZE, 0);
+	size_t n_runs = 0;
+	double rate = benchRate(n_chunks, [&]() {
+		auto name = "remote" + std::to_string(n_runs++) + ".bin";
+		auto file = ft::file::File::makeRemoteFile(name, hash, file_size,
+				ft::proto::HASH_ALGO_BLAKE2B);
+		for (size_t i = 0; i < n_chunks; i++) {
+			file->saveChunk(std::make_shared<ft::file::FileChunk>(file, i,
+					chunk, std::vector<uint8_t>()));
+		}
+		file->flush();
+		file->discard();
+	});
+	benchReport("FileRemote::saveChunk()", rate, "chunks/s");
+
+	std::filesystem::remove_all(dir);
+	return 0;
+}
@@ -0,0 +1,35 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+// Released under MIT License
+// Copyright (c) 2020 Hernan Perrone (hernan.perrone@gmail.com)
+//////////////////////////////////////////////////////////////////////////////
+
+#include <string>
+
+#include "ft_bench.hpp"
+#include "file/ft_file.hpp"
+#include "protocol/ft_crc32c.hpp"
+
+// Speed of the CRC32C of the chunks on the wire, in GB/s, for the sizes of
+// a chunk, of a message of consecutive chunks and of a large buffer
+
+int main()
+{
+	const size_t sizes[] = {
+		ft::file::CHUNK_SIZE,
+		ft::file::CHUNK_SIZE * ft::proto::CHUNK_RANGE_MAX_CHUNKS,
+		1U << 20,
+	};
+
+	for (size_t size : sizes) {
+		auto data = benchData(size);
+		volatile uint32_t sink = 0;
+		double rate = benchRate(size, [&]() {
+			sink = ft::proto::crc32c(data.data(), data.size(), sink);
+		});
+		benchReport("crc32c " + std::to_string(size) + " B", rate / 1e9,
+				"GB/s");
+	}
+
+	return 0;
+}
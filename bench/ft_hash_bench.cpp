@@ -0,0 +1,113 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+// Released under MIT License
+// Copyright (c) 2020 Hernan Perrone (hernan.perrone@gmail.com)
+//////////////////////////////////////////////////////////////////////////////
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cryptlib.h>
+#include <blake2.h>
+
+#include "ft_bench.hpp"
+#include "file/ft_blake2.hpp"
+
+// Speed of hashing a whole file, in GB/s, with the calc_hash() loop replaced
+// (Crypto++ BLAKE2b fed by 128 bytes ifstream reads, with a memset each) and
+// with the hashes of the offers now, read by 1MB preads. The file is in the
+// page cache, so it is the speed of the hashing, not of the disk.
+//
+// usage: ft_hash_bench [FILE_SIZE_MB]
+
+static const size_t READ_SIZE = 1U << 20;
+
+static void readFile(const std::filesystem::path& path,
+		const std::function<void(const uint8_t*, size_t)>& consume)
+{
+	int fd = open(path.c_str(), O_RDONLY);
+	std::vector<uint8_t> buf(READ_SIZE);
+	off_t offset = 0;
+	ssize_t n_read;
+	while ((n_read = pread(fd, buf.data(), buf.size(), offset)) > 0) {
+		consume(buf.data(), n_read);
+		offset += n_read;
+	}
+	close(fd);
+}
+
+/// Best of 3 runs, in GB/s
+static double benchFile(size_t size, const std::function<void()>& fn)
+{
+	double best = 0;
+	for (int i = 0; i < 3; i++) {
+		auto start = std::chrono::steady_clock::now();
+		fn();
+		double secs = std::chrono::duration<double>(
+				std::chrono::steady_clock::now() - start).count();
+		best = std::max(best, size / secs / 1e9);
+	}
+	return best;
+}
+
+int main(int argc, char** argv)
+{
+	size_t size = (argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 256U) <<
+			20;
+	auto path = std::filesystem::temp_directory_path() / "ft_hash_bench.bin";
+	{
+		auto data = benchData(size);
+		std::ofstream out(path, std::ios::binary);
+		out.write((const char*)data.data(), data.size());
+	}
+
+	uint8_t digest[ft::file::BLAKE2B_DIGEST_SIZE];
+
+	benchReport("calc_hash, Crypto++ 128 B ifstream", benchFile(size, [&]() {
+		CryptoPP::BLAKE2b blake_hash((unsigned int)64);
+		std::ifstream is(path, std::ifstream::in | std::ifstream::binary);
+		std::vector<uint8_t> buf(blake_hash.BlockSize());
+		do {
+			(void)memset(buf.data(), 0, buf.size());
+			is.read((char*)buf.data(), buf.size());
+			blake_hash.Update(buf.data(), is.gcount());
+		} while (is);
+		blake_hash.TruncatedFinal(digest, sizeof(digest));
+	}), "GB/s");
+
+	benchReport("blake2b, Crypto++ 1MB pread", benchFile(size, [&]() {
+		CryptoPP::BLAKE2b blake_hash((unsigned int)64);
+		readFile(path, [&](const uint8_t* data, size_t len) {
+			blake_hash.Update(data, len);
+		});
+		blake_hash.TruncatedFinal(digest, sizeof(digest));
+	}), "GB/s");
+
+	benchReport("blake2b, Blake2b 1MB pread", benchFile(size, [&]() {
+		ft::file::Blake2b blake_hash;
+		readFile(path, [&](const uint8_t* data, size_t len) {
+			blake_hash.update(data, len);
+		});
+		blake_hash.final(digest);
+	}), "GB/s");
+
+	benchReport("blake2bp, Blake2bp 1MB pread", benchFile(size, [&]() {
+		ft::file::Blake2bp blake_hash;
+		readFile(path, [&](const uint8_t* data, size_t len) {
+			blake_hash.update(data, len);
+		});
+		blake_hash.final(digest);
+	}), "GB/s");
+
+	std::filesystem::remove(path);
+	return 0;
+}
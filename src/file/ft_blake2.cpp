@@ -0,0 +1,471 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+// Released under MIT License
+// Copyright (c) 2020 Hernan Perrone (hernan.perrone@gmail.com)
+//////////////////////////////////////////////////////////////////////////////
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FT_BLAKE2_AVX2
+#endif
+
+#include "file/ft_blake2.hpp"
+
+namespace ft { namespace file {
+
+static const uint64_t BLAKE2B_IV[8] = {
+	0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL,
+	0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL,
+	0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL,
+	0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL
+};
+
+static const uint8_t BLAKE2B_SIGMA[12][16] = {
+	{  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },
+	{ 14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3 },
+	{ 11,  8, 12,  0,  5,  2, 15, 13, 10, 14,  3,  6,  7,  1,  9,  4 },
+	{  7,  9,  3,  1, 13, 12, 11, 14,  2,  6,  5, 10,  4,  0, 15,  8 },
+	{  9,  0,  5,  7,  2,  4, 10, 15, 14,  1, 11, 12,  6,  8,  3, 13 },
+	{  2, 12,  6, 10,  0, 11,  8,  3,  4, 13,  7,  5, 15, 14,  1,  9 },
+	{ 12,  5,  1, 15, 14, 13,  4, 10,  0,  7,  6,  3,  9,  2,  8, 11 },
+	{ 13, 11,  7, 14, 12,  1,  3,  9,  5,  0, 15,  4,  8,  6,  2, 10 },
+	{  6, 15, 14,  9, 11,  3,  0,  8, 12,  2, 13,  7,  1,  4, 10,  5 },
+	{ 10,  2,  8,  4,  7,  6,  1,  5, 15, 11,  9, 14,  3, 12, 13,  0 },
+	{  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },
+	{ 14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3 }
+};
+
+// BLAKE2bp tree parameters
+static const uint8_t BLAKE2BP_FANOUT = BLAKE2BP_LANES;
+static const uint8_t BLAKE2BP_DEPTH  = 2;
+
+typedef void (*Compress4Fn)(uint64_t h[8][BLAKE2BP_LANES],
+		const uint8_t* stripe, uint64_t t);
+
+static inline uint64_t rotr64(uint64_t x, int n)
+{
+	return (x >> n) | (x << (64 - n));
+}
+
+static inline uint64_t load64(const uint8_t* p)
+{
+	uint64_t v = 0;
+	for (int i = 7; i >= 0; i--) {
+		v = (v << 8) | p[i];
+	}
+	return v;
+}
+
+static void store_digest(const uint64_t h[8], size_t digest_size,
+		uint8_t* digest_out)
+{
+	for (size_t i = 0; i < digest_size; i++) {
+		digest_out[i] = (h[i / 8] >> (8 * (i % 8))) & 0xff;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////
+// Blake2b class' members
+
+Blake2b::Blake2b(size_t digest_size, uint8_t fanout, uint8_t depth,
+		uint64_t node_offset, uint8_t node_depth, uint8_t inner_size)
+: buf_len(0)
+, digest_size(digest_size)
+{
+	init(this->h, digest_size, fanout, depth, node_offset, node_depth,
+			inner_size);
+	this->t[0] = 0;
+	this->t[1] = 0;
+	memset(this->buf, 0, sizeof(this->buf));
+}
+
+void Blake2b::init(uint64_t h_out[8], size_t digest_size, uint8_t fanout,
+		uint8_t depth, uint64_t node_offset, uint8_t node_depth,
+		uint8_t inner_size)
+{
+	// Parameter block, no key, leaf length, salt nor personalization
+	memcpy(h_out, BLAKE2B_IV, sizeof(BLAKE2B_IV));
+	h_out[0] ^= (uint64_t)digest_size | ((uint64_t)fanout << 16) |
+			((uint64_t)depth << 24);
+	h_out[1] ^= node_offset;
+	h_out[2] ^= (uint64_t)node_depth | ((uint64_t)inner_size << 8);
+}
+
+void Blake2b::update(const uint8_t* data, size_t len)
+{
+	while (len > 0) {
+		// The last block is kept, as it is compressed as such by final()
+		if (this->buf_len == BLAKE2B_BLOCK_SIZE) {
+			this->t[0] += BLAKE2B_BLOCK_SIZE;
+			this->t[1] += (this->t[0] < BLAKE2B_BLOCK_SIZE) ? 1 : 0;
+			compress(this->h, this->buf, this->t[0], this->t[1], false, false);
+			this->buf_len = 0;
+		}
+
+		if (this->buf_len == 0) {
+			while (len > BLAKE2B_BLOCK_SIZE) {
+				this->t[0] += BLAKE2B_BLOCK_SIZE;
+				this->t[1] += (this->t[0] < BLAKE2B_BLOCK_SIZE) ? 1 : 0;
+				compress(this->h, data, this->t[0], this->t[1], false, false);
+				data += BLAKE2B_BLOCK_SIZE;
+				len  -= BLAKE2B_BLOCK_SIZE;
+			}
+		}
+
+		size_t n = std::min(BLAKE2B_BLOCK_SIZE - this->buf_len, len);
+		memcpy(this->buf + this->buf_len, data, n);
+		this->buf_len += n;
+		data += n;
+		len  -= n;
+	}
+}
+
+void Blake2b::final(uint8_t* digest_out, bool last_node) const
+{
+	uint64_t h[8];
+	uint8_t  block[BLAKE2B_BLOCK_SIZE] = {};
+	memcpy(h, this->h, sizeof(h));
+	memcpy(block, this->buf, this->buf_len);
+
+	uint64_t t0 = this->t[0] + this->buf_len;
+	uint64_t t1 = this->t[1] + ((t0 < this->buf_len) ? 1 : 0);
+	compress(h, block, t0, t1, true, last_node);
+
+	store_digest(h, this->digest_size, digest_out);
+}
+
+void Blake2b::save(std::vector<uint8_t>& state_out) const
+{
+	const uint8_t* p = (const uint8_t*)this->h;
+	state_out.insert(state_out.end(), p, p + sizeof(this->h));
+	p = (const uint8_t*)this->t;
+	state_out.insert(state_out.end(), p, p + sizeof(this->t));
+	p = (const uint8_t*)&this->buf_len;
+	state_out.insert(state_out.end(), p, p + sizeof(this->buf_len));
+	state_out.insert(state_out.end(), this->buf, this->buf + sizeof(this->buf));
+}
+
+bool Blake2b::load(const uint8_t* state)
+{
+	size_t buf_len;
+	memcpy(&buf_len, state + sizeof(this->h) + sizeof(this->t),
+			sizeof(buf_len));
+	if (buf_len > BLAKE2B_BLOCK_SIZE) {
+		return false;
+	}
+
+	memcpy(this->h, state, sizeof(this->h));
+	state += sizeof(this->h);
+	memcpy(this->t, state, sizeof(this->t));
+	state += sizeof(this->t) + sizeof(this->buf_len);
+	memcpy(this->buf, state, sizeof(this->buf));
+	this->buf_len = buf_len;
+	return true;
+}
+
+void Blake2b::compress(uint64_t h[8], const uint8_t* block, uint64_t t0,
+		uint64_t t1, bool last, bool last_node)
+{
+	uint64_t m[16];
+	uint64_t v[16];
+	for (int i = 0; i < 16; i++) {
+		m[i] = load64(block + i * 8);
+	}
+	for (int i = 0; i < 8; i++) {
+		v[i]     = h[i];
+		v[i + 8] = BLAKE2B_IV[i];
+	}
+	v[12] ^= t0;
+	v[13] ^= t1;
+	if (last) {
+		v[14] = ~v[14];
+	}
+	if (last_node) {
+		v[15] = ~v[15];
+	}
+
+	auto g = [&v](int a, int b, int c, int d, uint64_t x, uint64_t y) {
+		v[a] = v[a] + v[b] + x;
+		v[d] = rotr64(v[d] ^ v[a], 32);
+		v[c] = v[c] + v[d];
+		v[b] = rotr64(v[b] ^ v[c], 24);
+		v[a] = v[a] + v[b] + y;
+		v[d] = rotr64(v[d] ^ v[a], 16);
+		v[c] = v[c] + v[d];
+		v[b] = rotr64(v[b] ^ v[c], 63);
+	};
+
+	for (int r = 0; r < 12; r++) {
+		const uint8_t* s = BLAKE2B_SIGMA[r];
+		g(0, 4,  8, 12, m[s[0]],  m[s[1]]);
+		g(1, 5,  9, 13, m[s[2]],  m[s[3]]);
+		g(2, 6, 10, 14, m[s[4]],  m[s[5]]);
+		g(3, 7, 11, 15, m[s[6]],  m[s[7]]);
+		g(0, 5, 10, 15, m[s[8]],  m[s[9]]);
+		g(1, 6, 11, 12, m[s[10]], m[s[11]]);
+		g(2, 7,  8, 13, m[s[12]], m[s[13]]);
+		g(3, 4,  9, 14, m[s[14]], m[s[15]]);
+	}
+
+	for (int i = 0; i < 8; i++) {
+		h[i] ^= v[i] ^ v[i + 8];
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////
+// 4-lane compression functions
+
+static void compress4_sw(uint64_t h[8][BLAKE2BP_LANES],
+		const uint8_t* stripe, uint64_t t)
+{
+	for (size_t lane = 0; lane < BLAKE2BP_LANES; lane++) {
+		uint64_t lane_h[8];
+		for (int i = 0; i < 8; i++) {
+			lane_h[i] = h[i][lane];
+		}
+		Blake2b::compress(lane_h, stripe + lane * BLAKE2B_BLOCK_SIZE, t, 0,
+				false, false);
+		for (int i = 0; i < 8; i++) {
+			h[i][lane] = lane_h[i];
+		}
+	}
+}
+
+#if defined(FT_BLAKE2_AVX2)
+
+__attribute__((target("avx2")))
+static inline void g4(__m256i v[16], int a, int b, int c, int d, __m256i x,
+		__m256i y)
+{
+	const __m256i rot16 = _mm256_setr_epi8(
+			2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9,
+			2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9);
+	const __m256i rot24 = _mm256_setr_epi8(
+			3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10,
+			3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10);
+
+	v[a] = _mm256_add_epi64(_mm256_add_epi64(v[a], v[b]), x);
+	v[d] = _mm256_shuffle_epi32(_mm256_xor_si256(v[d], v[a]),
+			_MM_SHUFFLE(2, 3, 0, 1));
+	v[c] = _mm256_add_epi64(v[c], v[d]);
+	v[b] = _mm256_shuffle_epi8(_mm256_xor_si256(v[b], v[c]), rot24);
+	v[a] = _mm256_add_epi64(_mm256_add_epi64(v[a], v[b]), y);
+	v[d] = _mm256_shuffle_epi8(_mm256_xor_si256(v[d], v[a]), rot16);
+	v[c] = _mm256_add_epi64(v[c], v[d]);
+	__m256i bc = _mm256_xor_si256(v[b], v[c]);
+	v[b] = _mm256_or_si256(_mm256_srli_epi64(bc, 63), _mm256_add_epi64(bc, bc));
+}
+
+/// A 64-bit element per lane: the 4 lanes are compressed at once
+__attribute__((target("avx2")))
+static void compress4_avx2(uint64_t h[8][BLAKE2BP_LANES],
+		const uint8_t* stripe, uint64_t t)
+{
+	// Message words, transposed by groups of 4 from the blocks of the lanes
+	__m256i m[16];
+	for (int i = 0; i < 16; i += 4) {
+		const uint8_t* p = stripe + i * 8;
+		__m256i a0 = _mm256_loadu_si256((const __m256i*)(p));
+		__m256i a1 = _mm256_loadu_si256((const __m256i*)(p + 128));
+		__m256i a2 = _mm256_loadu_si256((const __m256i*)(p + 256));
+		__m256i a3 = _mm256_loadu_si256((const __m256i*)(p + 384));
+		__m256i t0 = _mm256_unpacklo_epi64(a0, a1);
+		__m256i t1 = _mm256_unpackhi_epi64(a0, a1);
+		__m256i t2 = _mm256_unpacklo_epi64(a2, a3);
+		__m256i t3 = _mm256_unpackhi_epi64(a2, a3);
+		m[i]     = _mm256_permute2x128_si256(t0, t2, 0x20);
+		m[i + 1] = _mm256_permute2x128_si256(t1, t3, 0x20);
+		m[i + 2] = _mm256_permute2x128_si256(t0, t2, 0x31);
+		m[i + 3] = _mm256_permute2x128_si256(t1, t3, 0x31);
+	}
+
+	__m256i v[16];
+	for (int i = 0; i < 8; i++) {
+		v[i]     = _mm256_loadu_si256((const __m256i*)h[i]);
+		v[i + 8] = _mm256_set1_epi64x(BLAKE2B_IV[i]);
+	}
+	v[12] = _mm256_xor_si256(v[12], _mm256_set1_epi64x(t));
+
+	for (int r = 0; r < 12; r++) {
+		const uint8_t* s = BLAKE2B_SIGMA[r];
+		g4(v, 0, 4,  8, 12, m[s[0]],  m[s[1]]);
+		g4(v, 1, 5,  9, 13, m[s[2]],  m[s[3]]);
+		g4(v, 2, 6, 10, 14, m[s[4]],  m[s[5]]);
+		g4(v, 3, 7, 11, 15, m[s[6]],  m[s[7]]);
+		g4(v, 0, 5, 10, 15, m[s[8]],  m[s[9]]);
+		g4(v, 1, 6, 11, 12, m[s[10]], m[s[11]]);
+		g4(v, 2, 7,  8, 13, m[s[12]], m[s[13]]);
+		g4(v, 3, 4,  9, 14, m[s[14]], m[s[15]]);
+	}
+
+	for (int i = 0; i < 8; i++) {
+		__m256i hv = _mm256_loadu_si256((const __m256i*)h[i]);
+		hv = _mm256_xor_si256(hv, _mm256_xor_si256(v[i], v[i + 8]));
+		_mm256_storeu_si256((__m256i*)h[i], hv);
+	}
+}
+
+static Compress4Fn select_compress4()
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2") ? compress4_avx2 : compress4_sw;
+}
+
+#else
+
+static Compress4Fn select_compress4()
+{
+	return compress4_sw;
+}
+
+#endif
+
+////////////////////////////////////////////////////////////////////////////
+// Blake2bp class' members
+
+Blake2bp::Blake2bp()
+: t(0)
+, has_pending(false)
+, buf_len(0)
+{
+	for (size_t lane = 0; lane < BLAKE2BP_LANES; lane++) {
+		uint64_t lane_h[8];
+		Blake2b::init(lane_h, BLAKE2B_DIGEST_SIZE, BLAKE2BP_FANOUT,
+				BLAKE2BP_DEPTH, lane, 0, BLAKE2B_DIGEST_SIZE);
+		for (int i = 0; i < 8; i++) {
+			this->h[i][lane] = lane_h[i];
+		}
+	}
+	memset(this->pending, 0, sizeof(this->pending));
+	memset(this->buf, 0, sizeof(this->buf));
+}
+
+void Blake2bp::compressStripe(const uint8_t* stripe)
+{
+	static const Compress4Fn impl = select_compress4();
+
+	this->t += BLAKE2B_BLOCK_SIZE;
+	impl(this->h, stripe, this->t);
+}
+
+void Blake2bp::update(const uint8_t* data, size_t len)
+{
+	// The last block of each lane is compressed as such by final(), so a
+	// stripe is only compressed once another whole one follows it
+	while (len > 0) {
+		if (this->buf_len == BLAKE2BP_STRIPE_SIZE) {
+			if (this->has_pending) {
+				compressStripe(this->pending);
+			}
+			memcpy(this->pending, this->buf, BLAKE2BP_STRIPE_SIZE);
+			this->has_pending = true;
+			this->buf_len = 0;
+		}
+
+		if (this->buf_len == 0 && len >= 2 * BLAKE2BP_STRIPE_SIZE) {
+			if (this->has_pending) {
+				compressStripe(this->pending);
+				this->has_pending = false;
+			}
+			while (len >= 2 * BLAKE2BP_STRIPE_SIZE) {
+				compressStripe(data);
+				data += BLAKE2BP_STRIPE_SIZE;
+				len  -= BLAKE2BP_STRIPE_SIZE;
+			}
+		}
+
+		size_t n = std::min(BLAKE2BP_STRIPE_SIZE - this->buf_len, len);
+		memcpy(this->buf + this->buf_len, data, n);
+		this->buf_len += n;
+		data += n;
+		len  -= n;
+	}
+}
+
+void Blake2bp::final(uint8_t* digest_out) const
+{
+	// Data not compressed yet: the pending stripe and the buffer
+	uint8_t rest[2 * BLAKE2BP_STRIPE_SIZE];
+	size_t rest_len = 0;
+	if (this->has_pending) {
+		memcpy(rest, this->pending, BLAKE2BP_STRIPE_SIZE);
+		rest_len = BLAKE2BP_STRIPE_SIZE;
+	}
+	memcpy(rest + rest_len, this->buf, this->buf_len);
+	rest_len += this->buf_len;
+
+	Blake2b root(BLAKE2B_DIGEST_SIZE, BLAKE2BP_FANOUT, BLAKE2BP_DEPTH,
+			0, 1, BLAKE2B_DIGEST_SIZE);
+
+	for (size_t lane = 0; lane < BLAKE2BP_LANES; lane++) {
+		uint64_t lane_h[8];
+		for (int i = 0; i < 8; i++) {
+			lane_h[i] = this->h[i][lane];
+		}
+		uint64_t lane_t = this->t;
+		bool last_node = (lane == BLAKE2BP_LANES - 1);
+
+		// Up to a block of the lane on each stripe of the rest
+		uint8_t block[BLAKE2B_BLOCK_SIZE] = {};
+		size_t block_len = 0;
+		for (size_t pos = lane * BLAKE2B_BLOCK_SIZE; pos < rest_len;
+				pos += BLAKE2BP_STRIPE_SIZE) {
+			if (block_len > 0) {
+				Blake2b::compress(lane_h, block, lane_t, 0, false, false);
+			}
+			block_len = std::min(BLAKE2B_BLOCK_SIZE, rest_len - pos);
+			memset(block, 0, sizeof(block));
+			memcpy(block, rest + pos, block_len);
+			lane_t += block_len;
+		}
+		Blake2b::compress(lane_h, block, lane_t, 0, true, last_node);
+
+		uint8_t lane_digest[BLAKE2B_DIGEST_SIZE];
+		store_digest(lane_h, sizeof(lane_digest), lane_digest);
+		root.update(lane_digest, sizeof(lane_digest));
+	}
+
+	root.final(digest_out, true);
+}
+
+void Blake2bp::save(std::vector<uint8_t>& state_out) const
+{
+	const uint8_t* p = (const uint8_t*)this->h;
+	state_out.insert(state_out.end(), p, p + sizeof(this->h));
+	p = (const uint8_t*)&this->t;
+	state_out.insert(state_out.end(), p, p + sizeof(this->t));
+	state_out.push_back(this->has_pending ? 1 : 0);
+	state_out.insert(state_out.end(), this->pending,
+			this->pending + sizeof(this->pending));
+	p = (const uint8_t*)&this->buf_len;
+	state_out.insert(state_out.end(), p, p + sizeof(this->buf_len));
+	state_out.insert(state_out.end(), this->buf, this->buf + sizeof(this->buf));
+}
+
+bool Blake2bp::load(const uint8_t* state)
+{
+	size_t buf_len;
+	const uint8_t* p = state + sizeof(this->h) + sizeof(this->t) + 1U +
+			sizeof(this->pending);
+	memcpy(&buf_len, p, sizeof(buf_len));
+	if (buf_len > BLAKE2BP_STRIPE_SIZE) {
+		return false;
+	}
+
+	memcpy(this->h, state, sizeof(this->h));
+	state += sizeof(this->h);
+	memcpy(&this->t, state, sizeof(this->t));
+	state += sizeof(this->t);
+	this->has_pending = (*state++ != 0);
+	memcpy(this->pending, state, sizeof(this->pending));
+	state += sizeof(this->pending) + sizeof(this->buf_len);
+	memcpy(this->buf, state, sizeof(this->buf));
+	this->buf_len = buf_len;
+	return true;
+}
+
+} // file
+} // ft
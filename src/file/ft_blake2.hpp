@@ -0,0 +1,114 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+// Released under MIT License
+// Copyright (c) 2020 Hernan Perrone (hernan.perrone@gmail.com)
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef FT_FILE_BLAKE2_H
+#define FT_FILE_BLAKE2_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace ft { namespace file {
+
+static const size_t BLAKE2B_BLOCK_SIZE  = 128U;
+static const size_t BLAKE2B_DIGEST_SIZE = 64U;   ///! Maximum digest length
+
+// Number of lanes of BLAKE2bp, and length of the blocks of all of them
+static const size_t BLAKE2BP_LANES       = 4U;
+static const size_t BLAKE2BP_STRIPE_SIZE = BLAKE2BP_LANES * BLAKE2B_BLOCK_SIZE;
+
+// Length of the states written by Blake2b::save() and Blake2bp::save()
+static const size_t BLAKE2B_STATE_SIZE  = 8U * 8U + 2U * 8U + 8U +
+		BLAKE2B_BLOCK_SIZE;
+static const size_t BLAKE2BP_STATE_SIZE = 8U * BLAKE2BP_LANES * 8U + 8U + 1U +
+		BLAKE2BP_STRIPE_SIZE + 8U + BLAKE2BP_STRIPE_SIZE;
+
+/// @brief BLAKE2b (RFC 7693), without key, with the tree parameters
+///
+/// Crypto++ hashes plain BLAKE2b, but it neither allows saving its state nor
+/// setting the node offset and depth of tree hashing, both needed by
+/// FileHasher and Blake2bp.
+class Blake2b {
+private:
+	uint64_t h[8];
+	uint64_t t[2];
+	uint8_t  buf[BLAKE2B_BLOCK_SIZE];
+	size_t   buf_len;
+	size_t   digest_size;
+
+public:
+	/// Plain BLAKE2b, or a node of a tree with the given parameters
+	Blake2b(size_t digest_size = BLAKE2B_DIGEST_SIZE, uint8_t fanout = 1,
+			uint8_t depth = 1, uint64_t node_offset = 0, uint8_t node_depth = 0,
+			uint8_t inner_size = 0);
+
+	void update(const uint8_t* data, size_t len);
+
+	/// @brief Writes the digest of the data (the state is kept)
+	///
+	/// last_node is set for the last node of a level of a tree.
+	void final(uint8_t* digest_out, bool last_node = false) const;
+
+	/// @brief Appends the state to state_out
+	void save(std::vector<uint8_t>& state_out) const;
+
+	/// @brief Reads the state written by save(), of BLAKE2B_STATE_SIZE bytes
+	bool load(const uint8_t* state);
+
+	/// @brief Initial chaining value for the given parameters
+	static void init(uint64_t h_out[8], size_t digest_size, uint8_t fanout,
+			uint8_t depth, uint64_t node_offset, uint8_t node_depth,
+			uint8_t inner_size);
+
+	/// @brief Compression function
+	///
+	/// t is the number of bytes hashed, including the block.
+	static void compress(uint64_t h[8], const uint8_t* block, uint64_t t0,
+			uint64_t t1, bool last, bool last_node);
+};
+
+/// @brief BLAKE2bp: 4 BLAKE2b lanes and a root hashing their digests
+///
+/// The data is split in blocks of BLAKE2B_BLOCK_SIZE and block i is hashed
+/// by the lane i % 4, so the 4 lanes are compressed at once, each one on a
+/// 64-bit element of the AVX2 registers (if the CPU supports them, otherwise
+/// one after the other).
+///
+/// Lanes are nodes of depth 0 of a tree of fanout 4 and depth 2 (the last
+/// lane is the last node), and the root a node of depth 1, as specified by
+/// BLAKE2 (https://blake2.net/blake2.pdf), so the hash is the same as the one
+/// of the reference implementation.
+class Blake2bp {
+private:
+	uint64_t h[8][BLAKE2BP_LANES];         ///! Chaining values, word major
+	uint64_t t;                            ///! Bytes compressed per lane
+	bool     has_pending;
+	uint8_t  pending[BLAKE2BP_STRIPE_SIZE]; ///! Last stripe, not compressed
+	size_t   buf_len;
+	uint8_t  buf[BLAKE2BP_STRIPE_SIZE];     ///! Data of a stripe not complete
+
+public:
+	Blake2bp();
+
+	void update(const uint8_t* data, size_t len);
+
+	/// @brief Writes the digest (BLAKE2B_DIGEST_SIZE bytes)
+	void final(uint8_t* digest_out) const;
+
+	/// @brief Appends the state to state_out
+	void save(std::vector<uint8_t>& state_out) const;
+
+	/// @brief Reads the state written by save(), of BLAKE2BP_STATE_SIZE bytes
+	bool load(const uint8_t* state);
+
+private:
+	/// @brief Compresses a whole stripe, not being the last one of any lane
+	void compressStripe(const uint8_t* stripe);
+};
+
+} // file
+} // ft
+#endif //FT_FILE_BLAKE2_H
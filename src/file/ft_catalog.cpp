@@ -0,0 +1,203 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+// Released under MIT License
+// Copyright (c) 2020 Hernan Perrone (hernan.perrone@gmail.com)
+//////////////////////////////////////////////////////////////////////////////
+
+#include <fstream>
+#include <sstream>
+#include <system_error>
+
+// POSIX & LINUX headers
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "file/ft_catalog.hpp"
+
+namespace ft { namespace file {
+
+static int64_t to_ns(const struct timespec& ts)
+{
+	return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+Catalog::Catalog(const std::filesystem::path& base_path)
+: base_path(base_path)
+, catalog_file(base_path / ".catalog")
+, fd(-1)
+{
+	std::filesystem::create_directories(this->base_path);
+	load();
+
+	this->fd = open(this->catalog_file.c_str(),
+			O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+	if (this->fd < 0) {
+		throw std::system_error(
+				std::make_error_code(static_cast<std::errc>(errno)),
+				"Failed to open the catalog");
+	}
+}
+
+Catalog::~Catalog()
+{
+	if (this->fd >= 0) {
+		(void)close(this->fd);
+	}
+}
+
+void Catalog::add(const std::filesystem::path& path, proto::HashAlgo hash_algo,
+		const std::vector<uint8_t>& hash)
+{
+	// Paths are stored up to the end of the line
+	std::string path_str = path.generic_string();
+	if (path_str.find('\n') != std::string::npos) {
+		return;
+	}
+
+	struct stat st;
+	if (stat((this->base_path / path).c_str(), &st) != 0) {
+		return;
+	}
+
+	Entry entry = { (uint64_t)st.st_dev, (uint64_t)st.st_ino,
+			(uint64_t)st.st_size, to_ns(st.st_mtim), to_ns(st.st_ctim),
+			(uint8_t)hash_algo, hash };
+
+	std::lock_guard<std::mutex> lock(this->mtx);
+	this->entries[path_str] = entry;
+	append(entryLine(path_str, entry));
+}
+
+bool Catalog::isComplete(const std::filesystem::path& path,
+		proto::HashAlgo hash_algo, const std::vector<uint8_t>& hash,
+		size_t size, bool& modified_out)
+{
+	std::string path_str = path.generic_string();
+	modified_out = false;
+
+	std::lock_guard<std::mutex> lock(this->mtx);
+	auto it = this->entries.find(path_str);
+	if (it == this->entries.end()) {
+		return false;
+	}
+
+	// Other version of the file
+	const auto& entry = it->second;
+	if (entry.hash_algo != hash_algo || entry.hash != hash ||
+			entry.size != size) {
+		return false;
+	}
+
+	struct stat st;
+	if (stat((this->base_path / path).c_str(), &st) != 0 ||
+			!sameFile(entry, st)) {
+		this->entries.erase(it);
+		append("- " + path_str);
+		modified_out = true;
+		return false;
+	}
+
+	return true;
+}
+
+void Catalog::remove(const std::filesystem::path& path)
+{
+	std::string path_str = path.generic_string();
+
+	std::lock_guard<std::mutex> lock(this->mtx);
+	if (this->entries.erase(path_str) > 0) {
+		append("- " + path_str);
+	}
+}
+
+bool Catalog::sameFile(const Entry& entry, const struct stat& st)
+{
+	return entry.dev == (uint64_t)st.st_dev &&
+			entry.ino == (uint64_t)st.st_ino &&
+			entry.size == (uint64_t)st.st_size &&
+			entry.mtime_ns == to_ns(st.st_mtim) &&
+			entry.ctime_ns == to_ns(st.st_ctim);
+}
+
+void Catalog::load()
+{
+	std::ifstream is(this->catalog_file, std::ios::in);
+	std::string line;
+	while (std::getline(is, line)) {
+		std::istringstream ss(line);
+		std::string op;
+		ss >> op;
+
+		if (op == "-" && ss.get() == ' ') {
+			std::string path;
+			std::getline(ss, path);
+			this->entries.erase(path);
+			continue;
+		}
+
+		Entry entry;
+		unsigned hash_algo;
+		std::string hash_hex;
+		ss >> entry.dev >> entry.ino >> entry.size >> entry.mtime_ns >>
+				entry.ctime_ns >> hash_algo >> hash_hex;
+		if (op != "+" || ss.fail() || ss.get() != ' ' ||
+				hash_algo >= proto::HASH_ALGO_MAX ||
+				!fromHex(hash_hex, entry.hash) ||
+				entry.hash.size() != proto::HASH_SIZE) {
+			// Ignore corrupted (e.g. partially written) lines
+			continue;
+		}
+		entry.hash_algo = hash_algo;
+
+		std::string path;
+		std::getline(ss, path);
+		this->entries[path] = entry;
+	}
+	is.close();
+
+	// Compact, dropping the files modified or removed
+	std::string tmp_file = this->catalog_file.string() + ".tmp";
+	std::ofstream os(tmp_file, std::ios::out | std::ios::trunc);
+	for (auto it = this->entries.begin(); it != this->entries.end();) {
+		struct stat st;
+		if (stat((this->base_path / it->first).c_str(), &st) != 0 ||
+				!sameFile(it->second, st)) {
+			it = this->entries.erase(it);
+			continue;
+		}
+		os << entryLine(it->first, it->second) << "\n";
+		++it;
+	}
+	os.close();
+
+	if (os.fail() ||
+			rename(tmp_file.c_str(), this->catalog_file.c_str()) != 0) {
+		int err = errno;
+		(void)unlink(tmp_file.c_str());
+		throw std::system_error(
+				std::make_error_code(static_cast<std::errc>(err)),
+				"Failed to write the catalog");
+	}
+}
+
+void Catalog::append(const std::string& line)
+{
+	std::string data = line + "\n";
+	if (write(this->fd, data.data(), data.size()) != (ssize_t)data.size()) {
+		// Not fatal: a lost line only makes the file be verified again (or
+		// left in the catalog until its entry is checked against the file)
+		return;
+	}
+}
+
+std::string Catalog::entryLine(const std::string& path, const Entry& entry)
+{
+	std::ostringstream ss;
+	ss << "+ " << entry.dev << " " << entry.ino << " " << entry.size << " "
+		<< entry.mtime_ns << " " << entry.ctime_ns << " "
+		<< (unsigned)entry.hash_algo << " " << toHex(entry.hash) << " " << path;
+	return ss.str();
+}
+
+} // file
+} // ft
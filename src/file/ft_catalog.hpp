@@ -0,0 +1,94 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+// Released under MIT License
+// Copyright (c) 2020 Hernan Perrone (hernan.perrone@gmail.com)
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef FT_FILE_CATALOG_H
+#define FT_FILE_CATALOG_H
+
+#include <filesystem>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+
+#include "ft_utils.hpp"
+#include "protocol/ft_msg.hpp"
+
+namespace ft { namespace file {
+
+FT_DECLARE_CLASS(Catalog)
+
+/// @brief Persistent catalog of the files completely transferred
+///
+/// Checking that a file offered again is complete reads its metadata, and
+/// hashes the whole file if its hash checkpoint is not found. The catalog
+/// keeps the files completed, with the device, inode, size, mtime and ctime of
+/// the stored file, so a file offered again with the same hash is completed
+/// without reading it, unless it was modified since.
+///
+/// The catalog file (".catalog" in the base path) is a journal, appended on
+/// each change with a line:
+///   + dev ino size mtime_ns ctime_ns hash_algo hash_hex path
+///   - path
+/// to add (or replace) and remove the entry of a path, relative to the base
+/// path. It is compacted when loaded: the entries of files modified or removed
+/// are dropped and the rest are written to a temporary file, renamed over the
+/// catalog file.
+class Catalog {
+private:
+	struct Entry {
+		uint64_t              dev;
+		uint64_t              ino;
+		uint64_t              size;
+		int64_t               mtime_ns;
+		int64_t               ctime_ns;
+		uint8_t               hash_algo;
+		std::vector<uint8_t>  hash;
+	};
+
+	const std::filesystem::path    base_path;
+	const std::filesystem::path    catalog_file;
+	std::mutex                     mtx;
+	std::map<std::string, Entry>   entries;
+	int                            fd;           ///! Catalog file, appended
+
+public:
+	Catalog(const std::filesystem::path& base_path);
+
+	virtual ~Catalog();
+
+	/// @brief Adds the file completed, as it is stored now
+	void add(const std::filesystem::path& path, proto::HashAlgo hash_algo,
+			const std::vector<uint8_t>& hash);
+
+	/// @brief True if the file is complete with the given hash
+	///
+	/// The entry of a file modified since it was added is removed, and
+	/// modified_out set.
+	bool isComplete(const std::filesystem::path& path,
+			proto::HashAlgo hash_algo, const std::vector<uint8_t>& hash,
+			size_t size, bool& modified_out);
+
+	/// @brief Removes the file (e.g. before replacing it)
+	void remove(const std::filesystem::path& path);
+
+private:
+	/// @brief True if the entry describes the file, as st
+	static bool sameFile(const Entry& entry, const struct stat& st);
+
+	/// @brief Reads the catalog file, and writes it back compacted
+	void load();
+
+	/// @brief Appends a line to the catalog file
+	void append(const std::string& line);
+
+	static std::string entryLine(const std::string& path, const Entry& entry);
+};
+
+} // file
+} // ft
+#endif //FT_FILE_CATALOG_H
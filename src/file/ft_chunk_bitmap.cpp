@@ -0,0 +1,310 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+// Released under MIT License
+// Copyright (c) 2020 Hernan Perrone (hernan.perrone@gmail.com)
+//////////////////////////////////////////////////////////////////////////////
+
+#include <algorithm>
+
+#include "file/ft_chunk_bitmap.hpp"
+
+namespace ft { namespace file {
+
+// Chunks per bit of the level 0 summaries (bits per word)
+static const size_t GROUP_CHUNKS = 64U;
+
+static const uint64_t ALL_SET = ~(uint64_t)0;
+
+static inline uint64_t load_word(const uint64_t* word)
+{
+	return __atomic_load_n(word, __ATOMIC_ACQUIRE);
+}
+
+static inline void store_word(uint64_t* word, uint64_t value)
+{
+	__atomic_store_n(word, value, __ATOMIC_RELEASE);
+}
+
+ChunkBitmap::ChunkBitmap(uint8_t* bits, size_t n_chunks, bool deferred)
+: mapped(bits)
+, n_chunks(n_chunks)
+, n_bytes(n_chunks / 8 + (n_chunks % 8 > 0 ? 1 : 0))
+, live(deferred ? std::vector<uint8_t>(bits, bits + n_bytes) :
+		std::vector<uint8_t>())
+, bits(deferred ? live.data() : bits)
+, pending_first(SIZE_MAX)
+, pending_end(0)
+{
+	// Levels up to a single word, the bits past the end of each level are
+	// taken as full (and not any)
+	size_t n_bits = n_chunks / GROUP_CHUNKS + (n_chunks % GROUP_CHUNKS > 0);
+	while (n_bits > 0) {
+		size_t n_words = n_bits / 64 + (n_bits % 64 > 0 ? 1 : 0);
+		this->full.emplace_back(n_words, 0);
+		this->any.emplace_back(n_words, 0);
+		if (n_bits % 64 > 0) {
+			this->full.back().back() = ALL_SET << (n_bits % 64);
+		}
+		if (n_words == 1) {
+			break;
+		}
+		n_bits = n_words;
+	}
+	if (this->full.empty()) {
+		return;
+	}
+
+	// Level 0 from the bits
+	size_t n_groups = n_chunks / GROUP_CHUNKS + (n_chunks % GROUP_CHUNKS > 0);
+	for (size_t group = 0; group < n_groups; group++) {
+		bool group_full, group_any;
+		groupState(group, group_full, group_any);
+		if (group_full) {
+			this->full[0][group / 64] |= (uint64_t)1 << (group % 64);
+		}
+		if (group_any) {
+			this->any[0][group / 64] |= (uint64_t)1 << (group % 64);
+		}
+	}
+
+	// Then each level from the one below
+	for (size_t level = 1; level < this->full.size(); level++) {
+		for (size_t pos = 0; pos < this->full[level - 1].size(); pos++) {
+			uint64_t bit = (uint64_t)1 << (pos % 64);
+			if (this->full[level - 1][pos] == ALL_SET) {
+				this->full[level][pos / 64] |= bit;
+			}
+			if (this->any[level - 1][pos] != 0) {
+				this->any[level][pos / 64] |= bit;
+			}
+		}
+	}
+}
+
+void ChunkBitmap::mark(size_t chunk_idx, size_t n, bool valid)
+{
+	if (chunk_idx >= this->n_chunks || n == 0) {
+		return;
+	}
+	n = std::min(n, this->n_chunks - chunk_idx);
+
+	// All the bits within a byte are updated at once
+	size_t last_idx = chunk_idx + n - 1;
+	for (size_t pos = chunk_idx / 8; pos <= last_idx / 8; pos++) {
+		size_t first_bit = (pos == chunk_idx / 8) ? chunk_idx % 8 : 0;
+		size_t last_bit  = (pos == last_idx / 8)  ? last_idx % 8  : 7;
+		uint8_t mask = (uint8_t)((0xFF >> first_bit) & (0xFF << (7 - last_bit)));
+		if (valid) {
+			__atomic_fetch_or(&this->bits[pos], mask, __ATOMIC_RELEASE);
+		} else {
+			__atomic_fetch_and(&this->bits[pos], (uint8_t)~mask,
+					__ATOMIC_RELEASE);
+		}
+	}
+
+	// The summaries of the groups are taken from the bits, so the last thread
+	// updating them sees the bits set by the others
+	std::lock_guard<std::mutex> lock(this->mtx);
+	for (size_t group = chunk_idx / GROUP_CHUNKS;
+			group <= last_idx / GROUP_CHUNKS; group++) {
+		bool group_full, group_any;
+		groupState(group, group_full, group_any);
+		setSummary(this->full, group, group_full, true);
+		setSummary(this->any, group, group_any, false);
+	}
+
+	if (this->bits != this->mapped) {
+		this->pending_first = std::min(this->pending_first, chunk_idx / 8);
+		this->pending_end   = std::max(this->pending_end, last_idx / 8 + 1);
+	}
+}
+
+size_t ChunkBitmap::find(size_t from_chunk_idx, bool received) const
+{
+	if (from_chunk_idx >= this->n_chunks) {
+		return UINT64_MAX;
+	}
+
+	size_t ret = findInGroup(from_chunk_idx, received);
+	size_t group = from_chunk_idx / GROUP_CHUNKS + 1;
+	while (ret == UINT64_MAX) {
+		group = findInLevel(0, group, received);
+		if (group == UINT64_MAX) {
+			break;
+		}
+		// The summary may be ahead of the bits, so the group is checked
+		ret = findInGroup(group * GROUP_CHUNKS, received);
+		group++;
+	}
+
+	return ret;
+}
+
+bool ChunkBitmap::isFull() const
+{
+	return this->full.empty() || load_word(&this->full.back()[0]) == ALL_SET;
+}
+
+bool ChunkBitmap::takePending(size_t& first_byte_out,
+		std::vector<uint8_t>& bytes_out)
+{
+	std::lock_guard<std::mutex> lock(this->mtx);
+	if (this->pending_first >= this->pending_end) {
+		return false;
+	}
+
+	// Bits set meanwhile by other threads are taken too: their chunks were
+	// written before they were marked
+	first_byte_out = this->pending_first;
+	bytes_out.resize(this->pending_end - this->pending_first);
+	for (size_t pos = 0; pos < bytes_out.size(); pos++) {
+		bytes_out[pos] = __atomic_load_n(&this->bits[first_byte_out + pos],
+				__ATOMIC_ACQUIRE);
+	}
+
+	this->pending_first = SIZE_MAX;
+	this->pending_end   = 0;
+	return true;
+}
+
+void ChunkBitmap::applyPending(size_t first_byte,
+		const std::vector<uint8_t>& bytes)
+{
+	if (first_byte >= this->n_bytes) {
+		return;
+	}
+	std::copy(bytes.begin(), bytes.begin() +
+			std::min(bytes.size(), this->n_bytes - first_byte),
+			this->mapped + first_byte);
+}
+
+void ChunkBitmap::discardPending(size_t first_byte,
+		const std::vector<uint8_t>& bytes)
+{
+	if (first_byte >= this->n_bytes || bytes.empty()) {
+		return;
+	}
+	size_t end_byte = std::min(first_byte + bytes.size(), this->n_bytes);
+
+	// Only the bits set since the mapping was last written are cleared, the
+	// chunks marked before are on disk
+	for (size_t pos = first_byte; pos < end_byte; pos++) {
+		uint8_t lost = bytes[pos - first_byte] & (uint8_t)~this->mapped[pos];
+		if (lost != 0) {
+			__atomic_fetch_and(&this->bits[pos], (uint8_t)~lost,
+					__ATOMIC_RELEASE);
+		}
+	}
+
+	std::lock_guard<std::mutex> lock(this->mtx);
+	for (size_t group = first_byte * 8 / GROUP_CHUNKS;
+			group <= (end_byte * 8 - 1) / GROUP_CHUNKS; group++) {
+		bool group_full, group_any;
+		groupState(group, group_full, group_any);
+		setSummary(this->full, group, group_full, true);
+		setSummary(this->any, group, group_any, false);
+	}
+
+	// The chunks cleared in the range (not received anymore) are still to be
+	// written to the mapping
+	this->pending_first = std::min(this->pending_first, first_byte);
+	this->pending_end   = std::max(this->pending_end, end_byte);
+}
+
+void ChunkBitmap::groupState(size_t group, bool& full_out, bool& any_out) const
+{
+	full_out = true;
+	any_out  = false;
+
+	size_t first_byte = group * GROUP_CHUNKS / 8;
+	size_t end_byte   = std::min(first_byte + GROUP_CHUNKS / 8, this->n_bytes);
+	for (size_t pos = first_byte; pos < end_byte; pos++) {
+		// The padding bits after the last chunk are not considered
+		uint8_t mask = 0xFF;
+		if (pos == this->n_bytes - 1 && this->n_chunks % 8 > 0) {
+			mask = (uint8_t)(0xFF << (8 - this->n_chunks % 8));
+		}
+		uint8_t byte = __atomic_load_n(&this->bits[pos], __ATOMIC_ACQUIRE) & mask;
+		full_out = full_out && byte == mask;
+		any_out  = any_out || byte != 0;
+	}
+}
+
+size_t ChunkBitmap::findInGroup(size_t from_chunk_idx, bool received) const
+{
+	// Bytes with all the bits in the opposite state are skipped
+	const uint8_t skip = received ? 0x00 : 0xFF;
+
+	size_t group    = from_chunk_idx / GROUP_CHUNKS;
+	size_t end_byte = std::min((group + 1) * GROUP_CHUNKS / 8, this->n_bytes);
+	for (size_t pos = from_chunk_idx / 8; pos < end_byte; pos++) {
+		uint8_t byte = __atomic_load_n(&this->bits[pos], __ATOMIC_ACQUIRE);
+		if (pos == from_chunk_idx / 8) {
+			// The bits of the first byte before from_chunk_idx are not
+			// considered
+			uint8_t mask = 0xFF >> (from_chunk_idx % 8);
+			byte = (byte & mask) | (skip & ~mask);
+		}
+		if (byte == skip) {
+			continue;
+		}
+
+		// The chunk index of the byte, plus the bit number within it
+		size_t ret = pos * 8;
+		for (int bit = 7; bit >= 0 && ((byte >> bit) & 0x01) != received;
+				bit--, ret++);
+		// This is to handle the padding bits after the last chunk
+		return (ret < this->n_chunks) ? ret : UINT64_MAX;
+	}
+
+	return UINT64_MAX;
+}
+
+size_t ChunkBitmap::findInLevel(size_t level, size_t pos, bool received) const
+{
+	const auto& words = received ? this->any[level] : this->full[level];
+
+	while (pos < words.size() * 64) {
+		uint64_t word = load_word(&words[pos / 64]);
+		uint64_t found = (received ? word : ~word) & (ALL_SET << (pos % 64));
+		if (found != 0) {
+			return (pos / 64) * 64 + __builtin_ctzll(found);
+		}
+
+		// The next word of the level with a group in the state, as told by the
+		// level above
+		if (level + 1 == this->full.size()) {
+			break;
+		}
+		size_t next_word = findInLevel(level + 1, pos / 64 + 1, received);
+		if (next_word == UINT64_MAX) {
+			break;
+		}
+		pos = next_word * 64;
+	}
+
+	return UINT64_MAX;
+}
+
+void ChunkBitmap::setSummary(std::vector<std::vector<uint64_t>>& levels,
+		size_t pos, bool value, bool propagate_full)
+{
+	for (size_t level = 0; level < levels.size(); level++) {
+		uint64_t* word = &levels[level][pos / 64];
+		uint64_t bit   = (uint64_t)1 << (pos % 64);
+		uint64_t old_value = load_word(word);
+		uint64_t new_value = value ? (old_value | bit) : (old_value & ~bit);
+		if (new_value == old_value) {
+			// The levels above are up to date
+			break;
+		}
+		store_word(word, new_value);
+
+		// The bit of the word in the level above
+		value = propagate_full ? new_value == ALL_SET : new_value != 0;
+		pos /= 64;
+	}
+}
+
+} // file
+} // ft
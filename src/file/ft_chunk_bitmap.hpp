@@ -0,0 +1,115 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+// Released under MIT License
+// Copyright (c) 2020 Hernan Perrone (hernan.perrone@gmail.com)
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef FT_FILE_CHUNKBITMAP_H
+#define FT_FILE_CHUNKBITMAP_H
+
+#include <mutex>
+#include <vector>
+
+#include "ft_utils.hpp"
+
+namespace ft { namespace file {
+
+FT_DECLARE_CLASS(ChunkBitmap)
+
+/// @brief Bitmap of the chunks received, with summaries to find chunks fast
+///
+/// The bits are the ones of the chunk_bitmap of a metadata file (mapped in
+/// memory), a bit per chunk from the most significant bit of each byte. They
+/// are set and cleared atomically, without locking.
+///
+/// On top of them, two hierarchies of 64 bit words are kept in memory:
+///   - full: level 0 has a bit per group of 64 chunks, set if all of them are
+///     received; each level above has a bit per word of the level below, set
+///     if all its bits are set.
+///   - any: the same, but set if any of the chunks are received.
+/// The top level is a single word, so finding the next missing (or received)
+/// chunk takes a few word scans (count trailing zeros) per level, and checking
+/// if all the chunks are received takes one.
+///
+/// The summaries are updated with a mutex held, after the bits. A summary bit
+/// not updated yet while chunks are marked (a full bit not set yet, or an any
+/// bit not cleared yet) only costs a scan of the words below, not a wrong
+/// answer. Chunks being unmarked (e.g. a transfer restarting) may still be
+/// skipped by a search until their summaries are updated.
+///
+/// A deferred bitmap sets the bits in a copy kept in memory instead, and
+/// tracks the bytes changed since takePending(), so they are written to the
+/// mapping by applyPending() once the data of their chunks is on disk (see
+/// FileSync), or cleared by discardPending() if it does not make it. Searches
+/// see the marks at once either way.
+class ChunkBitmap {
+private:
+	uint8_t* const                      mapped; ///! The bits in the file
+	const size_t                        n_chunks;
+	const size_t                        n_bytes;
+	std::vector<uint8_t>                live;   ///! Copy, if deferred
+	uint8_t* const                      bits;   ///! The ones marked
+
+	std::mutex                          mtx;    ///! Of the summary updates
+	std::vector<std::vector<uint64_t>>  full;   ///! Levels, from the bottom
+	std::vector<std::vector<uint64_t>>  any;
+	size_t                              pending_first; ///! Bytes not applied
+	size_t                              pending_end;
+
+public:
+	/// @brief Summarizes the bitmap in bits, of n_chunks bits
+	///
+	/// If deferred, the marks are not set in bits until applied.
+	ChunkBitmap(uint8_t* bits, size_t n_chunks, bool deferred = false);
+
+	ChunkBitmap(const ChunkBitmap&) = delete;
+	ChunkBitmap& operator=(const ChunkBitmap&) = delete;
+
+	virtual ~ChunkBitmap() {}
+
+	/// @brief Sets (or clears, if not valid) n chunks from chunk_idx
+	void mark(size_t chunk_idx, size_t n, bool valid);
+
+	/// @brief First chunk from from_chunk_idx received (or missing if not)
+	///
+	/// Returns UINT64_MAX if none.
+	size_t find(size_t from_chunk_idx, bool received) const;
+
+	/// @brief True if all the chunks are received
+	bool isFull() const;
+
+	/// @brief The bytes marked and not applied to the mapping yet
+	///
+	/// Returns false if none. The bytes from first_byte_out are taken as
+	/// applied after, so they must be given to applyPending().
+	bool takePending(size_t& first_byte_out, std::vector<uint8_t>& bytes_out);
+
+	/// @brief Writes the bytes taken by takePending() to the mapping
+	void applyPending(size_t first_byte, const std::vector<uint8_t>& bytes);
+
+	/// @brief Clears the chunks of the bytes taken by takePending() not set in
+	/// the mapping, so they are missing again (e.g. their data failed to sync)
+	///
+	/// The bytes are pending again, to be taken by the next takePending().
+	void discardPending(size_t first_byte, const std::vector<uint8_t>& bytes);
+
+private:
+	/// @brief State of the chunks of a group of 64 in the bits
+	void groupState(size_t group, bool& full_out, bool& any_out) const;
+
+	/// @brief First chunk from from_chunk_idx in the state, within its group
+	size_t findInGroup(size_t from_chunk_idx, bool received) const;
+
+	/// @brief First position of the level from pos with a group in the state
+	///
+	/// i.e.: the first bit not set in full, or set in any.
+	size_t findInLevel(size_t level, size_t pos, bool received) const;
+
+	/// @brief Sets the summary bit of the level, and updates the levels above
+	static void setSummary(std::vector<std::vector<uint64_t>>& levels,
+			size_t pos, bool value, bool propagate_full);
+};
+
+} // file
+} // ft
+#endif //FT_FILE_CHUNKBITMAP_H
@@ -0,0 +1,281 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+// Released under MIT License
+// Copyright (c) 2020 Hernan Perrone (hernan.perrone@gmail.com)
+//////////////////////////////////////////////////////////////////////////////
+
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <thread>
+
+#include "file/ft_chunk_store.hpp"
+
+namespace ft { namespace file {
+
+static const size_t RECIPE_ENTRY_SIZE = 4U + proto::CHUNK_HASH_SIZE;
+
+////////////////////////////////////////////////////////////////////////////
+// ChunkStore class' members
+
+ChunkStore::ChunkStore(const std::filesystem::path& base_path)
+: base_path(base_path)
+, store_path(base_path / ".store")
+, logical_bytes(0)
+, transferred_bytes(0)
+{
+	std::filesystem::create_directories(this->store_path);
+}
+
+bool ChunkStore::has(const std::vector<uint8_t>& hash) const
+{
+	return std::filesystem::exists(chunkPath(hash));
+}
+
+void ChunkStore::put(const std::vector<uint8_t>& hash,
+		const std::vector<uint8_t>& data)
+{
+	auto chunk_path = chunkPath(hash);
+	if (std::filesystem::exists(chunk_path)) {
+		return;
+	}
+
+	std::filesystem::create_directories(chunk_path.parent_path());
+
+	// Write to a temporary file (unique per thread) and then move it in place
+	std::stringstream tmp_name;
+	tmp_name << chunk_path.filename().generic_string() << ".tmp." <<
+			std::this_thread::get_id();
+	auto tmp_path = chunk_path.parent_path() / tmp_name.str();
+
+	std::ofstream os(tmp_path, std::ios::out | std::ios::binary);
+	os.write((const char*)data.data(), data.size());
+	os.close();
+	if (!os) {
+		std::filesystem::remove(tmp_path);
+		throw std::runtime_error("Failed writing chunk to the store");
+	}
+
+	std::filesystem::rename(tmp_path, chunk_path);
+}
+
+bool ChunkStore::get(const std::vector<uint8_t>& hash,
+		std::vector<uint8_t>& data_out) const
+{
+	auto chunk_path = chunkPath(hash);
+	std::error_code ec;
+	auto len = std::filesystem::file_size(chunk_path, ec);
+	if (ec) {
+		return false;
+	}
+
+	data_out.resize(len);
+	std::ifstream is(chunk_path, std::ios::in | std::ios::binary);
+	is.read((char*)data_out.data(), data_out.size());
+	return (bool)is;
+}
+
+FileRecipePtr ChunkStore::openRecipe(const std::filesystem::path& path,
+		const std::vector<uint8_t>& hash, size_t size)
+{
+	auto recipe_file = this->base_path / path.parent_path();
+	recipe_file /= std::string(".") + path.filename().generic_string() +
+			".recipe";
+
+	return std::make_shared<FileRecipe>(recipe_file, size, hash);
+}
+
+void ChunkStore::addStats(uint64_t logical, uint64_t transferred)
+{
+	this->logical_bytes += logical;
+	this->transferred_bytes += transferred;
+}
+
+std::filesystem::path ChunkStore::chunkPath(
+		const std::vector<uint8_t>& hash) const
+{
+	std::stringstream ss;
+	ss << std::hex << std::setfill('0');
+	for (auto b : hash) {
+		ss << std::setw(2) << (unsigned)b;
+	}
+
+	auto name = ss.str();
+	return this->store_path / name.substr(0, 2) / name;
+}
+
+////////////////////////////////////////////////////////////////////////////
+// FileRecipe class' members
+
+FileRecipe::FileRecipe(const std::filesystem::path& recipe_file,
+		size_t file_size, const std::vector<uint8_t>& file_hash)
+: recipe_file(recipe_file)
+, file_size(file_size)
+, file_hash(file_hash)
+, n_entries(0)
+, n_received(0)
+{
+	// Load the recipe of a previous connection if it is of the same file
+	if (std::filesystem::exists(this->recipe_file)) {
+		size_t stored_size = 0;
+		std::vector<uint8_t> stored_hash(proto::HASH_SIZE);
+
+		std::ifstream is(this->recipe_file, std::ios::in | std::ios::binary);
+		is.read((char*)&stored_size, sizeof(stored_size));
+		is.read((char*)stored_hash.data(), stored_hash.size());
+		is.read((char*)&this->n_entries, sizeof(this->n_entries));
+		is.close();
+
+		size_t recipe_len = std::filesystem::file_size(this->recipe_file);
+		if (is && stored_size == file_size && stored_hash == file_hash &&
+				recipe_len >= headerSize()) {
+			this->n_received = std::min(this->n_entries,
+					(recipe_len - headerSize()) / RECIPE_ENTRY_SIZE);
+			return;
+		}
+
+		this->n_entries = 0;
+	}
+
+	std::filesystem::create_directories(this->recipe_file.parent_path());
+
+	std::ofstream os(this->recipe_file, std::ios::out | std::ios::binary |
+			std::ios::trunc);
+	os.write((const char*)&this->file_size, sizeof(this->file_size));
+	os.write((const char*)this->file_hash.data(), proto::HASH_SIZE);
+	os.write((const char*)&this->n_entries, sizeof(this->n_entries));
+	os.close();
+}
+
+void FileRecipe::addEntries(size_t idx_first, size_t n_total,
+		const std::vector<proto::CdcEntry>& entries)
+{
+	if (idx_first != this->n_received || (this->n_received > 0 &&
+			n_total != this->n_entries)) {
+		return;
+	}
+
+	std::fstream os(this->recipe_file, std::ios::in | std::ios::out |
+			std::ios::binary);
+
+	if (this->n_received == 0) {
+		// First batch, update the number of entries in the header
+		this->n_entries = n_total;
+		os.seekp(sizeof(this->file_size) + proto::HASH_SIZE, std::ios::beg);
+		os.write((const char*)&this->n_entries, sizeof(this->n_entries));
+	}
+
+	os.seekp(headerSize() + this->n_received * RECIPE_ENTRY_SIZE,
+			std::ios::beg);
+	for (const auto& entry : entries) {
+		if (this->n_received == this->n_entries) {
+			break;
+		}
+
+		uint32_t len = entry.len;
+		os.write((const char*)&len, sizeof(len));
+		os.write((const char*)entry.hash.data(), proto::CHUNK_HASH_SIZE);
+		this->n_received++;
+	}
+	os.close();
+}
+
+bool FileRecipe::getEntry(size_t idx, proto::CdcEntry& entry_out) const
+{
+	if (idx >= this->n_received) {
+		return false;
+	}
+
+	std::ifstream is(this->recipe_file, std::ios::in | std::ios::binary);
+	is.seekg(headerSize() + idx * RECIPE_ENTRY_SIZE, std::ios::beg);
+	entry_out.hash.resize(proto::CHUNK_HASH_SIZE);
+	is.read((char*)&entry_out.len, sizeof(entry_out.len));
+	is.read((char*)entry_out.hash.data(), entry_out.hash.size());
+	return (bool)is;
+}
+
+size_t FileRecipe::nextMissingChunk(const ChunkStore& store,
+		size_t from_idx) const
+{
+	std::ifstream is(this->recipe_file, std::ios::in | std::ios::binary);
+	is.seekg(headerSize() + from_idx * RECIPE_ENTRY_SIZE, std::ios::beg);
+
+	proto::CdcEntry entry;
+	entry.hash.resize(proto::CHUNK_HASH_SIZE);
+	for (size_t idx = from_idx; idx < this->n_received; idx++) {
+		is.read((char*)&entry.len, sizeof(entry.len));
+		is.read((char*)entry.hash.data(), entry.hash.size());
+		if (!is || !store.has(entry.hash)) {
+			return idx;
+		}
+	}
+
+	return UINT64_MAX;
+}
+
+size_t FileRecipe::getMissingBytes(const ChunkStore& store) const
+{
+	size_t ret = 0;
+	for (size_t idx = nextMissingChunk(store, 0); idx != UINT64_MAX;
+			idx = nextMissingChunk(store, idx + 1)) {
+		proto::CdcEntry entry;
+		if (getEntry(idx, entry)) {
+			ret += entry.len;
+		}
+	}
+
+	return ret;
+}
+
+bool FileRecipe::rebuild(const ChunkStore& store, FilePtr file) const
+{
+	std::ifstream is(this->recipe_file, std::ios::in | std::ios::binary);
+	is.seekg(headerSize(), std::ios::beg);
+
+	// Concatenate the chunks from the store and save them as regular chunks
+	std::vector<uint8_t> buf;
+	size_t chunk_idx = 0;
+
+	proto::CdcEntry entry;
+	entry.hash.resize(proto::CHUNK_HASH_SIZE);
+	for (size_t idx = 0; idx < this->n_received; idx++) {
+		is.read((char*)&entry.len, sizeof(entry.len));
+		is.read((char*)entry.hash.data(), entry.hash.size());
+
+		std::vector<uint8_t> data;
+		if (!is || !store.get(entry.hash, data) || data.size() != entry.len) {
+			return false;
+		}
+		buf.insert(buf.end(), data.begin(), data.end());
+
+		size_t offset = 0;
+		for (; buf.size() - offset >= CHUNK_SIZE; offset += CHUNK_SIZE) {
+			file->saveChunk(std::make_shared<FileChunk>(file, chunk_idx++,
+					std::vector<uint8_t>(buf.begin() + offset,
+							buf.begin() + offset + CHUNK_SIZE),
+					std::vector<uint8_t>()));
+		}
+		buf.erase(buf.begin(), buf.begin() + offset);
+	}
+
+	if (!buf.empty()) {
+		file->saveChunk(std::make_shared<FileChunk>(file, chunk_idx, buf,
+				std::vector<uint8_t>()));
+	}
+
+	return true;
+}
+
+void FileRecipe::remove()
+{
+	std::filesystem::remove(this->recipe_file);
+}
+
+size_t FileRecipe::headerSize() const
+{
+	return sizeof(this->file_size) + proto::HASH_SIZE +
+			sizeof(this->n_entries);
+}
+
+} // file
+} // ft
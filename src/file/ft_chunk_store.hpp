@@ -0,0 +1,135 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+// Released under MIT License
+// Copyright (c) 2020 Hernan Perrone (hernan.perrone@gmail.com)
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef FT_FILE_CHUNKSTORE_H
+#define FT_FILE_CHUNKSTORE_H
+
+#include <atomic>
+#include <filesystem>
+#include <vector>
+
+#include "ft_utils.hpp"
+#include "file/ft_file.hpp"
+#include "protocol/ft_msg.hpp"
+
+namespace ft { namespace file {
+
+FT_DECLARE_CLASS(ChunkStore)
+FT_DECLARE_CLASS(FileRecipe)
+
+/// @brief Content addressed store of chunks, shared by all the clients
+///
+/// Each chunk is stored once, in a file named as the hex representation of its
+/// fingerprint, within the '.store' directory of the upload directory:
+///   .store/<first 2 hex digits>/<fingerprint in hex>
+///
+/// Chunks are written to a temporary file and then renamed, so concurrent
+/// uploads of the same chunk never expose partially written chunks.
+///
+/// The store also keeps the deduplication statistics of the files rebuilt
+/// since the server started.
+class ChunkStore {
+private:
+	const std::filesystem::path base_path;
+	const std::filesystem::path store_path;
+	std::atomic<uint64_t>       logical_bytes;
+	std::atomic<uint64_t>       transferred_bytes;
+
+public:
+	ChunkStore(const std::filesystem::path& base_path);
+
+	virtual ~ChunkStore() {}
+
+	bool has(const std::vector<uint8_t>& hash) const;
+
+	void put(const std::vector<uint8_t>& hash,
+			const std::vector<uint8_t>& data);
+
+	bool get(const std::vector<uint8_t>& hash,
+			std::vector<uint8_t>& data_out) const;
+
+	/// @brief Opens the recipe of a file being uploaded, creating it if needed
+	///
+	/// A recipe of a previous upload with a different hash or size is
+	/// discarded.
+	FileRecipePtr openRecipe(const std::filesystem::path& path,
+			const std::vector<uint8_t>& hash, size_t size);
+
+	/// @brief Accounts the bytes of a file and the ones to be transferred
+	void addStats(uint64_t logical, uint64_t transferred);
+
+	uint64_t getLogicalBytes() const { return this->logical_bytes; }
+
+	uint64_t getTransferredBytes() const { return this->transferred_bytes; }
+
+private:
+	std::filesystem::path chunkPath(const std::vector<uint8_t>& hash) const;
+};
+
+/// @brief Recipe of a file being uploaded in deduplicated storage mode
+///
+/// Persistent list of the content defined chunks of the file. It is received
+/// from the client in batches and stored next to the file being uploaded:
+/// ".file_name.recipe".
+///
+/// The layout of the file is
+///   - file_length: 8 bytes
+///   - file_hash:   64 bytes
+///   - n_entries:   8 bytes (0 until the first batch is received)
+///   - entries:     chunk length (4 bytes) + fingerprint (32 bytes)
+class FileRecipe {
+private:
+	const std::filesystem::path recipe_file;
+	const size_t                file_size;
+	const std::vector<uint8_t>  file_hash;
+	size_t                      n_entries;
+	size_t                      n_received;
+
+public:
+	FileRecipe(const std::filesystem::path& recipe_file, size_t file_size,
+			const std::vector<uint8_t>& file_hash);
+
+	virtual ~FileRecipe() {}
+
+	size_t getNumOfEntries() const { return this->n_entries; }
+
+	size_t getNumOfReceived() const { return this->n_received; }
+
+	bool isReceived() const {
+		return this->n_entries > 0 && this->n_received == this->n_entries;
+	}
+
+	/// @brief Appends a batch of entries
+	///
+	/// Batches must be added in order, otherwise they are ignored.
+	void addEntries(size_t idx_first, size_t n_total,
+			const std::vector<proto::CdcEntry>& entries);
+
+	bool getEntry(size_t idx, proto::CdcEntry& entry_out) const;
+
+	/// @brief Index of the first entry whose chunk is not in the store
+	///
+	/// Returns UINT64_MAX if all the chunks are in the store.
+	size_t nextMissingChunk(const ChunkStore& store, size_t from_idx) const;
+
+	/// @brief Total length of the chunks not in the store
+	size_t getMissingBytes(const ChunkStore& store) const;
+
+	/// @brief Writes the file contents from the chunks in the store
+	///
+	/// Chunks are saved to the file as regular chunks, so its metadata
+	/// reflects the progress.
+	bool rebuild(const ChunkStore& store, FilePtr file) const;
+
+	void remove();
+
+private:
+	size_t headerSize() const;
+};
+
+} // file
+} // ft
+#endif //FT_FILE_CHUNKSTORE_H
@@ -0,0 +1,145 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+// Released under MIT License
+// Copyright (c) 2020 Hernan Perrone (hernan.perrone@gmail.com)
+//////////////////////////////////////////////////////////////////////////////
+
+#include <stdexcept>
+#include <system_error>
+
+// POSIX & LINUX headers
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "file/ft_fd_cache.hpp"
+
+namespace ft { namespace file {
+
+FdCache::Fd::~Fd()
+{
+	if (this->map_addr) {
+		(void)munmap(this->map_addr, this->map_len);
+	}
+	(void)close(this->fd);
+}
+
+size_t FdCache::Fd::read(void* buf, size_t len, size_t offset) const
+{
+	size_t pos = 0;
+	while (pos < len) {
+		ssize_t n = pread(this->fd, (uint8_t*)buf + pos, len - pos,
+				offset + pos);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0) {
+			throw std::system_error(
+					std::make_error_code(static_cast<std::errc>(errno)),
+					"Failed reading file");
+		}
+		if (n == 0) {
+			break;
+		}
+		pos += n;
+	}
+	return pos;
+}
+
+void FdCache::Fd::write(const void* buf, size_t len, size_t offset) const
+{
+	size_t pos = 0;
+	while (pos < len) {
+		ssize_t n = pwrite(this->fd, (const uint8_t*)buf + pos, len - pos,
+				offset + pos);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0) {
+			throw std::system_error(
+					std::make_error_code(static_cast<std::errc>(errno)),
+					"Failed writing file");
+		}
+		pos += n;
+	}
+}
+
+uint8_t* FdCache::Fd::map(size_t len)
+{
+	std::lock_guard<std::mutex> lock(this->map_mtx);
+
+	if (this->map_addr) {
+		if (len > this->map_len) {
+			throw std::range_error("File mapped with a shorter length");
+		}
+		return this->map_addr;
+	}
+
+	// Accessing the mapping past the end of the file raises SIGBUS
+	struct stat st;
+	if (fstat(this->fd, &st) != 0 || (size_t)st.st_size < len) {
+		throw std::system_error(std::make_error_code(std::errc::invalid_argument),
+				"File shorter than its mapping");
+	}
+
+	void* addr = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_SHARED,
+			this->fd, 0);
+	if (addr == MAP_FAILED) {
+		throw std::system_error(
+				std::make_error_code(static_cast<std::errc>(errno)),
+				"Failed mapping file");
+	}
+
+	this->map_addr = (uint8_t*)addr;
+	this->map_len  = len;
+	return this->map_addr;
+}
+
+FdCache::FdCache(size_t max_fds, int open_flags)
+: max_fds(max_fds)
+, open_flags(open_flags)
+{
+}
+
+FdCache::FdPtr FdCache::open(const std::filesystem::path& path)
+{
+	std::lock_guard<std::mutex> lock(this->mtx);
+
+	auto it = this->fds.find(path.string());
+	if (it != this->fds.end()) {
+		this->lru.splice(this->lru.begin(), this->lru, it->second.lru_pos);
+		return it->second.fd;
+	}
+
+	int fd = ::open(path.c_str(), this->open_flags | O_CLOEXEC);
+	if (fd < 0) {
+		throw std::system_error(
+				std::make_error_code(static_cast<std::errc>(errno)),
+				"Failed to open " + path.string());
+	}
+	auto ret = std::make_shared<Fd>(fd);
+
+	// The evicted descriptors are closed once the threads using them are done
+	while (this->fds.size() >= this->max_fds && !this->lru.empty()) {
+		this->fds.erase(this->lru.back());
+		this->lru.pop_back();
+	}
+
+	this->lru.push_front(path.string());
+	this->fds[path.string()] = { ret, this->lru.begin() };
+	return ret;
+}
+
+void FdCache::forget(const std::filesystem::path& path)
+{
+	std::lock_guard<std::mutex> lock(this->mtx);
+
+	auto it = this->fds.find(path.string());
+	if (it != this->fds.end()) {
+		this->lru.erase(it->second.lru_pos);
+		this->fds.erase(it);
+	}
+}
+
+} // file
+} // ft
@@ -0,0 +1,126 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+// Released under MIT License
+// Copyright (c) 2020 Hernan Perrone (hernan.perrone@gmail.com)
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef FT_FILE_FDCACHE_H
+#define FT_FILE_FDCACHE_H
+
+#include <filesystem>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+// POSIX & LINUX headers
+#include <fcntl.h>
+
+#include "ft_utils.hpp"
+
+namespace ft { namespace file {
+
+FT_DECLARE_CLASS(FdCache)
+
+/// @brief Bounded LRU cache of the file descriptors of the files in transfer
+///
+/// Each chunk received is written to the file and marked in its metadata file,
+/// so opening them for each chunk costs more than writing it. The cache keeps
+/// them open (for reading and writing), up to max_fds files, closing the least
+/// recently used ones. Files are opened for reading and writing, or with the
+/// open flags given (e.g. O_RDONLY for the local files being sent).
+///
+/// A descriptor is shared by all the threads using the file, and only closed
+/// once evicted and no longer in use. Files are cached by path, so the path of
+/// a file must be forgotten before it is removed or replaced.
+class FdCache {
+public:
+	/// @brief An open file descriptor, closed on destruction
+	///
+	/// The beginning of the file may be mapped in memory (shared with the
+	/// file), unmapped on destruction as well. An object may be attached to
+	/// the descriptor (e.g. built from the mapping), so it is shared by all
+	/// the users of the file and dropped with it.
+	class Fd {
+	private:
+		std::mutex             map_mtx;
+		uint8_t*               map_addr;
+		size_t                 map_len;
+		std::mutex             attached_mtx;
+		std::shared_ptr<void>  attached;
+
+	public:
+		const int fd;
+
+		explicit Fd(int fd) : map_addr(nullptr), map_len(0), fd(fd) {}
+
+		Fd(const Fd&) = delete;
+		Fd& operator=(const Fd&) = delete;
+
+		virtual ~Fd();
+
+		/// @brief Reads up to len bytes at offset, less only at the end of file
+		///
+		/// Throws std::system_error on failure.
+		size_t read(void* buf, size_t len, size_t offset) const;
+
+		/// @brief Writes len bytes at offset
+		///
+		/// Throws std::system_error on failure.
+		void write(const void* buf, size_t len, size_t offset) const;
+
+		/// @brief The first len bytes of the file, mapped in memory
+		///
+		/// Mapped on the first call, the same mapping is returned after.
+		/// Throws std::system_error if the file is shorter than len or it
+		/// cannot be mapped.
+		uint8_t* map(size_t len);
+
+		/// @brief The object attached, made by make() on the first call
+		///
+		/// All the calls must attach objects of the same type.
+		template <typename T>
+		std::shared_ptr<T> attach(
+				const std::function<std::shared_ptr<T>()>& make) {
+			std::lock_guard<std::mutex> lock(this->attached_mtx);
+			if (!this->attached) {
+				this->attached = make();
+			}
+			return std::static_pointer_cast<T>(this->attached);
+		}
+	};
+	typedef std::shared_ptr<Fd> FdPtr;
+
+private:
+	typedef std::list<std::string> LruList;
+
+	struct Entry {
+		FdPtr              fd;
+		LruList::iterator  lru_pos;
+	};
+
+	const size_t                            max_fds;
+	const int                               open_flags;
+	std::mutex                              mtx;
+	LruList                                 lru;     ///! Most recent first
+	std::unordered_map<std::string, Entry>  fds;
+
+public:
+	FdCache(size_t max_fds, int open_flags = O_RDWR);
+
+	virtual ~FdCache() {}
+
+	/// @brief Descriptor of the file, opened if not cached
+	///
+	/// Throws std::system_error if the file cannot be opened.
+	FdPtr open(const std::filesystem::path& path);
+
+	/// @brief Drops the descriptor of the file, if cached
+	void forget(const std::filesystem::path& path);
+};
+
+} // file
+} // ft
+#endif //FT_FILE_FDCACHE_H
@@ -5,36 +5,78 @@
 //////////////////////////////////////////////////////////////////////////////
 
 #include <fstream>
+#include <functional>
 #include <iomanip>
 #include <algorithm>
+#include <condition_variable>
 #include <iostream>
+#include <map>
+#include <mutex>
 #include <string>
 #include <exception>
 #include <stdexcept>
+#include <system_error>
+#include <cstring>
+
+// POSIX & LINUX headers
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 // Using BLAKE2b from Crypto++ for calculating hashes
 #include <cryptlib.h>
 #include <blake2.h>
 
-#include "file/ft_file_meta.hpp"
+#include "file/ft_blake2.hpp"
+#include "file/ft_file_tree.hpp"
 #include "file/ft_file.hpp"
 
 namespace ft { namespace file {
 
+// Length of the reads hashing a whole file
+static const size_t HASH_READ_SIZE = 1024U * 1024U;
+
+// Local files kept open
+static const size_t LOCAL_FD_CACHE_MAX_FDS = 64U;
+
+// Number of chunks read at once from local files, from the chunk requested
+static const size_t READ_AHEAD_CHUNKS = 64U;
+
+// Bytes of consecutive chunks kept in memory to write them at once
+static const size_t WRITE_BUFFER_SIZE = 1024U * 1024U;
+
 /// @brief Local file in the client filesystem
 ///
 /// The class FileLocal represents a local file in the client file system.
 ///
 /// The key method within this class is getChunk(), used to retrieve the file
 /// segments being transferred.
+///
+/// Files hashed as a tree keep the FileTree, to provide the proofs of the
+/// chunks. When the hash was taken from the HashCache, the tree is only built
+/// on the first proof requested.
+///
+/// The chunks are read with pread from the descriptor kept open by the local
+/// FdCache, READ_AHEAD_CHUNKS at once from the chunk requested, so the next
+/// chunks (usually requested next) are copied from memory. The kernel is told
+/// to read the following ones meanwhile. The buffer is reused for each read,
+/// and released once the last chunk of the file is read.
 class FileLocal : virtual public File {
+	mutable FileTreePtr tree;
+	mutable std::mutex  tree_mtx;
+
+	mutable std::vector<uint8_t>  read_buf;         ///! Data read ahead
+	mutable size_t                read_buf_offset;  ///! Of read_buf in the file
+	mutable std::mutex            read_mtx;
 
 public:
 	const std::filesystem::path effective_path;
 public:
 	FileLocal(const std::filesystem::path& path,
 			const std::vector<uint8_t>& hash, const size_t size,
-			const std::filesystem::path& effective_path);
+			proto::HashAlgo hash_algo,
+			const std::filesystem::path& effective_path,
+			const FileTreePtr tree = FileTreePtr());
 public:
 	virtual ~FileLocal() {}
 
@@ -46,13 +88,57 @@ public:
 		throw std::domain_error("File chunks cannot be saved in local files");
 	};
 
+	virtual void flush() {
+		// Nothing is written to local files
+	};
+
+	virtual size_t getZeroRun(size_t chunk_idx, size_t max_chunks) const;
+
+	virtual void saveZeroChunks(size_t chunk_idx, size_t n_chunks) {
+		throw std::domain_error("File chunks cannot be saved in local files");
+	};
+
 	virtual size_t getNextMissingChunk(size_t from_chunk_idx = 0) const {
 		// Local file have all the chunks
 		return UINT64_MAX;
 	};
 
+	virtual size_t getNextReceivedChunk(size_t from_chunk_idx = 0) const {
+		return from_chunk_idx < getNumOfChunks() ? from_chunk_idx : UINT64_MAX;
+	};
+
+	virtual void getProof(size_t chunk_idx, size_t n_chunks,
+			std::vector<uint8_t>& proof_out) const;
+
+	virtual void readData(size_t offset, size_t len,
+			std::vector<uint8_t>& data_out) const;
+
+	virtual void commit() {
+		throw std::domain_error("Local files cannot be committed");
+	};
+
+	virtual void discard() {
+		throw std::domain_error("Local files cannot be discarded");
+	};
+
+	virtual void restart() {
+		throw std::domain_error("Local files cannot be restarted");
+	};
+
+	virtual void rehash() {
+		throw std::domain_error("Local files cannot be rehashed");
+	};
+
+	virtual void dropCache() const;
+
+private:
+	/// @brief Reads like readData(), through the read ahead buffer
+	void readAhead(size_t offset, size_t len,
+			std::vector<uint8_t>& data_out) const;
+
 	// Only File::makeLocalFile should construct instances of FileLocal
-	friend FilePtr File::makeLocalFile(const std::filesystem::path& in_file);
+	friend FilePtr File::makeLocalFile(const std::filesystem::path& in_file,
+			proto::HashAlgo hash_algo);
 };
 
 
@@ -63,9 +149,45 @@ public:
 
 /// @brief Remote file in the server filesystem
 ///
-/// The class FileRemote represents a file in the server's file system.
+/// The class FileRemote represents a file in the server's file system, or in
+/// the Storage set with setStorage(), as its StoredFile.
+///
+/// The file is hashed as its chunks are saved, from the data in memory, so
+/// isComplete() does not need to read it again. Chunks received out of order
+/// are read from the storage once the chunks before them are received. The
+/// state of the hash is kept by the storage (e.g. in a FileHasher checkpoint).
+///
+/// The file is created with all its space allocated (fallocate), so it is not
+/// fragmented by the chunks arriving out of order, and the constructor throws
+/// std::system_error (e.g. ENOSPC) if it does not fit.
+///
+/// The chunks saved one after the other are copied to a buffer, and written at
+/// once when WRITE_BUFFER_SIZE bytes are kept, a chunk that does not follow
+/// them is saved, they are the last ones missing, or on flush() (and
+/// destruction). Then they are marked in the metadata and hashed. So the
+/// chunks kept are not received for the metadata until written, but they are
+/// not reported as missing either. The buffer is reused while chunks arrive,
+/// and released by flush().
+///
+/// With an IoEngine (and a storage in files), the buffer is handed over to it
+/// instead of written, and the chunks are marked and hashed by its
+/// completion. Meanwhile they are in flight: not received for the metadata,
+/// nor missing, as the ones kept. The buffer of a write done is reused for the
+/// next one. The writes in flight are waited for by flush(), isComplete() and
+/// before the metadata is removed, and on destruction (the completions use
+/// the file).
 class FileRemote : virtual public File {
-	FileMetadata file_metadata;
+	StoredFilePtr stored;
+
+	mutable std::mutex    write_mtx;
+	std::vector<uint8_t>  write_buf;       ///! Chunks kept to write at once
+	size_t                write_chunk_idx; ///! Of the first one kept
+	size_t                write_n_chunks;
+
+	mutable std::mutex               flight_mtx;
+	mutable std::condition_variable  flight_cv;   ///! Signals writes done
+	std::multimap<size_t, size_t>    write_in_flight; ///! Chunks, by index
+	std::vector<uint8_t>             spare_buf;   ///! Of a write done
 
 public:
 	const std::filesystem::path effective_path;
@@ -73,9 +195,10 @@ public:
 	FileRemote(const std::filesystem::path& path,
 			const std::vector<uint8_t>& hash,
 			const size_t size,
+			proto::HashAlgo hash_algo,
 			const std::filesystem::path& effective_path);
 
-	virtual ~FileRemote() {}
+	virtual ~FileRemote();
 
 	virtual bool isComplete() const;
 
@@ -86,13 +209,58 @@ public:
 
 	virtual void saveChunk(const FileChunkPtr chunk);
 
-	virtual size_t getNextMissingChunk(size_t from_chunk_idx = 0) const {
-		return this->file_metadata.nextMissingChunk(from_chunk_idx);
-	};
+	virtual void flush();
+
+	virtual size_t getZeroRun(size_t chunk_idx, size_t max_chunks) const {
+		throw std::domain_error("File chunks cannot be retrieved from remote "
+				"files");
+	}
+
+	virtual void saveZeroChunks(size_t chunk_idx, size_t n_chunks);
+
+	virtual size_t getNextMissingChunk(size_t from_chunk_idx = 0) const;
+
+	virtual size_t getNextReceivedChunk(size_t from_chunk_idx = 0) const;
+
+	virtual void getProof(size_t chunk_idx, size_t n_chunks,
+			std::vector<uint8_t>& proof_out) const {
+		throw std::domain_error("Proofs cannot be retrieved from remote files");
+	}
+
+	virtual void readData(size_t offset, size_t len,
+			std::vector<uint8_t>& data_out) const;
+
+	virtual void commit();
+
+	virtual void discard();
+
+	virtual void restart();
+
+	virtual void rehash();
+
+	virtual void dropCache() const;
 
 	FilePtr metadataFile_makeRemoteFile( const std::filesystem::path& path,
 		const std::filesystem::path& effective_path);
 
+private:
+	/// @brief Writes, marks and hashes the chunks kept, if any
+	///
+	/// Must be called with write_mtx locked.
+	void writeChunks();
+
+	/// @brief Marks and hashes the chunks written by the IoEngine
+	void written(size_t chunk_idx, size_t n_chunks, int err,
+			std::vector<uint8_t>& data);
+
+	/// @brief Waits for the writes in the IoEngine
+	void waitWrites() const;
+
+	/// @brief Next missing chunk, skipping the ones kept and in flight
+	///
+	/// Must be called with write_mtx locked.
+	size_t nextMissingChunk(size_t from_chunk_idx) const;
+
 };
 
 
@@ -102,22 +270,56 @@ public:
 static void calc_hash(const std::filesystem::path& file,
 		std::vector<uint8_t>& digest_out);
 
-static void calc_hash(std::ifstream& is, std::vector<uint8_t>& digest_out);
+static void read_file(const std::filesystem::path& file,
+		const std::function<void(const uint8_t*, size_t)>& consume);
+
+static void calc_hash(const std::vector<uint8_t>& buf,
+		std::vector<uint8_t>& digest_out);
 
-static void calc_hash(std::vector<uint8_t>& buf,
+static void calc_hash(proto::HashAlgo hash_algo,
+		const std::filesystem::path& file, size_t file_size,
 		std::vector<uint8_t>& digest_out);
 
+static void calc_hash(proto::HashAlgo hash_algo,
+		const std::vector<uint8_t>& buf, std::vector<uint8_t>& digest_out);
+
+static std::filesystem::path delta_path(const std::filesystem::path& path);
+
+static bool is_zero(const uint8_t* data, size_t len);
+
 ////////////////////////////////////////////////////////////////////////////
 // File class' members
 
 std::filesystem::path File::sm_path_prefix = "";
+HashCachePtr          File::sm_hash_cache;
+IoEnginePtr           File::sm_io_engine;
+StoragePtr            File::sm_storage =
+		Storage::makeStorage(Storage::POSIX);
+FdCachePtr            File::sm_local_fd_cache =
+		std::make_shared<FdCache>(LOCAL_FD_CACHE_MAX_FDS, O_RDONLY);
 
 void File::setLocalPathPrefix(const std::filesystem::path& path_prefix)
 {
 	File::sm_path_prefix = path_prefix;
 }
 
-FilePtr File::makeLocalFile(const std::filesystem::path& path)
+void File::setHashCache(HashCachePtr hash_cache)
+{
+	File::sm_hash_cache = hash_cache;
+}
+
+void File::setIoEngine(IoEnginePtr io_engine)
+{
+	File::sm_io_engine = io_engine;
+}
+
+void File::setStorage(StoragePtr storage)
+{
+	File::sm_storage = storage;
+}
+
+FilePtr File::makeLocalFile(const std::filesystem::path& path,
+		proto::HashAlgo hash_algo)
 {
 	auto effective_path = File::sm_path_prefix;
 	effective_path /= path;
@@ -128,19 +330,48 @@ FilePtr File::makeLocalFile(const std::filesystem::path& path)
 				"regular file: ") + (std::string)effective_path);
 	}
 
+	struct stat st;
+	if (stat(effective_path.c_str(), &st) != 0) {
+		throw std::system_error(
+				std::make_error_code(static_cast<std::errc>(errno)),
+				"Failed to stat file");
+	}
+	size_t size = st.st_size;
+
 	std::vector<uint8_t> hash;
-	calc_hash(effective_path, hash);
-	return std::make_shared<FileLocal>(path, hash,
-			std::filesystem::file_size(effective_path), effective_path);
+	if (File::sm_hash_cache && File::sm_hash_cache->get(st, hash_algo, hash)) {
+		return std::make_shared<FileLocal>(path, hash, size, hash_algo,
+				effective_path);
+	}
+
+	FileTreePtr tree;
+	if (hash_algo == proto::HASH_ALGO_BLAKE2B_TREE) {
+		tree = std::make_shared<FileTree>(effective_path, size);
+		hash = tree->getFileHash();
+	} else {
+		calc_hash(hash_algo, effective_path, size, hash);
+	}
+
+	// Only cached if the file was not modified while hashing it
+	struct stat st_after;
+	if (File::sm_hash_cache && stat(effective_path.c_str(), &st_after) == 0 &&
+			HashCache::sameFile(st, st_after)) {
+		File::sm_hash_cache->put(effective_path, st, hash_algo, hash);
+	}
+
+	return std::make_shared<FileLocal>(path, hash, size, hash_algo,
+			effective_path, tree);
 }
 
 FilePtr File::makeRemoteFile(const std::filesystem::path& path,
-		const std::vector<uint8_t>& hash, const size_t& size)
+		const std::vector<uint8_t>& hash, const size_t& size,
+		proto::HashAlgo hash_algo)
 {
 	auto effective_path = File::sm_path_prefix;
 	effective_path /= path;
 
-	return std::make_shared<FileRemote>(path, hash, size, effective_path);
+	return std::make_shared<FileRemote>(path, hash, size, hash_algo,
+			effective_path);
 }
 
 FilePtr File::makeRemoteFile(const std::filesystem::path& path)
@@ -151,25 +382,111 @@ FilePtr File::makeRemoteFile(const std::filesystem::path& path)
 	size_t file_size;
 	size_t file_chunk_size;
 	std::vector<uint8_t> file_hash;
+	uint8_t file_hash_algo;
 
 	FilePtr ret;
-	FileMetadata::readHeader(effective_path, file_size, file_chunk_size,
-			file_hash);
-	if (file_chunk_size > 0) {
+	if (File::sm_storage->readHeader(effective_path, file_size,
+			file_chunk_size, file_hash, file_hash_algo)) {
 		ret = std::make_shared<FileRemote>(path, file_hash, file_size,
-				effective_path);
+				(proto::HashAlgo)file_hash_algo, effective_path);
+	}
+
+	return ret;
+}
+
+FilePtr File::makeRemoteDeltaFile(const std::filesystem::path& path,
+		const std::vector<uint8_t>& hash, const size_t& size,
+		proto::HashAlgo hash_algo)
+{
+	auto effective_path = File::sm_path_prefix;
+	effective_path /= delta_path(path);
+
+	return std::make_shared<FileRemote>(path, hash, size, hash_algo,
+			effective_path);
+}
+
+FilePtr File::makeRemoteDeltaFile(const std::filesystem::path& path)
+{
+	auto effective_path = File::sm_path_prefix;
+	effective_path /= delta_path(path);
+
+	size_t file_size;
+	size_t file_chunk_size;
+	std::vector<uint8_t> file_hash;
+	uint8_t file_hash_algo;
+
+	FilePtr ret;
+	if (File::sm_storage->readHeader(effective_path, file_size,
+			file_chunk_size, file_hash, file_hash_algo)) {
+		ret = std::make_shared<FileRemote>(path, file_hash, file_size,
+				(proto::HashAlgo)file_hash_algo, effective_path);
 	}
 
 	return ret;
 }
 
+FilePtr File::saveRemoteFile(const std::filesystem::path& path,
+		const std::vector<uint8_t>& hash, proto::HashAlgo hash_algo,
+		const std::vector<uint8_t>& data)
+{
+	std::vector<uint8_t> data_hash;
+	calc_hash(hash_algo, data, data_hash);
+	if (data_hash != hash) {
+		return FilePtr();
+	}
+
+	auto effective_path = File::sm_path_prefix;
+	effective_path /= path;
+
+	// The same contents may be already stored
+	if (File::sm_storage->isStored(effective_path, data.size())) {
+		auto file = File::makeLocalFile(path, hash_algo);
+		if (file->hash == hash) {
+			return file;
+		}
+	}
+
+	File::sm_storage->save(effective_path, hash, hash_algo, data);
+
+	auto delta = File::makeRemoteDeltaFile(path);
+	if (delta) {
+		delta->discard();
+	}
+
+	return std::make_shared<FileLocal>(path, hash, data.size(), hash_algo,
+			effective_path);
+}
+
+size_t File::getMissingRanges(size_t max_ranges,
+		std::vector<proto::ChunkRange>& ranges_out) const
+{
+	ranges_out.clear();
+
+	size_t n_missing = 0;
+	size_t n_chunks = getNumOfChunks();
+	for (size_t first = getNextMissingChunk(0); first < n_chunks;
+			first = getNextMissingChunk(first)) {
+		size_t last = std::min(getNextReceivedChunk(first), n_chunks) - 1;
+		if (ranges_out.size() < max_ranges) {
+			ranges_out.push_back({(uint32_t)first, (uint32_t)last});
+		}
+		n_missing += last - first + 1;
+		first = last + 1;
+	}
+
+	return n_missing;
+}
+
 ////////////////////////////////////////////////////////////////////////////
 // FileLocal class' members
 
 FileLocal::FileLocal(const std::filesystem::path& path,
 		const std::vector<uint8_t>& hash, const size_t size,
-		const std::filesystem::path& effective_path)
-: File(path, hash, size)
+		proto::HashAlgo hash_algo,
+		const std::filesystem::path& effective_path, const FileTreePtr tree)
+: File(path, hash, size, hash_algo)
+, tree(tree)
+, read_buf_offset(0)
 , effective_path(effective_path)
 {
 }
@@ -185,21 +502,160 @@ FileChunkPtr FileLocal::getChunk(size_t idx) const
 	size_t chunk_size = (this->size - offset) < CHUNK_SIZE ?
 			(this->size - offset) : CHUNK_SIZE;
 
-	// Read the data chunk to a memory buffer
-	std::vector<uint8_t> chunk_data(chunk_size);
-	std::ifstream is(this->effective_path, std::ios::in | std::ios::binary);
-	is.unsetf(std::ios::skipws);
-	is.seekg(offset, std::ifstream::beg);
-	is.read((char*)chunk_data.data(), chunk_data.size());
-	is.close();
-
-	// Calculate the hash
-	std::vector<uint8_t> chunk_hash;
-	calc_hash(chunk_data, chunk_hash);
+	// Read the data chunk to a memory buffer. The chunks are not hashed, as
+	// the file hash is verified once all of them are received.
+	std::vector<uint8_t> chunk_data;
+	readAhead(offset, chunk_size, chunk_data);
 
 	return std::make_shared<FileChunk>(
 			std::const_pointer_cast<File>(shared_from_this()), idx, chunk_data,
-			chunk_hash);
+			std::vector<uint8_t>());
+}
+
+size_t FileLocal::getZeroRun(size_t chunk_idx, size_t max_chunks) const
+{
+	const size_t n_chunks = getNumOfChunks();
+	if (chunk_idx >= n_chunks) {
+		return 0;
+	}
+	max_chunks = std::min(max_chunks, n_chunks - chunk_idx);
+
+	FdCache::FdPtr fd;
+	try {
+		fd = File::sm_local_fd_cache->open(this->effective_path);
+	} catch (const std::system_error&) {
+		return 0;
+	}
+
+	std::vector<uint8_t> buf(CHUNK_SIZE);
+	size_t n_read = 0;
+	size_t ret    = 0;
+	while (ret < max_chunks) {
+		size_t offset = (chunk_idx + ret) * CHUNK_SIZE;
+
+		// Holes are skipped without reading them
+		off_t data_offset = lseek(fd->fd, offset, SEEK_DATA);
+		if (data_offset < 0 && errno == ENXIO) {
+			data_offset = this->size; // Hole until the end of the file
+		}
+
+		if (data_offset > (off_t)offset) {
+			size_t hole_len = std::min((size_t)data_offset, this->size) - offset;
+			size_t n_hole = hole_len / CHUNK_SIZE;
+			if (offset + hole_len == this->size && hole_len % CHUNK_SIZE > 0) {
+				n_hole++; // Last chunk of the file
+			}
+
+			if (n_hole > 0) {
+				ret += std::min(n_hole, max_chunks - ret);
+				continue;
+			}
+		}
+
+		// Otherwise, read and check the chunk
+		if (n_read++ >= ZERO_RUN_MAX_READ_CHUNKS) {
+			break;
+		}
+
+		size_t len = std::min(CHUNK_SIZE, this->size - offset);
+		if (pread(fd->fd, buf.data(), len, offset) != (ssize_t)len ||
+				!is_zero(buf.data(), len)) {
+			break;
+		}
+		ret++;
+	}
+
+	return ret;
+}
+
+void FileLocal::getProof(size_t chunk_idx, size_t n_chunks,
+		std::vector<uint8_t>& proof_out) const
+{
+	if (this->hash_algo != proto::HASH_ALGO_BLAKE2B_TREE) {
+		throw std::domain_error("File not hashed as a tree");
+	}
+
+	std::lock_guard<std::mutex> lock(this->tree_mtx);
+	if (!this->tree) {
+		// Hash taken from the HashCache, so the tree is built now
+		auto tree = std::make_shared<FileTree>(this->effective_path,
+				this->size);
+		if (tree->getFileHash() != this->hash) {
+			throw std::runtime_error(std::string("File modified since it was "
+					"hashed: ") + (std::string)this->effective_path);
+		}
+		this->tree = tree;
+	}
+	this->tree->getProof(chunk_idx, n_chunks, proof_out);
+}
+
+void FileLocal::readData(size_t offset, size_t len,
+		std::vector<uint8_t>& data_out) const
+{
+	readAhead(offset, len, data_out);
+}
+
+void FileLocal::readAhead(size_t offset, size_t len,
+		std::vector<uint8_t>& data_out) const
+{
+	const size_t read_ahead_size = READ_AHEAD_CHUNKS * CHUNK_SIZE;
+	len = offset < this->size ? std::min(len, this->size - offset) : 0;
+
+	auto fd = File::sm_local_fd_cache->open(this->effective_path);
+	if (len > read_ahead_size) {
+		// Bigger reads (e.g. when splitting the file) are not buffered
+		data_out.resize(len);
+		data_out.resize(fd->read(data_out.data(), len, offset));
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(this->read_mtx);
+	if (offset < this->read_buf_offset ||
+			offset + len > this->read_buf_offset + this->read_buf.size()) {
+		if (this->read_buf.empty() && offset == 0) {
+			// Sent from the start, so the kernel reads ahead more
+			(void)posix_fadvise(fd->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		}
+		this->read_buf.resize(std::min(read_ahead_size, this->size - offset));
+		this->read_buf_offset = offset;
+		this->read_buf.resize(fd->read(this->read_buf.data(),
+				this->read_buf.size(), offset));
+
+		// The kernel reads the next ones while these are sent
+		size_t next = offset + this->read_buf.size();
+		if (next < this->size) {
+			(void)posix_fadvise(fd->fd, next, read_ahead_size,
+					POSIX_FADV_WILLNEED);
+		}
+	}
+
+	size_t start = offset - this->read_buf_offset;
+	size_t end   = std::min(start + len, this->read_buf.size());
+	data_out.assign(this->read_buf.begin() + start,
+			this->read_buf.begin() + end);
+
+	if (offset + len >= this->size) {
+		// The last chunk, usually not read again
+		std::vector<uint8_t>().swap(this->read_buf);
+		this->read_buf_offset = 0;
+	}
+}
+
+void FileLocal::dropCache() const
+{
+	{
+		std::lock_guard<std::mutex> lock(this->read_mtx);
+		std::vector<uint8_t>().swap(this->read_buf);
+		this->read_buf_offset = 0;
+	}
+
+	try {
+		auto fd = File::sm_local_fd_cache->open(this->effective_path);
+		(void)posix_fadvise(fd->fd, 0, 0, POSIX_FADV_DONTNEED);
+	} catch (const std::system_error&) {
+		// Not readable any more, so nothing to drop
+	}
+	File::sm_local_fd_cache->forget(this->effective_path);
 }
 
 ////////////////////////////////////////////////////////////////////////////
@@ -207,36 +663,50 @@ FileChunkPtr FileLocal::getChunk(size_t idx) const
 
 FileRemote::FileRemote(const std::filesystem::path& path,
 			const std::vector<uint8_t>& hash, const size_t size,
+			proto::HashAlgo hash_algo,
 			const std::filesystem::path& effective_path)
-: File(path, hash, size)
+: File(path, hash, size, hash_algo)
 , effective_path(effective_path)
-, file_metadata(effective_path, size, CHUNK_SIZE, hash)
+, stored(File::sm_storage->open(effective_path, size, CHUNK_SIZE, hash,
+		hash_algo))
+, write_chunk_idx(0)
+, write_n_chunks(0)
 {
-	std::filesystem::create_directories(this->effective_path.parent_path());
-	file_metadata.createIfNotExist();
+	// Created with all its space, so running out of space is found before
+	// requesting the first chunk
+	this->stored->create();
+}
 
-	if (!std::filesystem::exists(this->effective_path)) {
-		// If file does not exists, create an empty file
-		std::ofstream os(this->effective_path,
-				std::ios::out | std::ios::binary);
-		os.seekp(size - 1, std::ios::beg);
-		uint8_t b = 0;
-		os.write((char*)&b, 1);
-		os.close();
+FileRemote::~FileRemote()
+{
+	// The chunks kept are lost otherwise, and requested again
+	try {
+		flush();
+	} catch (const std::exception& e) {
+		std::cout << "Failed writing chunks of " << this->path.filename() <<
+				": " << e.what() << std::endl;
 	}
+	waitWrites();
 }
 
 bool FileRemote::isComplete() const
 {
+	waitWrites();
+
 	bool ret = false;
-	if (std::filesystem::exists(this->effective_path)) {
-		// Hash is computing intensive, so only calculate it if all the chunks
-		// have been received.
-		if (this->file_metadata.nextMissingChunk(0) == UINT64_MAX) {
+	if (this->stored->exists()) {
+		// The hash is only checked if all the chunks have been received.
+		if (this->stored->nextMissingChunk(0) == UINT64_MAX) {
 			std::vector<uint8_t> local_hash;
-			calc_hash(this->effective_path, local_hash);
-			ret = memcmp(this->hash.data(), local_hash.data(),
-					this->hash.size()) == 0;
+			ret = this->stored->updateHash(UINT64_MAX, nullptr, 0,
+					local_hash) && local_hash == this->hash;
+
+			// The checkpoint may not match the file (e.g. if chunks were
+			// saved again), so the file is hashed before taking it as corrupted
+			if (!ret) {
+				this->stored->verify(local_hash);
+				ret = local_hash == this->hash;
+			}
 		}
 	}
 
@@ -253,63 +723,365 @@ void FileRemote::saveChunk(const FileChunkPtr chunk)
 		return;
 	}
 
-	//Check if the chunk size is valid according to the file being received
-	size_t chunk_size = (this->size - offset) < CHUNK_SIZE ?
-			(this->size - offset) : CHUNK_SIZE;
+	//Check if the chunk size is valid according to the file being received.
+	//The data may span several chunks, only the last one of the file can be
+	//shorter than CHUNK_SIZE.
+	size_t n_chunks = chunk->data.size() / CHUNK_SIZE +
+			(chunk->data.size() % CHUNK_SIZE > 0 ? 1 : 0);
+	size_t chunk_size = std::min(this->size - offset, n_chunks * CHUNK_SIZE);
 
-	if (chunk_size != chunk->data.size()) {
+	if (n_chunks == 0 || chunk_size != chunk->data.size()) {
 		std::cout << "Try to save chunk with invalid size" << std::endl;
 		return;
 	}
 
-	// Open the file, seek to the beginning of the chunk and write it.
-	std::fstream os(this->effective_path,
-			std::ios::in | std::ios::out | std::ios::binary);
-	os.unsetf(std::ios::skipws);
-	os.seekp(offset, std::ifstream::beg);
-	os.write((char*)(chunk->data.data()), chunk->data.size());
-	os.close();
+	std::lock_guard<std::mutex> lock(this->write_mtx);
+
+	// Only consecutive chunks are written at once, up to WRITE_BUFFER_SIZE
+	if (this->write_n_chunks > 0 &&
+			(chunk->idx != this->write_chunk_idx + this->write_n_chunks ||
+			this->write_buf.size() + chunk->data.size() > WRITE_BUFFER_SIZE)) {
+		writeChunks();
+	}
+	if (this->write_n_chunks == 0) {
+		this->write_chunk_idx = chunk->idx;
+		this->write_buf.reserve(WRITE_BUFFER_SIZE);
+	}
+	this->write_buf.insert(this->write_buf.end(), chunk->data.begin(),
+			chunk->data.end());
+	this->write_n_chunks += n_chunks;
+
+	// The last chunks missing are written at once, so the file can be verified
+	if (this->write_buf.size() >= WRITE_BUFFER_SIZE ||
+			nextMissingChunk(0) == UINT64_MAX) {
+		writeChunks();
+	}
+}
+
+void FileRemote::flush()
+{
+	{
+		std::lock_guard<std::mutex> lock(this->write_mtx);
+		writeChunks();
+		std::vector<uint8_t>().swap(this->write_buf);
+	}
+	waitWrites();
+
+	std::lock_guard<std::mutex> lock(this->flight_mtx);
+	std::vector<uint8_t>().swap(this->spare_buf);
+}
+
+void FileRemote::saveZeroChunks(size_t chunk_idx, size_t n_chunks)
+{
+	size_t offset = chunk_idx * CHUNK_SIZE;
+	if (offset >= this->size || n_chunks == 0) {
+		std::cout << "Try to save chunk index outside file length range" <<
+				std::endl;
+		return;
+	}
+	size_t len = std::min(n_chunks * CHUNK_SIZE, this->size - offset);
+
+	std::lock_guard<std::mutex> lock(this->write_mtx);
+	writeChunks();
+
+	// The file may have other contents from a previous transfer
+	this->stored->writeZeros(offset, len);
+	this->stored->markChunks(chunk_idx, n_chunks, true);
+
+	// Holes are read fast, so they are hashed from the file
+	std::vector<uint8_t> hash_out;
+	this->stored->updateHash(chunk_idx, nullptr, 0, hash_out);
+}
+
+size_t FileRemote::getNextMissingChunk(size_t from_chunk_idx) const
+{
+	std::lock_guard<std::mutex> lock(this->write_mtx);
+	return nextMissingChunk(from_chunk_idx);
+}
+
+size_t FileRemote::getNextReceivedChunk(size_t from_chunk_idx) const
+{
+	std::lock_guard<std::mutex> lock(this->write_mtx);
+
+	// The chunks kept and in flight are taken as received
+	size_t ret = this->stored->nextReceivedChunk(from_chunk_idx);
+	if (this->write_n_chunks > 0 && this->write_chunk_idx < ret &&
+			this->write_chunk_idx + this->write_n_chunks > from_chunk_idx) {
+		ret = std::max(this->write_chunk_idx, from_chunk_idx);
+	}
+
+	std::lock_guard<std::mutex> flight_lock(this->flight_mtx);
+	for (const auto& range : this->write_in_flight) {
+		if (range.first >= ret) {
+			break;
+		}
+		if (range.first + range.second > from_chunk_idx) {
+			ret = std::max(range.first, from_chunk_idx);
+			break;
+		}
+	}
+	return ret;
+}
+
+void FileRemote::readData(size_t offset, size_t len,
+		std::vector<uint8_t>& data_out) const
+{
+	data_out.resize(len);
+	data_out.resize(this->stored->read(data_out.data(), len, offset));
+}
+
+void FileRemote::commit()
+{
+	// The bitmap of the complete file is written to disk, and the data is not
+	// kept in the page cache
+	flush();
+	this->stored->flush();
+	dropCache();
+
+	auto final_path = File::sm_path_prefix;
+	final_path /= this->path;
+
+	if (this->effective_path != final_path) {
+		// Delta transfer: replace the stored version and its metadata
+		this->stored->rename(final_path);
+	}
+}
+
+void FileRemote::discard()
+{
+	{
+		std::lock_guard<std::mutex> lock(this->write_mtx);
+		std::vector<uint8_t>().swap(this->write_buf);
+		this->write_n_chunks = 0;
+	}
+	waitWrites();
 
-	file_metadata.markChunk(chunk->idx, true);
+	this->stored->remove();
+}
+
+void FileRemote::restart()
+{
+	{
+		std::lock_guard<std::mutex> lock(this->write_mtx);
+		std::vector<uint8_t>().swap(this->write_buf);
+		this->write_n_chunks = 0;
+	}
+	waitWrites();
+
+	this->stored->restart();
+}
+
+void FileRemote::rehash()
+{
+	this->stored->rehash();
+}
+
+void FileRemote::dropCache() const
+{
+	this->stored->drop();
+}
+
+void FileRemote::writeChunks()
+{
+	if (this->write_n_chunks == 0) {
+		return;
+	}
+
+	// If the write fails, the chunks are dropped, so they are requested again
+	size_t n_chunks = this->write_n_chunks;
+	this->write_n_chunks = 0;
+
+	// Storages without files are written at once
+	FdCache::FdPtr fd;
+	if (File::sm_io_engine) {
+		fd = this->stored->fd();
+	}
+
+	if (fd) {
+		// The buffer goes with the write, the one of a write done (if any)
+		// is taken for the next
+		size_t chunk_idx = this->write_chunk_idx;
+		std::vector<uint8_t> data;
+		data.swap(this->write_buf);
+
+		{
+			std::lock_guard<std::mutex> lock(this->flight_mtx);
+			this->write_in_flight.emplace(chunk_idx, n_chunks);
+			this->write_buf.swap(this->spare_buf);
+		}
+		this->write_buf.clear();
+		File::sm_io_engine->write(fd, std::move(data), chunk_idx * CHUNK_SIZE,
+				[this, chunk_idx, n_chunks](int err,
+						std::vector<uint8_t>& data) {
+					written(chunk_idx, n_chunks, err, data);
+				});
+		return;
+	}
+
+	try {
+		this->stored->write(this->write_buf.data(), this->write_buf.size(),
+				this->write_chunk_idx * CHUNK_SIZE);
+
+		// Only marked once written
+		this->stored->markChunks(this->write_chunk_idx, n_chunks, true);
+
+		std::vector<uint8_t> hash_out;
+		this->stored->updateHash(this->write_chunk_idx, this->write_buf.data(),
+				this->write_buf.size(), hash_out);
+	} catch (...) {
+		this->write_buf.clear();
+		throw;
+	}
+	this->write_buf.clear();
+}
+
+void FileRemote::written(size_t chunk_idx, size_t n_chunks, int err,
+		std::vector<uint8_t>& data)
+{
+	if (err != 0) {
+		// Not marked, so they are requested again
+		std::cout << "Failed writing chunks of " << this->path.filename() <<
+				": " << strerror(err) << std::endl;
+	} else {
+		try {
+			this->stored->markChunks(chunk_idx, n_chunks, true,
+					File::sm_io_engine->syncsWrites());
+
+			std::vector<uint8_t> hash_out;
+			this->stored->updateHash(chunk_idx, data.data(), data.size(), hash_out);
+		} catch (const std::exception& e) {
+			std::cout << "Failed marking chunks of " << this->path.filename() <<
+					": " << e.what() << std::endl;
+		}
+	}
+
+	// The file may be destroyed once there are no writes in flight
+	std::lock_guard<std::mutex> lock(this->flight_mtx);
+	if (data.capacity() > this->spare_buf.capacity()) {
+		this->spare_buf.swap(data);
+	}
+
+	// Only the entry of this write: the same chunks may be in flight twice
+	// (e.g. the same file sent by two clients), and the file must not be
+	// destroyed before the other write is done
+	auto range = this->write_in_flight.equal_range(chunk_idx);
+	for (auto it = range.first; it != range.second; ++it) {
+		if (it->second == n_chunks) {
+			this->write_in_flight.erase(it);
+			break;
+		}
+	}
+	this->flight_cv.notify_all();
+}
+
+void FileRemote::waitWrites() const
+{
+	std::unique_lock<std::mutex> lock(this->flight_mtx);
+	this->flight_cv.wait(lock, [this]() {
+		return this->write_in_flight.empty();
+	});
+}
+
+size_t FileRemote::nextMissingChunk(size_t from_chunk_idx) const
+{
+	std::lock_guard<std::mutex> lock(this->flight_mtx);
+
+	// Past the chunks kept and in flight, until none of them is found
+	size_t ret = this->stored->nextMissingChunk(from_chunk_idx);
+	while (ret != UINT64_MAX) {
+		size_t skip_to = 0;
+		if (this->write_n_chunks > 0 && ret >= this->write_chunk_idx &&
+				ret < this->write_chunk_idx + this->write_n_chunks) {
+			skip_to = this->write_chunk_idx + this->write_n_chunks;
+		}
+
+		auto it = this->write_in_flight.upper_bound(ret);
+		if (it != this->write_in_flight.begin() &&
+				ret < std::prev(it)->first + std::prev(it)->second) {
+			skip_to = std::prev(it)->first + std::prev(it)->second;
+		}
+
+		if (skip_to == 0) {
+			break;
+		}
+		ret = this->stored->nextMissingChunk(skip_to);
+	}
+	return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////
+// FileChunk class' members
+
+bool FileChunk::isZero() const
+{
+	return is_zero(this->data.data(), this->data.size());
 }
 
 ////////////////////////////////////////////////////////////////////////////
 // Implementation of module's static functions
 
-static void calc_hash(const std::filesystem::path& file,
-		std::vector<uint8_t>& digest_out)
+static bool is_zero(const uint8_t* data, size_t len)
 {
-	std::ifstream is(file, std::ifstream::in | std::ifstream::binary);
-	is.unsetf(std::ios::skipws);
-	try {
-		calc_hash(is, digest_out);
-	} catch (std::exception any) {
-		is.close();
-		throw any;
+	// If the first byte is zero and each byte is equal to the following one,
+	// all are zeros. memcmp() is vectorized by the C library, so this is way
+	// faster than checking byte per byte.
+	return len > 0 && data[0] == 0 && memcmp(data, data + 1, len - 1) == 0;
+}
+
+static void read_file(const std::filesystem::path& file,
+		const std::function<void(const uint8_t*, size_t)>& consume)
+{
+	int fd = open(file.c_str(), O_RDONLY);
+	if (fd < 0) {
+		throw std::system_error(
+				std::make_error_code(static_cast<std::errc>(errno)),
+				"Failed opening " + file.generic_string());
 	}
-	is.close();
+	(void)posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	std::vector<uint8_t> buf(HASH_READ_SIZE);
+	off_t offset = 0;
+	while (true) {
+		ssize_t n_read = pread(fd, buf.data(), buf.size(), offset);
+		if (n_read < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n_read < 0) {
+			int err = errno;
+			close(fd);
+			throw std::system_error(
+					std::make_error_code(static_cast<std::errc>(err)),
+					"Failed reading " + file.generic_string());
+		}
+		if (n_read == 0) {
+			break;
+		}
+		try {
+			consume(buf.data(), n_read);
+		} catch (...) {
+			close(fd);
+			throw;
+		}
+		offset += n_read;
+	}
+	close(fd);
 }
 
-static void calc_hash(std::ifstream& is, std::vector<uint8_t>& digest_out)
+static void calc_hash(const std::filesystem::path& file,
+		std::vector<uint8_t>& digest_out)
 {
 	CryptoPP::BLAKE2b blake_hash((unsigned int)64);
-	std::vector<uint8_t> buf(blake_hash.BlockSize());
+
+	read_file(file, [&blake_hash](const uint8_t* data, size_t len) {
+		blake_hash.Update(data, len);
+	});
 
 	digest_out.clear();
 	digest_out.resize(blake_hash.DigestSize());
-
-	is.seekg(0, std::ifstream::beg);
-	do {
-		(void)memset(buf.data(), 0, buf.size());
-		is.read((char*)buf.data(), buf.size());
-		size_t n_read = is.gcount();
-		blake_hash.Update(buf.data(), n_read);
-	} while(is);
-
 	blake_hash.TruncatedFinal(digest_out.data(), digest_out.size());
 }
 
-static void calc_hash(std::vector<uint8_t>& buf,
+static void calc_hash(const std::vector<uint8_t>& buf,
 		std::vector<uint8_t>& digest_out)
 {
 	CryptoPP::BLAKE2b blake_hash((unsigned int)64);
@@ -320,5 +1092,61 @@ static void calc_hash(std::vector<uint8_t>& buf,
 	blake_hash.TruncatedFinal(digest_out.data(), digest_out.size());
 }
 
+static void calc_hash(proto::HashAlgo hash_algo,
+		const std::filesystem::path& file, size_t file_size,
+		std::vector<uint8_t>& digest_out)
+{
+	switch (hash_algo) {
+	case proto::HASH_ALGO_BLAKE2B:
+		calc_hash(file, digest_out);
+		break;
+	case proto::HASH_ALGO_BLAKE2B_TREE:
+		digest_out = FileTree(file, file_size).getFileHash();
+		break;
+	case proto::HASH_ALGO_BLAKE2BP: {
+		Blake2bp blake_hash;
+		read_file(file, [&blake_hash](const uint8_t* data, size_t len) {
+			blake_hash.update(data, len);
+		});
+		digest_out.resize(proto::HASH_SIZE);
+		blake_hash.final(digest_out.data());
+		break;
+	}
+	default:
+		throw std::invalid_argument("Unsupported hash algorithm");
+	}
+}
+
+static void calc_hash(proto::HashAlgo hash_algo,
+		const std::vector<uint8_t>& buf, std::vector<uint8_t>& digest_out)
+{
+	switch (hash_algo) {
+	case proto::HASH_ALGO_BLAKE2B:
+		calc_hash(buf, digest_out);
+		break;
+	case proto::HASH_ALGO_BLAKE2B_TREE:
+		digest_out = FileTree(buf).getFileHash();
+		break;
+	case proto::HASH_ALGO_BLAKE2BP: {
+		Blake2bp blake_hash;
+		blake_hash.update(buf.data(), buf.size());
+		digest_out.resize(proto::HASH_SIZE);
+		blake_hash.final(digest_out.data());
+		break;
+	}
+	default:
+		throw std::invalid_argument("Unsupported hash algorithm");
+	}
+}
+
+static std::filesystem::path delta_path(const std::filesystem::path& path)
+{
+	// The file is rebuilt as a hidden sibling of the stored version, i.e.: for
+	// a file named 'image.jpg', the delta file name is '.image.jpg.delta'.
+	auto ret = path.parent_path();
+	ret /= std::string(".") + path.filename().generic_string() + ".delta";
+	return ret;
+}
+
 } // file
 } // ft
\ No newline at end of file
@@ -11,6 +11,10 @@
 #include <vector>
 
 #include "ft_utils.hpp"
+#include "file/ft_fd_cache.hpp"
+#include "file/ft_hash_cache.hpp"
+#include "file/ft_io_engine.hpp"
+#include "file/ft_storage.hpp"
 #include "protocol/ft_msg.hpp"
 
 namespace ft { namespace file {
@@ -20,6 +24,9 @@ FT_DECLARE_CLASS(FileChunk)
 
 static const size_t CHUNK_SIZE = ft::proto::MAX_MSG_PAYLOAD_SIZE;
 
+// Maximum number of chunks read by getZeroRun() (holes are not read)
+static const size_t ZERO_RUN_MAX_READ_CHUNKS = 256U;
+
 /// @brief Represents a file being transferred
 ///
 /// Provides an abstraction of actual file in the filesystem as well as it holds
@@ -42,29 +49,82 @@ static const size_t CHUNK_SIZE = ft::proto::MAX_MSG_PAYLOAD_SIZE;
 /// collisions among different clients uploading different files with the same
 /// name.
 ///
+/// The hash of the file is calculated with the hash_algo chosen by the client.
+/// With proto::HASH_ALGO_BLAKE2B_TREE, the hash is the one of a FileTree of the
+/// chunks, so the chunks can be verified as they are received.
+///
+/// The hashes of local files are taken from the HashCache set with
+/// setHashCache(), if any, when the files were not modified since hashed.
+///
+/// The chunks of remote files are written by the IoEngine set with
+/// setIoEngine(), if any, instead of by the threads saving them.
+///
+/// Remote files are stored (their data, metadata and hash state) in the
+/// Storage set with setStorage(), the file system (Storage::POSIX) by default.
+///
+/// When a new version of an already received file is offered, it is rebuilt by
+/// a delta transfer next to the stored version. makeRemoteDeltaFile() returns
+/// such RemoteFile, which is moved over the stored version by commit() once
+/// complete.
+///
 class File : public virtual std::enable_shared_from_this<File> {
-private:
+protected:
 	static std::filesystem::path sm_path_prefix;
+	static HashCachePtr          sm_hash_cache;
+	static StoragePtr            sm_storage;         ///! Of the remote files
+	static FdCachePtr            sm_local_fd_cache;  ///! Of the local files
+	static IoEnginePtr           sm_io_engine;
 
 public:
 	const std::filesystem::path path;
 	const std::vector<uint8_t>  hash;
 	const size_t                size;
+	const proto::HashAlgo       hash_algo;
 
 public:
 	static void setLocalPathPrefix(const std::filesystem::path& path_prefix);
 
-	static FilePtr makeLocalFile(const std::filesystem::path& path);
+	static void setHashCache(HashCachePtr hash_cache);
+
+	/// @brief Sets the IoEngine writing the chunks of the remote files
+	///
+	/// Must be set before any file is used.
+	static void setIoEngine(IoEnginePtr io_engine);
+
+	/// @brief Sets the Storage of the remote files
+	///
+	/// Must be set before any file is used.
+	static void setStorage(StoragePtr storage);
+
+	static FilePtr makeLocalFile(const std::filesystem::path& path,
+			proto::HashAlgo hash_algo = proto::HASH_ALGO_BLAKE2B);
 
 	static FilePtr makeRemoteFile(const std::filesystem::path& path,
-			const std::vector<uint8_t>& hash, const size_t& size);
+			const std::vector<uint8_t>& hash, const size_t& size,
+			proto::HashAlgo hash_algo);
 
 	static FilePtr makeRemoteFile(const std::filesystem::path& path);
 
+	static FilePtr makeRemoteDeltaFile(const std::filesystem::path& path,
+			const std::vector<uint8_t>& hash, const size_t& size,
+			proto::HashAlgo hash_algo);
+
+	static FilePtr makeRemoteDeltaFile(const std::filesystem::path& path);
+
+	/// @brief Writes a whole file received at once, verifying its hash
+	///
+	/// Used for small files sent inline in the offer: no metadata file is
+	/// created, and any partial transfer of the file is discarded. Returns
+	/// the file (as a complete, local file), or nullptr if the data does not
+	/// match the hash.
+	static FilePtr saveRemoteFile(const std::filesystem::path& path,
+			const std::vector<uint8_t>& hash, proto::HashAlgo hash_algo,
+			const std::vector<uint8_t>& data);
+
 protected:
 	File(const std::filesystem::path& path, const std::vector<uint8_t>& hash,
-			const size_t size)
-	: path(path), hash(hash), size(size) {}
+			const size_t size, proto::HashAlgo hash_algo)
+	: path(path), hash(hash), size(size), hash_algo(hash_algo) {}
 
 public:
 	virtual ~File() {}
@@ -73,10 +133,70 @@ public:
 
 	virtual FileChunkPtr getChunk(size_t chunk_idx) const = 0;
 
+	/// @brief Saves the data of the chunk
+	///
+	/// The data may span several consecutive chunks from the chunk index. It
+	/// may be kept in memory with the chunks before it, and written with them
+	/// by flush(). The chunks kept are not missing for getNextMissingChunk().
 	virtual void saveChunk(const FileChunkPtr chunk) = 0;
 
+	/// @brief Writes the chunks kept in memory by saveChunk(), if any
+	///
+	/// Waits for the writes of the file in flight in the IoEngine too.
+	virtual void flush() = 0;
+
+	/// @brief Number of consecutive chunks from chunk_idx that are all zeros
+	///
+	/// Holes of sparse files are skipped without reading them. Returns up to
+	/// max_chunks.
+	virtual size_t getZeroRun(size_t chunk_idx, size_t max_chunks) const = 0;
+
+	/// @brief Saves n_chunks chunks of zeros from chunk_idx
+	///
+	/// The range is left as a hole in the file when the filesystem allows it.
+	virtual void saveZeroChunks(size_t chunk_idx, size_t n_chunks) = 0;
+
 	virtual size_t getNextMissingChunk(size_t from_chunk_idx = 0) const = 0;
 
+	virtual size_t getNextReceivedChunk(size_t from_chunk_idx = 0) const = 0;
+
+	/// @brief Lists up to max_ranges ranges of missing chunks
+	///
+	/// Returns the total number of missing chunks.
+	size_t getMissingRanges(size_t max_ranges,
+			std::vector<proto::ChunkRange>& ranges_out) const;
+
+	/// @brief Proof of a range of chunks in the FileTree of the file
+	///
+	/// Only for local files hashed as a tree.
+	virtual void getProof(size_t chunk_idx, size_t n_chunks,
+			std::vector<uint8_t>& proof_out) const = 0;
+
+	/// @brief Read len bytes starting at offset (less if the end is reached)
+	virtual void readData(size_t offset, size_t len,
+			std::vector<uint8_t>& data_out) const = 0;
+
+	/// @brief Moves a completed delta transfer over the stored version
+	virtual void commit() = 0;
+
+	/// @brief Removes the received data and its metadata
+	virtual void discard() = 0;
+
+	/// @brief Forgets the received chunks, so the transfer starts over
+	virtual void restart() = 0;
+
+	/// @brief Forgets the hash of the received data, so it is hashed again
+	///
+	/// Used when the stored file was modified since it was hashed.
+	virtual void rehash() = 0;
+
+	/// @brief Drops the data of the file from the page cache
+	///
+	/// Used once a transfer is done, so large files do not push out the data
+	/// in use. Remote files are written to disk first, as dirty pages are not
+	/// dropped.
+	virtual void dropCache() const = 0;
+
 	size_t getNumOfChunks() const {
 		return size / CHUNK_SIZE + ( size % CHUNK_SIZE > 0 ? 1 : 0);
 	}
@@ -84,7 +204,8 @@ public:
 
 /// @brief A segment of data within a File
 ///
-/// Holds the data of a segment of the file, including its index, data and hash.
+/// Holds the data of a segment of the file, including its index, data and hash
+/// (empty when not calculated, e.g. for the chunks read to be sent).
 ///
 /// This is mostly a data object.
 class FileChunk {
@@ -100,6 +221,9 @@ public:
 	: file(file), idx(idx), data(data), hash(hash) {}
 
 	virtual ~FileChunk() {}
+
+	/// @brief True if all the bytes of the chunk are zero
+	bool isZero() const;
 };
 
 } // file
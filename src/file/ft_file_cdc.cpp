@@ -0,0 +1,152 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+// Released under MIT License
+// Copyright (c) 2020 Hernan Perrone (hernan.perrone@gmail.com)
+//////////////////////////////////////////////////////////////////////////////
+
+#include <algorithm>
+#include <stdexcept>
+
+// Using BLAKE2b from Crypto++ for calculating the fingerprints
+#include <cryptlib.h>
+#include <blake2.h>
+
+#include "file/ft_file_cdc.hpp"
+
+namespace ft { namespace file {
+
+// The file is read in pieces of this size while chunking
+static const size_t CDC_READ_SIZE = 1024U * 1024U;
+
+// FastCDC masks for an 8KB normal size: more effective bits are used before
+// reaching the normal size, so chunk lengths concentrate around it.
+static const uint64_t CDC_MASK_S = 0x0003590703530000ULL;
+static const uint64_t CDC_MASK_L = 0x0000d90003530000ULL;
+
+/// Table of random values for the gear hash
+///
+/// Must be the same on all the clients so the same contents produce the same
+/// chunks, so it is generated from a fixed seed (splitmix64).
+class GearTable {
+public:
+	uint64_t values[256];
+
+	GearTable() {
+		uint64_t seed = 0x6674636463676561ULL;
+		for (size_t i = 0; i < 256; i++) {
+			uint64_t z = (seed += 0x9E3779B97F4A7C15ULL);
+			z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+			z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+			this->values[i] = z ^ (z >> 31);
+		}
+	}
+};
+
+static const GearTable sm_gear;
+
+////////////////////////////////////////////////////////////////////////////
+// FileCdc class' members
+
+FileCdc::FileCdc(const FilePtr file)
+: file(file)
+{
+	// Read the file in pieces, keeping at least CDC_MAX_SIZE bytes ahead of
+	// the current position until the end of the file.
+	std::vector<uint8_t> buf;
+	size_t buf_base = 0;
+	size_t pos      = 0;
+
+	while (pos < file->size) {
+		size_t buf_pos = pos - buf_base;
+		if (buf.size() - buf_pos < CDC_MAX_SIZE &&
+				buf_base + buf.size() < file->size) {
+			buf.erase(buf.begin(), buf.begin() + buf_pos);
+			buf_base = pos;
+
+			std::vector<uint8_t> tmp;
+			file->readData(buf_base + buf.size(), CDC_READ_SIZE, tmp);
+			if (tmp.empty()) {
+				throw std::runtime_error("Failed reading file for chunking");
+			}
+			buf.insert(buf.end(), tmp.begin(), tmp.end());
+			buf_pos = 0;
+		}
+
+		const uint8_t* data = buf.data() + buf_pos;
+		size_t len = findBoundary(data, buf.size() - buf_pos);
+
+		proto::CdcEntry entry;
+		entry.len = len;
+		calcFingerprint(data, len, entry.hash);
+
+		this->offsets.push_back(pos);
+		this->entries.push_back(std::move(entry));
+		pos += len;
+	}
+}
+
+void FileCdc::getEntries(size_t idx_first,
+		std::vector<proto::CdcEntry>& out) const
+{
+	out.clear();
+	for (size_t i = idx_first; i < this->entries.size() &&
+			out.size() < CDC_MAX_ENTRIES_PER_MSG; i++) {
+		out.push_back(this->entries[i]);
+	}
+}
+
+void FileCdc::getChunkData(size_t idx, std::vector<uint8_t>& data_out) const
+{
+	if (idx >= this->entries.size()) {
+		throw std::range_error("Recipe entry index out of range");
+	}
+
+	this->file->readData(this->offsets[idx], this->entries[idx].len,
+			data_out);
+	if (data_out.size() != this->entries[idx].len) {
+		throw std::runtime_error("Failed reading chunk data");
+	}
+}
+
+size_t FileCdc::findBoundary(const uint8_t* data, size_t len)
+{
+	size_t n = std::min(len, CDC_MAX_SIZE);
+	if (n <= CDC_MIN_SIZE) {
+		return n;
+	}
+
+	// Gear hash: the contribution of each byte is shifted out after 64 bytes,
+	// so the hash only depends on the last 64 bytes.
+	uint64_t fp = 0;
+	size_t i = CDC_MIN_SIZE;
+	size_t barrier = std::min(CDC_NORMAL_SIZE, n);
+
+	for (; i < barrier; i++) {
+		fp = (fp << 1) + sm_gear.values[data[i]];
+		if ((fp & CDC_MASK_S) == 0) {
+			return i + 1;
+		}
+	}
+
+	for (; i < n; i++) {
+		fp = (fp << 1) + sm_gear.values[data[i]];
+		if ((fp & CDC_MASK_L) == 0) {
+			return i + 1;
+		}
+	}
+
+	return n;
+}
+
+void FileCdc::calcFingerprint(const uint8_t* data, size_t len,
+		std::vector<uint8_t>& hash_out)
+{
+	CryptoPP::BLAKE2b blake_hash((unsigned int)proto::CHUNK_HASH_SIZE);
+
+	hash_out.resize(proto::CHUNK_HASH_SIZE);
+	blake_hash.Update(data, len);
+	blake_hash.TruncatedFinal(hash_out.data(), hash_out.size());
+}
+
+} // file
+} // ft
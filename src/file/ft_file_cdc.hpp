@@ -0,0 +1,70 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+// Released under MIT License
+// Copyright (c) 2020 Hernan Perrone (hernan.perrone@gmail.com)
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef FT_FILE_FILECDC_H
+#define FT_FILE_FILECDC_H
+
+#include <vector>
+
+#include "ft_utils.hpp"
+#include "file/ft_file.hpp"
+#include "protocol/ft_msg.hpp"
+
+namespace ft { namespace file {
+
+FT_DECLARE_CLASS(FileCdc)
+
+// Content defined chunks size limits. Chunks are sent in a single message, so
+// the maximum must fit in the message length field.
+static const size_t CDC_MIN_SIZE    = 2048U;
+static const size_t CDC_NORMAL_SIZE = 8192U;
+static const size_t CDC_MAX_SIZE    = 32768U;
+
+// Maximum number of recipe entries in a FILE CDC RECIPE message
+static const size_t CDC_MAX_ENTRIES_PER_MSG = 1800U;
+
+/// @brief Content defined chunking of a local file
+///
+/// Splits the file in variable length chunks using FastCDC (a gear rolling
+/// hash with normalized chunking), so the boundaries depend on the contents
+/// and not on the offsets. The same data found in different files, or shifted
+/// within the same file, produces the same chunks.
+///
+/// The list of chunks (length and fingerprint) is the recipe of the file. It
+/// is offered to the server, which only requests the chunks that are not in
+/// its ChunkStore.
+class FileCdc {
+private:
+	const FilePtr                 file;
+	std::vector<size_t>           offsets;
+	std::vector<proto::CdcEntry>  entries;
+
+public:
+	/// Chunks the file and calculates the fingerprints
+	FileCdc(const FilePtr file);
+
+	virtual ~FileCdc() {}
+
+	size_t getNumOfEntries() const { return this->entries.size(); }
+
+	/// @brief Copies up to CDC_MAX_ENTRIES_PER_MSG entries from idx_first
+	void getEntries(size_t idx_first, std::vector<proto::CdcEntry>& out)
+			const;
+
+	/// @brief Reads the data of the chunk in the recipe entry idx
+	void getChunkData(size_t idx, std::vector<uint8_t>& data_out) const;
+
+	/// @brief Returns the length of the next chunk in data
+	static size_t findBoundary(const uint8_t* data, size_t len);
+
+	/// @brief Fingerprint of the data of a chunk
+	static void calcFingerprint(const uint8_t* data, size_t len,
+			std::vector<uint8_t>& hash_out);
+};
+
+} // file
+} // ft
+#endif //FT_FILE_FILECDC_H
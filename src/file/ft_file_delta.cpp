@@ -0,0 +1,359 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+// Released under MIT License
+// Copyright (c) 2020 Hernan Perrone (hernan.perrone@gmail.com)
+//////////////////////////////////////////////////////////////////////////////
+
+#include <algorithm>
+#include <stdexcept>
+#include <unordered_map>
+
+// Using BLAKE2b from Crypto++ for calculating the strong checksums
+#include <cryptlib.h>
+#include <blake2.h>
+
+#include "file/ft_file_delta.hpp"
+
+namespace ft { namespace file {
+
+// The local file is read in pieces of this size while searching for blocks
+static const size_t DELTA_READ_SIZE = 1024U * 1024U;
+
+/// @brief rsync's rolling checksum
+///
+/// Weak checksum of a window of data that can be moved one byte forward in
+/// constant time.
+class RollingChecksum {
+private:
+	uint32_t a;
+	uint32_t b;
+	size_t   len;
+
+public:
+	RollingChecksum() : a(0), b(0), len(0) {}
+
+	void init(const uint8_t* data, size_t data_len) {
+		this->a = 0;
+		this->b = 0;
+		this->len = data_len;
+		for (size_t i = 0; i < data_len; i++) {
+			this->a += data[i];
+			this->b += (uint32_t)(data_len - i) * data[i];
+		}
+	}
+
+	/// Moves the window, removing byte out and appending byte in
+	void roll(uint8_t out, uint8_t in) {
+		this->a += in - out;
+		this->b += this->a - (uint32_t)this->len * out;
+	}
+
+	uint32_t value() const {
+		return (this->a & 0xffff) | ((this->b & 0xffff) << 16);
+	}
+};
+
+static uint64_t calc_strong(const uint8_t* data, size_t len);
+
+////////////////////////////////////////////////////////////////////////////
+// FileDelta class' members
+
+FileDelta::FileDelta(const FilePtr file, size_t basis_size,
+		size_t block_size)
+: file(file)
+, basis_size(basis_size)
+, block_size(block_size)
+, computed(false)
+{
+	if (block_size == 0) {
+		throw std::invalid_argument("Invalid delta block size");
+	}
+}
+
+size_t FileDelta::getNumOfBlocks() const
+{
+	return this->basis_size / this->block_size +
+			(this->basis_size % this->block_size > 0 ? 1 : 0);
+}
+
+void FileDelta::addSignatures(size_t block_first,
+		const std::vector<proto::DeltaBlockSig>& blocks)
+{
+	if (block_first != this->sigs.size()) {
+		return;
+	}
+
+	size_t n_blocks = std::min(blocks.size(),
+			getNumOfBlocks() - this->sigs.size());
+	this->sigs.insert(this->sigs.end(), blocks.begin(),
+			blocks.begin() + n_blocks);
+}
+
+void FileDelta::compute()
+{
+	const size_t size = this->file->size;
+	const size_t bs   = this->block_size;
+
+	// Index the full blocks of the basis by their weak checksum
+	std::unordered_map<uint32_t, std::vector<size_t>> index;
+	for (size_t i = 0; i < this->sigs.size() && (i + 1) * bs <=
+			this->basis_size; i++) {
+		index[this->sigs[i].weak].push_back(i);
+	}
+
+	// The local file is read in pieces, keeping in memory the window being
+	// checked plus some read ahead.
+	std::vector<uint8_t> buf;
+	size_t buf_base = 0;
+
+	this->segments.clear();
+
+	size_t pos       = 0;
+	size_t lit_start = 0;
+	bool   rc_valid  = false;
+	RollingChecksum rc;
+
+	while (pos + bs <= size) {
+		// Make sure the window plus the next byte are in the buffer
+		if (pos - buf_base > DELTA_READ_SIZE) {
+			buf.erase(buf.begin(), buf.begin() + (pos - buf_base));
+			buf_base = pos;
+		}
+
+		while (buf_base + buf.size() < std::min(pos + bs + 1, size)) {
+			std::vector<uint8_t> tmp;
+			this->file->readData(buf_base + buf.size(), DELTA_READ_SIZE, tmp);
+			if (tmp.empty()) {
+				throw std::runtime_error("Failed reading file for delta");
+			}
+			buf.insert(buf.end(), tmp.begin(), tmp.end());
+		}
+
+		const uint8_t* window = buf.data() + (pos - buf_base);
+		if (!rc_valid) {
+			rc.init(window, bs);
+			rc_valid = true;
+		}
+
+		// Look for a block of the basis with the same contents
+		size_t match = SIZE_MAX;
+		auto it = index.find(rc.value());
+		if (it != index.end()) {
+			uint64_t strong = calc_strong(window, bs);
+			for (size_t block_idx : it->second) {
+				if (this->sigs[block_idx].strong == strong) {
+					match = block_idx;
+					break;
+				}
+			}
+		}
+
+		if (match != SIZE_MAX) {
+			addSegment(lit_start, pos - lit_start, 0, true);
+			addSegment(pos, bs, match * bs, false);
+			pos += bs;
+			lit_start = pos;
+			rc_valid = false;
+		} else {
+			if (pos + bs < size) {
+				rc.roll(window[0], window[bs]);
+			}
+			pos++;
+		}
+	}
+
+	addSegment(lit_start, size - lit_start, 0, true);
+
+	this->computed = true;
+}
+
+size_t FileDelta::getCopiedBytes() const
+{
+	size_t ret = 0;
+	for (const auto& segment : this->segments) {
+		ret += segment.literal ? 0 : segment.len;
+	}
+	return ret;
+}
+
+size_t FileDelta::getOps(size_t chunk_first,
+		std::vector<proto::DeltaOp>& ops_out) const
+{
+	ops_out.clear();
+
+	const size_t n_file_chunks = this->file->getNumOfChunks();
+
+	// Find the segment containing the first chunk
+	auto seg = std::upper_bound(this->segments.begin(), this->segments.end(),
+			chunk_first * CHUNK_SIZE,
+			[](size_t offset, const Segment& s) { return offset < s.offset; });
+	if (seg != this->segments.begin()) {
+		seg--;
+	}
+
+	size_t n_chunks = 0;
+	size_t ops_size = 0;
+	for (size_t idx = chunk_first; idx < n_file_chunks &&
+			n_chunks < DELTA_MAX_CHUNKS_PER_MSG; idx++) {
+		size_t chunk_start = idx * CHUNK_SIZE;
+		size_t chunk_end   = std::min(chunk_start + CHUNK_SIZE,
+				this->file->size);
+
+		// Calculate the length of the instructions for this chunk
+		size_t chunk_ops_size = 0;
+		bool   has_literal    = false;
+		for (auto s = seg; s != this->segments.end() &&
+				s->offset < chunk_end; s++) {
+			size_t start = std::max(s->offset, chunk_start);
+			size_t end   = std::min(s->offset + s->len, chunk_end);
+			chunk_ops_size += s->literal ? (3 + end - start) : 9;
+			has_literal |= s->literal;
+		}
+
+		if (n_chunks > 0 && ops_size + chunk_ops_size > DELTA_MAX_OPS_SIZE) {
+			break;
+		}
+
+		std::vector<uint8_t> chunk_data;
+		if (has_literal) {
+			this->file->readData(chunk_start, chunk_end - chunk_start,
+					chunk_data);
+			if (chunk_data.size() != chunk_end - chunk_start) {
+				throw std::runtime_error("Failed reading file for delta");
+			}
+		}
+
+		for (; seg != this->segments.end() && seg->offset < chunk_end;
+				seg++) {
+			size_t start = std::max(seg->offset, chunk_start);
+			size_t end   = std::min(seg->offset + seg->len, chunk_end);
+			size_t src   = seg->src_offset + (start - seg->offset);
+
+			if (seg->literal) {
+				proto::DeltaOp op;
+				op.literal    = true;
+				op.src_offset = 0;
+				op.len        = end - start;
+				op.data.assign(chunk_data.begin() + (start - chunk_start),
+						chunk_data.begin() + (end - chunk_start));
+				ops_out.push_back(std::move(op));
+			} else if (!ops_out.empty() && !ops_out.back().literal &&
+					ops_out.back().src_offset + ops_out.back().len == src) {
+				// Continuation of the previous copy (in the previous chunk)
+				ops_out.back().len += end - start;
+			} else {
+				proto::DeltaOp op;
+				op.literal    = false;
+				op.src_offset = src;
+				op.len        = end - start;
+				ops_out.push_back(std::move(op));
+			}
+
+			if (seg->offset + seg->len > chunk_end) {
+				// The segment continues in the next chunk
+				break;
+			}
+		}
+
+		ops_size += chunk_ops_size;
+		n_chunks++;
+	}
+
+	return n_chunks;
+}
+
+void FileDelta::calcSignatures(const FilePtr basis, size_t block_first,
+		size_t n_blocks, std::vector<proto::DeltaBlockSig>& sigs_out)
+{
+	sigs_out.clear();
+
+	std::vector<uint8_t> buf;
+	basis->readData(block_first * DELTA_BLOCK_SIZE,
+			n_blocks * DELTA_BLOCK_SIZE, buf);
+
+	RollingChecksum rc;
+	for (size_t offset = 0; offset < buf.size(); offset += DELTA_BLOCK_SIZE) {
+		size_t len = std::min(DELTA_BLOCK_SIZE, buf.size() - offset);
+		rc.init(buf.data() + offset, len);
+
+		proto::DeltaBlockSig sig;
+		sig.weak   = rc.value();
+		sig.strong = calc_strong(buf.data() + offset, len);
+		sigs_out.push_back(sig);
+	}
+}
+
+bool FileDelta::patch(const FilePtr basis,
+		const std::vector<proto::DeltaOp>& ops, size_t max_len,
+		std::vector<uint8_t>& data_out)
+{
+	data_out.clear();
+
+	for (const auto& op : ops) {
+		if (op.len > max_len - data_out.size()) {
+			return false;
+		}
+
+		if (op.literal) {
+			data_out.insert(data_out.end(), op.data.begin(), op.data.end());
+			continue;
+		}
+
+		if ((size_t)op.src_offset + op.len > basis->size) {
+			return false;
+		}
+
+		std::vector<uint8_t> tmp;
+		basis->readData(op.src_offset, op.len, tmp);
+		if (tmp.size() != op.len) {
+			return false;
+		}
+		data_out.insert(data_out.end(), tmp.begin(), tmp.end());
+	}
+
+	return true;
+}
+
+void FileDelta::addSegment(size_t offset, size_t len, size_t src_offset,
+		bool literal)
+{
+	if (len == 0) {
+		return;
+	}
+
+	if (!this->segments.empty()) {
+		// Merge with the previous segment when contiguous
+		auto& last = this->segments.back();
+		if (last.literal && literal) {
+			last.len += len;
+			return;
+		} else if (!last.literal && !literal &&
+				last.src_offset + last.len == src_offset) {
+			last.len += len;
+			return;
+		}
+	}
+
+	this->segments.push_back({offset, len, src_offset, literal});
+}
+
+////////////////////////////////////////////////////////////////////////////
+// Implementation of module's static functions
+
+static uint64_t calc_strong(const uint8_t* data, size_t len)
+{
+	CryptoPP::BLAKE2b blake_hash((unsigned int)proto::DELTA_STRONG_HASH_SIZE);
+	uint8_t digest[proto::DELTA_STRONG_HASH_SIZE];
+
+	blake_hash.Update(data, len);
+	blake_hash.TruncatedFinal(digest, sizeof(digest));
+
+	uint64_t ret = 0;
+	for (size_t i = 0; i < sizeof(digest); i++) {
+		ret = (ret << 8) | digest[i];
+	}
+	return ret;
+}
+
+} // file
+} // ft
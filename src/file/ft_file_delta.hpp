@@ -0,0 +1,125 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+// Released under MIT License
+// Copyright (c) 2020 Hernan Perrone (hernan.perrone@gmail.com)
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef FT_FILE_FILEDELTA_H
+#define FT_FILE_FILEDELTA_H
+
+#include <vector>
+
+#include "ft_utils.hpp"
+#include "file/ft_file.hpp"
+#include "protocol/ft_msg.hpp"
+
+namespace ft { namespace file {
+
+FT_DECLARE_CLASS(FileDelta)
+
+// The stored version is signed in blocks of the chunk size
+static const size_t DELTA_BLOCK_SIZE = CHUNK_SIZE;
+
+// Maximum number of block signatures in a FILE DELTA SIGNATURES message
+static const size_t DELTA_MAX_SIGS_PER_MSG = 4096U;
+
+// Maximum number of chunks rebuilt by a single FILE DELTA DATA message
+static const size_t DELTA_MAX_CHUNKS_PER_MSG = 1024U;
+
+// Maximum length of the encoded instructions in a FILE DELTA DATA message,
+// reserving room for the message header.
+static const size_t DELTA_MAX_OPS_SIZE = proto::MAX_TCP_MSG_SIZE - 1024U;
+
+/// @brief Delta transfer of a new version of a file
+///
+/// Implements an rsync like algorithm for uploading a file when a previous
+/// version of it is already stored in the server.
+///
+/// The server splits the stored version (the basis) in blocks and sends a
+/// rolling checksum and a strong checksum of each block, see calcSignatures().
+///
+/// On the client side, a FileDelta instance collects those signatures and
+/// searches the local file for blocks of the basis at any offset, see
+/// compute(). The local file is then described as a sequence of copy
+/// instructions (ranges of the basis) and literal data.
+///
+/// The instructions are sent in batches covering whole chunks, see getOps(),
+/// so the server rebuilds the chunks with patch() and saves them as in a
+/// regular transfer. This keeps the progress tracking, and the ability of
+/// resuming the transfer, of the FileMetadata.
+class FileDelta {
+private:
+	/// Range of the local file, copied from the basis or sent as literal
+	struct Segment {
+		size_t offset;     ///! Offset in the local file
+		size_t len;        ///! Length of the segment
+		size_t src_offset; ///! Offset in the basis (if not literal)
+		bool   literal;    ///! Whether the data must be sent
+	};
+
+	const FilePtr                     file;
+	const size_t                      basis_size;
+	const size_t                      block_size;
+	std::vector<proto::DeltaBlockSig> sigs;
+	std::vector<Segment>              segments;
+	bool                              computed;
+
+public:
+	FileDelta(const FilePtr file, size_t basis_size, size_t block_size);
+
+	virtual ~FileDelta() {}
+
+	size_t getBasisSize() const { return this->basis_size; }
+
+	size_t getBlockSize() const { return this->block_size; }
+
+	/// @brief Number of blocks the basis is split into
+	size_t getNumOfBlocks() const;
+
+	/// @brief Stores the signatures received from the server
+	///
+	/// Signatures must be added in order, otherwise they are ignored.
+	void addSignatures(size_t block_first,
+			const std::vector<proto::DeltaBlockSig>& blocks);
+
+	/// @brief Index of the first block whose signature is not received yet
+	///
+	/// Returns getNumOfBlocks() if all the signatures have been received.
+	size_t getNextMissingSignature() const { return this->sigs.size(); }
+
+	/// @brief Searches the local file for the blocks of the basis
+	void compute();
+
+	bool isComputed() const { return this->computed; }
+
+	/// @brief Bytes of the local file that will be copied from the basis
+	size_t getCopiedBytes() const;
+
+	/// @brief Builds the instructions for the chunks starting at chunk_first
+	///
+	/// Adds as many chunks as fit into a message. Returns the number of chunks
+	/// covered by the instructions.
+	size_t getOps(size_t chunk_first, std::vector<proto::DeltaOp>& ops_out)
+			const;
+
+	/// @brief Signatures of the blocks of the basis
+	static void calcSignatures(const FilePtr basis, size_t block_first,
+			size_t n_blocks, std::vector<proto::DeltaBlockSig>& sigs_out);
+
+	/// @brief Rebuilds the data described by the instructions
+	///
+	/// Returns false if the instructions reference data outside the basis, or
+	/// describe more than max_len bytes (checked before reading each one, as
+	/// the instructions come from the peer).
+	static bool patch(const FilePtr basis,
+			const std::vector<proto::DeltaOp>& ops, size_t max_len,
+			std::vector<uint8_t>& data_out);
+
+private:
+	void addSegment(size_t offset, size_t len, size_t src_offset,
+			bool literal);
+};
+
+} // file
+} // ft
+#endif //FT_FILE_FILEDELTA_H
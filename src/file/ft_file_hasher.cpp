@@ -0,0 +1,208 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+// Released under MIT License
+// Copyright (c) 2020 Hernan Perrone (hernan.perrone@gmail.com)
+//////////////////////////////////////////////////////////////////////////////
+
+#include <algorithm>
+#include <cstring>
+#include <system_error>
+
+#include <unistd.h>
+
+#include "file/ft_file.hpp"
+#include "file/ft_file_tree.hpp"
+#include "file/ft_file_hasher.hpp"
+#include "protocol/ft_crc32c.hpp"
+
+namespace ft { namespace file {
+
+// Maximum length of a checkpoint file: a subtree per bit of the leaf count,
+// longer than the Blake2b and Blake2bp states
+static const size_t CHECKPOINT_MAX_SIZE = proto::HASH_SIZE + 1U + 8U +
+		64U * TREE_NODE_SIZE + 4U;
+
+static size_t num_of_chunks(size_t len)
+{
+	return len / CHUNK_SIZE + (len % CHUNK_SIZE > 0 ? 1 : 0);
+}
+
+static size_t popcount(size_t n)
+{
+	return __builtin_popcountll(n);
+}
+
+////////////////////////////////////////////////////////////////////////////
+// FileHasher class' members
+
+FileHasher::FileHasher(proto::HashAlgo hash_algo, size_t file_size,
+		const std::vector<uint8_t>& file_hash)
+: hash_algo(hash_algo)
+, file_size(file_size)
+, file_hash(file_hash)
+{
+	reset();
+}
+
+void FileHasher::reset()
+{
+	this->offset = 0;
+
+	this->blake2b  = Blake2b(proto::HASH_SIZE);
+	this->blake2bp = Blake2bp();
+
+	this->subtrees.clear();
+}
+
+void FileHasher::update(const uint8_t* data, size_t len)
+{
+	if (this->hash_algo == proto::HASH_ALGO_BLAKE2B_TREE) {
+		// A leaf per chunk, merged with the subtrees of the same height
+		for (size_t pos = 0; pos < len; pos += CHUNK_SIZE) {
+			std::vector<uint8_t> leaf;
+			FileTree::calcLeaves(data + pos, std::min(CHUNK_SIZE, len - pos),
+					leaf);
+			this->subtrees.insert(this->subtrees.end(), leaf.begin(),
+					leaf.end());
+
+			size_t n_leaves = num_of_chunks(this->offset + pos + 1);
+			for (; (n_leaves & 1U) == 0; n_leaves >>= 1) {
+				uint8_t* right = this->subtrees.data() + this->subtrees.size() -
+						TREE_NODE_SIZE;
+				uint8_t* left = right - TREE_NODE_SIZE;
+				FileTree::calcNode(left, right, left);
+				this->subtrees.resize(this->subtrees.size() - TREE_NODE_SIZE);
+			}
+		}
+		this->offset += len;
+		return;
+	}
+
+	this->offset += len;
+	if (this->hash_algo == proto::HASH_ALGO_BLAKE2BP) {
+		this->blake2bp.update(data, len);
+	} else {
+		this->blake2b.update(data, len);
+	}
+}
+
+void FileHasher::final(std::vector<uint8_t>& hash_out) const
+{
+	if (this->hash_algo == proto::HASH_ALGO_BLAKE2B_TREE) {
+		if (this->subtrees.empty()) {
+			// Empty file, a single empty leaf
+			hash_out = FileTree(std::vector<uint8_t>()).getFileHash();
+			return;
+		}
+
+		uint8_t top[TREE_NODE_SIZE];
+		size_t n_subtrees = this->subtrees.size() / TREE_NODE_SIZE;
+		memcpy(top, this->subtrees.data() + (n_subtrees - 1) * TREE_NODE_SIZE,
+				TREE_NODE_SIZE);
+		for (size_t i = n_subtrees - 1; i > 0; i--) {
+			FileTree::calcNode(this->subtrees.data() + (i - 1) *
+					TREE_NODE_SIZE, top, top);
+		}
+		FileTree::calcFileHash(this->offset, top, hash_out);
+		return;
+	}
+
+	hash_out.resize(proto::HASH_SIZE);
+	if (this->hash_algo == proto::HASH_ALGO_BLAKE2BP) {
+		this->blake2bp.final(hash_out.data());
+	} else {
+		this->blake2b.final(hash_out.data());
+	}
+}
+
+bool FileHasher::load(int fd)
+{
+	reset();
+
+	std::vector<uint8_t> data(CHECKPOINT_MAX_SIZE);
+	ssize_t len = pread(fd, data.data(), data.size(), 0);
+	if (len < (ssize_t)(proto::HASH_SIZE + 1U + 8U + 4U)) {
+		return false;
+	}
+	data.resize(len);
+
+	// Checkpoints of other files, or written partially, are discarded
+	uint32_t crc;
+	memcpy(&crc, data.data() + data.size() - sizeof(crc), sizeof(crc));
+	if (proto::crc32c(data.data(), data.size() - sizeof(crc)) != crc ||
+			memcmp(data.data(), this->file_hash.data(), proto::HASH_SIZE) != 0 ||
+			data[proto::HASH_SIZE] != this->hash_algo) {
+		return false;
+	}
+
+	const uint8_t* p = data.data() + proto::HASH_SIZE + 1U;
+	size_t offset;
+	memcpy(&offset, p, sizeof(offset));
+	p += sizeof(offset);
+	size_t state_len = data.size() - (proto::HASH_SIZE + 1U + 8U + 4U);
+
+	if (offset > this->file_size) {
+		return false;
+	}
+
+	if (this->hash_algo == proto::HASH_ALGO_BLAKE2B_TREE) {
+		size_t n_subtrees = popcount(num_of_chunks(offset));
+		if (state_len != n_subtrees * TREE_NODE_SIZE ||
+				(offset % CHUNK_SIZE != 0 && offset != this->file_size)) {
+			return false;
+		}
+		this->subtrees.assign(p, p + state_len);
+	} else if (this->hash_algo == proto::HASH_ALGO_BLAKE2BP) {
+		if (state_len != BLAKE2BP_STATE_SIZE || !this->blake2bp.load(p)) {
+			reset();
+			return false;
+		}
+	} else {
+		if (state_len != BLAKE2B_STATE_SIZE || !this->blake2b.load(p)) {
+			reset();
+			return false;
+		}
+	}
+
+	this->offset = offset;
+	return true;
+}
+
+void FileHasher::save(int fd) const
+{
+	std::vector<uint8_t> data(this->file_hash);
+	data.push_back(this->hash_algo);
+	const uint8_t* p = (const uint8_t*)&this->offset;
+	data.insert(data.end(), p, p + sizeof(this->offset));
+
+	if (this->hash_algo == proto::HASH_ALGO_BLAKE2B_TREE) {
+		data.insert(data.end(), this->subtrees.begin(), this->subtrees.end());
+	} else if (this->hash_algo == proto::HASH_ALGO_BLAKE2BP) {
+		this->blake2bp.save(data);
+	} else {
+		this->blake2b.save(data);
+	}
+
+	uint32_t crc = proto::crc32c(data.data(), data.size());
+	p = (const uint8_t*)&crc;
+	data.insert(data.end(), p, p + sizeof(crc));
+
+	if (pwrite(fd, data.data(), data.size(), 0) != (ssize_t)data.size() ||
+			ftruncate(fd, data.size()) != 0) {
+		throw std::system_error(
+				std::make_error_code(static_cast<std::errc>(errno)),
+				"Failed writing hash checkpoint");
+	}
+}
+
+std::filesystem::path FileHasher::checkpointPath(
+		const std::filesystem::path& file_effective_path)
+{
+	auto checkpoint_file = file_effective_path.parent_path();
+	checkpoint_file /= std::string(".") +
+			file_effective_path.filename().generic_string() + ".hash";
+	return checkpoint_file;
+}
+
+} // file
+} // ft
@@ -0,0 +1,93 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+// Released under MIT License
+// Copyright (c) 2020 Hernan Perrone (hernan.perrone@gmail.com)
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef FT_FILE_FILEHASHER_H
+#define FT_FILE_FILEHASHER_H
+
+#include <filesystem>
+#include <vector>
+
+#include "ft_utils.hpp"
+#include "file/ft_blake2.hpp"
+#include "protocol/ft_msg.hpp"
+
+namespace ft { namespace file {
+
+FT_DECLARE_CLASS(FileHasher)
+
+/// @brief Hash of a file calculated as its data is received
+///
+/// The data is hashed in order, from the beginning of the file, with the hash
+/// algorithm of the file:
+///   - proto::HASH_ALGO_BLAKE2B: a Blake2b state, as the one of Crypto++ but
+///     implemented here, as Crypto++ does not allow saving its state.
+///   - proto::HASH_ALGO_BLAKE2BP: a Blake2bp state.
+///   - proto::HASH_ALGO_BLAKE2B_TREE: the stack of the complete subtrees of the
+///     FileTree hashed so far (the data must be given by whole chunks). As a
+///     node left without pair is promoted, the top node is the subtrees
+///     hashed from right to left.
+///
+/// The state is saved in a checkpoint file next to the metadata file of the
+/// file being received, so a transfer resumed after a restart does not need
+/// to read the file again.
+///
+/// The name of the checkpoint file is ".file_name.hash", and its layout:
+///   - file_hash: 64 bytes (the hash of the file being hashed)
+///   - hash_algo: 1 byte
+///   - offset:    8 bytes (length of the data hashed)
+///   - state:     variable length
+///   - crc:       4 bytes (CRC32C of all the above)
+class FileHasher {
+private:
+	const proto::HashAlgo        hash_algo;
+	const size_t                 file_size;
+	const std::vector<uint8_t>   file_hash;
+	size_t                       offset;
+
+	// HASH_ALGO_BLAKE2B and HASH_ALGO_BLAKE2BP states
+	Blake2b                      blake2b;
+	Blake2bp                     blake2bp;
+
+	// HASH_ALGO_BLAKE2B_TREE state, a node per complete subtree
+	std::vector<uint8_t>         subtrees;
+
+public:
+	FileHasher(proto::HashAlgo hash_algo, size_t file_size,
+			const std::vector<uint8_t>& file_hash);
+
+	virtual ~FileHasher() {}
+
+	/// @brief Length of the data hashed so far
+	size_t getOffset() const { return this->offset; }
+
+	/// @brief Hashes the data following the one hashed so far
+	void update(const uint8_t* data, size_t len);
+
+	/// @brief Hash of the data hashed so far
+	///
+	/// Must only be called when the whole file is hashed.
+	void final(std::vector<uint8_t>& hash_out) const;
+
+	/// @brief Loads the state from the checkpoint file, opened as fd
+	///
+	/// Returns false (and the state is left empty) if the file does not have a
+	/// valid checkpoint of the same file.
+	bool load(int fd);
+
+	/// @brief Saves the state into the checkpoint file, opened as fd
+	void save(int fd) const;
+
+	/// @brief Path of the checkpoint file of the given file
+	static std::filesystem::path checkpointPath(
+			const std::filesystem::path& file_effective_path);
+
+private:
+	void reset();
+};
+
+} // file
+} // ft
+#endif //FT_FILE_FILEHASHER_H
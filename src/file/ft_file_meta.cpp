@@ -4,6 +4,7 @@
 // Copyright (c) 2020 Hernan Perrone (hernan.perrone@gmail.com)
 //////////////////////////////////////////////////////////////////////////////
 
+#include <chrono>
 #include <fstream>
 #include <iomanip>
 #include <algorithm>
@@ -11,26 +12,52 @@
 #include <string>
 #include <exception>
 #include <stdexcept>
+#include <system_error>
+
+// POSIX & LINUX headers
+#include <sys/mman.h>
 
 #include "file/ft_file.hpp"
 #include "file/ft_file_meta.hpp"
 
 namespace ft { namespace file {
 
+// Default flush policy of the bitmaps: chunks marked, and milliseconds
+static const size_t BITMAP_FLUSH_CHUNKS = 1024U;
+static const size_t BITMAP_FLUSH_MS     = 1000U;
+
+size_t FileMetadata::sm_flush_chunks = BITMAP_FLUSH_CHUNKS;
+size_t FileMetadata::sm_flush_ms     = BITMAP_FLUSH_MS;
+FileSyncPtr FileMetadata::sm_sync;
+StateStorePtr FileMetadata::sm_store;
+
+// Header of the metadata files before hash_algo was added: file_length,
+// chunk_size and file_hash
+static const size_t LEGACY_HEADER_SIZE = 8U + 8U + proto::HASH_SIZE;
+
+static int64_t now_ms()
+{
+	return std::chrono::duration_cast<std::chrono::milliseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
 FileMetadata::FileMetadata(const std::filesystem::path& file_effective_path,
-		size_t file_size, size_t file_chunk_size, std::vector<uint8_t> file_hash)
+		size_t file_size, size_t file_chunk_size, std::vector<uint8_t> file_hash,
+		uint8_t file_hash_algo, FdCachePtr fd_cache)
 : file_effective_path(file_effective_path)
 , file_size(file_size)
 , file_hash(file_hash)
+, file_hash_algo(file_hash_algo)
 , file_chunk_size(file_chunk_size)
 , file_n_chunks(file_size / file_chunk_size + ((file_size % file_chunk_size) > 0 ? 1 : 0))
 , header_size(sizeof(this->file_size) + sizeof(this->file_chunk_size) +
-		proto::HASH_SIZE)
+		proto::HASH_SIZE + sizeof(this->file_hash_algo))
 , bitmap_size((file_n_chunks / 8) + ((file_n_chunks % 8) > 0 ? 1 : 0))
+, fd_cache(fd_cache)
+, n_unflushed(0)
+, flushed_at(now_ms())
 {
-	this->metadata_file = file_effective_path.parent_path();
-	this->metadata_file /= std::string(".") +
-			file_effective_path.filename().generic_string() + ".meta";
+	this->metadata_file = metadataPath(file_effective_path);
 }
 
 void FileMetadata::createIfNotExist()
@@ -38,7 +65,18 @@ void FileMetadata::createIfNotExist()
 	// Create directories if they not exists
 	std::filesystem::create_directories(this->file_effective_path.parent_path());
 
-	if (!std::filesystem::exists(this->metadata_file)) {
+	if (sm_store) {
+		migrateFile(this->file_effective_path);
+		sm_store->create(this->file_effective_path, this->file_size,
+				this->file_chunk_size, this->file_hash, this->file_hash_algo);
+		return;
+	}
+
+	upgradeFile(this->metadata_file);
+
+	std::error_code ec;
+	auto meta_size = std::filesystem::file_size(this->metadata_file, ec);
+	if (ec || meta_size != this->header_size + this->bitmap_size) {
 		// -- Write the header -- //
 		std::ofstream ms(this->metadata_file , std::ios::out | std::ios::binary);
 		ms.unsetf(std::ios::skipws);
@@ -46,6 +84,7 @@ void FileMetadata::createIfNotExist()
 		ms.write((char*)&this->file_size,       sizeof(this->file_size));
 		ms.write((char*)&this->file_chunk_size, sizeof(this->file_chunk_size));
 		ms.write((char*)this->file_hash.data(), proto::HASH_SIZE);
+		ms.write((char*)&this->file_hash_algo,  sizeof(this->file_hash_algo));
 
 		// Then write the bitmap (1 bit per chunk in the file)
 		for (int i = 0; i < this->bitmap_size; i++) {
@@ -54,71 +93,274 @@ void FileMetadata::createIfNotExist()
 		}
 
 		ms.close();
+
+		// The file may have been created again
+		this->fd_cache->forget(this->metadata_file);
 	}
 }
 
 void FileMetadata::markChunk(size_t chunk_idx, bool valid)
 {
-	std::fstream ms(this->metadata_file , std::ios::in | std::ios::out |
-			std::ios::binary);
-	ms.unsetf(std::ios::skipws);
+	markChunks(chunk_idx, 1, valid);
+}
+
+void FileMetadata::markChunks(size_t chunk_idx, size_t n_chunks, bool valid,
+		bool data_synced)
+{
+	if (chunk_idx >= this->file_n_chunks || n_chunks == 0) {
+		return;
+	}
+	n_chunks = std::min(n_chunks, this->file_n_chunks - chunk_idx);
 
-	// Read the byte containing the bit
-	ms.seekg(this->header_size + chunk_idx / 8, std::ifstream::beg);
-	uint8_t bitmap = 0;
-	ms.read((char*)&bitmap, 1);
+	FdCache::FdPtr fd;
+	ChunkBitmapPtr bitmap;
+	uint8_t* meta = map(fd, bitmap);
+	bitmap->mark(chunk_idx, n_chunks, valid);
 
-	// Update the read byte setting the bit
-	uint8_t bit = (uint8_t)(1 << (7 - (chunk_idx % 8)));
-	if (valid) {
-		bitmap |= bit;
-	} else {
-		bitmap &= ~bit;
+	if (!sm_sync) {
+		flushIfDue(meta, n_chunks);
+		return;
 	}
 
-	// write the byte to the file (in the same position is was read)
-	ms.seekp(this->header_size + chunk_idx / 8, std::ifstream::beg);
-	ms.write((char*)&bitmap, 1);
-	ms.close();
+	uint64_t round = sm_sync->add(this->metadata_file,
+			this->fd_cache->open(this->file_effective_path), fd, bitmap);
+	if (sm_sync->getMode() == FileSync::GROUP && !data_synced) {
+		sm_sync->wait(round, this->metadata_file);
+	}
+}
+
+bool FileMetadata::isComplete() const
+{
+	FdCache::FdPtr fd;
+	ChunkBitmapPtr bitmap;
+	map(fd, bitmap);
+	return bitmap->isFull();
 }
 
 size_t FileMetadata::nextMissingChunk(size_t from_chunk_idx) const
 {
-	std::ifstream ms(this->metadata_file , std::ios::in | std::ios::binary);
-	ms.unsetf(std::ios::skipws);
-	ms.seekg(this->header_size + from_chunk_idx / 8, std::ifstream::beg);
+	FdCache::FdPtr fd;
+	ChunkBitmapPtr bitmap;
+	map(fd, bitmap);
+	return bitmap->find(from_chunk_idx, false);
+}
+
+size_t FileMetadata::nextReceivedChunk(size_t from_chunk_idx) const
+{
+	FdCache::FdPtr fd;
+	ChunkBitmapPtr bitmap;
+	map(fd, bitmap);
+	return bitmap->find(from_chunk_idx, true);
+}
 
-	// Skip all bytes set to 0xFF (all bits set)
-	uint8_t bitmap = 0xFF;
-	while(ms && bitmap == 0xFF) {
-		ms.read((char*)&bitmap, 1);
+uint8_t* FileMetadata::map(FdCache::FdPtr& fd_out,
+		ChunkBitmapPtr& bitmap_out) const
+{
+	if (sm_store) {
+		fd_out     = sm_store->indexFd();
+		bitmap_out = sm_store->bitmap(this->file_effective_path,
+				(bool)sm_sync);
+		return nullptr;
 	}
 
-	size_t ret = UINT64_MAX;
-	if (bitmap != 0xFF) {
-		// Calculate the chunk index based on the position within the file
-		ret = ((int)ms.tellg() - this->header_size - 1) * 8;
-		// plus the bit number within the byte
-		for (int i = 7; i >= 0 && ((bitmap >> i) & 0x01) == 0x01; i--, ret++);
-		// This is to handle case when the last chunk is set
-		ret = (ret < this->file_n_chunks) ? ret : UINT64_MAX;
+	fd_out = this->fd_cache->open(this->metadata_file);
+	uint8_t* meta = fd_out->map(this->header_size + this->bitmap_size);
+
+	// The summaries are built once per mapping, shared by all its users
+	size_t n_chunks = this->file_n_chunks;
+	uint8_t* bits   = meta + this->header_size;
+	bool deferred   = (bool)sm_sync;
+	bitmap_out = fd_out->attach<ChunkBitmap>([bits, n_chunks, deferred]() {
+		return std::make_shared<ChunkBitmap>(bits, n_chunks, deferred);
+	});
+	return meta;
+}
+
+void FileMetadata::flush()
+{
+	FdCache::FdPtr fd;
+	ChunkBitmapPtr bitmap;
+	uint8_t* meta = map(fd, bitmap);
+
+	if (sm_sync) {
+		sm_sync->sync(this->metadata_file,
+				this->fd_cache->open(this->file_effective_path), fd, bitmap);
+		return;
 	}
 
-	ms.close();
-	return ret;
+	this->n_unflushed = 0;
+	this->flushed_at  = now_ms();
+	if (!meta) {
+		sm_store->flush(this->file_effective_path);
+		return;
+	}
+	if (msync(meta, this->header_size + this->bitmap_size, MS_SYNC) != 0) {
+		throw std::system_error(
+				std::make_error_code(static_cast<std::errc>(errno)),
+				"Failed flushing metadata file");
+	}
 }
 
-void FileMetadata::readHeader(const std::filesystem::path& file_effective_path,
-		size_t& file_size, size_t& file_chunk_size,
-		std::vector<uint8_t>& file_hash)
+void FileMetadata::flushIfDue(const uint8_t* meta, size_t n_marked)
+{
+	size_t n_unflushed = (this->n_unflushed += n_marked);
+	int64_t now = now_ms();
+	if ((sm_flush_chunks == 0 || n_unflushed < sm_flush_chunks) &&
+			(sm_flush_ms == 0 || now - this->flushed_at < (int64_t)sm_flush_ms)) {
+		return;
+	}
+
+	// Not thrown: the marks are kept in the mapping, flushed later
+	this->n_unflushed = 0;
+	this->flushed_at  = now;
+	if (!meta) {
+		try {
+			sm_store->flush(this->file_effective_path);
+		} catch (const std::system_error&) {
+		}
+		return;
+	}
+	(void)msync((void*)meta, this->header_size + this->bitmap_size, MS_SYNC);
+}
+
+void FileMetadata::setFlushPolicy(size_t flush_chunks, size_t flush_ms)
+{
+	sm_flush_chunks = flush_chunks;
+	sm_flush_ms     = flush_ms;
+}
+
+void FileMetadata::setSync(FileSyncPtr sync)
+{
+	sm_sync = sync;
+}
+
+void FileMetadata::setStore(StateStorePtr store)
+{
+	sm_store = store;
+}
+
+void FileMetadata::remove()
+{
+	this->fd_cache->forget(this->metadata_file);
+	remove(this->file_effective_path);
+}
+
+void FileMetadata::remove(const std::filesystem::path& file_effective_path)
+{
+	if (sm_store) {
+		sm_store->remove(file_effective_path);
+	}
+	std::filesystem::remove(metadataPath(file_effective_path));
+}
+
+bool FileMetadata::exists(const std::filesystem::path& file_effective_path)
+{
+	return (sm_store && sm_store->exists(file_effective_path)) ||
+			std::filesystem::exists(metadataPath(file_effective_path));
+}
+
+void FileMetadata::rename(const std::filesystem::path& new_file_effective_path)
+{
+	if (sm_store) {
+		sm_store->rename(this->file_effective_path, new_file_effective_path);
+		return;
+	}
+
+	auto new_metadata_file = metadataPath(new_file_effective_path);
+	this->fd_cache->forget(this->metadata_file);
+	this->fd_cache->forget(new_metadata_file);
+	std::filesystem::rename(this->metadata_file, new_metadata_file);
+}
+
+std::filesystem::path FileMetadata::metadataPath(
+		const std::filesystem::path& file_effective_path)
 {
 	auto metadata_file = file_effective_path.parent_path();
 	metadata_file /= std::string(".") +
 			file_effective_path.filename().generic_string() + ".meta";
+	return metadata_file;
+}
+
+void FileMetadata::readHeader(const std::filesystem::path& file_effective_path,
+		size_t& file_size, size_t& file_chunk_size,
+		std::vector<uint8_t>& file_hash, uint8_t& file_hash_algo)
+{
+	if (sm_store) {
+		// Migrated on first use
+		if (sm_store->readHeader(file_effective_path, file_size,
+				file_chunk_size, file_hash, file_hash_algo) ||
+				(migrateFile(file_effective_path) &&
+				sm_store->readHeader(file_effective_path, file_size,
+						file_chunk_size, file_hash, file_hash_algo))) {
+			return;
+		}
+
+		file_size = 0;
+		file_chunk_size = 0;
+		file_hash.resize(proto::HASH_SIZE);
+		file_hash_algo = proto::HASH_ALGO_BLAKE2B;
+		return;
+	}
+
+	readFileHeader(metadataPath(file_effective_path), file_size,
+			file_chunk_size, file_hash, file_hash_algo);
+}
+
+void FileMetadata::upgradeFile(const std::filesystem::path& metadata_file)
+{
+	std::error_code ec;
+	size_t meta_size = std::filesystem::file_size(metadata_file, ec);
+	if (ec || meta_size < LEGACY_HEADER_SIZE) {
+		return;
+	}
+
+	std::ifstream is(metadata_file, std::ios::in | std::ios::binary);
+	std::vector<uint8_t> data(meta_size);
+	is.read((char*)data.data(), data.size());
+	if (!is) {
+		return;
+	}
+	is.close();
+
+	// Of that layout if the bitmap of the header follows it, and nothing else
+	uint64_t file_size, file_chunk_size;
+	std::copy(data.begin(), data.begin() + 8, (uint8_t*)&file_size);
+	std::copy(data.begin() + 8, data.begin() + 16, (uint8_t*)&file_chunk_size);
+	size_t n_chunks = file_chunk_size == 0 ? 0 : file_size / file_chunk_size +
+			(file_size % file_chunk_size > 0 ? 1 : 0);
+	if (file_chunk_size == 0 || meta_size !=
+			LEGACY_HEADER_SIZE + n_chunks / 8 + (n_chunks % 8 > 0 ? 1 : 0)) {
+		return;
+	}
+
+	// Written aside and renamed over it, not to lose the bitmap if
+	// interrupted
+	uint8_t hash_algo = proto::HASH_ALGO_BLAKE2B;
+	data.insert(data.begin() + LEGACY_HEADER_SIZE, hash_algo);
+	auto tmp_file = metadata_file;
+	tmp_file += ".tmp";
+	std::ofstream os(tmp_file, std::ios::out | std::ios::binary);
+	os.write((const char*)data.data(), data.size());
+	os.close();
+	if (!os) {
+		std::filesystem::remove(tmp_file, ec);
+		throw std::system_error(
+				std::make_error_code(std::errc::io_error),
+				"Failed upgrading the metadata file " + metadata_file.string());
+	}
+	std::filesystem::rename(tmp_file, metadata_file);
+}
+
+void FileMetadata::readFileHeader(const std::filesystem::path& metadata_file,
+		size_t& file_size, size_t& file_chunk_size,
+		std::vector<uint8_t>& file_hash, uint8_t& file_hash_algo)
+{
+	upgradeFile(metadata_file);
 
 	file_size = 0;
 	file_chunk_size = 0;
 	file_hash.resize(proto::HASH_SIZE);
+	file_hash_algo = proto::HASH_ALGO_BLAKE2B;
 	if (std::filesystem::exists(metadata_file)) {
 		std::ifstream ms(metadata_file , std::ios::in | std::ios::binary);
 		ms.unsetf(std::ios::skipws);
@@ -126,8 +368,92 @@ void FileMetadata::readHeader(const std::filesystem::path& file_effective_path,
 		ms.read((char*)&file_size, sizeof(file_size));
 		ms.read((char*)&file_chunk_size, sizeof(file_chunk_size));
 		ms.read((char*)file_hash.data(), proto::HASH_SIZE);
+		ms.read((char*)&file_hash_algo, sizeof(file_hash_algo));
 		ms.close();
+
+		// Metadata files of other layouts are taken as not existing
+		std::error_code ec;
+		size_t n_chunks = file_chunk_size == 0 ? 0 : file_size /
+				file_chunk_size + (file_size % file_chunk_size > 0 ? 1 : 0);
+		if (std::filesystem::file_size(metadata_file, ec) !=
+				sizeof(file_size) + sizeof(file_chunk_size) + proto::HASH_SIZE +
+				sizeof(file_hash_algo) + n_chunks / 8 +
+				(n_chunks % 8 > 0 ? 1 : 0) || ec) {
+			file_chunk_size = 0;
+		}
+	}
+}
+
+bool FileMetadata::migrateFile(
+		const std::filesystem::path& file_effective_path)
+{
+	auto metadata_file = metadataPath(file_effective_path);
+	if (sm_store->exists(file_effective_path) ||
+			!std::filesystem::exists(metadata_file)) {
+		return false;
+	}
+
+	size_t file_size;
+	size_t file_chunk_size;
+	std::vector<uint8_t> file_hash;
+	uint8_t file_hash_algo;
+	readFileHeader(metadata_file, file_size, file_chunk_size, file_hash,
+			file_hash_algo);
+	if (file_chunk_size == 0) {
+		return false;
+	}
+
+	// The bitmap follows the header
+	size_t n_chunks = file_size / file_chunk_size +
+			(file_size % file_chunk_size > 0 ? 1 : 0);
+	std::vector<uint8_t> bitmap(n_chunks / 8 + (n_chunks % 8 > 0 ? 1 : 0));
+	std::ifstream ms(metadata_file , std::ios::in | std::ios::binary);
+	ms.seekg(sizeof(file_size) + sizeof(file_chunk_size) + proto::HASH_SIZE +
+			sizeof(file_hash_algo));
+	ms.read((char*)bitmap.data(), bitmap.size());
+	if (!ms) {
+		return false;
+	}
+	ms.close();
+
+	// Written to disk before the metadata file is removed
+	sm_store->create(file_effective_path, file_size, file_chunk_size,
+			file_hash, file_hash_algo);
+	std::copy(bitmap.begin(), bitmap.end(),
+			sm_store->bits(file_effective_path));
+	sm_store->flush(file_effective_path);
+	std::filesystem::remove(metadata_file);
+	return true;
+}
+
+size_t FileMetadata::migrate(const std::filesystem::path& base_path)
+{
+	// The metadata files found first, as they are removed
+	std::vector<std::filesystem::path> files;
+	std::error_code ec;
+	for (auto it = std::filesystem::recursive_directory_iterator(base_path,
+			std::filesystem::directory_options::skip_permission_denied, ec);
+			!ec && it != std::filesystem::recursive_directory_iterator();
+			it.increment(ec)) {
+		std::string name = it->path().filename().generic_string();
+		if (name.size() > 6 && name[0] == '.' &&
+				name.compare(name.size() - 5, 5, ".meta") == 0 &&
+				it->is_regular_file(ec)) {
+			files.push_back(it->path().parent_path() /
+					name.substr(1, name.size() - 6));
+		}
+	}
+
+	size_t n_migrated = 0;
+	for (const auto& file : files) {
+		try {
+			n_migrated += migrateFile(file) ? 1 : 0;
+		} catch (const std::exception& e) {
+			std::cout << "Failed migrating the metadata of " << file <<
+					": " << e.what() << std::endl;
+		}
 	}
+	return n_migrated;
 }
 
 } // file
@@ -7,10 +7,15 @@
 #ifndef FT_FILE_FILEMETA_H
 #define FT_FILE_FILEMETA_H
 
+#include <atomic>
 #include <filesystem>
 #include <vector>
 
 #include "ft_utils.hpp"
+#include "file/ft_chunk_bitmap.hpp"
+#include "file/ft_fd_cache.hpp"
+#include "file/ft_file_sync.hpp"
+#include "file/ft_state_store.hpp"
 #include "protocol/ft_msg.hpp"
 
 namespace ft { namespace file {
@@ -29,41 +34,78 @@ FT_DECLARE_CLASS(FileMetadata)
 ///   - file_length: 8 bytes
 ///   - chunk_size:  8 bytes
 ///   - file_hash:   64 bytes
+///   - hash_algo:   1 byte (proto::HashAlgo of file_hash)
 ///   - chunk_bitmap: variable length (1 bit per chunk)
 ///
 /// Each bit in the chunk_bitmap represents a chunk and is set to 1 if the chunk
 /// have been already saved into the target file.
 ///
+/// The metadata files of the layout without hash_algo (always a BLAKE2b hash)
+/// are upgraded to this one, keeping their chunk_bitmap, when first used.
+///
 /// The file name of the metadata file is: ".file_name.meta" where file_name is
 /// the name of the file being transferred. i.e.: for a file named 'image.jpg',
 /// the metafile file name will be '.image.jpg.meta'.
 ///
-/// File is never fully load into memory, all the changes are done directly to
-/// the file, so if the process is terminated while receiving a file, the
-/// information on received chunks is up to date.
+/// File is never fully load into memory: it is mapped (shared) from the file,
+/// kept open in the FdCache, and the bits are set and cleared atomically in
+/// the mapping, so the threads saving chunks of the same file do not lose each
+/// other's marks. The ChunkBitmap of the mapping, attached to the descriptor,
+/// keeps the summaries to find the next missing or received chunk at once.
+/// The chunks are marked once their data is written, so if the process is
+/// terminated while receiving a file, the information on received chunks is
+/// up to date.
+///
+/// The mapping is flushed to disk (msync) every flush_chunks chunks marked,
+/// or flush_ms milliseconds, as set by setFlushPolicy() (0 disables each one),
+/// and by flush() once the file is complete.
+///
+/// The mapping may be written back before the data of the chunks marked, so
+/// with a FileSync set by setSync() the bitmap is deferred instead: the files
+/// with chunks marked are added to the FileSync, which writes the marks to
+/// the mapping once their data is synced (and flush() waits for it). The
+/// flush policy is not used then.
+///
+/// With a StateStore set by setStore(), the header and the chunk_bitmap are a
+/// record of the store instead of a metadata file, marked the same way. The
+/// metadata file of a file without record is migrated to the store (and
+/// removed) when the file is loaded, or by migrate() for a whole tree.
 class FileMetadata {
 private:
  	const std::filesystem::path file_effective_path;
 	const size_t                file_size;
 	const size_t                file_chunk_size;
 	const std::vector<uint8_t>  file_hash;
+	const uint8_t               file_hash_algo;
 	const size_t                file_n_chunks;
 	const size_t                header_size;
 	const size_t                bitmap_size;
 	std::filesystem::path       metadata_file;
+	const FdCachePtr            fd_cache;
+
+	std::atomic<size_t>         n_unflushed;  ///! Chunks marked since flushed
+	std::atomic<int64_t>        flushed_at;   ///! Last flush, in ms
+
+	static size_t               sm_flush_chunks;
+	static size_t               sm_flush_ms;
+	static FileSyncPtr          sm_sync;
+	static StateStorePtr        sm_store;
 
 public:
 	/// Constructor
 	FileMetadata(const std::filesystem::path& file_effective_path,
 			size_t file_size, size_t file_chunk_size,
-			std::vector<uint8_t> file_hash);
+			std::vector<uint8_t> file_hash, uint8_t file_hash_algo,
+			FdCachePtr fd_cache);
 
 	virtual ~FileMetadata() {}
 
 	/// @brief If the metadata file not exists, creates it
 	///
 	/// The metadata file is initialized with the target file length, chunk size
-	/// and all the bits in the chunk_bitmap set to 0.
+	/// and all the bits in the chunk_bitmap set to 0. A metadata file of the
+	/// layout without hash_algo is upgraded instead, and one of an unexpected
+	/// length is also initialized.
 	void createIfNotExist();
 
 	/// @brief Sets on/off the bit in the chunk_bitmap for the chunk index
@@ -71,16 +113,102 @@ public:
 	/// Sets the bit to 1 if valid is true, 0 otherwise.
 	void markChunk(size_t idx, bool valid);
 
+	/// @brief Same as markChunk() for n_chunks chunks from chunk_idx
+	///
+	/// With a FileSync in GROUP mode, waits for the chunks to be durable,
+	/// unless their data is already synced (e.g. by the IoEngine). Throws
+	/// std::system_error if they failed to sync.
+	void markChunks(size_t chunk_idx, size_t n_chunks, bool valid,
+			bool data_synced = false);
+
 	/// @brief Get the first chunk index that is not marked as saved
 	///
 	/// Search in the chunk_bitmap for the first bit set to 0 after the chunk
 	/// index specified by from_chunk_idx.
 	size_t nextMissingChunk(size_t from_chunk_idx) const;
 
+	/// @brief True if all the chunks are marked as saved
+	bool isComplete() const;
+
+	/// @brief Get the first chunk index that is marked as saved
+	///
+	/// Search in the chunk_bitmap for the first bit set to 1 after the chunk
+	/// index specified by from_chunk_idx.
+	size_t nextReceivedChunk(size_t from_chunk_idx) const;
+
+	/// @brief Writes the bitmap marked so far to disk
+	///
+	/// With a FileSync, the data of the file is synced first. Throws
+	/// std::system_error on failure.
+	void flush();
+
+	/// @brief Removes the metadata file
+	void remove();
+
+	/// @brief Removes the metadata file of the given file, if any
+	static void remove(const std::filesystem::path& file_effective_path);
+
+	/// @brief True if the given file has a metadata file
+	static bool exists(const std::filesystem::path& file_effective_path);
+
+	/// @brief Moves the metadata file to be the one of another file
+	void rename(const std::filesystem::path& new_file_effective_path);
+
+	/// @brief Path of the metadata file of the given file
+	static std::filesystem::path metadataPath(
+			const std::filesystem::path& file_effective_path);
+
+	/// @brief Sets when the bitmap of the files is flushed to disk
+	///
+	/// Every flush_chunks chunks marked or flush_ms milliseconds, whatever
+	/// comes first, 0 disabling each one.
+	static void setFlushPolicy(size_t flush_chunks, size_t flush_ms);
+
+	/// @brief Sets the FileSync making the marks durable, if any
+	///
+	/// Must be set before any file is used.
+	static void setSync(FileSyncPtr sync);
+
+	/// @brief Sets the StateStore keeping the metadata, if any
+	///
+	/// Must be set before any file is used.
+	static void setStore(StateStorePtr store);
+
+	/// @brief Migrates the metadata files in the tree to the StateStore
+	///
+	/// Returns the number of files migrated.
+	static size_t migrate(const std::filesystem::path& base_path);
+
 	/// @brief Read the header of the metadata file.
 	static void readHeader(const std::filesystem::path& file_effective_path,
 			size_t& file_size, size_t& file_chunk_size,
-			std::vector<uint8_t>& file_hash);
+			std::vector<uint8_t>& file_hash, uint8_t& file_hash_algo);
+
+private:
+	/// @brief The metadata file, mapped in memory, and its ChunkBitmap
+	///
+	/// With a StateStore, the index file and the bitmap of the record (no
+	/// mapping is returned).
+	uint8_t* map(FdCache::FdPtr& fd_out, ChunkBitmapPtr& bitmap_out) const;
+
+	/// @brief Flushes the bitmap if due by the flush policy
+	void flushIfDue(const uint8_t* meta, size_t n_marked);
+
+	/// @brief Moves the metadata file of the given file to the StateStore
+	///
+	/// Returns false if it has no metadata file (of a known layout).
+	static bool migrateFile(const std::filesystem::path& file_effective_path);
+
+	/// @brief Rewrites a metadata file of the layout without hash_algo to the
+	/// current one, if it is of that layout
+	static void upgradeFile(const std::filesystem::path& metadata_file);
+
+	/// @brief Reads the header of the metadata file, not of the StateStore
+	///
+	/// The file is upgraded first (see upgradeFile()).
+	static void readFileHeader(const std::filesystem::path& metadata_file,
+			size_t& file_size, size_t& file_chunk_size,
+			std::vector<uint8_t>& file_hash, uint8_t& file_hash_algo);
 };
 
 } // file
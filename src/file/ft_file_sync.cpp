@@ -0,0 +1,295 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+// Released under MIT License
+// Copyright (c) 2020 Hernan Perrone (hernan.perrone@gmail.com)
+//////////////////////////////////////////////////////////////////////////////
+
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <system_error>
+
+// POSIX & LINUX headers
+#include <unistd.h>
+
+#include "file/ft_file_sync.hpp"
+
+namespace ft { namespace file {
+
+// Upper bound of the first bucket of the histograms, in microseconds
+static const double HISTOGRAM_FIRST_US = 16.0;
+
+static const char* HISTOGRAM_LABELS[FileSync::Histogram::N_BUCKETS] = {
+	"<16us", "<64us", "<256us", "<1ms", "<4ms", "<16ms", "<64ms", "<256ms",
+	"<1s", "<4s", ">=4s"
+};
+
+////////////////////////////////////////////////////////////////////////////
+// FileSync::Histogram class' members
+
+void FileSync::Histogram::add(std::chrono::steady_clock::duration latency)
+{
+	double us = std::chrono::duration<double, std::micro>(latency).count();
+
+	size_t bucket = 0;
+	for (double bound = HISTOGRAM_FIRST_US;
+			bucket < N_BUCKETS - 1 && us >= bound; bound *= 4.0, bucket++);
+
+	this->counts[bucket]++;
+	this->n++;
+	this->total_ms += us / 1000.0;
+	this->max_ms    = std::max(this->max_ms, us / 1000.0);
+}
+
+std::string FileSync::Histogram::toString() const
+{
+	std::ostringstream out;
+	out << std::fixed << std::setprecision(3) << this->n << " calls, mean "
+		<< (this->n > 0 ? this->total_ms / this->n : 0.0) << " ms, max "
+		<< this->max_ms << " ms [";
+
+	const char* sep = "";
+	for (size_t bucket = 0; bucket < N_BUCKETS; bucket++) {
+		if (this->counts[bucket] > 0) {
+			out << sep << HISTOGRAM_LABELS[bucket] << ": "
+				<< this->counts[bucket];
+			sep = ", ";
+		}
+	}
+	out << "]";
+	return out.str();
+}
+
+////////////////////////////////////////////////////////////////////////////
+// FileSync class' members
+
+FileSync::FileSync(const std::string& name, Mode mode,
+		std::chrono::milliseconds interval)
+: name(name)
+, mode(mode)
+, interval(interval)
+, n_started(0)
+, n_done(0)
+, round_wanted(false)
+, stopped(false)
+, n_files(0)
+{
+	this->thread = std::thread(&FileSync::run, this);
+}
+
+FileSync::~FileSync()
+{
+	stop();
+}
+
+uint64_t FileSync::add(const std::filesystem::path& metadata_file,
+		FdCache::FdPtr data_fd, FdCache::FdPtr meta_fd, ChunkBitmapPtr bitmap)
+{
+	return enqueue(metadata_file, { data_fd, meta_fd, bitmap }, false);
+}
+
+void FileSync::wait(uint64_t round, const std::filesystem::path& metadata_file)
+{
+	std::unique_lock<std::mutex> lock(this->mtx);
+	this->done_cv.wait(lock, [this, round]() { return this->n_done >= round; });
+
+	// The failures of the file since it was last waited for
+	auto it = this->failed.find(metadata_file.string());
+	if (it != this->failed.end()) {
+		int err = it->second;
+		this->failed.erase(it);
+		throw std::system_error(std::make_error_code(static_cast<std::errc>(err)),
+				"Failed syncing file");
+	}
+}
+
+void FileSync::sync(const std::filesystem::path& metadata_file,
+		FdCache::FdPtr data_fd, FdCache::FdPtr meta_fd, ChunkBitmapPtr bitmap)
+{
+	wait(enqueue(metadata_file, { data_fd, meta_fd, bitmap }, true),
+			metadata_file);
+}
+
+void FileSync::stop()
+{
+	{
+		std::lock_guard<std::mutex> lock(this->mtx);
+		if (this->stopped) {
+			return;
+		}
+		this->stopped = true;
+		this->work_cv.notify_all();
+	}
+
+	this->thread.join();
+}
+
+void FileSync::logStats() const
+{
+	std::lock_guard<std::mutex> lock(this->mtx);
+
+	std::cout << this->name << " | Sync (" << modeName(this->mode) << "): "
+		<< this->n_done << " rounds, " << this->n_files << " files" << std::endl;
+	std::cout << this->name << " |   Data fdatasync: "
+		<< this->data_latency.toString() << std::endl;
+	std::cout << this->name << " |   Metadata fdatasync: "
+		<< this->meta_latency.toString() << std::endl;
+}
+
+const char* FileSync::modeName(Mode mode)
+{
+	switch (mode) {
+	case PERIODIC: return "periodic";
+	case GROUP:    return "group";
+	}
+	return "unknown";
+}
+
+uint64_t FileSync::enqueue(const std::filesystem::path& metadata_file,
+		Pending file, bool now)
+{
+	std::unique_lock<std::mutex> lock(this->mtx);
+
+	if (this->stopped) {
+		// No thread anymore, synced by the caller
+		lock.unlock();
+		std::unordered_map<std::string, Pending> files;
+		files[metadata_file.string()] = file;
+		auto round_failed = round(files);
+
+		lock.lock();
+		for (const auto& failure : round_failed) {
+			this->failed[failure.first] = failure.second;
+		}
+		return 0;
+	}
+
+	// A file already added is replaced (e.g. its metadata file created again)
+	this->pending[metadata_file.string()] = file;
+	if (now || this->mode == GROUP) {
+		this->round_wanted = this->round_wanted || now;
+		this->work_cv.notify_one();
+	}
+
+	// The next round to start takes it
+	return this->n_started + 1;
+}
+
+void FileSync::run()
+{
+	std::unique_lock<std::mutex> lock(this->mtx);
+	while (true) {
+		if (this->mode == GROUP) {
+			this->work_cv.wait(lock, [this]() {
+				return !this->pending.empty() || this->stopped;
+			});
+		} else {
+			this->work_cv.wait_for(lock, this->interval, [this]() {
+				return this->round_wanted || this->stopped;
+			});
+		}
+		this->round_wanted = false;
+
+		if (this->pending.empty()) {
+			if (this->stopped) {
+				break;
+			}
+			continue;
+		}
+
+		// The files added from now on are taken by the next round
+		std::unordered_map<std::string, Pending> files;
+		files.swap(this->pending);
+		uint64_t started = ++this->n_started;
+
+		lock.unlock();
+		auto round_failed = round(files);
+		lock.lock();
+
+		for (const auto& failure : round_failed) {
+			this->failed[failure.first] = failure.second;
+		}
+		this->n_files += files.size();
+		this->n_done = started;
+		this->done_cv.notify_all();
+	}
+}
+
+std::unordered_map<std::string, int> FileSync::round(
+		std::unordered_map<std::string, Pending>& files)
+{
+	struct Marks {
+		bool                  any;
+		size_t                first_byte;
+		std::vector<uint8_t>  bytes;
+	};
+	std::unordered_map<std::string, Marks> marks;
+	std::unordered_map<std::string, int> round_failed;
+
+	// The marks are taken before the data is synced: the chunks marked after
+	// may have been written after too
+	for (auto& file : files) {
+		auto& file_marks = marks[file.first];
+		file_marks.any = file.second.bitmap->takePending(file_marks.first_byte,
+				file_marks.bytes);
+	}
+
+	for (auto& file : files) {
+		auto start = std::chrono::steady_clock::now();
+		int ret = fdatasync(file.second.data_fd->fd);
+		auto latency = std::chrono::steady_clock::now() - start;
+		if (ret != 0) {
+			round_failed[file.first] = errno;
+
+			// The pages that failed may be dropped by the kernel, so syncing
+			// again would not fail: the chunks are received again instead
+			const auto& file_marks = marks[file.first];
+			if (file_marks.any) {
+				file.second.bitmap->discardPending(file_marks.first_byte,
+						file_marks.bytes);
+			}
+		}
+
+		std::lock_guard<std::mutex> lock(this->mtx);
+		this->data_latency.add(latency);
+	}
+
+	// Then only the marks of the data synced are written to the bitmap. The
+	// files sharing a metadata file (e.g. the index of a StateStore) sync it
+	// once.
+	std::unordered_map<int, std::vector<std::string>> meta_files;
+	for (auto& file : files) {
+		const auto& file_marks = marks[file.first];
+		if (!file_marks.any || round_failed.count(file.first) > 0) {
+			continue;
+		}
+		file.second.bitmap->applyPending(file_marks.first_byte,
+				file_marks.bytes);
+		meta_files[file.second.meta_fd->fd].push_back(file.first);
+	}
+
+	for (const auto& meta_file : meta_files) {
+		auto start = std::chrono::steady_clock::now();
+		int ret = fdatasync(meta_file.first);
+		auto latency = std::chrono::steady_clock::now() - start;
+		if (ret != 0) {
+			int err = errno;
+			for (const auto& file : meta_file.second) {
+				round_failed[file] = err;
+			}
+		}
+
+		std::lock_guard<std::mutex> lock(this->mtx);
+		this->meta_latency.add(latency);
+	}
+
+	for (const auto& failure : round_failed) {
+		std::cout << this->name << " | Failed syncing "
+			<< std::filesystem::path(failure.first).filename() << ": "
+			<< std::generic_category().message(failure.second) << std::endl;
+	}
+	return round_failed;
+}
+
+} // file
+} // ft
@@ -0,0 +1,157 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+// Released under MIT License
+// Copyright (c) 2020 Hernan Perrone (hernan.perrone@gmail.com)
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef FT_FILE_FILESYNC_H
+#define FT_FILE_FILESYNC_H
+
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "ft_utils.hpp"
+#include "file/ft_chunk_bitmap.hpp"
+#include "file/ft_fd_cache.hpp"
+
+namespace ft { namespace file {
+
+FT_DECLARE_CLASS(FileSync)
+
+/// @brief Makes the chunks received durable, many files at once
+///
+/// The chunks are written to the page cache, and the bitmap of the metadata
+/// file is written back by the kernel whenever it wants, so after a power loss
+/// the bitmap may claim chunks whose data never reached the disk. Syncing the
+/// data for each chunk would cost more than receiving it.
+///
+/// With a FileSync, the bitmaps are deferred (see ChunkBitmap): the chunks
+/// are marked in memory, and the files with chunks marked are added to the
+/// sync. A thread syncs them in rounds: the bytes of the bitmaps marked so
+/// far are taken, then the data of each file is synced (fdatasync), then the
+/// bytes are written to the mapping and the metadata file synced. So the
+/// bitmap on disk only claims chunks whose data is on disk, and the chunks of
+/// all the files in transfer are made durable by two fdatasync per file (or
+/// one, and one for all the files in a StateStore). The chunks of a file
+/// whose data fails to sync are cleared from its bitmap, to be received again.
+///
+/// The rounds are run:
+///   - PERIODIC: every interval, the threads marking chunks do not wait.
+///   - GROUP: as soon as a file is added (group commit), the threads marking
+///     chunks wait for the round taking them. The ones added while a round is
+///     running are taken by the next one.
+/// Either way, sync() runs a round at once and waits for it (e.g. for a file
+/// complete).
+///
+/// The latency of the fdatasync of the data and of the metadata files is
+/// kept in histograms, logged by logStats().
+class FileSync {
+public:
+	enum Mode { PERIODIC, GROUP };
+
+	/// @brief Histogram of latencies, by power of 4 from 16 microseconds
+	class Histogram {
+	public:
+		static const size_t N_BUCKETS = 11;
+
+	private:
+		std::array<uint64_t, N_BUCKETS>  counts;
+		uint64_t                         n;
+		double                           total_ms;
+		double                           max_ms;
+
+	public:
+		Histogram() : counts{}, n(0), total_ms(0.0), max_ms(0.0) {}
+
+		void add(std::chrono::steady_clock::duration latency);
+
+		/// @brief Text of the buckets not empty, the mean and the maximum
+		std::string toString() const;
+	};
+
+private:
+	/// A file with chunks marked since the last round
+	struct Pending {
+		FdCache::FdPtr  data_fd;
+		FdCache::FdPtr  meta_fd;
+		ChunkBitmapPtr  bitmap;
+	};
+
+	const std::string                         name;
+	const Mode                                mode;
+	const std::chrono::milliseconds           interval;
+
+	mutable std::mutex                        mtx;
+	std::condition_variable                   work_cv;  ///! Signals a round due
+	std::condition_variable                   done_cv;  ///! Signals round done
+	std::unordered_map<std::string, Pending>  pending;  ///! By metadata file
+	std::unordered_map<std::string, int>      failed;   ///! errno, by file
+	uint64_t                                  n_started;
+	uint64_t                                  n_done;
+	bool                                      round_wanted;
+	bool                                      stopped;
+	std::thread                               thread;
+
+	// Stats
+	uint64_t                                  n_files;
+	Histogram                                 data_latency;
+	Histogram                                 meta_latency;
+
+public:
+	FileSync(const std::string& name, Mode mode,
+			std::chrono::milliseconds interval);
+
+	virtual ~FileSync();
+
+	/// @brief Adds a file with chunks marked in its (deferred) bitmap
+	///
+	/// Returns the round taking them, to be given to wait() (only waited for
+	/// in GROUP mode).
+	uint64_t add(const std::filesystem::path& metadata_file,
+			FdCache::FdPtr data_fd, FdCache::FdPtr meta_fd,
+			ChunkBitmapPtr bitmap);
+
+	/// @brief Waits for the round, then throws if the file failed to sync
+	///
+	/// Throws std::system_error with the errno of the failure.
+	void wait(uint64_t round, const std::filesystem::path& metadata_file);
+
+	/// @brief Adds the file and waits for a round run at once
+	void sync(const std::filesystem::path& metadata_file,
+			FdCache::FdPtr data_fd, FdCache::FdPtr meta_fd,
+			ChunkBitmapPtr bitmap);
+
+	/// @brief Stops the thread, once the files added are synced
+	void stop();
+
+	Mode getMode() const { return this->mode; }
+
+	/// @brief Logs the rounds, files synced and the fdatasync latencies
+	void logStats() const;
+
+	/// @brief Name of the mode
+	static const char* modeName(Mode mode);
+
+private:
+	/// @brief Adds the file, to the next round (run at once if now)
+	uint64_t enqueue(const std::filesystem::path& metadata_file,
+			Pending file, bool now);
+
+	/// Thread loop
+	void run();
+
+	/// @brief Syncs the files, returning the errno of the failed ones
+	std::unordered_map<std::string, int> round(
+			std::unordered_map<std::string, Pending>& files);
+};
+
+} // file
+} // ft
+#endif //FT_FILE_FILESYNC_H
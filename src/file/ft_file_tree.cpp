@@ -0,0 +1,384 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+// Released under MIT License
+// Copyright (c) 2020 Hernan Perrone (hernan.perrone@gmail.com)
+//////////////////////////////////////////////////////////////////////////////
+
+#include <algorithm>
+#include <cstring>
+#include <exception>
+#include <system_error>
+#include <thread>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+// Using BLAKE2b from Crypto++ for hashing the tree nodes
+#include <cryptlib.h>
+#include <blake2.h>
+
+#include "file/ft_file.hpp"
+#include "file/ft_file_tree.hpp"
+
+namespace ft { namespace file {
+
+// Prefixes of the hashed data, by kind of hash
+static const uint8_t TREE_PREFIX_LEAF = 0x00;
+static const uint8_t TREE_PREFIX_NODE = 0x01;
+static const uint8_t TREE_PREFIX_FILE = 0x02;
+
+// Number of chunks read at once by the hashing threads
+static const size_t TREE_READ_CHUNKS = 64U;
+
+static size_t num_of_leaves(size_t file_size);
+
+static void calc_leaf(const uint8_t* data, size_t len, uint8_t* leaf_out);
+
+static void calc_node(const uint8_t* left, const uint8_t* right,
+		uint8_t* node_out);
+
+static void calc_file_hash(size_t file_size, const uint8_t* top,
+		std::vector<uint8_t>& hash_out);
+
+static void hash_leaves(int fd, size_t file_size, size_t leaf_first,
+		size_t leaf_last, uint8_t* leaves_out);
+
+/// Walks the nodes covering a range of leaves, depth first from left to right
+///
+/// Used to get the proof of a range (from all the levels) and to verify it
+/// (from the leaves of the range and the proof).
+class RangeWalker {
+private:
+	std::vector<size_t>         n_nodes;   ///! Number of nodes per level
+	const size_t                first;
+	const size_t                last;
+
+public:
+	RangeWalker(size_t n_leaves, size_t first, size_t last)
+	: first(first), last(last)
+	{
+		this->n_nodes.push_back(n_leaves);
+		while (this->n_nodes.back() > 1) {
+			this->n_nodes.push_back((this->n_nodes.back() + 1) / 2);
+		}
+	}
+
+	size_t getTopLevel() const { return this->n_nodes.size() - 1; }
+
+	/// Appends the nodes out of the range to proof_out
+	void getProof(const std::vector<std::vector<uint8_t>>& levels,
+			size_t level, size_t idx, std::vector<uint8_t>& proof_out) const
+	{
+		if (isOut(level, idx)) {
+			auto node = levels[level].begin() + idx * TREE_NODE_SIZE;
+			proof_out.insert(proof_out.end(), node, node + TREE_NODE_SIZE);
+		} else if (level > 0) {
+			getProof(levels, level - 1, idx * 2, proof_out);
+			if (idx * 2 + 1 < this->n_nodes[level - 1]) {
+				getProof(levels, level - 1, idx * 2 + 1, proof_out);
+			}
+		}
+	}
+
+	/// Hashes the node from the leaves of the range and the proof
+	///
+	/// Returns false if the proof does not have the expected nodes.
+	bool calcNode(const std::vector<uint8_t>& leaves,
+			const std::vector<uint8_t>& proof, size_t& proof_pos,
+			size_t level, size_t idx, uint8_t* node_out) const
+	{
+		if (isOut(level, idx)) {
+			if (proof_pos + TREE_NODE_SIZE > proof.size()) {
+				return false;
+			}
+			memcpy(node_out, proof.data() + proof_pos, TREE_NODE_SIZE);
+			proof_pos += TREE_NODE_SIZE;
+			return true;
+		}
+
+		if (level == 0) {
+			memcpy(node_out, leaves.data() + (idx - this->first) *
+					TREE_NODE_SIZE, TREE_NODE_SIZE);
+			return true;
+		}
+
+		// A node without right child is its left child promoted
+		uint8_t left[TREE_NODE_SIZE];
+		uint8_t right[TREE_NODE_SIZE];
+		if (!calcNode(leaves, proof, proof_pos, level - 1, idx * 2, left)) {
+			return false;
+		}
+		if (idx * 2 + 1 >= this->n_nodes[level - 1]) {
+			memcpy(node_out, left, TREE_NODE_SIZE);
+			return true;
+		}
+		if (!calcNode(leaves, proof, proof_pos, level - 1, idx * 2 + 1,
+				right)) {
+			return false;
+		}
+		calc_node(left, right, node_out);
+		return true;
+	}
+
+private:
+	/// True if none of the leaves of the node are in the range
+	bool isOut(size_t level, size_t idx) const
+	{
+		size_t leaf_first = idx << level;
+		size_t leaf_last = std::min(((idx + 1) << level), this->n_nodes[0]) - 1;
+		return leaf_last < this->first || leaf_first > this->last;
+	}
+};
+
+////////////////////////////////////////////////////////////////////////////
+// FileTree class' members
+
+FileTree::FileTree(const std::filesystem::path& path, size_t file_size)
+: file_size(file_size)
+{
+	size_t n_leaves = num_of_leaves(file_size);
+	this->levels.emplace_back(n_leaves * TREE_NODE_SIZE);
+
+	if (file_size == 0) {
+		calc_leaf(nullptr, 0, this->levels[0].data());
+		build();
+		return;
+	}
+
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		throw std::system_error(
+				std::make_error_code(static_cast<std::errc>(errno)),
+				"Failed opening file to hash: " + (std::string)path);
+	}
+
+	// Each thread hashes a contiguous range of leaves
+	size_t n_threads = std::max(1U, std::thread::hardware_concurrency());
+	n_threads = std::min(n_threads,
+			(n_leaves + TREE_READ_CHUNKS - 1) / TREE_READ_CHUNKS);
+	size_t per_thread = (n_leaves + n_threads - 1) / n_threads;
+
+	std::vector<std::thread> threads;
+	std::vector<std::exception_ptr> errors(n_threads);
+	for (size_t t = 0; t < n_threads; t++) {
+		size_t leaf_first = t * per_thread;
+		size_t leaf_last = std::min(leaf_first + per_thread, n_leaves) - 1;
+		uint8_t* leaves_out = this->levels[0].data() +
+				leaf_first * TREE_NODE_SIZE;
+		threads.emplace_back([=, &errors]() {
+			try {
+				hash_leaves(fd, file_size, leaf_first, leaf_last, leaves_out);
+			} catch (...) {
+				errors[t] = std::current_exception();
+			}
+		});
+	}
+	for (auto& thread : threads) {
+		thread.join();
+	}
+	(void)close(fd);
+
+	for (const auto& error : errors) {
+		if (error) {
+			std::rethrow_exception(error);
+		}
+	}
+
+	build();
+}
+
+FileTree::FileTree(const std::vector<uint8_t>& data)
+: file_size(data.size())
+{
+	this->levels.emplace_back();
+	if (data.empty()) {
+		this->levels[0].resize(TREE_NODE_SIZE);
+		calc_leaf(nullptr, 0, this->levels[0].data());
+	} else {
+		calcLeaves(data.data(), data.size(), this->levels[0]);
+	}
+
+	build();
+}
+
+void FileTree::getProof(size_t chunk_idx, size_t n_chunks,
+		std::vector<uint8_t>& proof_out) const
+{
+	proof_out.clear();
+
+	RangeWalker walker(this->levels[0].size() / TREE_NODE_SIZE, chunk_idx,
+			chunk_idx + n_chunks - 1);
+	walker.getProof(this->levels, walker.getTopLevel(), 0, proof_out);
+}
+
+bool FileTree::verify(size_t file_size, const std::vector<uint8_t>& file_hash,
+		size_t chunk_idx, const std::vector<uint8_t>& leaves,
+		const std::vector<uint8_t>& proof)
+{
+	size_t n_leaves = num_of_leaves(file_size);
+	size_t n_chunks = leaves.size() / TREE_NODE_SIZE;
+	if (n_chunks == 0 || chunk_idx + n_chunks > n_leaves) {
+		return false;
+	}
+
+	RangeWalker walker(n_leaves, chunk_idx, chunk_idx + n_chunks - 1);
+
+	uint8_t top[TREE_NODE_SIZE];
+	size_t proof_pos = 0;
+	if (!walker.calcNode(leaves, proof, proof_pos, walker.getTopLevel(), 0,
+			top) || proof_pos != proof.size()) {
+		return false;
+	}
+
+	std::vector<uint8_t> hash;
+	calc_file_hash(file_size, top, hash);
+	return hash == file_hash;
+}
+
+void FileTree::calcLeaves(const uint8_t* data, size_t len,
+		std::vector<uint8_t>& leaves_out)
+{
+	for (size_t offset = 0; offset < len; offset += CHUNK_SIZE) {
+		size_t pos = leaves_out.size();
+		leaves_out.resize(pos + TREE_NODE_SIZE);
+		calc_leaf(data + offset, std::min(CHUNK_SIZE, len - offset),
+				leaves_out.data() + pos);
+	}
+}
+
+void FileTree::calcZeroLeaves(size_t file_size, size_t chunk_idx,
+		size_t n_chunks, std::vector<uint8_t>& leaves_out)
+{
+	std::vector<uint8_t> zeros(CHUNK_SIZE, 0);
+	uint8_t zero_leaf[TREE_NODE_SIZE];
+	calc_leaf(zeros.data(), zeros.size(), zero_leaf);
+
+	for (size_t idx = chunk_idx; idx < chunk_idx + n_chunks; idx++) {
+		size_t offset = idx * CHUNK_SIZE;
+		if (offset >= file_size) {
+			break;
+		}
+
+		// Only the last chunk of the file may be shorter
+		size_t pos = leaves_out.size();
+		leaves_out.resize(pos + TREE_NODE_SIZE);
+		if (file_size - offset < CHUNK_SIZE) {
+			calc_leaf(zeros.data(), file_size - offset, leaves_out.data() + pos);
+		} else {
+			memcpy(leaves_out.data() + pos, zero_leaf, TREE_NODE_SIZE);
+		}
+	}
+}
+
+void FileTree::calcNode(const uint8_t* left, const uint8_t* right,
+		uint8_t* node_out)
+{
+	calc_node(left, right, node_out);
+}
+
+void FileTree::calcFileHash(size_t file_size, const uint8_t* top,
+		std::vector<uint8_t>& hash_out)
+{
+	calc_file_hash(file_size, top, hash_out);
+}
+
+void FileTree::build()
+{
+	while (this->levels.back().size() > TREE_NODE_SIZE) {
+		const auto& below = this->levels.back();
+		size_t n_below = below.size() / TREE_NODE_SIZE;
+
+		std::vector<uint8_t> level(((n_below + 1) / 2) * TREE_NODE_SIZE);
+		for (size_t i = 0; i < n_below / 2; i++) {
+			calc_node(below.data() + 2 * i * TREE_NODE_SIZE,
+					below.data() + (2 * i + 1) * TREE_NODE_SIZE,
+					level.data() + i * TREE_NODE_SIZE);
+		}
+		if (n_below % 2 > 0) {
+			memcpy(level.data() + (level.size() - TREE_NODE_SIZE),
+					below.data() + (below.size() - TREE_NODE_SIZE),
+					TREE_NODE_SIZE);
+		}
+
+		this->levels.push_back(std::move(level));
+	}
+
+	calc_file_hash(this->file_size, this->levels.back().data(),
+			this->file_hash);
+}
+
+////////////////////////////////////////////////////////////////////////////
+// Implementation of module's static functions
+
+static size_t num_of_leaves(size_t file_size)
+{
+	// Empty files have a single, empty, leaf
+	return std::max((size_t)1U,
+			file_size / CHUNK_SIZE + (file_size % CHUNK_SIZE > 0 ? 1 : 0));
+}
+
+static void calc_leaf(const uint8_t* data, size_t len, uint8_t* leaf_out)
+{
+	CryptoPP::BLAKE2b blake_hash((unsigned int)TREE_NODE_SIZE);
+	blake_hash.Update(&TREE_PREFIX_LEAF, 1);
+	blake_hash.Update(data, len);
+	blake_hash.TruncatedFinal(leaf_out, TREE_NODE_SIZE);
+}
+
+static void calc_node(const uint8_t* left, const uint8_t* right,
+		uint8_t* node_out)
+{
+	CryptoPP::BLAKE2b blake_hash((unsigned int)TREE_NODE_SIZE);
+	blake_hash.Update(&TREE_PREFIX_NODE, 1);
+	blake_hash.Update(left, TREE_NODE_SIZE);
+	blake_hash.Update(right, TREE_NODE_SIZE);
+	blake_hash.TruncatedFinal(node_out, TREE_NODE_SIZE);
+}
+
+static void calc_file_hash(size_t file_size, const uint8_t* top,
+		std::vector<uint8_t>& hash_out)
+{
+	uint8_t size_buf[8];
+	for (size_t i = 0; i < sizeof(size_buf); i++) {
+		size_buf[i] = (uint8_t)((uint64_t)file_size >> (56 - 8 * i));
+	}
+
+	CryptoPP::BLAKE2b blake_hash((unsigned int)proto::HASH_SIZE);
+	hash_out.resize(proto::HASH_SIZE);
+	blake_hash.Update(&TREE_PREFIX_FILE, 1);
+	blake_hash.Update(size_buf, sizeof(size_buf));
+	blake_hash.Update(top, TREE_NODE_SIZE);
+	blake_hash.TruncatedFinal(hash_out.data(), hash_out.size());
+}
+
+static void hash_leaves(int fd, size_t file_size, size_t leaf_first,
+		size_t leaf_last, uint8_t* leaves_out)
+{
+	std::vector<uint8_t> buf(TREE_READ_CHUNKS * CHUNK_SIZE);
+
+	for (size_t idx = leaf_first; idx <= leaf_last; idx += TREE_READ_CHUNKS) {
+		size_t offset = idx * CHUNK_SIZE;
+		size_t len = std::min(std::min(leaf_last - idx + 1, TREE_READ_CHUNKS) *
+				CHUNK_SIZE, file_size - offset);
+
+		for (size_t done = 0; done < len;) {
+			ssize_t ret = pread(fd, buf.data() + done, len - done,
+					offset + done);
+			if (ret <= 0) {
+				throw std::system_error(
+						std::make_error_code(static_cast<std::errc>(
+						ret < 0 ? errno : EIO)), "Failed reading file to hash");
+			}
+			done += ret;
+		}
+
+		for (size_t pos = 0; pos < len; pos += CHUNK_SIZE) {
+			calc_leaf(buf.data() + pos, std::min(CHUNK_SIZE, len - pos),
+					leaves_out + (idx - leaf_first) * TREE_NODE_SIZE +
+					(pos / CHUNK_SIZE) * TREE_NODE_SIZE);
+		}
+	}
+}
+
+} // file
+} // ft
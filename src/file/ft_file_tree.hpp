@@ -0,0 +1,92 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+// Released under MIT License
+// Copyright (c) 2020 Hernan Perrone (hernan.perrone@gmail.com)
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef FT_FILE_FILETREE_H
+#define FT_FILE_FILETREE_H
+
+#include <filesystem>
+#include <vector>
+
+#include "ft_utils.hpp"
+#include "protocol/ft_msg.hpp"
+
+namespace ft { namespace file {
+
+FT_DECLARE_CLASS(FileTree)
+
+// Size of the hashes of the tree nodes
+static const size_t TREE_NODE_SIZE = proto::CHUNK_HASH_SIZE;
+
+/// @brief Hash tree (Merkle tree) of a file
+///
+/// The leaves are the hashes of the file chunks (one empty leaf for empty
+/// files). Each level pairs the nodes of the level below, and a node left
+/// without pair is promoted as is. The file hash is the hash of the file size
+/// and the top node.
+///
+/// Leaves and nodes are BLAKE2b digests of TREE_NODE_SIZE bytes, prefixed by a
+/// different byte, so a leaf cannot be taken as a node:
+///   - leaf:      H(0x00 | chunk data)
+///   - node:      H(0x01 | left node | right node)
+///   - file hash: H(0x02 | file size (8 bytes) | top node), of HASH_SIZE bytes
+///
+/// As the leaves are independent, they are hashed on all the cores, and a
+/// range of chunks can be verified alone with the proof of the range: the
+/// nodes of the subtrees out of the range, as found walking the tree depth
+/// first, from left to right.
+class FileTree {
+private:
+	const size_t                       file_size;
+	std::vector<std::vector<uint8_t>>  levels;    ///! Leaves first
+	std::vector<uint8_t>               file_hash;
+
+public:
+	/// Hashes the file, the leaves on as many threads as cores
+	FileTree(const std::filesystem::path& path, size_t file_size);
+
+	/// Hashes the data
+	FileTree(const std::vector<uint8_t>& data);
+
+	virtual ~FileTree() {}
+
+	const std::vector<uint8_t>& getFileHash() const { return this->file_hash; }
+
+	/// @brief Proof of the chunks from chunk_idx to chunk_idx + n_chunks - 1
+	void getProof(size_t chunk_idx, size_t n_chunks,
+			std::vector<uint8_t>& proof_out) const;
+
+	/// @brief Checks a range of chunks against the file hash
+	///
+	/// leaves are the hashes of the chunks in the range, from chunk_idx, and
+	/// proof the proof of the range.
+	static bool verify(size_t file_size, const std::vector<uint8_t>& file_hash,
+			size_t chunk_idx, const std::vector<uint8_t>& leaves,
+			const std::vector<uint8_t>& proof);
+
+	/// @brief Appends the leaves of the data of consecutive chunks
+	static void calcLeaves(const uint8_t* data, size_t len,
+			std::vector<uint8_t>& leaves_out);
+
+	/// @brief Appends the leaves of n_chunks chunks of zeros from chunk_idx
+	static void calcZeroLeaves(size_t file_size, size_t chunk_idx,
+			size_t n_chunks, std::vector<uint8_t>& leaves_out);
+
+	/// @brief Hashes the node of the left and right nodes
+	static void calcNode(const uint8_t* left, const uint8_t* right,
+			uint8_t* node_out);
+
+	/// @brief Hashes the file hash of the top node
+	static void calcFileHash(size_t file_size, const uint8_t* top,
+			std::vector<uint8_t>& hash_out);
+
+private:
+	/// @brief Hashes the levels above the leaves and the file hash
+	void build();
+};
+
+} // file
+} // ft
+#endif //FT_FILE_FILETREE_H
@@ -0,0 +1,177 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+// Released under MIT License
+// Copyright (c) 2020 Hernan Perrone (hernan.perrone@gmail.com)
+//////////////////////////////////////////////////////////////////////////////
+
+#include <fstream>
+#include <sstream>
+#include <system_error>
+
+// POSIX & LINUX headers
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+#include "file/ft_hash_cache.hpp"
+
+namespace ft { namespace file {
+
+static int64_t to_ns(const struct timespec& ts)
+{
+	return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+HashCache::HashCache(const std::filesystem::path& cache_file)
+: cache_file(cache_file)
+{
+	load(this->cache_file, this->entries);
+}
+
+bool HashCache::get(const struct stat& st, proto::HashAlgo hash_algo,
+		std::vector<uint8_t>& hash_out)
+{
+	std::lock_guard<std::mutex> lock(this->mtx);
+
+	auto it = this->entries.find(Key(st.st_dev, st.st_ino, hash_algo));
+	if (it == this->entries.end()) {
+		return false;
+	}
+
+	const auto& entry = it->second;
+	if (entry.size != (uint64_t)st.st_size ||
+			entry.mtime_ns != to_ns(st.st_mtim) ||
+			entry.ctime_ns != to_ns(st.st_ctim)) {
+		return false;
+	}
+
+	hash_out = entry.hash;
+	return true;
+}
+
+void HashCache::put(const std::filesystem::path& path, const struct stat& st,
+		proto::HashAlgo hash_algo, const std::vector<uint8_t>& hash)
+{
+	// Paths are stored up to the end of the line
+	std::string path_str = std::filesystem::absolute(path).string();
+	if (path_str.find('\n') != std::string::npos) {
+		return;
+	}
+
+	Entry entry = { (uint64_t)st.st_size, to_ns(st.st_mtim),
+			to_ns(st.st_ctim), hash, path_str };
+	Key key(st.st_dev, st.st_ino, hash_algo);
+
+	std::lock_guard<std::mutex> lock(this->mtx);
+	this->entries[key]     = entry;
+	this->new_entries[key] = entry;
+}
+
+void HashCache::save()
+{
+	std::lock_guard<std::mutex> lock(this->mtx);
+
+	if (this->new_entries.empty()) {
+		return;
+	}
+
+	std::filesystem::create_directories(this->cache_file.parent_path());
+
+	std::string lock_file = this->cache_file.string() + ".lock";
+	int lock_fd = open(lock_file.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (lock_fd < 0) {
+		throw std::system_error(
+				std::make_error_code(static_cast<std::errc>(errno)),
+				"Failed to open the hash cache lock file");
+	}
+	if (flock(lock_fd, LOCK_EX) != 0) {
+		int err = errno;
+		(void)close(lock_fd);
+		throw std::system_error(
+				std::make_error_code(static_cast<std::errc>(err)),
+				"Failed to lock the hash cache");
+	}
+
+	// Merge with the entries saved by other clients since it was loaded
+	std::map<Key, Entry> merged;
+	load(this->cache_file, merged);
+	for (const auto& it : this->new_entries) {
+		merged[it.first] = it.second;
+	}
+
+	std::string tmp_file = this->cache_file.string() + "." +
+			std::to_string(getpid()) + ".tmp";
+	std::ofstream os(tmp_file, std::ios::out | std::ios::trunc);
+	for (const auto& it : merged) {
+		const auto& entry = it.second;
+
+		// Drop the entries of files removed or replaced
+		struct stat st;
+		if (stat(entry.path.c_str(), &st) != 0 ||
+				st.st_dev != (dev_t)std::get<0>(it.first) ||
+				st.st_ino != (ino_t)std::get<1>(it.first)) {
+			continue;
+		}
+
+		os << std::get<0>(it.first) << " " << std::get<1>(it.first) << " "
+			<< entry.size << " " << entry.mtime_ns << " " << entry.ctime_ns
+			<< " " << (unsigned)std::get<2>(it.first) << " "
+			<< toHex(entry.hash) << " " << entry.path << "\n";
+	}
+	os.close();
+
+	bool ok = !os.fail() &&
+			rename(tmp_file.c_str(), this->cache_file.c_str()) == 0;
+	int err = errno;
+	if (!ok) {
+		(void)unlink(tmp_file.c_str());
+	}
+
+	(void)flock(lock_fd, LOCK_UN);
+	(void)close(lock_fd);
+
+	if (!ok) {
+		throw std::system_error(
+				std::make_error_code(static_cast<std::errc>(err)),
+				"Failed to write the hash cache");
+	}
+
+	this->new_entries.clear();
+}
+
+bool HashCache::sameFile(const struct stat& a, const struct stat& b)
+{
+	return a.st_dev == b.st_dev && a.st_ino == b.st_ino &&
+			a.st_size == b.st_size &&
+			to_ns(a.st_mtim) == to_ns(b.st_mtim) &&
+			to_ns(a.st_ctim) == to_ns(b.st_ctim);
+}
+
+void HashCache::load(const std::filesystem::path& cache_file,
+		std::map<Key, Entry>& entries_out)
+{
+	std::ifstream is(cache_file, std::ios::in);
+	std::string line;
+	while (std::getline(is, line)) {
+		std::istringstream ss(line);
+		uint64_t dev, ino;
+		unsigned hash_algo;
+		std::string hash_hex;
+		Entry entry;
+
+		ss >> dev >> ino >> entry.size >> entry.mtime_ns >> entry.ctime_ns
+			>> hash_algo >> hash_hex;
+		if (ss.fail() || ss.get() != ' ' ||
+				hash_algo >= proto::HASH_ALGO_MAX || !fromHex(hash_hex, entry.hash) ||
+				entry.hash.size() != proto::HASH_SIZE) {
+			// Ignore corrupted entries
+			continue;
+		}
+		std::getline(ss, entry.path);
+
+		entries_out[Key(dev, ino, hash_algo)] = entry;
+	}
+}
+
+} // file
+} // ft
@@ -0,0 +1,90 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+// Released under MIT License
+// Copyright (c) 2020 Hernan Perrone (hernan.perrone@gmail.com)
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef FT_FILE_HASHCACHE_H
+#define FT_FILE_HASHCACHE_H
+
+#include <filesystem>
+#include <map>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include <sys/stat.h>
+
+#include "ft_utils.hpp"
+#include "protocol/ft_msg.hpp"
+
+namespace ft { namespace file {
+
+FT_DECLARE_CLASS(HashCache)
+
+/// @brief Persistent cache of the hashes of local files
+///
+/// Hashing a big file takes long, and it is done again each time the client
+/// restarts (e.g. to resume an upload after a network failure). The cache
+/// keeps the hashes already calculated, identified by the device, inode, size,
+/// mtime and ctime of the file (and the hash algorithm), so the hash of a file
+/// not modified since is taken from the cache.
+///
+/// The cache is a text file with an entry per line:
+///   dev ino size mtime_ns ctime_ns hash_algo hash_hex path
+///
+/// Several clients may run at once, so the cache file is only updated with
+/// the lock file held: the current cache file is read again, merged with the
+/// new entries and written to a temporary file, renamed over the cache file.
+/// Readers never see a partial file, and no entry added by other client is
+/// lost. Entries whose path no longer names the same file are dropped.
+class HashCache {
+private:
+	struct Entry {
+		uint64_t              size;
+		int64_t               mtime_ns;
+		int64_t               ctime_ns;
+		std::vector<uint8_t>  hash;
+		std::string           path;
+	};
+
+	/// Device, inode and hash algorithm
+	typedef std::tuple<uint64_t, uint64_t, uint8_t> Key;
+
+	const std::filesystem::path  cache_file;
+	std::mutex                   mtx;
+	std::map<Key, Entry>         entries;
+	std::map<Key, Entry>         new_entries;  ///! Not saved yet
+
+public:
+	HashCache(const std::filesystem::path& cache_file);
+
+	virtual ~HashCache() {}
+
+	/// @brief Looks for the hash of the file, as described by st
+	///
+	/// Returns true and sets hash_out if the cached hash is still valid.
+	bool get(const struct stat& st, proto::HashAlgo hash_algo,
+			std::vector<uint8_t>& hash_out);
+
+	/// @brief Adds the hash of the file, as described by st, to the cache
+	///
+	/// The entry is only written to disk by save().
+	void put(const std::filesystem::path& path, const struct stat& st,
+			proto::HashAlgo hash_algo, const std::vector<uint8_t>& hash);
+
+	/// @brief Writes the new entries to the cache file
+	void save();
+
+	/// @brief True if both stat describe the same, unmodified, file
+	static bool sameFile(const struct stat& a, const struct stat& b);
+
+private:
+	static void load(const std::filesystem::path& cache_file,
+			std::map<Key, Entry>& entries_out);
+};
+
+} // file
+} // ft
+#endif //FT_FILE_HASHCACHE_H
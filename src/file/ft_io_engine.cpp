@@ -0,0 +1,506 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+// Released under MIT License
+// Copyright (c) 2020 Hernan Perrone (hernan.perrone@gmail.com)
+//////////////////////////////////////////////////////////////////////////////
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <system_error>
+
+// POSIX & LINUX headers
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "file/ft_io_engine.hpp"
+
+namespace ft { namespace file {
+
+// Submission entries of the ring, two per write (the write and its sync)
+static const unsigned RING_ENTRIES = 256U;
+
+// user_data of the NOP waking up the reaper to stop. The ones of the ops are
+// their address, with the lowest bit set for the sync linked to the write.
+static const uint64_t USER_DATA_STOP = 0U;
+static const uint64_t USER_DATA_SYNC = 1U;
+
+// Operations known by the probe of the kernel
+static const unsigned PROBE_OPS = 256U;
+
+static int uring_setup(unsigned entries, struct io_uring_params* params);
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+		unsigned flags);
+static int uring_register(int fd, unsigned opcode, void* arg,
+		unsigned nr_args);
+
+IoEngine::IoEngine(const std::string& name, Backend backend, size_t depth,
+		size_t max_queued, size_t n_threads, bool sync_writes)
+: name(name)
+, depth(std::max(depth, (size_t)1U))
+, max_queued(std::max(max_queued, (size_t)1U))
+, sync_writes(sync_writes)
+, backend(backend)
+, ring()
+, n_in_flight(0)
+, n_queued(0)
+, stopped(false)
+, n_writes(0)
+, n_bytes(0)
+, n_syncs(0)
+, max_in_flight(0)
+{
+	this->ring.fd = -1;
+	if (this->backend == URING && !setupRing(RING_ENTRIES)) {
+		this->backend = THREADS;
+	}
+
+	if (this->backend == URING) {
+		this->threads.emplace_back(&IoEngine::reap, this);
+	} else {
+		for (size_t i = 0; i < std::max(n_threads, (size_t)1U); i++) {
+			this->threads.emplace_back(&IoEngine::work, this);
+		}
+	}
+}
+
+IoEngine::~IoEngine()
+{
+	stop();
+
+	if (this->ring.fd >= 0) {
+		(void)munmap(this->ring.sqes, this->ring.sqes_len);
+		if (this->ring.cq_ptr != this->ring.sq_ptr) {
+			(void)munmap(this->ring.cq_ptr, this->ring.cq_len);
+		}
+		(void)munmap(this->ring.sq_ptr, this->ring.sq_len);
+		(void)close(this->ring.fd);
+	}
+}
+
+void IoEngine::write(FdCache::FdPtr fd, std::vector<uint8_t>&& data,
+		size_t offset, DoneFn done)
+{
+	auto op = std::make_shared<Op>();
+	op->fd        = fd;
+	op->data      = std::move(data);
+	op->offset    = offset;
+	op->n_written = 0;
+	op->sync      = this->sync_writes;
+	op->done      = done;
+	op->err       = 0;
+	op->n_cqes    = 0;
+
+	struct stat st;
+	op->dev = fstat(fd->fd, &st) == 0 ? st.st_dev : 0;
+
+	{
+		std::unique_lock<std::mutex> lock(this->mtx);
+
+		// Block while the queue of the device is full
+		this->space_cv.wait(lock, [this, &op]() {
+			return this->devices[op->dev].queued.size() < this->max_queued ||
+					this->stopped;
+		});
+
+		if (!this->stopped) {
+			this->devices[op->dev].queued.push_back(op);
+			this->n_queued++;
+			dispatch();
+			return;
+		}
+	}
+
+	// No threads anymore
+	run(*op);
+	op->done(op->err, op->data);
+}
+
+void IoEngine::stop()
+{
+	{
+		std::unique_lock<std::mutex> lock(this->mtx);
+		if (this->stopped) {
+			return;
+		}
+		this->stopped = true;
+		this->space_cv.notify_all();
+
+		this->idle_cv.wait(lock, [this]() {
+			return this->n_in_flight == 0 && this->n_queued == 0;
+		});
+
+		if (this->backend == URING) {
+			unsigned tail = *this->ring.sq_tail;
+			unsigned idx  = tail & *this->ring.sq_mask;
+			auto sqe = &((struct io_uring_sqe*)this->ring.sqes)[idx];
+			memset(sqe, 0, sizeof(*sqe));
+			sqe->opcode    = IORING_OP_NOP;
+			sqe->user_data = USER_DATA_STOP;
+			this->ring.sq_array[idx] = idx;
+			__atomic_store_n(this->ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+			(void)uring_enter(this->ring.fd, 1, 0, 0);
+		} else {
+			this->ready_cv.notify_all();
+		}
+	}
+
+	for (auto& thread : this->threads) {
+		thread.join();
+	}
+	this->threads.clear();
+}
+
+void IoEngine::logStats() const
+{
+	std::lock_guard<std::mutex> lock(this->mtx);
+
+	std::cout << this->name << " | IO engine (" << backendName(this->backend)
+		<< "): " << this->n_writes << " writes, "
+		<< (this->n_bytes / (1024.0 * 1024.0)) << " MB, " << this->n_syncs
+		<< " syncs, " << this->max_in_flight << " max in flight" << std::endl;
+}
+
+const char* IoEngine::backendName(Backend backend)
+{
+	switch (backend) {
+	case URING:   return "io_uring";
+	case THREADS: return "threads";
+	}
+	return "unknown";
+}
+
+bool IoEngine::setupRing(size_t n_entries)
+{
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	int fd = uring_setup(n_entries, &params);
+	if (fd < 0) {
+		return false;
+	}
+
+	// The write operation is from Linux 5.6, as the probe of the operations
+	std::vector<uint8_t> probe_buf(sizeof(struct io_uring_probe) +
+			PROBE_OPS * sizeof(struct io_uring_probe_op), 0);
+	auto probe = (struct io_uring_probe*)probe_buf.data();
+	if (uring_register(fd, IORING_REGISTER_PROBE, probe, PROBE_OPS) != 0 ||
+			probe->last_op < IORING_OP_WRITE ||
+			(probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED) == 0) {
+		(void)close(fd);
+		return false;
+	}
+
+	// Both rings are in a single mapping from Linux 5.4
+	Ring& r = this->ring;
+	r.sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	r.cq_len = params.cq_off.cqes +
+			params.cq_entries * sizeof(struct io_uring_cqe);
+	bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+	if (single_mmap) {
+		r.sq_len = r.cq_len = std::max(r.sq_len, r.cq_len);
+	}
+	r.sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	r.sq_ptr = mmap(nullptr, r.sq_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	r.cq_ptr = single_mmap || r.sq_ptr == MAP_FAILED ? r.sq_ptr :
+			mmap(nullptr, r.cq_len, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+	r.sqes = mmap(nullptr, r.sqes_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (r.sq_ptr == MAP_FAILED || r.cq_ptr == MAP_FAILED ||
+			r.sqes == MAP_FAILED) {
+		if (r.sqes != MAP_FAILED) {
+			(void)munmap(r.sqes, r.sqes_len);
+		}
+		if (r.cq_ptr != MAP_FAILED && r.cq_ptr != r.sq_ptr) {
+			(void)munmap(r.cq_ptr, r.cq_len);
+		}
+		if (r.sq_ptr != MAP_FAILED) {
+			(void)munmap(r.sq_ptr, r.sq_len);
+		}
+		(void)close(fd);
+		return false;
+	}
+
+	uint8_t* sq = (uint8_t*)r.sq_ptr;
+	r.sq_head    = (unsigned*)(sq + params.sq_off.head);
+	r.sq_tail    = (unsigned*)(sq + params.sq_off.tail);
+	r.sq_mask    = (unsigned*)(sq + params.sq_off.ring_mask);
+	r.sq_array   = (unsigned*)(sq + params.sq_off.array);
+	r.sq_entries = params.sq_entries;
+
+	uint8_t* cq = (uint8_t*)r.cq_ptr;
+	r.cq_head    = (unsigned*)(cq + params.cq_off.head);
+	r.cq_tail    = (unsigned*)(cq + params.cq_off.tail);
+	r.cq_mask    = (unsigned*)(cq + params.cq_off.ring_mask);
+	r.cqes       = cq + params.cq_off.cqes;
+
+	r.fd = fd;
+	return true;
+}
+
+void IoEngine::dispatch()
+{
+	bool ring_full = false;
+	for (auto& entry : this->devices) {
+		Device& device = entry.second;
+		while (!device.queued.empty() && device.n_in_flight < this->depth &&
+				!ring_full) {
+			auto op = device.queued.front();
+			if (this->backend == URING) {
+				if (!prepare(op)) {
+					ring_full = true;
+					break;
+				}
+				this->submitted[op.get()] = op;
+			} else {
+				this->ready.push_back(op);
+				this->ready_cv.notify_one();
+			}
+
+			device.queued.pop_front();
+			device.n_in_flight++;
+			this->n_queued--;
+			this->n_in_flight++;
+			this->max_in_flight = std::max(this->max_in_flight,
+					this->n_in_flight);
+			this->space_cv.notify_all();
+		}
+	}
+
+	if (this->backend != URING) {
+		return;
+	}
+
+	// The entries prepared (and not taken by a failed call before)
+	unsigned to_submit = *this->ring.sq_tail -
+			__atomic_load_n(this->ring.sq_head, __ATOMIC_ACQUIRE);
+	while (to_submit > 0) {
+		int ret = uring_enter(this->ring.fd, to_submit, 0, 0);
+		if (ret < 0 && errno == EINTR) {
+			continue;
+		}
+		if (ret < 0) {
+			// Taken by the next call (e.g. once completions are reaped)
+			std::cout << this->name << " | Failed submitting writes: " <<
+				strerror(errno) << std::endl;
+		}
+		break;
+	}
+}
+
+bool IoEngine::prepare(const OpPtr& op)
+{
+	unsigned n_sqes = op->sync ? 2U : 1U;
+	unsigned tail = *this->ring.sq_tail;
+	unsigned head = __atomic_load_n(this->ring.sq_head, __ATOMIC_ACQUIRE);
+	if (tail - head + n_sqes > this->ring.sq_entries) {
+		return false;
+	}
+
+	auto sqes = (struct io_uring_sqe*)this->ring.sqes;
+	unsigned idx = tail & *this->ring.sq_mask;
+	auto sqe = &sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode    = IORING_OP_WRITE;
+	sqe->fd        = op->fd->fd;
+	sqe->addr      = (uint64_t)(uintptr_t)(op->data.data() + op->n_written);
+	sqe->len       = (uint32_t)(op->data.size() - op->n_written);
+	sqe->off       = op->offset + op->n_written;
+	sqe->user_data = (uint64_t)(uintptr_t)op.get();
+	if (op->sync) {
+		// The sync only runs once the write succeeded, cancelled otherwise
+		sqe->flags = IOSQE_IO_LINK;
+	}
+	this->ring.sq_array[idx] = idx;
+	tail++;
+
+	if (op->sync) {
+		idx = tail & *this->ring.sq_mask;
+		sqe = &sqes[idx];
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode      = IORING_OP_FSYNC;
+		sqe->fd          = op->fd->fd;
+		sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+		sqe->user_data   = (uint64_t)(uintptr_t)op.get() | USER_DATA_SYNC;
+		this->ring.sq_array[idx] = idx;
+		tail++;
+	}
+
+	op->n_cqes = n_sqes;
+	__atomic_store_n(this->ring.sq_tail, tail, __ATOMIC_RELEASE);
+	return true;
+}
+
+void IoEngine::finish(const OpPtr& op, std::vector<OpPtr>& done_out)
+{
+	this->devices[op->dev].n_in_flight--;
+	this->n_in_flight--;
+	this->n_writes++;
+	done_out.push_back(op);
+
+	this->space_cv.notify_all();
+	this->idle_cv.notify_all();
+}
+
+void IoEngine::run(Op& op)
+{
+	try {
+		op.fd->write(op.data.data() + op.n_written,
+				op.data.size() - op.n_written, op.offset + op.n_written);
+		op.n_written = op.data.size();
+		if (op.sync && fdatasync(op.fd->fd) != 0) {
+			op.err = errno;
+		}
+	} catch (const std::system_error& e) {
+		op.err = e.code().value();
+	}
+}
+
+void IoEngine::reap()
+{
+	bool stop = false;
+	while (!stop) {
+		if (uring_enter(this->ring.fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 &&
+				errno != EINTR) {
+			std::cout << this->name << " | Failed waiting for writes: " <<
+				strerror(errno) << std::endl;
+		}
+
+		std::vector<OpPtr> done;
+		{
+			std::lock_guard<std::mutex> lock(this->mtx);
+
+			auto cqes = (struct io_uring_cqe*)this->ring.cqes;
+			unsigned head = *this->ring.cq_head;
+			unsigned tail = __atomic_load_n(this->ring.cq_tail, __ATOMIC_ACQUIRE);
+			for (; head != tail; head++) {
+				const auto& cqe = cqes[head & *this->ring.cq_mask];
+				if (cqe.user_data == USER_DATA_STOP) {
+					stop = true;
+					continue;
+				}
+
+				bool is_sync = (cqe.user_data & USER_DATA_SYNC) != 0;
+				auto it = this->submitted.find(
+						(Op*)(uintptr_t)(cqe.user_data & ~USER_DATA_SYNC));
+				if (it == this->submitted.end()) {
+					continue;
+				}
+				auto op = it->second;
+
+				if (is_sync) {
+					// Cancelled after a short write, synced once resubmitted
+					if (cqe.res == 0) {
+						this->n_syncs++;
+					} else if (cqe.res != -ECANCELED && op->err == 0) {
+						op->err = -cqe.res;
+					}
+				} else if (cqe.res < 0) {
+					op->err = -cqe.res;
+				} else if (cqe.res == 0 && op->n_written < op->data.size()) {
+					op->err = EIO;
+				} else {
+					op->n_written += cqe.res;
+					this->n_bytes += cqe.res;
+				}
+
+				if (--op->n_cqes > 0) {
+					continue;
+				}
+
+				this->submitted.erase(it);
+				if (op->err == 0 && op->n_written < op->data.size()) {
+					// The rest of a short write is queued again, first
+					Device& device = this->devices[op->dev];
+					device.n_in_flight--;
+					device.queued.push_front(op);
+					this->n_in_flight--;
+					this->n_queued++;
+					continue;
+				}
+				finish(op, done);
+			}
+			__atomic_store_n(this->ring.cq_head, head, __ATOMIC_RELEASE);
+
+			dispatch();
+		}
+
+		for (const auto& op : done) {
+			try {
+				op->done(op->err, op->data);
+			} catch (const std::exception& e) {
+				std::cout << e.what() << std::endl;
+			}
+		}
+	}
+}
+
+void IoEngine::work()
+{
+	while (true) {
+		OpPtr op;
+		{
+			std::unique_lock<std::mutex> lock(this->mtx);
+			this->ready_cv.wait(lock, [this]() {
+				return !this->ready.empty() || (this->stopped &&
+						this->n_in_flight == 0 && this->n_queued == 0);
+			});
+			if (this->ready.empty()) {
+				return;
+			}
+			op = this->ready.front();
+			this->ready.pop_front();
+		}
+
+		run(*op);
+
+		std::vector<OpPtr> done;
+		{
+			std::lock_guard<std::mutex> lock(this->mtx);
+			this->n_bytes += op->n_written;
+			if (op->sync && op->err == 0) {
+				this->n_syncs++;
+			}
+			finish(op, done);
+			dispatch();
+			if (this->stopped) {
+				this->ready_cv.notify_all();
+			}
+		}
+
+		try {
+			op->done(op->err, op->data);
+		} catch (const std::exception& e) {
+			std::cout << e.what() << std::endl;
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////
+// Implementation of module's static functions
+
+static int uring_setup(unsigned entries, struct io_uring_params* params)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+		unsigned flags)
+{
+	return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+			flags, nullptr, 0);
+}
+
+static int uring_register(int fd, unsigned opcode, void* arg,
+		unsigned nr_args)
+{
+	return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+} // file
+} // ft
@@ -0,0 +1,186 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+// Released under MIT License
+// Copyright (c) 2020 Hernan Perrone (hernan.perrone@gmail.com)
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef FT_FILE_IOENGINE_H
+#define FT_FILE_IOENGINE_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// POSIX & LINUX headers
+#include <sys/types.h>
+
+#include "ft_utils.hpp"
+#include "file/ft_fd_cache.hpp"
+
+namespace ft { namespace file {
+
+FT_DECLARE_CLASS(IoEngine)
+
+/// @brief Writes the chunks received asynchronously, off the worker threads
+///
+/// The RequestBroker workers saving the chunks hand the writes over, so a slow
+/// disk does not keep them from handling the other requests. Each write is
+/// of a buffer owned by the engine, optionally followed by an fdatasync of
+/// the file (e.g. for the GROUP durability, see FileSync), and its completion
+/// callback receives the errno of the failure (0 if none) and the data, that
+/// it may take (e.g. to reuse the buffer).
+///
+/// The writes are run by:
+///   - URING: an io_uring, the write and the fdatasync submitted as linked
+///     SQEs, and a thread reaping the completions and running the callbacks.
+///   - THREADS: a few threads doing pwrite() and fdatasync(), for kernels
+///     without io_uring (or without its write operation, before 5.6) or where
+///     it is disabled.
+///
+/// The writes in flight are limited per device (depth), the next ones queued
+/// and submitted as the ones before complete. Up to max_queued writes are
+/// queued per device: write() blocks while the queue is full, so the
+/// buffers do not pile up in memory when the disk cannot keep up.
+///
+/// The writes, bytes, syncs and the most writes in flight are logged by
+/// logStats().
+class IoEngine {
+public:
+	enum Backend { URING, THREADS };
+
+	typedef std::function<void(int, std::vector<uint8_t>&)> DoneFn;
+
+private:
+	struct Op {
+		FdCache::FdPtr        fd;
+		std::vector<uint8_t>  data;
+		size_t                offset;
+		size_t                n_written;
+		bool                  sync;
+		dev_t                 dev;
+		DoneFn                done;
+		int                   err;
+		size_t                n_cqes;    ///! Completions to reap, if URING
+	};
+	typedef std::shared_ptr<Op> OpPtr;
+
+	struct Device {
+		size_t             n_in_flight;
+		std::deque<OpPtr>  queued;
+	};
+
+	/// The rings shared with the kernel, if URING
+	struct Ring {
+		int        fd;
+		void*      sq_ptr;
+		size_t     sq_len;
+		void*      cq_ptr;
+		size_t     cq_len;
+		void*      sqes;
+		size_t     sqes_len;
+		unsigned*  sq_head;
+		unsigned*  sq_tail;
+		unsigned*  sq_mask;
+		unsigned*  sq_array;
+		unsigned   sq_entries;
+		unsigned*  cq_head;
+		unsigned*  cq_tail;
+		unsigned*  cq_mask;
+		void*      cqes;
+	};
+
+	const std::string                  name;
+	const size_t                       depth;
+	const size_t                       max_queued;
+	const bool                         sync_writes;
+	Backend                            backend;
+	Ring                               ring;
+
+	mutable std::mutex                 mtx;
+	std::condition_variable            space_cv;  ///! Signals room in a queue
+	std::condition_variable            idle_cv;   ///! Signals writes done
+	std::condition_variable            ready_cv;  ///! Signals ready, THREADS
+	std::unordered_map<dev_t, Device>  devices;
+	std::deque<OpPtr>                  ready;     ///! To the threads
+	std::unordered_map<Op*, OpPtr>     submitted; ///! To the ring
+	size_t                             n_in_flight;
+	size_t                             n_queued;
+	bool                               stopped;
+	std::vector<std::thread>           threads;
+
+	// Stats
+	uint64_t                           n_writes;
+	uint64_t                           n_bytes;
+	uint64_t                           n_syncs;
+	size_t                             max_in_flight;
+
+public:
+	/// @brief Engine of the backend, or THREADS if it is not available
+	///
+	/// depth writes in flight per device, of n_threads threads if THREADS. If
+	/// sync_writes, each write is followed by an fdatasync.
+	IoEngine(const std::string& name, Backend backend, size_t depth,
+			size_t max_queued, size_t n_threads, bool sync_writes);
+
+	virtual ~IoEngine();
+
+	/// @brief Writes the data at offset, then calls done
+	///
+	/// done is called by a thread of the engine, or by the caller once
+	/// stopped.
+	void write(FdCache::FdPtr fd, std::vector<uint8_t>&& data, size_t offset,
+			DoneFn done);
+
+	/// @brief Waits for the writes in flight, then stops the threads
+	void stop();
+
+	/// @brief The backend in use
+	Backend getBackend() const { return this->backend; }
+
+	/// @brief True if the writes are followed by an fdatasync
+	bool syncsWrites() const { return this->sync_writes; }
+
+	/// @brief Logs the writes, bytes, syncs and the most in flight
+	void logStats() const;
+
+	/// @brief Name of the backend
+	static const char* backendName(Backend backend);
+
+private:
+	/// @brief Sets up the io_uring, false if not available
+	bool setupRing(size_t n_entries);
+
+	/// @brief Submits the writes queued that fit in the depth of each device
+	///
+	/// Must be called with mtx locked.
+	void dispatch();
+
+	/// @brief Adds the SQEs of the op to the ring, false if no room
+	///
+	/// Must be called with mtx locked.
+	bool prepare(const OpPtr& op);
+
+	/// @brief Accounts the op done, to call its callback once unlocked
+	///
+	/// Must be called with mtx locked.
+	void finish(const OpPtr& op, std::vector<OpPtr>& done_out);
+
+	/// @brief Runs the op in the calling thread
+	static void run(Op& op);
+
+	/// Reaper loop, if URING
+	void reap();
+
+	/// Thread loop, if THREADS
+	void work();
+};
+
+} // file
+} // ft
+#endif //FT_FILE_IOENGINE_H
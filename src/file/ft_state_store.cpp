@@ -0,0 +1,695 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+// Released under MIT License
+// Copyright (c) 2020 Hernan Perrone (hernan.perrone@gmail.com)
+//////////////////////////////////////////////////////////////////////////////
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <system_error>
+
+// POSIX & LINUX headers
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "file/ft_state_store.hpp"
+#include "protocol/ft_msg.hpp"
+
+namespace ft { namespace file {
+
+// Address space mapped for the index, the most it can grow
+static const size_t   INDEX_MAX_SIZE        = 1ULL << 36;
+
+static const uint64_t INDEX_MAGIC           = 0x5845444e49544621ULL;
+static const uint64_t INDEX_VERSION         = 1U;
+static const size_t   INDEX_HEADER_SIZE     = 64U;
+
+static const uint64_t RECORD_MAGIC          = 0x44524f4345525446ULL;
+static const size_t   RECORD_ALIGN          = 64U;
+
+// Removed lines of the journal always allowed, before compacting it
+static const size_t   JOURNAL_MIN_DEAD_LINES = 1024U;
+
+/// Header of the index file
+struct IndexHeader {
+	uint64_t  magic;
+	uint64_t  version;
+	uint64_t  next_serial;
+};
+
+/// Header of a record in the index file, followed by the chunk_bitmap
+struct RecordHeader {
+	uint64_t  magic;
+	uint64_t  serial;
+	uint64_t  file_size;
+	uint64_t  chunk_size;
+	uint8_t   hash[proto::HASH_SIZE];
+	uint8_t   hash_algo;
+	uint8_t   pad[7];
+};
+
+static size_t n_chunks_of(size_t file_size, size_t chunk_size)
+{
+	return chunk_size == 0 ? 0 : file_size / chunk_size +
+			((file_size % chunk_size) > 0 ? 1 : 0);
+}
+
+static std::system_error errno_error(int err, const std::string& what)
+{
+	return std::system_error(
+			std::make_error_code(static_cast<std::errc>(err)), what);
+}
+
+StateStore::StateStore(const std::string& name,
+		const std::filesystem::path& base_path, bool durable)
+: name(name)
+, base_path(base_path)
+, index_file(base_path / ".state.index")
+, journal_file(base_path / ".state.journal")
+, durable(durable)
+, created(!std::filesystem::exists(journal_file))
+, index(nullptr)
+, index_size(0)
+, journal_fd(-1)
+, next_serial(1)
+, n_dead_lines(0)
+, compacting(false)
+, stopped(false)
+, n_compactions(0)
+{
+	std::filesystem::create_directories(this->base_path);
+
+	// The journal of an index initialized is no longer valid
+	if (openIndex()) {
+		load();
+	}
+
+	std::unique_lock<std::mutex> lock(this->mtx);
+	compact(lock);
+	lock.unlock();
+
+	this->thread = std::thread(&StateStore::run, this);
+}
+
+StateStore::~StateStore()
+{
+	stop();
+	if (this->journal_fd >= 0) {
+		(void)close(this->journal_fd);
+	}
+	if (this->index) {
+		(void)munmap(this->index, INDEX_MAX_SIZE);
+	}
+}
+
+void StateStore::create(const std::filesystem::path& file_effective_path,
+		size_t file_size, size_t chunk_size, const std::vector<uint8_t>& hash,
+		uint8_t hash_algo)
+{
+	std::string path = key(file_effective_path);
+	std::vector<uint8_t> file_hash(hash);
+	file_hash.resize(proto::HASH_SIZE);
+
+	std::lock_guard<std::mutex> lock(this->mtx);
+	auto it = this->records.find(path);
+	if (it != this->records.end()) {
+		const auto& record = it->second;
+		if (record.file_size == file_size && record.chunk_size == chunk_size &&
+				record.hash == file_hash && record.hash_algo == hash_algo) {
+			return;
+		}
+
+		// The line adding it is replaced
+		release(it->second);
+		this->records.erase(it);
+		this->n_dead_lines++;
+	}
+
+	Record record;
+	record.serial     = this->next_serial++;
+	record.len        = recordLength(file_size, chunk_size);
+	record.offset     = allocate(record.len);
+	record.file_size  = file_size;
+	record.chunk_size = chunk_size;
+	record.hash       = file_hash;
+	record.hash_algo  = hash_algo;
+
+	// No chunk marked, and the magic last: the record is not valid until
+	// fully written
+	uint8_t* data = this->index + record.offset;
+	std::fill(data, data + record.len, 0);
+	auto header = (RecordHeader*)data;
+	header->serial     = record.serial;
+	header->file_size  = file_size;
+	header->chunk_size = chunk_size;
+	std::copy(file_hash.begin(), file_hash.end(), header->hash);
+	header->hash_algo  = hash_algo;
+	header->magic      = RECORD_MAGIC;
+	((IndexHeader*)this->index)->next_serial = this->next_serial;
+
+	append(recordLine(path, record), this->durable);
+	this->records[path] = record;
+}
+
+bool StateStore::exists(const std::filesystem::path& file_effective_path) const
+{
+	std::string path = key(file_effective_path);
+
+	std::lock_guard<std::mutex> lock(this->mtx);
+	return this->records.count(path) > 0;
+}
+
+bool StateStore::readHeader(const std::filesystem::path& file_effective_path,
+		size_t& file_size, size_t& file_chunk_size,
+		std::vector<uint8_t>& file_hash, uint8_t& file_hash_algo) const
+{
+	std::string path = key(file_effective_path);
+
+	std::lock_guard<std::mutex> lock(this->mtx);
+	auto it = this->records.find(path);
+	if (it == this->records.end()) {
+		return false;
+	}
+
+	file_size       = it->second.file_size;
+	file_chunk_size = it->second.chunk_size;
+	file_hash       = it->second.hash;
+	file_hash_algo  = it->second.hash_algo;
+	return true;
+}
+
+ChunkBitmapPtr StateStore::bitmap(
+		const std::filesystem::path& file_effective_path, bool deferred)
+{
+	std::string path = key(file_effective_path);
+
+	std::lock_guard<std::mutex> lock(this->mtx);
+	auto it = this->records.find(path);
+	if (it == this->records.end()) {
+		throw std::out_of_range("No state of " + path);
+	}
+
+	// The summaries are built once per record, shared by all its users
+	auto& record = it->second;
+	if (!record.bitmap) {
+		record.bitmap = std::make_shared<ChunkBitmap>(
+				this->index + record.offset + sizeof(RecordHeader),
+				n_chunks_of(record.file_size, record.chunk_size), deferred);
+	}
+	return record.bitmap;
+}
+
+uint8_t* StateStore::bits(const std::filesystem::path& file_effective_path)
+{
+	std::string path = key(file_effective_path);
+
+	std::lock_guard<std::mutex> lock(this->mtx);
+	auto it = this->records.find(path);
+	if (it == this->records.end()) {
+		throw std::out_of_range("No state of " + path);
+	}
+	return this->index + it->second.offset + sizeof(RecordHeader);
+}
+
+void StateStore::flush(const std::filesystem::path& file_effective_path)
+{
+	std::string path = key(file_effective_path);
+	size_t first, end;
+	{
+		std::lock_guard<std::mutex> lock(this->mtx);
+		auto it = this->records.find(path);
+		if (it == this->records.end()) {
+			return;
+		}
+		first = it->second.offset;
+		end   = it->second.offset + it->second.len;
+	}
+
+	// From the page of the record
+	size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	first -= first % page;
+	if (msync(this->index + first, end - first, MS_SYNC) != 0) {
+		throw errno_error(errno, "Failed flushing the state of " + path);
+	}
+}
+
+void StateStore::remove(const std::filesystem::path& file_effective_path)
+{
+	std::string path = key(file_effective_path);
+
+	std::lock_guard<std::mutex> lock(this->mtx);
+	auto it = this->records.find(path);
+	if (it == this->records.end()) {
+		return;
+	}
+
+	release(it->second);
+	this->records.erase(it);
+	append("- " + path, false);
+
+	// The lines adding and removing it
+	this->n_dead_lines += 2;
+	if (this->n_dead_lines > std::max(JOURNAL_MIN_DEAD_LINES,
+			this->records.size())) {
+		this->compact_cv.notify_one();
+	}
+}
+
+void StateStore::rename(const std::filesystem::path& file_effective_path,
+		const std::filesystem::path& new_file_effective_path)
+{
+	std::string path     = key(file_effective_path);
+	std::string new_path = key(new_file_effective_path);
+
+	std::lock_guard<std::mutex> lock(this->mtx);
+	auto it = this->records.find(path);
+	if (it == this->records.end() || path == new_path) {
+		return;
+	}
+
+	auto new_it = this->records.find(new_path);
+	if (new_it != this->records.end()) {
+		release(new_it->second);
+		this->records.erase(new_it);
+		this->n_dead_lines++;
+	}
+
+	// Added first: a line of the same record takes it from the path before
+	Record record = it->second;
+	this->records.erase(it);
+	append(recordLine(new_path, record), this->durable);
+	append("- " + path, false);
+	this->records[new_path] = record;
+	this->n_dead_lines += 2;
+}
+
+std::vector<StateStore::Transfer> StateStore::list() const
+{
+	std::vector<Transfer> transfers;
+
+	std::lock_guard<std::mutex> lock(this->mtx);
+	for (const auto& it : this->records) {
+		const auto& record = it.second;
+		size_t n_chunks = n_chunks_of(record.file_size, record.chunk_size);
+		const uint8_t* bits = this->index + record.offset +
+				sizeof(RecordHeader);
+
+		size_t n_received = 0;
+		for (size_t i = 0; i < (n_chunks + 7) / 8; i++) {
+			n_received += __builtin_popcount(bits[i]);
+		}
+
+		transfers.push_back({ it.first, record.file_size, record.chunk_size,
+				record.hash, record.hash_algo, n_chunks, n_received });
+	}
+	return transfers;
+}
+
+void StateStore::stop()
+{
+	{
+		std::lock_guard<std::mutex> lock(this->mtx);
+		this->stopped = true;
+	}
+	this->compact_cv.notify_all();
+
+	if (this->thread.joinable()) {
+		this->thread.join();
+	}
+}
+
+void StateStore::logStats() const
+{
+	std::lock_guard<std::mutex> lock(this->mtx);
+	std::cout << this->name << " | State store: " << this->records.size() <<
+			" transfers, index " << this->index_size / 1024 << " KB, " <<
+			this->n_compactions << " journal compactions" << std::endl;
+}
+
+std::string StateStore::key(
+		const std::filesystem::path& file_effective_path) const
+{
+	// Paths are stored up to the end of the line
+	std::string path = file_effective_path.lexically_relative(
+			this->base_path).generic_string();
+	if (path.empty() || path.find('\n') != std::string::npos) {
+		throw std::invalid_argument("Path not supported by the state store: " +
+				file_effective_path.generic_string());
+	}
+	return path;
+}
+
+bool StateStore::openIndex()
+{
+	int fd = open(this->index_file.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		throw errno_error(errno, "Failed to open the state index");
+	}
+	this->index_fd = std::make_shared<FdCache::Fd>(fd);
+
+	// Mapped once, with room to grow: the bitmaps never move
+	void* addr = mmap(nullptr, INDEX_MAX_SIZE, PROT_READ | PROT_WRITE,
+			MAP_SHARED, fd, 0);
+	if (addr == MAP_FAILED) {
+		throw errno_error(errno, "Failed to map the state index");
+	}
+	this->index = (uint8_t*)addr;
+
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		throw errno_error(errno, "Failed to open the state index");
+	}
+
+	auto header = (IndexHeader*)this->index;
+	if ((size_t)st.st_size >= INDEX_HEADER_SIZE &&
+			(size_t)st.st_size <= INDEX_MAX_SIZE &&
+			header->magic == INDEX_MAGIC && header->version == INDEX_VERSION) {
+		this->index_size  = st.st_size;
+		this->next_serial = std::max<uint64_t>(header->next_serial, 1U);
+		return true;
+	}
+
+	// Not valid (or new): initialized empty
+	int ret = ftruncate(fd, 0);
+	if (ret == 0) {
+		ret = posix_fallocate(fd, 0, INDEX_HEADER_SIZE);
+		errno = ret;
+	}
+	if (ret != 0) {
+		throw errno_error(errno, "Failed to initialize the state index");
+	}
+	header->magic       = INDEX_MAGIC;
+	header->version     = INDEX_VERSION;
+	header->next_serial = 1;
+	this->index_size    = INDEX_HEADER_SIZE;
+	return false;
+}
+
+void StateStore::load()
+{
+	std::map<size_t, std::string> owners;  ///! Path, by offset
+
+	std::ifstream is(this->journal_file, std::ios::in);
+	std::string line;
+	while (std::getline(is, line)) {
+		std::istringstream ss(line);
+		std::string op;
+		ss >> op;
+
+		if (op == "-" && ss.get() == ' ') {
+			std::string path;
+			std::getline(ss, path);
+			auto it = this->records.find(path);
+			if (it != this->records.end()) {
+				owners.erase(it->second.offset);
+				this->records.erase(it);
+			}
+			continue;
+		}
+
+		Record record;
+		unsigned hash_algo;
+		std::string hash_hex;
+		ss >> record.serial >> record.offset >> record.file_size >>
+				record.chunk_size >> hash_algo >> hash_hex;
+		if (op != "+" || ss.fail() || ss.get() != ' ' ||
+				hash_algo >= proto::HASH_ALGO_MAX || record.chunk_size == 0 ||
+				!fromHex(hash_hex, record.hash) ||
+				record.hash.size() != proto::HASH_SIZE) {
+			// Ignore corrupted (e.g. partially written) lines
+			continue;
+		}
+		record.hash_algo = hash_algo;
+		record.len = recordLength(record.file_size, record.chunk_size);
+
+		std::string path;
+		std::getline(ss, path);
+
+		// Replacing the record of the path, or taking the one of other path
+		// (i.e.: renamed)
+		auto it = this->records.find(path);
+		if (it != this->records.end()) {
+			owners.erase(it->second.offset);
+		}
+		auto owner = owners.find(record.offset);
+		if (owner != owners.end()) {
+			this->records.erase(owner->second);
+		}
+		owners[record.offset] = path;
+		this->records[path] = record;
+	}
+	is.close();
+
+	// Only the records matching their header in the index, and not
+	// overlapping a newer record, are kept
+	size_t end = INDEX_HEADER_SIZE;
+	std::string last_path;
+	for (const auto& owner : owners) {
+		auto it = this->records.find(owner.second);
+		const auto& record = it->second;
+		auto header = (const RecordHeader*)(this->index + record.offset);
+
+		bool valid = record.offset >= INDEX_HEADER_SIZE &&
+				record.offset % RECORD_ALIGN == 0 &&
+				record.offset + record.len <= this->index_size &&
+				header->magic == RECORD_MAGIC &&
+				header->serial == record.serial &&
+				header->file_size == record.file_size &&
+				header->chunk_size == record.chunk_size &&
+				header->hash_algo == record.hash_algo &&
+				std::equal(record.hash.begin(), record.hash.end(),
+						header->hash);
+		if (valid && record.offset < end) {
+			auto last = this->records.find(last_path);
+			if (last->second.serial > record.serial) {
+				valid = false;
+			} else {
+				this->records.erase(last);
+			}
+		}
+		if (!valid) {
+			this->records.erase(it);
+			continue;
+		}
+
+		end = record.offset + record.len;
+		last_path = owner.second;
+		this->next_serial = std::max(this->next_serial, record.serial + 1);
+	}
+
+	// The rest is free
+	size_t pos = INDEX_HEADER_SIZE;
+	std::map<size_t, size_t> used;
+	for (const auto& it : this->records) {
+		used[it.second.offset] = it.second.len;
+	}
+	for (const auto& it : used) {
+		if (it.first > pos) {
+			addFree(pos, it.first - pos);
+		}
+		pos = it.first + it.second;
+	}
+	if (this->index_size > pos) {
+		addFree(pos, this->index_size - pos);
+	}
+}
+
+void StateStore::compact(std::unique_lock<std::mutex>& lock)
+{
+	// The records, and the lines appended while they are written
+	std::string data;
+	for (const auto& it : this->records) {
+		data += recordLine(it.first, it.second) + "\n";
+	}
+	this->n_dead_lines = 0;
+	this->compacting   = true;
+	this->backlog.clear();
+	lock.unlock();
+
+	std::string tmp_file = this->journal_file.string() + ".tmp";
+	int fd = open(tmp_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+			0644);
+	int err = fd < 0 ? errno : 0;
+	if (fd >= 0 && (write(fd, data.data(), data.size()) != (ssize_t)data.size()
+			|| fdatasync(fd) != 0)) {
+		err = errno != 0 ? errno : EIO;
+	}
+
+	lock.lock();
+	this->compacting = false;
+	if (err == 0 && !this->backlog.empty() &&
+			(write(fd, this->backlog.data(), this->backlog.size()) !=
+			(ssize_t)this->backlog.size() || fdatasync(fd) != 0)) {
+		err = errno != 0 ? errno : EIO;
+	}
+	this->backlog.clear();
+	if (err == 0 &&
+			::rename(tmp_file.c_str(), this->journal_file.c_str()) != 0) {
+		err = errno;
+	}
+	if (err != 0) {
+		if (fd >= 0) {
+			(void)close(fd);
+		}
+		(void)unlink(tmp_file.c_str());
+		throw errno_error(err, "Failed to write the state journal");
+	}
+
+	// Appended from now on
+	if (this->journal_fd >= 0) {
+		(void)close(this->journal_fd);
+	}
+	(void)close(fd);
+	this->journal_fd = open(this->journal_file.c_str(),
+			O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+	if (this->journal_fd < 0) {
+		throw errno_error(errno, "Failed to open the state journal");
+	}
+
+	// The space retired no longer used is free, and the free space at the
+	// end truncated
+	for (auto it = this->retired.begin(); it != this->retired.end();) {
+		if (!it->bitmap.expired()) {
+			++it;
+			continue;
+		}
+		addFree(it->offset, it->len);
+		it = this->retired.erase(it);
+	}
+	if (!this->free_space.empty()) {
+		auto last = std::prev(this->free_space.end());
+		if (last->first + last->second == this->index_size &&
+				ftruncate(this->index_fd->fd, last->first) == 0) {
+			this->index_size = last->first;
+			this->free_space.erase(last);
+		}
+	}
+
+	this->n_compactions++;
+}
+
+size_t StateStore::allocate(size_t len)
+{
+	for (auto it = this->retired.begin(); it != this->retired.end();) {
+		if (!it->bitmap.expired()) {
+			++it;
+			continue;
+		}
+		addFree(it->offset, it->len);
+		it = this->retired.erase(it);
+	}
+
+	// The first space that fits
+	for (auto it = this->free_space.begin(); it != this->free_space.end();
+			++it) {
+		if (it->second < len) {
+			continue;
+		}
+		size_t offset = it->first;
+		size_t rest   = it->second - len;
+		this->free_space.erase(it);
+		if (rest > 0) {
+			this->free_space[offset + len] = rest;
+		}
+		return offset;
+	}
+
+	// Otherwise the index grows, with its space allocated (accessing the
+	// mapping of a file out of space raises SIGBUS)
+	size_t offset = this->index_size;
+	if (offset + len > INDEX_MAX_SIZE) {
+		throw errno_error(EFBIG, "Failed to grow the state index");
+	}
+	int ret = posix_fallocate(this->index_fd->fd, offset, len);
+	if (ret != 0) {
+		throw errno_error(ret, "Failed to grow the state index");
+	}
+	this->index_size += len;
+	return offset;
+}
+
+void StateStore::addFree(size_t offset, size_t len)
+{
+	auto next = this->free_space.lower_bound(offset);
+	if (next != this->free_space.end() && offset + len == next->first) {
+		len += next->second;
+		next = this->free_space.erase(next);
+	}
+	if (next != this->free_space.begin()) {
+		auto prev = std::prev(next);
+		if (prev->first + prev->second == offset) {
+			prev->second += len;
+			return;
+		}
+	}
+	this->free_space[offset] = len;
+}
+
+void StateStore::release(Record& record)
+{
+	// Not taken by the journal lines of the record when loaded
+	((RecordHeader*)(this->index + record.offset))->magic = 0;
+	this->retired.push_back({ record.offset, record.len, record.bitmap });
+}
+
+void StateStore::append(const std::string& line, bool sync)
+{
+	std::string data = line + "\n";
+	if (this->compacting) {
+		this->backlog += data;
+	}
+
+	// Not fatal: a lost line only makes the transfer start again
+	if (write(this->journal_fd, data.data(), data.size()) !=
+			(ssize_t)data.size()) {
+		return;
+	}
+	if (sync) {
+		(void)fdatasync(this->journal_fd);
+	}
+}
+
+void StateStore::run()
+{
+	std::unique_lock<std::mutex> lock(this->mtx);
+	while (true) {
+		this->compact_cv.wait(lock, [this]() {
+			return this->stopped || this->n_dead_lines >
+					std::max(JOURNAL_MIN_DEAD_LINES, this->records.size());
+		});
+		if (this->stopped) {
+			break;
+		}
+
+		try {
+			compact(lock);
+		} catch (const std::exception& e) {
+			std::cout << this->name << " | " << e.what() << std::endl;
+		}
+	}
+}
+
+size_t StateStore::recordLength(size_t file_size, size_t chunk_size)
+{
+	size_t len = sizeof(RecordHeader) +
+			(n_chunks_of(file_size, chunk_size) + 7) / 8;
+	return (len + RECORD_ALIGN - 1) / RECORD_ALIGN * RECORD_ALIGN;
+}
+
+std::string StateStore::recordLine(const std::string& path,
+		const Record& record)
+{
+	std::ostringstream ss;
+	ss << "+ " << record.serial << " " << record.offset << " " <<
+		record.file_size << " " << record.chunk_size << " " <<
+		(unsigned)record.hash_algo << " " << toHex(record.hash) << " " << path;
+	return ss.str();
+}
+
+} // file
+} // ft
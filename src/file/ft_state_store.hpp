@@ -0,0 +1,228 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+// Released under MIT License
+// Copyright (c) 2020 Hernan Perrone (hernan.perrone@gmail.com)
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef FT_FILE_STATESTORE_H
+#define FT_FILE_STATESTORE_H
+
+#include <condition_variable>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ft_utils.hpp"
+#include "file/ft_chunk_bitmap.hpp"
+#include "file/ft_fd_cache.hpp"
+
+namespace ft { namespace file {
+
+FT_DECLARE_CLASS(StateStore)
+
+/// @brief Single store of the state of the transfers of a storage root
+///
+/// Each transfer otherwise keeps a metadata file next to its data (see
+/// FileMetadata), so listing the transfers in progress walks the whole tree,
+/// and a metadata file per file in transfer weighs on the file system. The
+/// store keeps the state of all of them in two files in the storage root:
+///
+///   - ".state.index": the records of the transfers, mapped in memory. Each
+///     record has a header (serial, file length, chunk size, file hash and its
+///     algorithm) and the chunk_bitmap, set and cleared in the mapping as the
+///     one of a metadata file. The records are allocated in the file, the
+///     space of the removed ones reused once no longer in use.
+///   - ".state.journal": appended on each change with a line:
+///       + serial offset file_length chunk_size hash_algo hash_hex path
+///       - path
+///     to add (or replace) and remove the record of a path, relative to the
+///     storage root.
+///
+/// Loading the store replays the journal, and takes the records whose header
+/// in the index matches their line (so a line of a record not fully written,
+/// or of a record removed since, is dropped): recovering after a crash reads
+/// a line per transfer, and no metadata file. The journal is compacted when
+/// loaded, and by a thread once it has more removed lines than records: the
+/// records are written to a temporary file, renamed over the journal. The
+/// free space at the end of the index is truncated then.
+///
+/// The index is mapped once with room to grow, so the bitmaps never move. If
+/// durable, the journal is synced when a record is added, so the marks made
+/// durable in the index (see FileSync) are found after a power loss.
+class StateStore {
+public:
+	/// A transfer in the store
+	struct Transfer {
+		std::filesystem::path  path;        ///! Relative to the storage root
+		size_t                 file_size;
+		size_t                 chunk_size;
+		std::vector<uint8_t>   hash;
+		uint8_t                hash_algo;
+		size_t                 n_chunks;
+		size_t                 n_received;
+	};
+
+private:
+	struct Record {
+		uint64_t               serial;
+		size_t                 offset;
+		size_t                 len;
+		size_t                 file_size;
+		size_t                 chunk_size;
+		std::vector<uint8_t>   hash;
+		uint8_t                hash_algo;
+		ChunkBitmapPtr         bitmap;      ///! Built on first use
+	};
+
+	/// Space of a removed record, free once its bitmap is not used
+	struct Retired {
+		size_t                     offset;
+		size_t                     len;
+		std::weak_ptr<ChunkBitmap> bitmap;
+	};
+
+	const std::string                   name;
+	const std::filesystem::path         base_path;
+	const std::filesystem::path         index_file;
+	const std::filesystem::path         journal_file;
+	const bool                          durable;
+	const bool                          created;     ///! No journal before
+
+	mutable std::mutex                  mtx;
+	std::condition_variable             compact_cv;  ///! Signals compaction due
+	FdCache::FdPtr                      index_fd;
+	uint8_t*                            index;       ///! Mapping, with room
+	size_t                              index_size;  ///! Length of the file
+	int                                 journal_fd;  ///! Appended
+	std::map<std::string, Record>       records;     ///! By path
+	std::map<size_t, size_t>            free_space;  ///! Length, by offset
+	std::vector<Retired>                retired;
+	uint64_t                            next_serial;
+	size_t                              n_dead_lines; ///! Of the journal
+	bool                                compacting;
+	std::string                         backlog;     ///! Lines, if compacting
+	bool                                stopped;
+	std::thread                         thread;
+
+	// Stats
+	uint64_t                            n_compactions;
+
+public:
+	/// @brief Loads (or creates) the store of the storage root
+	///
+	/// Throws std::system_error if the store files cannot be opened.
+	StateStore(const std::string& name,
+			const std::filesystem::path& base_path, bool durable);
+
+	virtual ~StateStore();
+
+	/// @brief Adds the record of the file, unless it has one with the header
+	///
+	/// A record with another header is replaced, with no chunk marked.
+	void create(const std::filesystem::path& file_effective_path,
+			size_t file_size, size_t chunk_size,
+			const std::vector<uint8_t>& hash, uint8_t hash_algo);
+
+	/// @brief True if the file has a record
+	bool exists(const std::filesystem::path& file_effective_path) const;
+
+	/// @brief Reads the header of the record of the file, false if none
+	bool readHeader(const std::filesystem::path& file_effective_path,
+			size_t& file_size, size_t& file_chunk_size,
+			std::vector<uint8_t>& file_hash, uint8_t& file_hash_algo) const;
+
+	/// @brief The ChunkBitmap of the record of the file
+	///
+	/// Built on first use (deferred or not, see ChunkBitmap), shared after.
+	/// Throws std::out_of_range if the file has no record.
+	ChunkBitmapPtr bitmap(const std::filesystem::path& file_effective_path,
+			bool deferred);
+
+	/// @brief The bits of the bitmap of the record, in the mapping
+	///
+	/// Throws std::out_of_range if the file has no record.
+	uint8_t* bits(const std::filesystem::path& file_effective_path);
+
+	/// @brief Writes the record of the file to disk (msync)
+	///
+	/// Throws std::system_error on failure.
+	void flush(const std::filesystem::path& file_effective_path);
+
+	/// @brief Removes the record of the file, if any
+	void remove(const std::filesystem::path& file_effective_path);
+
+	/// @brief Moves the record of the file to be the one of another file
+	void rename(const std::filesystem::path& file_effective_path,
+			const std::filesystem::path& new_file_effective_path);
+
+	/// @brief The transfers in the store, with the chunks received
+	std::vector<Transfer> list() const;
+
+	/// @brief Descriptor of the index file (e.g. to sync it)
+	FdCache::FdPtr indexFd() const { return this->index_fd; }
+
+	/// @brief True if the store was created, not loaded
+	bool isNew() const { return this->created; }
+
+	/// @brief Stops the compaction thread
+	void stop();
+
+	/// @brief Logs the records, index length and compactions
+	void logStats() const;
+
+private:
+	/// @brief Path of the file relative to the storage root
+	std::string key(const std::filesystem::path& file_effective_path) const;
+
+	/// @brief Opens and maps the index, initialized if not valid
+	///
+	/// Returns false if initialized (i.e.: the journal is no longer valid).
+	bool openIndex();
+
+	/// @brief Replays the journal, keeping the records matching the index
+	void load();
+
+	/// @brief Writes the records to the journal, and truncates the index
+	///
+	/// Run by the thread with mtx locked (unlocked while writing), or when
+	/// loaded.
+	void compact(std::unique_lock<std::mutex>& lock);
+
+	/// @brief Space for a record of len bytes in the index
+	///
+	/// Must be called with mtx locked. Throws std::system_error if the index
+	/// cannot grow.
+	size_t allocate(size_t len);
+
+	/// @brief Adds the space to the free space, merged with its neighbours
+	///
+	/// Must be called with mtx locked.
+	void addFree(size_t offset, size_t len);
+
+	/// @brief Retires the space of the record, clearing its header
+	///
+	/// Must be called with mtx locked.
+	void release(Record& record);
+
+	/// @brief Appends a line to the journal
+	///
+	/// Must be called with mtx locked.
+	void append(const std::string& line, bool sync);
+
+	/// Thread loop
+	void run();
+
+	/// @brief Length of the record of a file
+	static size_t recordLength(size_t file_size, size_t chunk_size);
+
+	static std::string recordLine(const std::string& path,
+			const Record& record);
+};
+
+} // file
+} // ft
+#endif //FT_FILE_STATESTORE_H
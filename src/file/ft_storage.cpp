@@ -0,0 +1,743 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+// Released under MIT License
+// Copyright (c) 2020 Hernan Perrone (hernan.perrone@gmail.com)
+//////////////////////////////////////////////////////////////////////////////
+
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <stdexcept>
+#include <system_error>
+#include <cstring>
+
+// POSIX & LINUX headers
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+#include "file/ft_chunk_bitmap.hpp"
+#include "file/ft_file.hpp"
+#include "file/ft_file_meta.hpp"
+#include "file/ft_storage.hpp"
+
+namespace ft { namespace file {
+
+// Number of chunks read at once to hash the chunks received out of order
+static const size_t HASH_READ_CHUNKS = 256U;
+
+// Remote files kept open (the data and metadata files of a transfer are 2)
+static const size_t FD_CACHE_MAX_FDS = 128U;
+
+/// @brief Files in the file system
+///
+/// The data is the file itself, created with all its space, and written
+/// through the descriptors kept open by the FdCache (or by the IoEngine). The
+/// marks are the ones of its FileMetadata, and the state of the hash the one
+/// of its checkpoint file (see FileHasher), locked while hashing.
+class StoredFilePosix : public StoredFile {
+	const FdCachePtr  fd_cache;
+	FileMetadata      metadata;
+
+public:
+	StoredFilePosix(const std::filesystem::path& effective_path, size_t size,
+			size_t chunk_size, const std::vector<uint8_t>& hash,
+			proto::HashAlgo hash_algo, FdCachePtr fd_cache)
+	: StoredFile(effective_path, size, chunk_size, hash, hash_algo)
+	, fd_cache(fd_cache)
+	, metadata(effective_path, size, chunk_size, hash, hash_algo, fd_cache)
+	{}
+
+	virtual void create();
+
+	virtual bool exists() const {
+		return std::filesystem::exists(this->effective_path);
+	}
+
+	virtual void write(const uint8_t* data, size_t len, size_t offset) {
+		this->fd_cache->open(this->effective_path)->write(data, len, offset);
+	}
+
+	virtual void writeZeros(size_t offset, size_t len);
+
+	virtual size_t read(uint8_t* buf, size_t len, size_t offset) const {
+		return this->fd_cache->open(this->effective_path)->read(buf, len,
+				offset);
+	}
+
+	virtual FdCache::FdPtr fd() const {
+		return this->fd_cache->open(this->effective_path);
+	}
+
+	virtual void markChunks(size_t chunk_idx, size_t n_chunks, bool valid,
+			bool data_synced) {
+		this->metadata.markChunks(chunk_idx, n_chunks, valid, data_synced);
+	}
+
+	virtual size_t nextMissingChunk(size_t from_chunk_idx) const {
+		return this->metadata.nextMissingChunk(from_chunk_idx);
+	}
+
+	virtual size_t nextReceivedChunk(size_t from_chunk_idx) const {
+		return this->metadata.nextReceivedChunk(from_chunk_idx);
+	}
+
+	virtual void flush() { this->metadata.flush(); }
+
+	virtual bool updateHash(size_t chunk_idx, const uint8_t* data, size_t len,
+			std::vector<uint8_t>& hash_out);
+
+	virtual void rehash() {
+		std::filesystem::remove(
+				FileHasher::checkpointPath(this->effective_path));
+	}
+
+	virtual void remove();
+
+	virtual void restart();
+
+	virtual void rename(const std::filesystem::path& new_effective_path);
+
+	virtual void drop();
+};
+
+class StoragePosix : public Storage {
+	const FdCachePtr fd_cache;  ///! Of the files and their metadata files
+
+public:
+	StoragePosix() : fd_cache(std::make_shared<FdCache>(FD_CACHE_MAX_FDS)) {}
+
+	virtual Backend getBackend() const { return POSIX; }
+
+	virtual StoredFilePtr open(const std::filesystem::path& effective_path,
+			size_t size, size_t chunk_size, const std::vector<uint8_t>& hash,
+			proto::HashAlgo hash_algo) {
+		return std::make_shared<StoredFilePosix>(effective_path, size,
+				chunk_size, hash, hash_algo, this->fd_cache);
+	}
+
+	virtual bool readHeader(const std::filesystem::path& effective_path,
+			size_t& size, size_t& chunk_size, std::vector<uint8_t>& hash,
+			uint8_t& hash_algo) const {
+		FileMetadata::readHeader(effective_path, size, chunk_size, hash,
+				hash_algo);
+		return chunk_size > 0;
+	}
+
+	virtual bool isStored(const std::filesystem::path& effective_path,
+			size_t size) const {
+		std::error_code ec;
+		return !FileMetadata::exists(effective_path) &&
+				std::filesystem::file_size(effective_path, ec) == size && !ec;
+	}
+
+	virtual void save(const std::filesystem::path& effective_path,
+			const std::vector<uint8_t>& hash, proto::HashAlgo hash_algo,
+			const std::vector<uint8_t>& data);
+};
+
+/// A file stored in memory
+struct MemoryEntry {
+	size_t                       size;
+	size_t                       chunk_size;
+	std::vector<uint8_t>         hash;
+	uint8_t                      hash_algo;
+	size_t                       n_chunks;
+	std::vector<uint8_t>         bits;
+	ChunkBitmapPtr               bitmap;     ///! Of bits
+	std::vector<uint8_t>         data;       ///! Empty, if discarded
+	std::mutex                   hash_mtx;
+	std::unique_ptr<FileHasher>  hasher;     ///! Hashed so far, if any
+};
+typedef std::shared_ptr<MemoryEntry> MemoryEntryPtr;
+
+/// The files stored in memory, by effective path
+struct MemoryTable {
+	std::mutex                             mtx;
+	std::map<std::string, MemoryEntryPtr>  entries;
+};
+typedef std::shared_ptr<MemoryTable> MemoryTablePtr;
+
+/// @brief Files in memory, RAM or NONE
+///
+/// The entry of the file in the table of the storage has its header, its
+/// bitmap (not deferred, as nothing is synced) and its hasher, and its data
+/// unless discarded. The entry is taken by create(): the file keeps using it
+/// even if removed from the table (e.g. by another transfer of the path).
+class StoredFileMemory : public StoredFile {
+	const MemoryTablePtr  table;
+	const bool            keep_data;
+	MemoryEntryPtr        entry;
+
+public:
+	StoredFileMemory(const std::filesystem::path& effective_path, size_t size,
+			size_t chunk_size, const std::vector<uint8_t>& hash,
+			proto::HashAlgo hash_algo, MemoryTablePtr table, bool keep_data)
+	: StoredFile(effective_path, size, chunk_size, hash, hash_algo)
+	, table(table), keep_data(keep_data)
+	{}
+
+	virtual void create();
+
+	virtual bool exists() const {
+		std::lock_guard<std::mutex> lock(this->table->mtx);
+		return this->table->entries.count(
+				this->effective_path.generic_string()) > 0;
+	}
+
+	virtual void write(const uint8_t* data, size_t len, size_t offset);
+
+	virtual void writeZeros(size_t offset, size_t len);
+
+	virtual size_t read(uint8_t* buf, size_t len, size_t offset) const;
+
+	virtual FdCache::FdPtr fd() const { return FdCache::FdPtr(); }
+
+	virtual void markChunks(size_t chunk_idx, size_t n_chunks, bool valid,
+			bool data_synced);
+
+	virtual size_t nextMissingChunk(size_t from_chunk_idx) const {
+		return this->entry->bitmap->find(from_chunk_idx, false);
+	}
+
+	virtual size_t nextReceivedChunk(size_t from_chunk_idx) const {
+		return this->entry->bitmap->find(from_chunk_idx, true);
+	}
+
+	virtual void flush() {}
+
+	virtual bool updateHash(size_t chunk_idx, const uint8_t* data, size_t len,
+			std::vector<uint8_t>& hash_out);
+
+	virtual void verify(std::vector<uint8_t>& hash_out) const;
+
+	virtual void rehash();
+
+	virtual void remove();
+
+	virtual void restart();
+
+	virtual void rename(const std::filesystem::path& new_effective_path);
+
+	virtual void drop() {}
+
+	/// @brief New entry, with no chunk marked
+	///
+	/// Throws std::system_error (ENOMEM) if the data does not fit in memory.
+	static MemoryEntryPtr makeEntry(size_t size, size_t chunk_size,
+			const std::vector<uint8_t>& hash, uint8_t hash_algo,
+			bool keep_data);
+};
+
+class StorageMemory : public Storage {
+	const MemoryTablePtr  table;
+	const bool            keep_data;
+
+public:
+	StorageMemory(bool keep_data)
+	: table(std::make_shared<MemoryTable>()), keep_data(keep_data) {}
+
+	virtual Backend getBackend() const {
+		return this->keep_data ? RAM : NONE;
+	}
+
+	virtual StoredFilePtr open(const std::filesystem::path& effective_path,
+			size_t size, size_t chunk_size, const std::vector<uint8_t>& hash,
+			proto::HashAlgo hash_algo) {
+		return std::make_shared<StoredFileMemory>(effective_path, size,
+				chunk_size, hash, hash_algo, this->table, this->keep_data);
+	}
+
+	virtual bool readHeader(const std::filesystem::path& effective_path,
+			size_t& size, size_t& chunk_size, std::vector<uint8_t>& hash,
+			uint8_t& hash_algo) const;
+
+	/// The files in memory are only served from their entries
+	virtual bool isStored(const std::filesystem::path& effective_path,
+			size_t size) const {
+		return false;
+	}
+
+	virtual void save(const std::filesystem::path& effective_path,
+			const std::vector<uint8_t>& hash, proto::HashAlgo hash_algo,
+			const std::vector<uint8_t>& data);
+};
+
+/////////////////////////////////////////////////////////////////////////////
+// Module static functions
+
+static void create_file(const std::filesystem::path& file, size_t size);
+
+////////////////////////////////////////////////////////////////////////////
+// StoredFile class' members
+
+void StoredFile::verify(std::vector<uint8_t>& hash_out) const
+{
+	FileHasher hasher(this->hash_algo, this->size, this->hash);
+
+	// Whole chunks, as the tree hash requires
+	std::vector<uint8_t> buf(std::min(this->size,
+			HASH_READ_CHUNKS * this->chunk_size));
+	while (hasher.getOffset() < this->size) {
+		size_t n = read(buf.data(), std::min(buf.size(),
+				this->size - hasher.getOffset()), hasher.getOffset());
+		if (n == 0) {
+			break;
+		}
+		hasher.update(buf.data(), n);
+	}
+
+	hash_out.clear();
+	if (hasher.getOffset() == this->size) {
+		hasher.final(hash_out);
+	}
+}
+
+void StoredFile::hashMarked(FileHasher& hasher, size_t chunk_idx,
+		const uint8_t* data, size_t len) const
+{
+	if (data != nullptr && chunk_idx * this->chunk_size == hasher.getOffset()) {
+		hasher.update(data, len);
+	}
+
+	// Catch up with the chunks received out of order
+	std::vector<uint8_t> buf;
+	while (hasher.getOffset() < this->size) {
+		size_t offset = hasher.getOffset();
+		size_t next_missing = nextMissingChunk(offset / this->chunk_size);
+		size_t end = next_missing == UINT64_MAX ? this->size :
+				std::min(next_missing * this->chunk_size, this->size);
+		if (end <= offset) {
+			break;
+		}
+
+		buf.resize(std::min(end - offset, HASH_READ_CHUNKS * this->chunk_size));
+		buf.resize(read(buf.data(), buf.size(), offset));
+		if (buf.empty()) {
+			break;
+		}
+		hasher.update(buf.data(), buf.size());
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////
+// StoredFilePosix class' members
+
+void StoredFilePosix::create()
+{
+	std::filesystem::create_directories(this->effective_path.parent_path());
+
+	if (!std::filesystem::exists(this->effective_path)) {
+		// If file does not exists, create it with all its space, so running
+		// out of space is found before requesting the first chunk
+		create_file(this->effective_path, this->size);
+		this->fd_cache->forget(this->effective_path);
+	}
+
+	this->metadata.createIfNotExist();
+}
+
+void StoredFilePosix::writeZeros(size_t offset, size_t len)
+{
+	// The file may have other contents from a previous transfer, so the
+	// range is deallocated (keeping the file sparse), or zeroed otherwise
+	auto fd = this->fd_cache->open(this->effective_path);
+	if (fallocate(fd->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset,
+			len) != 0) {
+		std::vector<uint8_t> zeros(std::min(len, (size_t)1024U * 1024U));
+		for (size_t pos = 0; pos < len; pos += zeros.size()) {
+			size_t n = std::min(zeros.size(), len - pos);
+			fd->write(zeros.data(), n, offset + pos);
+		}
+	}
+}
+
+bool StoredFilePosix::updateHash(size_t chunk_idx, const uint8_t* data,
+		size_t len, std::vector<uint8_t>& hash_out)
+{
+	auto checkpoint_file = FileHasher::checkpointPath(this->effective_path);
+	int fd = ::open(checkpoint_file.c_str(), O_RDWR | O_CREAT | O_CLOEXEC,
+			0644);
+	if (fd < 0) {
+		throw std::system_error(
+				std::make_error_code(static_cast<std::errc>(errno)),
+				"Failed to open hash checkpoint");
+	}
+
+	// The chunks of a file may be saved by several threads at once
+	if (flock(fd, LOCK_EX) != 0) {
+		int err = errno;
+		(void)close(fd);
+		throw std::system_error(
+				std::make_error_code(static_cast<std::errc>(err)),
+				"Failed to lock hash checkpoint");
+	}
+
+	FileHasher hasher(this->hash_algo, this->size, this->hash);
+	(void)hasher.load(fd);
+	size_t start = hasher.getOffset();
+
+	try {
+		hashMarked(hasher, chunk_idx, data, len);
+		if (hasher.getOffset() != start) {
+			hasher.save(fd);
+		}
+	} catch (...) {
+		(void)close(fd);
+		throw;
+	}
+	(void)close(fd);
+
+	bool ret = hasher.getOffset() == this->size;
+	if (ret) {
+		hasher.final(hash_out);
+	}
+	return ret;
+}
+
+void StoredFilePosix::remove()
+{
+	this->fd_cache->forget(this->effective_path);
+	std::filesystem::remove(this->effective_path);
+	std::filesystem::remove(FileHasher::checkpointPath(this->effective_path));
+	this->metadata.remove();
+}
+
+void StoredFilePosix::restart()
+{
+	std::filesystem::remove(FileHasher::checkpointPath(this->effective_path));
+	this->metadata.remove();
+	this->metadata.createIfNotExist();
+}
+
+void StoredFilePosix::rename(const std::filesystem::path& new_effective_path)
+{
+	this->fd_cache->forget(this->effective_path);
+	this->fd_cache->forget(new_effective_path);
+	std::filesystem::rename(this->effective_path, new_effective_path);
+	this->metadata.rename(new_effective_path);
+
+	std::error_code ec;
+	std::filesystem::rename(FileHasher::checkpointPath(this->effective_path),
+			FileHasher::checkpointPath(new_effective_path), ec);
+}
+
+void StoredFilePosix::drop()
+{
+	auto fd = this->fd_cache->open(this->effective_path);
+
+	// Only clean pages are dropped, so the data is written (without flushing
+	// the file metadata, unlike fdatasync) before
+	if (sync_file_range(fd->fd, 0, 0, SYNC_FILE_RANGE_WAIT_BEFORE |
+			SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER) != 0) {
+		throw std::system_error(
+				std::make_error_code(static_cast<std::errc>(errno)),
+				"Failed writing " + this->effective_path.generic_string());
+	}
+	(void)posix_fadvise(fd->fd, 0, 0, POSIX_FADV_DONTNEED);
+	this->fd_cache->forget(this->effective_path);
+}
+
+////////////////////////////////////////////////////////////////////////////
+// StoragePosix class' members
+
+void StoragePosix::save(const std::filesystem::path& effective_path,
+		const std::vector<uint8_t>& hash, proto::HashAlgo hash_algo,
+		const std::vector<uint8_t>& data)
+{
+	// Write to a temporary file and move it in place, then drop the progress
+	// of any previous transfer
+	std::filesystem::create_directories(effective_path.parent_path());
+	auto tmp_path = effective_path.parent_path() /
+			(std::string(".") + effective_path.filename().generic_string() +
+			".tmp");
+
+	std::ofstream os(tmp_path, std::ios::out | std::ios::binary |
+			std::ios::trunc);
+	os.write((const char*)data.data(), data.size());
+	os.close();
+	if (!os) {
+		std::filesystem::remove(tmp_path);
+		throw std::runtime_error("Failed writing file: " +
+				(std::string)effective_path);
+	}
+
+	this->fd_cache->forget(effective_path);
+	this->fd_cache->forget(FileMetadata::metadataPath(effective_path));
+	std::filesystem::rename(tmp_path, effective_path);
+	FileMetadata::remove(effective_path);
+	std::filesystem::remove(FileHasher::checkpointPath(effective_path));
+}
+
+////////////////////////////////////////////////////////////////////////////
+// StoredFileMemory class' members
+
+void StoredFileMemory::create()
+{
+	std::lock_guard<std::mutex> lock(this->table->mtx);
+
+	auto& entry = this->table->entries[this->effective_path.generic_string()];
+	if (!entry || entry->size != this->size ||
+			entry->chunk_size != this->chunk_size || entry->hash != this->hash ||
+			entry->hash_algo != this->hash_algo) {
+		try {
+			entry = makeEntry(this->size, this->chunk_size, this->hash,
+					this->hash_algo, this->keep_data);
+		} catch (...) {
+			if (!entry) {
+				this->table->entries.erase(
+						this->effective_path.generic_string());
+			}
+			throw;
+		}
+	}
+	this->entry = entry;
+}
+
+void StoredFileMemory::write(const uint8_t* data, size_t len, size_t offset)
+{
+	if (offset > this->size || len > this->size - offset) {
+		throw std::system_error(std::make_error_code(std::errc::invalid_argument),
+				"Write past the end of " + this->effective_path.generic_string());
+	}
+	if (this->keep_data) {
+		memcpy(this->entry->data.data() + offset, data, len);
+	}
+}
+
+void StoredFileMemory::writeZeros(size_t offset, size_t len)
+{
+	if (this->keep_data && offset < this->size) {
+		memset(this->entry->data.data() + offset, 0,
+				std::min(len, this->size - offset));
+	}
+}
+
+size_t StoredFileMemory::read(uint8_t* buf, size_t len, size_t offset) const
+{
+	if (offset >= this->size) {
+		return 0;
+	}
+	len = std::min(len, this->size - offset);
+
+	// The data discarded is read as zeros
+	if (this->keep_data) {
+		memcpy(buf, this->entry->data.data() + offset, len);
+	} else {
+		memset(buf, 0, len);
+	}
+	return len;
+}
+
+void StoredFileMemory::markChunks(size_t chunk_idx, size_t n_chunks,
+		bool valid, bool data_synced)
+{
+	if (chunk_idx >= this->entry->n_chunks || n_chunks == 0) {
+		return;
+	}
+	n_chunks = std::min(n_chunks, this->entry->n_chunks - chunk_idx);
+	this->entry->bitmap->mark(chunk_idx, n_chunks, valid);
+}
+
+bool StoredFileMemory::updateHash(size_t chunk_idx, const uint8_t* data,
+		size_t len, std::vector<uint8_t>& hash_out)
+{
+	// Without the data, the file is taken as the one offered once received
+	if (!this->keep_data) {
+		bool ret = this->entry->bitmap->isFull();
+		if (ret) {
+			hash_out = this->hash;
+		}
+		return ret;
+	}
+
+	std::lock_guard<std::mutex> lock(this->entry->hash_mtx);
+	auto& hasher = this->entry->hasher;
+	if (!hasher) {
+		hasher.reset(new FileHasher(this->hash_algo, this->size, this->hash));
+	}
+	hashMarked(*hasher, chunk_idx, data, len);
+
+	bool ret = hasher->getOffset() == this->size;
+	if (ret) {
+		hasher->final(hash_out);
+	}
+	return ret;
+}
+
+void StoredFileMemory::verify(std::vector<uint8_t>& hash_out) const
+{
+	if (this->keep_data) {
+		StoredFile::verify(hash_out);
+		return;
+	}
+
+	hash_out.clear();
+	if (this->entry->bitmap->isFull()) {
+		hash_out = this->hash;
+	}
+}
+
+void StoredFileMemory::rehash()
+{
+	std::lock_guard<std::mutex> lock(this->entry->hash_mtx);
+	this->entry->hasher.reset();
+}
+
+void StoredFileMemory::remove()
+{
+	std::lock_guard<std::mutex> lock(this->table->mtx);
+	auto it = this->table->entries.find(this->effective_path.generic_string());
+	if (it != this->table->entries.end() && it->second == this->entry) {
+		this->table->entries.erase(it);
+	}
+}
+
+void StoredFileMemory::restart()
+{
+	this->entry->bitmap->mark(0, this->entry->n_chunks, false);
+	rehash();
+}
+
+void StoredFileMemory::rename(const std::filesystem::path& new_effective_path)
+{
+	std::lock_guard<std::mutex> lock(this->table->mtx);
+	this->table->entries[new_effective_path.generic_string()] = this->entry;
+	this->table->entries.erase(this->effective_path.generic_string());
+}
+
+MemoryEntryPtr StoredFileMemory::makeEntry(size_t size, size_t chunk_size,
+		const std::vector<uint8_t>& hash, uint8_t hash_algo, bool keep_data)
+{
+	auto entry = std::make_shared<MemoryEntry>();
+	entry->size = size;
+	entry->chunk_size = chunk_size;
+	entry->hash = hash;
+	entry->hash_algo = hash_algo;
+	entry->n_chunks = size / chunk_size + (size % chunk_size > 0 ? 1 : 0);
+	entry->bits.resize(entry->n_chunks / 8 + (entry->n_chunks % 8 > 0 ? 1 : 0));
+	entry->bitmap = std::make_shared<ChunkBitmap>(entry->bits.data(),
+			entry->n_chunks);
+
+	if (keep_data) {
+		try {
+			entry->data.resize(size);
+		} catch (const std::bad_alloc&) {
+			throw std::system_error(
+					std::make_error_code(std::errc::not_enough_memory),
+					"Failed allocating " + std::to_string(size) + " bytes");
+		}
+	}
+	return entry;
+}
+
+////////////////////////////////////////////////////////////////////////////
+// StorageMemory class' members
+
+bool StorageMemory::readHeader(const std::filesystem::path& effective_path,
+		size_t& size, size_t& chunk_size, std::vector<uint8_t>& hash,
+		uint8_t& hash_algo) const
+{
+	std::lock_guard<std::mutex> lock(this->table->mtx);
+	auto it = this->table->entries.find(effective_path.generic_string());
+	if (it == this->table->entries.end()) {
+		return false;
+	}
+
+	size = it->second->size;
+	chunk_size = it->second->chunk_size;
+	hash = it->second->hash;
+	hash_algo = it->second->hash_algo;
+	return true;
+}
+
+void StorageMemory::save(const std::filesystem::path& effective_path,
+		const std::vector<uint8_t>& hash, proto::HashAlgo hash_algo,
+		const std::vector<uint8_t>& data)
+{
+	// A complete entry, found as received if offered again
+	MemoryEntryPtr entry;
+	try {
+		entry = StoredFileMemory::makeEntry(data.size(), CHUNK_SIZE, hash,
+				hash_algo, false);
+		if (this->keep_data) {
+			entry->data = data;
+		}
+	} catch (const std::exception& e) {
+		throw std::runtime_error("Failed writing file: " +
+				(std::string)effective_path + ": " + e.what());
+	}
+	entry->bitmap->mark(0, entry->n_chunks, true);
+
+	std::lock_guard<std::mutex> lock(this->table->mtx);
+	this->table->entries[effective_path.generic_string()] = entry;
+}
+
+////////////////////////////////////////////////////////////////////////////
+// Storage class' members
+
+StoragePtr Storage::makeStorage(Backend backend)
+{
+	switch (backend) {
+	case POSIX:
+		return std::make_shared<StoragePosix>();
+	case RAM:
+		return std::make_shared<StorageMemory>(true);
+	case NONE:
+		return std::make_shared<StorageMemory>(false);
+	}
+	throw std::invalid_argument("Unsupported storage backend");
+}
+
+const char* Storage::backendName(Backend backend)
+{
+	switch (backend) {
+	case POSIX:
+		return "posix";
+	case RAM:
+		return "ram";
+	case NONE:
+		return "null";
+	}
+	return "unknown";
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Module static functions
+
+static void create_file(const std::filesystem::path& file, size_t size)
+{
+	int fd = ::open(file.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		throw std::system_error(
+				std::make_error_code(static_cast<std::errc>(errno)),
+				"Failed creating " + file.generic_string());
+	}
+
+	// The blocks are allocated at once (and as contiguous as the filesystem
+	// can) instead of as the chunks arrive, in any order. Filesystems without
+	// fallocate only get the file sized.
+	int err = 0;
+	if (size > 0 && fallocate(fd, 0, 0, size) != 0) {
+		err = errno;
+		if (err == EOPNOTSUPP || err == ENOSYS) {
+			err = ftruncate(fd, size) == 0 ? 0 : errno;
+		}
+	}
+	(void)close(fd);
+
+	if (err != 0) {
+		std::error_code ec;
+		std::filesystem::remove(file, ec);
+		throw std::system_error(
+				std::make_error_code(static_cast<std::errc>(err)),
+				"Failed allocating " + file.generic_string());
+	}
+}
+
+} // file
+} // ft
@@ -0,0 +1,174 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+// Released under MIT License
+// Copyright (c) 2020 Hernan Perrone (hernan.perrone@gmail.com)
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef FT_FILE_STORAGE_H
+#define FT_FILE_STORAGE_H
+
+#include <filesystem>
+#include <vector>
+
+#include "ft_utils.hpp"
+#include "file/ft_fd_cache.hpp"
+#include "file/ft_file_hasher.hpp"
+#include "protocol/ft_msg.hpp"
+
+namespace ft { namespace file {
+
+FT_DECLARE_CLASS(Storage)
+FT_DECLARE_CLASS(StoredFile)
+
+/// @brief The data and the progress of a file being received
+///
+/// Provides the operations of a remote file (see File) on its storage: the
+/// data of its chunks, the metadata (the header and the chunk bitmap, see
+/// FileMetadata) and the state of its hash (see FileHasher). Instances must be
+/// obtained from the Storage backend by Storage::open().
+///
+/// The chunks written are not marked by write(): they are marked by
+/// markChunks() once written, and hashed by updateHash().
+class StoredFile {
+protected:
+	const std::filesystem::path  effective_path;
+	const size_t                 size;
+	const size_t                 chunk_size;
+	const std::vector<uint8_t>   hash;
+	const proto::HashAlgo        hash_algo;
+
+	StoredFile(const std::filesystem::path& effective_path, size_t size,
+			size_t chunk_size, const std::vector<uint8_t>& hash,
+			proto::HashAlgo hash_algo)
+	: effective_path(effective_path), size(size), chunk_size(chunk_size)
+	, hash(hash), hash_algo(hash_algo) {}
+
+public:
+	virtual ~StoredFile() {}
+
+	/// @brief Creates the data, with all its space, and the metadata
+	///
+	/// Only the ones not existing are created (metadata of other header is
+	/// created again). Throws std::system_error if the data does not fit
+	/// (e.g. ENOSPC).
+	virtual void create() = 0;
+
+	/// @brief True if the data exists
+	virtual bool exists() const = 0;
+
+	/// @brief Writes len bytes of chunks at offset
+	///
+	/// Throws std::system_error on failure.
+	virtual void write(const uint8_t* data, size_t len, size_t offset) = 0;
+
+	/// @brief Writes len bytes of zeros at offset (a hole, if possible)
+	virtual void writeZeros(size_t offset, size_t len) = 0;
+
+	/// @brief Reads up to len bytes at offset, less only at the end
+	virtual size_t read(uint8_t* buf, size_t len, size_t offset) const = 0;
+
+	/// @brief Descriptor of the data, to write it through the IoEngine
+	///
+	/// nullptr if the data is not stored in a file.
+	virtual FdCache::FdPtr fd() const = 0;
+
+	/// @brief Sets (or clears, if not valid) n_chunks chunks from chunk_idx
+	///
+	/// See FileMetadata::markChunks().
+	virtual void markChunks(size_t chunk_idx, size_t n_chunks, bool valid,
+			bool data_synced = false) = 0;
+
+	/// @brief First chunk from from_chunk_idx not marked, UINT64_MAX if none
+	virtual size_t nextMissingChunk(size_t from_chunk_idx) const = 0;
+
+	/// @brief First chunk from from_chunk_idx marked, UINT64_MAX if none
+	virtual size_t nextReceivedChunk(size_t from_chunk_idx) const = 0;
+
+	/// @brief Writes the marks to disk, if stored in disk
+	virtual void flush() = 0;
+
+	/// @brief Hashes the chunks marked in order since the last time
+	///
+	/// data is the data of the chunks written from chunk_idx, if any. Returns
+	/// true, and the hash in hash_out, once all the file is hashed.
+	virtual bool updateHash(size_t chunk_idx, const uint8_t* data, size_t len,
+			std::vector<uint8_t>& hash_out) = 0;
+
+	/// @brief Hashes all the data again, read from the storage
+	virtual void verify(std::vector<uint8_t>& hash_out) const;
+
+	/// @brief Forgets the state of the hash, so the data is hashed again
+	virtual void rehash() = 0;
+
+	/// @brief Removes the data, the metadata and the state of the hash
+	virtual void remove() = 0;
+
+	/// @brief Forgets the chunks marked and the state of the hash
+	virtual void restart() = 0;
+
+	/// @brief Moves it all to be the one of other file
+	virtual void rename(const std::filesystem::path& new_effective_path) = 0;
+
+	/// @brief Writes the data to disk and drops it from the page cache
+	virtual void drop() = 0;
+
+protected:
+	/// @brief Hashes the chunks marked in order from the offset of the hasher
+	///
+	/// data is as given to updateHash(), hashed instead of read if it follows
+	/// the data hashed.
+	void hashMarked(FileHasher& hasher, size_t chunk_idx, const uint8_t* data,
+			size_t len) const;
+};
+
+/// @brief Backend storing the files received
+///
+/// The server stores the files received in a Storage, so the network and
+/// the protocol can be measured (or tested) apart from the disk:
+///   - POSIX: the files in the file system, with their metadata files (or
+///     StateStore) and hash checkpoints, written through the IoEngine if any.
+///   - RAM: the data and the metadata in memory, lost on exit.
+///   - NONE: the data is discarded, only the chunks received are tracked (in
+///     memory), and the files are taken as matching their hash once all
+///     their chunks are received.
+class Storage {
+public:
+	enum Backend { POSIX, RAM, NONE };
+
+	virtual ~Storage() {}
+
+	virtual Backend getBackend() const = 0;
+
+	/// @brief The file stored at the effective path, with the given header
+	///
+	/// Nothing is created until StoredFile::create().
+	virtual StoredFilePtr open(const std::filesystem::path& effective_path,
+			size_t size, size_t chunk_size, const std::vector<uint8_t>& hash,
+			proto::HashAlgo hash_algo) = 0;
+
+	/// @brief Reads the header of the metadata of the file, false if none
+	virtual bool readHeader(const std::filesystem::path& effective_path,
+			size_t& size, size_t& chunk_size, std::vector<uint8_t>& hash,
+			uint8_t& hash_algo) const = 0;
+
+	/// @brief True if the whole file is stored, of the size, not in transfer
+	virtual bool isStored(const std::filesystem::path& effective_path,
+			size_t size) const = 0;
+
+	/// @brief Stores a whole file at once, replacing any transfer of it
+	///
+	/// Throws std::runtime_error on failure.
+	virtual void save(const std::filesystem::path& effective_path,
+			const std::vector<uint8_t>& hash, proto::HashAlgo hash_algo,
+			const std::vector<uint8_t>& data) = 0;
+
+	/// @brief Storage of the backend
+	static StoragePtr makeStorage(Backend backend);
+
+	/// @brief Name of the backend
+	static const char* backendName(Backend backend);
+};
+
+} // file
+} // ft
+#endif //FT_FILE_STORAGE_H
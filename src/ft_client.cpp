@@ -4,10 +4,14 @@
 // Copyright (c) 2020 Hernan Perrone (hernan.perrone@gmail.com)
 //////////////////////////////////////////////////////////////////////////////
 
+#include <algorithm>
+#include <cstring>
 #include <filesystem>
 #include <iostream>
 #include <string>
 #include <map>
+#include <set>
+#include <vector>
 #include <unistd.h>
 
 #include <boost/uuid/uuid.hpp>
@@ -20,15 +24,23 @@
 #include "loop/ft_signal.hpp"
 #include "netwrk/ft_conn.hpp"
 #include "file/ft_file.hpp"
+#include "file/ft_file_cdc.hpp"
 #include "request/ft_req_hndlr.hpp"
 #include "request/ft_req.hpp"
 
 static const std::filesystem::path CLIENT_UUID_FILE("/.ft_client/.uuid");
+static const std::filesystem::path CLIENT_HASH_CACHE_FILE(
+		"/.ft_client/.hash_cache");
 
 static const uint16_t DEFAULT_PORT = 4444;
 
 static void show_usage(std::ostream& out, const char* app);
 
+// Names of the hash algorithms, by proto::HashAlgo
+static const char* HASH_ALGO_NAMES[ft::proto::HASH_ALGO_MAX] = {
+	"blake2b", "tree", "blake2bp"
+};
+
 FT_DECLARE_CLASS(ClientRequestHandler)
 
 
@@ -45,8 +57,10 @@ FT_DECLARE_CLASS(ClientRequestHandler)
 /// behavior.
 class ClientRequestHandler : public virtual ft::request::RequestHandler {
 private:
-	const boost::uuids::uuid                 client_uuid;
-	std::map<std::string, ft::file::FilePtr> client_files;
+	const boost::uuids::uuid                      client_uuid;
+	std::map<std::string, ft::file::FilePtr>      client_files;
+	std::map<std::string, ft::file::FileDeltaPtr> client_deltas;
+	std::map<std::string, ft::file::FileCdcPtr>   client_cdcs;
 
 public:
 	ClientRequestHandler(const boost::uuids::uuid client_uuid)
@@ -62,8 +76,24 @@ public:
 	/// @brief Action to offer files to be uploaded to the server.
 	virtual void offer(ft::netwrk::ConnectionPtr conn, ft::file::FilePtr file);
 
+	/// @brief Action to offer several files at once in a FILE MANIFEST
+	virtual void offer(ft::netwrk::ConnectionPtr conn,
+			const std::vector<ft::file::FilePtr>& files);
+
 	/// @brief Check if all the uploads are completed
 	bool uploadsCompleted() const;
+
+private:
+	/// @brief Drops the files already complete in the server from the offer
+	void handleManifestStatus(ft::proto::MessagePtr msg);
+
+	/// @brief Collects the signatures of a delta transfer
+	ft::proto::MessagePtr handleDeltaSigs(ft::proto::MessagePtr msg,
+			ft::file::FilePtr file);
+
+	/// @brief Answers the recipe and chunk requests of a deduplicated transfer
+	ft::proto::MessagePtr handleCdcReq(ft::proto::MessagePtr msg,
+			ft::file::FilePtr file);
 };
 
 
@@ -74,13 +104,14 @@ int main(int argc, char* argv[]) {
 	std::string           host("localhost");
 	uint16_t              port        = DEFAULT_PORT;
 	boost::uuids::uuid    client_uuid = ft::getClientUUID(CLIENT_UUID_FILE);
-	std::filesystem::path file; // Mandatory to be provided in command line
+	ft::proto::HashAlgo   hash_algo   = ft::proto::HASH_ALGO_BLAKE2B;
+	std::vector<std::filesystem::path> files; // At least one is mandatory
 
 
 	// -- Parse command line arguments and update parameters -- //
 
 	int opt;
-	while ((opt = getopt(argc, argv, "hd:p:u:")) != -1) {
+	while ((opt = getopt(argc, argv, "hd:p:u:ta:")) != -1) {
 		switch (opt) {
 		case 'h': show_usage(std::cout, argv[0]); exit(0); break;
 		case 'd': host = optarg;                           break;
@@ -88,6 +119,21 @@ int main(int argc, char* argv[]) {
 		case 'u':
 			client_uuid = boost::lexical_cast<boost::uuids::uuid>(optarg);
 			break;
+		case 't': hash_algo = ft::proto::HASH_ALGO_BLAKE2B_TREE; break;
+		case 'a':
+			hash_algo = ft::proto::HASH_ALGO_MAX;
+			for (int i = 0; i < ft::proto::HASH_ALGO_MAX; i++) {
+				if (strcmp(optarg, HASH_ALGO_NAMES[i]) == 0) {
+					hash_algo = (ft::proto::HashAlgo)i;
+				}
+			}
+			if (hash_algo == ft::proto::HASH_ALGO_MAX) {
+				std::cerr << "ERROR: Unknown hash algorithm '" << optarg <<
+						"'" << std::endl;
+				show_usage(std::cerr, argv[0]);
+				exit(1);
+			}
+			break;
 		default:  show_usage(std::cerr, argv[0]); exit(1); break;
 		}
 	}
@@ -98,17 +144,34 @@ int main(int argc, char* argv[]) {
 		exit(1);
 	}
 
-	file = std::filesystem::path(argv[optind]);
-	if (!std::filesystem::exists(file)) {
-		std::cerr << "ERROR: File '" << file << "' does not exist." << std::endl;
-		show_usage(std::cerr, argv[0]);
-		exit(1);
+	std::set<std::string> file_names;
+	for (int i = optind; i < argc; i++) {
+		std::filesystem::path file(argv[i]);
+		if (!std::filesystem::exists(file)) {
+			std::cerr << "ERROR: File '" << file << "' does not exist." <<
+					std::endl;
+			show_usage(std::cerr, argv[0]);
+			exit(1);
+		}
+
+		// Files are stored in the server by name, so names must be unique
+		if (!file_names.insert(file.filename().generic_string()).second) {
+			std::cerr << "ERROR: File name '" << file.filename() <<
+					"' is repeated." << std::endl;
+			exit(1);
+		}
+
+		files.push_back(file);
 	}
 
 	std::cout << "FT CLIENT | Starting..." << std::endl;
 	std::cout << "FT CLIENT |   UUID:   " << to_string(client_uuid) << std::endl;
 	std::cout << "FT CLIENT |   SERVER: " << host << ":" << port << std::endl;
-	std::cout << "FT CLIENT |   FILE:   " << file << std::endl;
+	std::cout << "FT CLIENT |   HASH:   " << HASH_ALGO_NAMES[hash_algo] <<
+			std::endl;
+	for (const auto& file : files) {
+		std::cout << "FT CLIENT |   FILE:   " << file << std::endl;
+	}
 
 	// -- Initialize all the components handling the client -- //
 
@@ -125,8 +188,22 @@ int main(int argc, char* argv[]) {
 	// The ClientRequestHandler to control the client behavior
 	auto client_req_hndlr = std::make_shared<ClientRequestHandler>(client_uuid);
 
-	// The file to upload
-	auto localFile  = ft::file::File::makeLocalFile(file);
+	// The files to upload, hashed unless the hash is in the cache
+	auto hash_cache = std::make_shared<ft::file::HashCache>(
+			CLIENT_HASH_CACHE_FILE);
+	ft::file::File::setHashCache(hash_cache);
+
+	std::vector<ft::file::FilePtr> local_files;
+	for (const auto& file : files) {
+		local_files.push_back(ft::file::File::makeLocalFile(file, hash_algo));
+	}
+
+	try {
+		hash_cache->save();
+	} catch (std::exception& e) {
+		std::cerr << "FT CLIENT | WARNING: Hash cache not saved: " << e.what()
+			<< std::endl;
+	}
 
 	// The RequestBroker, using the ClientRequestHandler as flow control and 1
 	// single working thread
@@ -149,9 +226,13 @@ int main(int argc, char* argv[]) {
 	// -- Make the ClientRequestHandler to offer the file -- //
 
 
-	// Start the interaction by offering a file to the server
-	client_req_hndlr->offer(conn, localFile);
-	// Optionally, more files can be offered
+	// Start the interaction by offering a file to the server, or all of them
+	// at once in a manifest
+	if (local_files.size() == 1) {
+		client_req_hndlr->offer(conn, local_files.front());
+	} else {
+		client_req_hndlr->offer(conn, local_files);
+	}
 
 	// -- Main Loop -- //
 
@@ -162,6 +243,8 @@ int main(int argc, char* argv[]) {
 			poll_group->pollAndHandle() &&
 			!signals->receivedTermSignal());
 
+	std::cout << "FT CLIENT | Messages per write: " <<
+			ft::netwrk::Connection::getTotalMsgsPerWrite() << std::endl;
 	std::cout << "FT CLIENT | Terminating..." << std::endl;
 }
 
@@ -172,12 +255,15 @@ static void show_usage(std::ostream& out, const char* app)
 
 	out
 		<< "Usage: " << app_name.filename().generic_string()
-					 << "<option(s)> FILE" << std::endl
+					 << "<option(s)> FILE [FILE...]" << std::endl
 		<< "Options:" << std::endl
 		<< "\t-h\t\tShow this help message" << std::endl
 		<< "\t-d SERVER\t\tDestination server" << std::endl
 		<< "\t-p PORT\t\tDestination port" << std::endl
-		<< "\t-u UUID\t\tClient UUID" << std::endl;
+		<< "\t-u UUID\t\tClient UUID" << std::endl
+		<< "\t-t\t\tHash the files as a tree of their chunks" << std::endl
+		<< "\t-a ALGO\t\tHash algorithm: blake2b (default), tree (as -t) or"
+				" blake2bp" << std::endl;
 }
 
 
@@ -193,6 +279,12 @@ void ClientRequestHandler::handleRequest(ft::request::RequestPtr req)
 		return;
 	}
 
+	// The status of the files in a manifest is not for a single file
+	if (msg->msg_type == ft::proto::MSGTYPE_FILE_MANIFEST_STATUS) {
+		handleManifestStatus(msg);
+		return;
+	}
+
 	// Check if the file in the message is one being offered by the client
 	auto it = this->client_files.find(msg->file_name);
 	if (it == this->client_files.end()) {
@@ -204,15 +296,53 @@ void ClientRequestHandler::handleRequest(ft::request::RequestPtr req)
 
 	ft::proto::MessagePtr response;
 
+	auto delta = this->client_deltas[msg->file_name];
+
 	switch(msg->msg_type) {
 	case ft::proto::MSGTYPE_FILE_CHUNK_REQ:
-		// Send the requested file chunk
-		response = ft::proto::MessageFactory::buildMsgChunkData(msg->seq_number,
-				this ->client_uuid, file, msg->chunk_req.chunk_idx_first);
+		if (delta && delta->isComputed()) {
+			// Delta transfer: send the instructions to rebuild the chunk
+			response = ft::proto::MessageFactory::buildMsgDeltaData(
+					msg->seq_number, this->client_uuid, file, delta,
+					msg->chunk_req.chunk_idx_first);
+		} else {
+			// Send the requested range of chunks, up to the maximum that fits
+			// in a message. The server takes a shorter reply as our limit.
+			size_t n_chunks = 1;
+			if (msg->chunk_req.chunk_idx_last > msg->chunk_req.chunk_idx_first) {
+				n_chunks = std::min((size_t)(msg->chunk_req.chunk_idx_last -
+						msg->chunk_req.chunk_idx_first + 1),
+						ft::proto::CHUNK_RANGE_MAX_CHUNKS);
+			}
+			response = ft::proto::MessageFactory::buildMsgChunkData(
+					msg->seq_number, this ->client_uuid, file,
+					msg->chunk_req.chunk_idx_first, n_chunks);
+		}
+		break;
+	case ft::proto::MSGTYPE_FILE_DELTA_SIGS:
+		response = handleDeltaSigs(msg, file);
+		break;
+	case ft::proto::MSGTYPE_FILE_CDC_REQ:
+		response = handleCdcReq(msg, file);
 		break;
 	case ft::proto::MSGTYPE_FILE_COMPLETE:
-		// The server already have the file remove from the offered file lists
+		// The server already have the file remove from the offered file lists,
+		// and it is not read again
+		file->dropCache();
 		this->client_files.erase(msg->file_name);
+		this->client_deltas.erase(msg->file_name);
+		this->client_cdcs.erase(msg->file_name);
+		break;
+	case ft::proto::MSGTYPE_FILE_ERROR:
+		// The server cannot receive the file, so it is given up
+		std::cout << "FT CLIENT | Server cannot receive " << msg->file_name
+			<< ": " << (msg->error.code == ft::proto::FILE_ERROR_NO_SPACE ?
+				"no space left" : "I/O error") << std::endl;
+		file->dropCache();
+		this->client_files.erase(msg->file_name);
+		this->client_deltas.erase(msg->file_name);
+		this->client_cdcs.erase(msg->file_name);
+		break;
 	default: 
 		break; // Just ignore unsupported messages
 	}
@@ -242,6 +372,99 @@ void ClientRequestHandler::offer(ft::netwrk::ConnectionPtr conn,
 	conn->sendBuffer(buf);
 }
 
+void ClientRequestHandler::offer(ft::netwrk::ConnectionPtr conn,
+		const std::vector<ft::file::FilePtr>& files)
+{
+	// All the files must be in the map before the server replies
+	for (const auto& file : files) {
+		this->client_files.insert({file->path.filename().generic_string(),
+				file});
+	}
+
+	// The files are offered in as many FILE MANIFEST messages as needed
+	for (size_t idx = 0; idx < files.size(); ) {
+		std::vector<uint8_t> buf;
+		auto msg = ft::proto::MessageFactory::buildMsgManifest(1,
+				this->client_uuid, files, idx);
+		msg->serialize(buf);
+		conn->sendBuffer(buf);
+
+		idx += msg->manifest.files.size();
+	}
+}
+
+void ClientRequestHandler::handleManifestStatus(ft::proto::MessagePtr msg)
+{
+	for (const auto& file_status : msg->manifest_status.files) {
+		auto it = this->client_files.find(file_status.file_name);
+		if (it == this->client_files.end()) {
+			continue;
+		}
+
+		if (file_status.status == ft::proto::MANIFEST_FILE_MISSING) {
+			std::cout << "FT CLIENT | To upload: " << file_status.file_name
+				<< " - " << file_status.n_missing << " of "
+				<< it->second->getNumOfChunks() << " chunks missing"
+				<< std::endl;
+		} else {
+			std::cout << "FT CLIENT | "
+				<< (file_status.status == ft::proto::MANIFEST_FILE_COMPLETE ?
+					"Already uploaded: " : "Rejected by the server: ")
+				<< file_status.file_name << std::endl;
+			it->second->dropCache();
+			this->client_files.erase(it);
+		}
+	}
+}
+
+ft::proto::MessagePtr ClientRequestHandler::handleDeltaSigs(
+		ft::proto::MessagePtr msg, ft::file::FilePtr file)
+{
+	// The server sends the signatures of the stored version of the file
+	auto& delta = this->client_deltas[msg->file_name];
+	if (!delta || msg->delta_sigs.block_first == 0) {
+		delta = std::make_shared<ft::file::FileDelta>(file,
+				msg->delta_sigs.basis_size, msg->delta_sigs.block_size);
+	}
+
+	delta->addSignatures(msg->delta_sigs.block_first, msg->delta_sigs.blocks);
+
+	if (delta->getNextMissingSignature() == delta->getNumOfBlocks() &&
+			!delta->isComputed()) {
+		delta->compute();
+		std::cout << "FT CLIENT | Delta transfer: " << msg->file_name << " - "
+			<< delta->getCopiedBytes() << " of " << file->size
+			<< " bytes already in the server" << std::endl;
+	}
+
+	// Request the next signatures, or to go on once all are received
+	return ft::proto::MessageFactory::buildMsgDeltaSigsReq(msg->seq_number,
+			this->client_uuid, file, delta);
+}
+
+ft::proto::MessagePtr ClientRequestHandler::handleCdcReq(
+		ft::proto::MessagePtr msg, ft::file::FilePtr file)
+{
+	// The server stores files deduplicated, chunk the file on first request
+	auto& cdc = this->client_cdcs[msg->file_name];
+	if (!cdc) {
+		cdc = std::make_shared<ft::file::FileCdc>(file);
+		std::cout << "FT CLIENT | Deduplicated transfer: " << msg->file_name
+			<< " - " << cdc->getNumOfEntries() << " content defined chunks"
+			<< std::endl;
+	}
+
+	if (msg->cdc_req.what == ft::proto::CDC_REQ_RECIPE) {
+		return ft::proto::MessageFactory::buildMsgCdcRecipe(msg->seq_number,
+				this->client_uuid, file, cdc, msg->cdc_req.idx);
+	} else if (msg->cdc_req.what == ft::proto::CDC_REQ_CHUNK) {
+		return ft::proto::MessageFactory::buildMsgCdcData(msg->seq_number,
+				this->client_uuid, file, cdc, msg->cdc_req.idx);
+	}
+
+	return ft::proto::MessagePtr();
+}
+
 bool ClientRequestHandler::uploadsCompleted() const {
 	// True if all the files have been removed from the map
 	return this->client_files.empty();
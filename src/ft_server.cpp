@@ -4,17 +4,38 @@
 // Copyright (c) 2020 Hernan Perrone (hernan.perrone@gmail.com)
 //////////////////////////////////////////////////////////////////////////////
 
+#include <algorithm>
+#include <deque>
 #include <iostream>
+#include <map>
+#include <mutex>
+#include <set>
+#include <system_error>
+#include <unistd.h>
 
 #include <boost/uuid/uuid.hpp>
 #include <boost/uuid/uuid_io.hpp>
 
+#include "file/ft_chunk_store.hpp"
 #include "file/ft_file.hpp"
+#include "file/ft_file_meta.hpp"
+#include "file/ft_file_sync.hpp"
+#include "file/ft_io_engine.hpp"
+#include "file/ft_state_store.hpp"
+#include "file/ft_storage.hpp"
+#include "file/ft_catalog.hpp"
+#include "file/ft_file_cdc.hpp"
+#include "file/ft_file_delta.hpp"
+#include "file/ft_file_tree.hpp"
 #include "loop/ft_poll_grp.hpp"
 #include "loop/ft_signal.hpp"
 #include "netwrk/ft_conn_listener.hpp"
 #include "netwrk/ft_conn.hpp"
+#include "protocol/ft_crc32c.hpp"
 #include "protocol/ft_msg_fctry.hpp"
+#include "request/ft_chunk_tuner.hpp"
+#include "request/ft_hash_pool.hpp"
+#include "request/ft_transfer_table.hpp"
 #include "request/ft_req_hndlr.hpp"
 #include "request/ft_req.hpp"
 
@@ -24,8 +45,33 @@ static const uint16_t MAX_REQ_BROKER_THREADS = 16;
 
 static const uint16_t DEFAULT_PORT           = 4444;
 
+// Files of a FILE MANIFEST being transferred at the same time
+static const size_t   MAX_MANIFEST_ACTIVE_FILES = 8;
+
+// Threads verifying the received files, and files waiting for them
+static const size_t   HASH_POOL_THREADS      = 2;
+static const size_t   HASH_POOL_MAX_QUEUED   = 64;
+
+// Files in transfer kept loaded, and time they are kept while not used
+static const size_t   TRANSFER_TABLE_MAX_FILES = 256;
+static const std::chrono::seconds TRANSFER_IDLE_TIMEOUT(60);
+
+// Time without chunks after which the chunks kept by a file are written
+static const std::chrono::milliseconds TRANSFER_FLUSH_IDLE(1000);
+
+// Interval of the periodic durability mode, if not given
+static const unsigned SYNC_DEFAULT_INTERVAL_MS = 1000;
+
+// Writes of the chunks received in flight and queued per device, and threads
+// writing them when io_uring is not available
+static const size_t   IO_ENGINE_DEPTH        = 8;
+static const size_t   IO_ENGINE_MAX_QUEUED   = 32;
+static const size_t   IO_ENGINE_THREADS      = 4;
+
 static const std::filesystem::path SERVER_BASE_PATH("/in");
 
+static void show_usage(std::ostream& out, const char* app);
+
 FT_DECLARE_CLASS(ServerRequestHandler)
 
 /// @brief RequestHandler specialization for server behavior
@@ -39,27 +85,293 @@ FT_DECLARE_CLASS(ServerRequestHandler)
 /// It can be considered as an usage of inversion of control or strategy design
 /// patterns since, when injected into the RequestBroker, it controls its
 /// behavior.
+///
+/// If a ChunkStore is provided, files are uploaded in deduplicated storage
+/// mode: the client offers the recipe of content defined chunks of the file and
+/// only the chunks not found in the store are transferred.
+///
+/// Files offered in a FILE MANIFEST are transferred over the same connection,
+/// up to MAX_MANIFEST_ACTIVE_FILES at the same time. Whenever one of them is
+/// completed, the transfer of the next one in the manifest is started.
+///
+/// Once all the chunks of a file are received, its hash is verified by the
+/// HashPool, so the RequestBroker workers go on with other requests. The reply
+/// (FILE COMPLETE, or the request to restart the transfer) is sent once the
+/// file is verified.
+///
+/// If a Catalog is provided (the files are stored in the file system), the
+/// files completed are added to it, so offering them again is answered with
+/// FILE COMPLETE without reading them.
+///
+/// The files receiving chunks are kept in the TransferTable, so they are not
+/// loaded again for each FILE CHUNK DATA (or FILE DELTA and FILE CDC message),
+/// and the chunks they keep in memory are written at once. A file is dropped
+/// from it when it is offered again (as it may be replaced) and when its
+/// transfer is completed.
 class ServerRequestHandler : public virtual ft::request::RequestHandler {
+private:
+	/// A file being verified, and the last request waiting for it
+	struct Verification {
+		ft::netwrk::ConnectionWPtr  conn;
+		ft::proto::MessagePtr       msg;
+		ft::request::ChunkTunerPtr  tuner;
+	};
+
+	/// Files of a FILE MANIFEST still to transfer
+	struct ManifestSchedule {
+		std::deque<ft::proto::MessagePtr> pending; ///! Offers not started
+		std::set<std::string>             active;  ///! Files in transfer
+	};
+
+	const ft::file::ChunkStorePtr  chunk_store;
+	const ft::request::HashPoolPtr hash_pool;
+	const ft::file::CatalogPtr     catalog;
+	const ft::request::TransferTablePtr transfers;
+
+	std::mutex                                        manifests_mutex;
+	std::map<ft::netwrk::ConnectionWPtr, ManifestSchedule,
+			std::owner_less<ft::netwrk::ConnectionWPtr>> manifests;
+
+	std::mutex                                        tuners_mutex;
+	std::map<ft::netwrk::ConnectionWPtr, ft::request::ChunkTunerPtr,
+			std::owner_less<ft::netwrk::ConnectionWPtr>> tuners;
+
+	std::mutex                                        verifying_mutex;
+	std::map<std::filesystem::path, Verification>     verifying;
 
 public:
-	ServerRequestHandler()
-	: RequestHandler() {}
+	ServerRequestHandler(const ft::file::ChunkStorePtr chunk_store,
+			const ft::request::HashPoolPtr hash_pool,
+			const ft::file::CatalogPtr catalog,
+			const ft::request::TransferTablePtr transfers)
+	: RequestHandler()
+	, chunk_store(chunk_store)
+	, hash_pool(hash_pool)
+	, catalog(catalog)
+	, transfers(transfers) {}
 
 	virtual ~ServerRequestHandler() {}
 
 	/// @brief Handles the requests dispatched from the RequestBroker
 	virtual void handleRequest(ft::request::RequestPtr req);
+
+private:
+	/// @brief Replies FILE COMPLETE or the first request of the transfer
+	ft::proto::MessagePtr handleOffer(ft::netwrk::ConnectionPtr conn,
+			ft::proto::MessagePtr msg);
+
+	/// @brief Replies the status of the files and starts their transfers
+	void handleManifest(ft::netwrk::ConnectionPtr conn,
+			ft::proto::MessagePtr msg);
+
+	/// @brief Starts the transfers of the pending files of the manifest of conn
+	///
+	/// If file_name is a file of the manifest, it is considered completed.
+	void scheduleManifest(ft::netwrk::ConnectionPtr conn,
+			const boost::uuids::uuid& client_uuid, const std::string& file_name);
+
+	/// @brief Writes a small file received inline
+	///
+	/// Returns the FILE COMPLETE reply, or nullptr if the data is not valid.
+	ft::proto::MessagePtr saveInline(ft::proto::MessagePtr msg,
+			const std::filesystem::path& file_path,
+			const std::vector<uint8_t>& hash, uint8_t hash_algo,
+			const std::vector<uint8_t>& data);
+
+	/// @brief The file in transfer of the path, kept in the TransferTable
+	///
+	/// If not kept, it is loaded (the file rebuilt by a delta transfer in
+	/// progress, if any) and kept. Returns nullptr if there is no file.
+	ft::file::FilePtr getTransfer(const std::filesystem::path& file_path);
+
+	/// @brief Same as above, for the file rebuilt by a delta transfer
+	///
+	/// The stored version it is rebuilt from is returned in basis_out, both
+	/// kept in the TransferTable. Returns nullptr if there is no delta
+	/// transfer of the path.
+	ft::file::FilePtr getDeltaTransfer(const std::filesystem::path& file_path,
+			ft::file::FilePtr& basis_out);
+
+	/// @brief Checks the CRC of the chunks in a FILE CHUNK DATA message
+	///
+	/// The chunks of files hashed as a tree are also checked with their proof.
+	bool verifyChunks(ft::proto::MessagePtr msg, ft::file::FilePtr file);
+
+	/// @brief Replies FILE ERROR for a file that cannot be received
+	///
+	/// e.g. its data file cannot be allocated.
+	ft::proto::MessagePtr fileError(ft::proto::MessagePtr msg,
+			const std::system_error& error);
+
+	/// @brief Starts (or resumes) the delta transfer of a new file version
+	ft::proto::MessagePtr offerDelta(ft::netwrk::ConnectionPtr conn,
+			ft::proto::MessagePtr msg, const std::filesystem::path& file_path,
+			ft::file::FilePtr basis);
+
+	/// @brief Rebuilds and saves the chunks in a FILE DELTA DATA message
+	void saveDelta(ft::proto::MessagePtr msg, ft::file::FilePtr basis,
+			ft::file::FilePtr file);
+
+	/// @brief Verifies the file or requests the next missing chunks
+	///
+	/// The number of chunks requested is the one tuned for the connection,
+	/// only one if tuner is nullptr. Returns nullptr if the file is verified,
+	/// as the reply is sent once done.
+	ft::proto::MessagePtr completeOrRequest(ft::netwrk::ConnectionPtr conn,
+			ft::proto::MessagePtr msg, ft::file::FilePtr file,
+			ft::request::ChunkTunerPtr tuner);
+
+	/// @brief Verifies the hash of a file with all its chunks received
+	///
+	/// The file is hashed by the HashPool (rebuilt from the recipe first, if
+	/// any), and verified() replies to the last request of the file.
+	void verify(ft::netwrk::ConnectionPtr conn, ft::proto::MessagePtr msg,
+			ft::file::FilePtr file, ft::request::ChunkTunerPtr tuner,
+			ft::file::FileRecipePtr recipe);
+
+	/// @brief Completes or restarts the transfer of a verified file
+	void verified(ft::file::FilePtr file, ft::file::FileRecipePtr recipe,
+			bool complete);
+
+	/// @brief True if the file is being verified
+	bool isVerifying(const std::filesystem::path& file_path);
+
+	/// @brief Gets the ChunkTuner of the connection
+	ft::request::ChunkTunerPtr getTuner(ft::netwrk::ConnectionPtr conn,
+			const boost::uuids::uuid& client_uuid);
+
+	/// @brief Requests the recipe or the next chunk missing in the store
+	///
+	/// Once all the chunks are in the store, rebuilds the file.
+	ft::proto::MessagePtr requestRecipeOrChunk(ft::netwrk::ConnectionPtr conn,
+			ft::proto::MessagePtr msg, ft::file::FilePtr file,
+			ft::file::FileRecipePtr recipe, size_t from_idx);
 };
 
 
 int main(int argc, char* argv[]) {
+
+	// -- Default parameters -- //
+
+	bool dedup_storage = false;
+	unsigned flush_chunks = 0, flush_ms = 0;
+	bool flush_policy  = false;
+	std::string durability = "none";
+	unsigned sync_interval_ms = SYNC_DEFAULT_INTERVAL_MS;
+	std::string io_engine_name;
+	std::string metadata = "files";
+	ft::file::Storage::Backend backend = ft::file::Storage::POSIX;
+
+	// -- Parse command line arguments and update parameters -- //
+
+	int opt;
+	while ((opt = getopt(argc, argv, "hcf:d:i:m:b:")) != -1) {
+		switch (opt) {
+		case 'h': show_usage(std::cout, argv[0]); exit(0); break;
+		case 'c': dedup_storage = true;                    break;
+		case 'f':
+			if (sscanf(optarg, "%u:%u", &flush_chunks, &flush_ms) != 2) {
+				std::cerr << "ERROR: Invalid flush policy '" << optarg <<
+						"'" << std::endl;
+				show_usage(std::cerr, argv[0]);
+				exit(1);
+			}
+			flush_policy = true;
+			break;
+		case 'd':
+			durability = optarg;
+			if (durability.rfind("periodic:", 0) == 0) {
+				if (sscanf(optarg, "periodic:%u", &sync_interval_ms) != 1 ||
+						sync_interval_ms == 0) {
+					durability.clear();
+				} else {
+					durability = "periodic";
+				}
+			}
+			if (durability != "none" && durability != "periodic" &&
+					durability != "group") {
+				std::cerr << "ERROR: Invalid durability mode '" << optarg <<
+						"'" << std::endl;
+				show_usage(std::cerr, argv[0]);
+				exit(1);
+			}
+			break;
+		case 'i':
+			io_engine_name = optarg;
+			if (io_engine_name != "inline" && io_engine_name != "uring" &&
+					io_engine_name != "threads") {
+				std::cerr << "ERROR: Invalid IO engine '" << optarg <<
+						"'" << std::endl;
+				show_usage(std::cerr, argv[0]);
+				exit(1);
+			}
+			break;
+		case 'm':
+			metadata = optarg;
+			if (metadata != "files" && metadata != "store") {
+				std::cerr << "ERROR: Invalid metadata storage '" << optarg <<
+						"'" << std::endl;
+				show_usage(std::cerr, argv[0]);
+				exit(1);
+			}
+			break;
+		case 'b':
+			if (std::string(optarg) == "posix") {
+				backend = ft::file::Storage::POSIX;
+			} else if (std::string(optarg) == "ram") {
+				backend = ft::file::Storage::RAM;
+			} else if (std::string(optarg) == "null") {
+				backend = ft::file::Storage::NONE;
+			} else {
+				std::cerr << "ERROR: Invalid storage backend '" << optarg <<
+						"'" << std::endl;
+				show_usage(std::cerr, argv[0]);
+				exit(1);
+			}
+			break;
+		default:  show_usage(std::cerr, argv[0]); exit(1); break;
+		}
+	}
+
+	// The deduplicated storage, metadata, durability and IO engine only apply
+	// to the files stored in the file system
+	if (backend != ft::file::Storage::POSIX) {
+		if (dedup_storage || durability != "none" || metadata != "files" ||
+				(!io_engine_name.empty() && io_engine_name != "inline")) {
+			std::cerr << "ERROR: The -c, -d, -i and -m options need the posix"
+					" backend" << std::endl;
+			show_usage(std::cerr, argv[0]);
+			exit(1);
+		}
+		io_engine_name = "inline";
+	} else if (io_engine_name.empty()) {
+		io_engine_name = "uring";
+	}
+
 	std::cout << "FT SERVER | Starting..." << std::endl;
+	std::cout << "FT SERVER |   STORAGE: " <<
+			(dedup_storage ? "deduplicated" : "files") << std::endl;
+	std::cout << "FT SERVER |   DURABILITY: " << durability << std::endl;
+	std::cout << "FT SERVER |   METADATA: " << metadata << std::endl;
+	std::cout << "FT SERVER |   BACKEND: " <<
+			ft::file::Storage::backendName(backend) << std::endl;
 
 	// -- Initialize and configure all the server components  -- //
 
 	// Set the server output directory
 	ft::file::File::setLocalPathPrefix(SERVER_BASE_PATH);
 
+	// The files received are kept in memory by the ram and null backends, so
+	// the disk is left out of the measures of the network and the protocol
+	if (backend != ft::file::Storage::POSIX) {
+		ft::file::File::setStorage(ft::file::Storage::makeStorage(backend));
+	}
+
+	// When the progress of the files is written to disk
+	if (flush_policy) {
+		ft::file::FileMetadata::setFlushPolicy(flush_chunks, flush_ms);
+	}
+
 	// Instantiate the server components
 
 	// The PollGroup handles 2 Pollables (the Connection and the SignalHandler)
@@ -73,8 +385,79 @@ int main(int argc, char* argv[]) {
 	auto server     = std::make_shared<ft::netwrk::ConnectionListener>(
 			poll_group, DEFAULT_PORT, MAX_CONNECTIONS);
 
+	// The content addressed chunk store, only in deduplicated storage mode
+	ft::file::ChunkStorePtr chunk_store;
+	if (dedup_storage) {
+		chunk_store = std::make_shared<ft::file::ChunkStore>(SERVER_BASE_PATH);
+	}
+
+	// Threads verifying the hash of the received files
+	auto hash_pool  = std::make_shared<ft::request::HashPool>("FT SERVER",
+			HASH_POOL_THREADS, HASH_POOL_MAX_QUEUED);
+
+	// The thread syncing the chunks received, unless not durable (like the
+	// HashPool, once the SignalHandler blocked the signals)
+	ft::file::FileSyncPtr file_sync;
+	if (durability != "none") {
+		file_sync = std::make_shared<ft::file::FileSync>("FT SERVER",
+				durability == "group" ? ft::file::FileSync::GROUP :
+					ft::file::FileSync::PERIODIC,
+				std::chrono::milliseconds(sync_interval_ms));
+		ft::file::FileMetadata::setSync(file_sync);
+	}
+
+	// The engine writing the chunks received, unless written inline. In the
+	// group durability, the writes are synced by the engine too.
+	ft::file::IoEnginePtr io_engine;
+	if (io_engine_name != "inline") {
+		io_engine = std::make_shared<ft::file::IoEngine>("FT SERVER",
+				io_engine_name == "uring" ? ft::file::IoEngine::URING :
+					ft::file::IoEngine::THREADS,
+				IO_ENGINE_DEPTH, IO_ENGINE_MAX_QUEUED, IO_ENGINE_THREADS,
+				durability == "group");
+		ft::file::File::setIoEngine(io_engine);
+	}
+	std::cout << "FT SERVER |   IO ENGINE: " << (io_engine ?
+			ft::file::IoEngine::backendName(io_engine->getBackend()) :
+			"inline") << std::endl;
+
+	// The state of the transfers in a single store, instead of a metadata
+	// file per file. The metadata files are migrated when the store is
+	// created, and when loading the files left after.
+	ft::file::StateStorePtr state_store;
+	if (metadata == "store") {
+		state_store = std::make_shared<ft::file::StateStore>("FT SERVER",
+				SERVER_BASE_PATH, durability != "none");
+		ft::file::FileMetadata::setStore(state_store);
+		if (state_store->isNew()) {
+			std::cout << "FT SERVER | Metadata files migrated: " <<
+					ft::file::FileMetadata::migrate(SERVER_BASE_PATH) <<
+					std::endl;
+		}
+		// The files complete keep their record, with all the chunks
+		size_t n_in_progress = 0;
+		for (const auto& transfer : state_store->list()) {
+			n_in_progress += transfer.n_received < transfer.n_chunks;
+		}
+		std::cout << "FT SERVER | Transfers in progress: " << n_in_progress <<
+				std::endl;
+	}
+
+	// The files completed, to answer the offers of the same files at once.
+	// Only of the files in the file system: the ones in memory are lost on
+	// exit, and the ones discarded are never complete.
+	ft::file::CatalogPtr catalog;
+	if (backend == ft::file::Storage::POSIX) {
+		catalog = std::make_shared<ft::file::Catalog>(SERVER_BASE_PATH);
+	}
+
+	// The files in transfer, kept between their chunks
+	auto transfers  = std::make_shared<ft::request::TransferTable>("FT SERVER",
+			TRANSFER_TABLE_MAX_FILES, TRANSFER_IDLE_TIMEOUT);
+
 	// The ServerRequestHandler to control the server behavior
-	auto server_req_handler = std::make_shared<ServerRequestHandler>();
+	auto server_req_handler = std::make_shared<ServerRequestHandler>(
+			chunk_store, hash_pool, catalog, transfers);
 
 	// The RequestBroker, using the ServerRequestHandler as flow control and
 	// MAX_REQ_BROKER_THREADS working threads
@@ -94,13 +477,68 @@ int main(int argc, char* argv[]) {
 
 	// -- Main Loop -- //
 
-	// Loop handling events until termination is signaled
-	while(poll_group->pollAndHandle() && !signals->receivedTermSignal());
+	// Loop handling events until termination is signaled. The chunks kept by
+	// the files with no chunks for a while are written meanwhile.
+	while(poll_group->pollAndHandle() && !signals->receivedTermSignal()) {
+		transfers->flushIdle(TRANSFER_FLUSH_IDLE);
+	}
 
+	hash_pool->stop();
+	hash_pool->logStats();
+	transfers->logStats();
+	transfers->clear();
+	if (io_engine) {
+		io_engine->stop();
+		io_engine->logStats();
+	}
+	if (file_sync) {
+		file_sync->stop();
+		file_sync->logStats();
+	}
+	if (state_store) {
+		state_store->stop();
+		state_store->logStats();
+	}
+	std::cout << "FT SERVER | Messages per write: " <<
+			ft::netwrk::Connection::getTotalMsgsPerWrite() << std::endl;
 	std::cout << "FT SERVER | Terminating..." << std::endl;
 }
 
 
+static void show_usage(std::ostream& out, const char* app)
+{
+	std::filesystem::path app_name = app;
+
+	out
+		<< "Usage: " << app_name.filename().generic_string()
+					 << " <option(s)>" << std::endl
+		<< "Options:" << std::endl
+		<< "\t-h\t\tShow this help message" << std::endl
+		<< "\t-c\t\tDeduplicated storage (content defined chunking)"
+		<< std::endl
+		<< "\t-f N:MS\t\tFlush the progress of the files every N chunks or MS"
+				" milliseconds (0 disables each one, default 1024:1000)"
+		<< std::endl
+		<< "\t-d MODE\t\tDurability of the chunks received: none (default),"
+				" periodic[:MS] (synced every MS milliseconds, default 1000) or"
+				" group (each write waits for a sync shared with the others)"
+		<< std::endl
+		<< "\t-i ENGINE\tWrites of the chunks received: uring (default,"
+				" io_uring, or threads if not available), threads or inline"
+				" (by the request workers)"
+		<< std::endl
+		<< "\t-m STORAGE\tMetadata of the transfers: files (default, a"
+				" metadata file per file) or store (a single state store,"
+				" migrating the metadata files)"
+		<< std::endl
+		<< "\t-b BACKEND\tStorage of the files received: posix (default, the"
+				" file system), ram (in memory, lost on exit) or null (the"
+				" data is discarded, for benchmarks). Only posix takes -c, -d,"
+				" -i and -m"
+		<< std::endl;
+}
+
+
 
 void ServerRequestHandler::handleRequest(ft::request::RequestPtr req)
 {
@@ -114,62 +552,130 @@ void ServerRequestHandler::handleRequest(ft::request::RequestPtr req)
 
 	switch(msg->msg_type) {
 	case ft::proto::MSGTYPE_FILE_OFFER:
+		response = handleOffer(conn, msg);
+		break;
+
+	case ft::proto::MSGTYPE_FILE_MANIFEST:
+		handleManifest(conn, msg);
+		break;
+
+	case ft::proto::MSGTYPE_FILE_CHUNK_DATA:
 	{
-		auto file = ft::file::File::makeRemoteFile(file_path,
-				msg->offer.file_hash, msg->offer.file_size);
-		if (file && file->isComplete()) {
-			std::cout << "FT SERVER | File already transferred: " <<
-					file_path.filename() << std::endl;
-
-			response = ft::proto::MessageFactory::buildMsgComplete(
-					msg->seq_number, msg->client_uuid, file);
-		} else if (file) {
-			size_t req_chunk_idx = file->getNextMissingChunk();
-			response = ft::proto::MessageFactory::buildMsgChunkReq(
-					msg->seq_number + 1, msg->client_uuid, file, req_chunk_idx,
-					UINT16_MAX);
-
-			// Reduce the log frequency to speed up the transfer
-			if (file->getNumOfChunks() > 100 && (req_chunk_idx % 10) == 0) {
-				std::cout << "FT SERVER | Request chunk: CID:"
-					<< boost::uuids::to_string(msg->client_uuid)
-					<< " - " << file_path.filename()
-					<< "[" << req_chunk_idx << "]" << std::endl;
+		auto file = getTransfer(file_path);
+		if (file) {
+			auto tuner = getTuner(conn, msg->client_uuid);
+			size_t n_chunks = msg->chunk_data.data.size() /
+					ft::file::CHUNK_SIZE +
+					(msg->chunk_data.data.size() % ft::file::CHUNK_SIZE > 0 ?
+					1 : 0);
+			tuner->dataReceived(msg->file_name, n_chunks,
+					msg->chunk_data.data.size());
+
+			if (!verifyChunks(msg, file)) {
+				// Not saved, so the chunks are requested again
+				std::cout << "FT SERVER | Invalid chunk data, requesting it "
+					"again: " << file->path.filename() << "[" <<
+					msg->chunk_data.idx << "]" << std::endl;
+			} else if (msg->chunk_data.n_zero > 0) {
+				// Zero chunks are not written, but left as a hole in the file
+				file->saveZeroChunks(msg->chunk_data.idx,
+						msg->chunk_data.n_zero);
+			} else {
+				auto fchunk = std::make_shared<ft::file::FileChunk>(file,
+								msg->chunk_data.idx, msg->chunk_data.data,
+								std::vector<uint8_t>());
+				file->saveChunk(fchunk);
 			}
+
+			response = completeOrRequest(conn, msg, file, tuner);
 		}
 	}
 	break;
 
-	case ft::proto::MSGTYPE_FILE_CHUNK_DATA:
+	case ft::proto::MSGTYPE_FILE_DELTA_SIGS:
 	{
-		auto file = ft::file::File::makeRemoteFile(file_path);
+		ft::file::FilePtr basis;
+		auto file = getDeltaTransfer(file_path, basis);
 		if (file) {
-			auto fchunk = std::make_shared<ft::file::FileChunk>(file,
-							msg->chunk_data.idx, msg->chunk_data.data,
-							msg->chunk_data.hash);
-			file->saveChunk(fchunk);
+			size_t n_blocks = basis->size / ft::file::DELTA_BLOCK_SIZE +
+					(basis->size % ft::file::DELTA_BLOCK_SIZE > 0 ? 1 : 0);
+			if (msg->delta_sigs.block_first < n_blocks) {
+				response = ft::proto::MessageFactory::buildMsgDeltaSigs(
+						msg->seq_number + 1, msg->client_uuid, basis,
+						msg->delta_sigs.block_first);
+			} else {
+				// The client has all the signatures, go on with the transfer
+				response = completeOrRequest(conn, msg, file, nullptr);
+			}
+		}
+	}
+	break;
 
-			if (file->isComplete()) {
-				std::cout << "FT SERVER | File transferred: " <<
-					file_path.filename() << std::endl;
+	case ft::proto::MSGTYPE_FILE_DELTA_DATA:
+	{
+		ft::file::FilePtr basis;
+		auto file = getDeltaTransfer(file_path, basis);
+		if (file) {
+			saveDelta(msg, basis, file);
+			response = completeOrRequest(conn, msg, file, nullptr);
+		}
+	}
+	break;
+
+	case ft::proto::MSGTYPE_FILE_CDC_RECIPE:
+	{
+		auto file = getTransfer(file_path);
+		if (file && this->chunk_store) {
+			auto recipe = this->chunk_store->openRecipe(file_path, file->hash,
+					file->size);
+			recipe->addEntries(msg->cdc_recipe.idx_first,
+					msg->cdc_recipe.n_total, msg->cdc_recipe.entries);
+
+			if (recipe->isReceived() && msg->cdc_recipe.idx_first +
+					msg->cdc_recipe.entries.size() == recipe->getNumOfEntries()) {
+				// Whole recipe received, account what is already stored
+				size_t missing = recipe->getMissingBytes(*this->chunk_store);
+				this->chunk_store->addStats(file->size, missing);
+
+				std::cout << "FT SERVER | Dedup: " << file_path.filename()
+					<< " - " << (file->size - missing) << " of " << file->size
+					<< " bytes already stored. Total saved: "
+					<< (this->chunk_store->getLogicalBytes() -
+						this->chunk_store->getTransferredBytes())
+					<< " bytes, dedup ratio: "
+					<< ((double)this->chunk_store->getLogicalBytes() /
+						std::max(this->chunk_store->getTransferredBytes(),
+								(uint64_t)1U))
+					<< std::endl;
+			}
+
+			response = requestRecipeOrChunk(conn, msg, file, recipe, 0);
+		}
+	}
+	break;
+
+	case ft::proto::MSGTYPE_FILE_CDC_DATA:
+	{
+		auto file = getTransfer(file_path);
+		if (file && this->chunk_store) {
+			auto recipe = this->chunk_store->openRecipe(file_path, file->hash,
+					file->size);
 
-				response = ft::proto::MessageFactory::buildMsgComplete(
-						msg->seq_number, msg->client_uuid, file);
+			// Only store the chunk if it matches the fingerprint in the recipe
+			ft::proto::CdcEntry entry;
+			std::vector<uint8_t> hash;
+			ft::file::FileCdc::calcFingerprint(msg->cdc_data.data.data(),
+					msg->cdc_data.data.size(), hash);
+			if (recipe->getEntry(msg->cdc_data.idx, entry) &&
+					entry.hash == hash) {
+				this->chunk_store->put(hash, msg->cdc_data.data);
 			} else {
-				size_t req_chunk_idx = file->getNextMissingChunk();
-				response = ft::proto::MessageFactory::buildMsgChunkReq(
-						msg->seq_number + 1, msg->client_uuid, file,
-						req_chunk_idx, UINT16_MAX);
-
-				// Reduce the log frequency to speed up the transfer
-				if (file->getNumOfChunks() > 100 && (req_chunk_idx % 10) == 0) {
-					std::cout << "FT SERVER | Request chunk: CID:"
-						<< boost::uuids::to_string(msg->client_uuid)
-						<< " - " << file_path.filename()
-						<< "[" << req_chunk_idx << "]"
-						<< std::endl;
-				}
+				std::cout << "Invalid chunk data: " << msg->file_name <<
+						std::endl;
 			}
+
+			response = requestRecipeOrChunk(conn, msg, file, recipe,
+					msg->cdc_data.idx);
 		}
 	}
 	break;
@@ -183,4 +689,606 @@ void ServerRequestHandler::handleRequest(ft::request::RequestPtr req)
 		response->serialize(buf);
 		conn->sendBuffer(buf);
 	}
+
+	// A completed file may let the next one of a manifest start
+	if (response && conn &&
+			response->msg_type == ft::proto::MSGTYPE_FILE_COMPLETE) {
+		scheduleManifest(conn, msg->client_uuid, msg->file_name);
+	}
+}
+
+ft::proto::MessagePtr ServerRequestHandler::handleOffer(
+		ft::netwrk::ConnectionPtr conn, ft::proto::MessagePtr msg)
+{
+	std::filesystem::path file_path = to_string(msg->client_uuid);
+	file_path /= msg->file_name;
+
+	ft::proto::MessagePtr response;
+
+	// The file kept may be replaced by the one offered
+	this->transfers->remove(file_path);
+
+	if (msg->offer.hash_algo >= ft::proto::HASH_ALGO_MAX) {
+		std::cout << "Unsupported hash algorithm: " << msg->file_name <<
+				std::endl;
+		return response;
+	}
+
+	// Files already transferred, and not modified since, are not read again
+	bool modified = false;
+	if (this->catalog && this->catalog->isComplete(file_path,
+			(ft::proto::HashAlgo)msg->offer.hash_algo, msg->offer.file_hash,
+			msg->offer.file_size, modified)) {
+		std::cout << "FT SERVER | File already transferred: " <<
+				file_path.filename() << std::endl;
+		return ft::proto::MessageFactory::buildMsgComplete(msg->seq_number,
+				msg->client_uuid, msg->file_name);
+	}
+
+	// Small files come within the offer, so they are completed at once
+	if (msg->offer.has_inline) {
+		response = saveInline(msg, file_path, msg->offer.file_hash,
+				msg->offer.hash_algo, msg->offer.inline_data);
+		if (response) {
+			return response;
+		}
+	}
+
+	auto file = ft::file::File::makeRemoteFile(file_path);
+	if (file && modified) {
+		// The hash kept of the received data may not match the file any more
+		file->rehash();
+	}
+	if (file && file->hash != msg->offer.file_hash) {
+		// A different version of the file is stored in the server. If it
+		// is complete, only the differences are transferred.
+		if (!this->chunk_store && file->size > 0 &&
+				msg->offer.file_size > 0 &&
+				file->getNextMissingChunk() == UINT64_MAX) {
+			return offerDelta(conn, msg, file_path, file);
+		}
+
+		// Otherwise, the partially received version is not longer useful
+		file->discard();
+		if (this->catalog) {
+			this->catalog->remove(file_path);
+		}
+	}
+
+	// The space of the file is allocated before requesting any chunk
+	try {
+		file = ft::file::File::makeRemoteFile(file_path,
+				msg->offer.file_hash, msg->offer.file_size,
+				(ft::proto::HashAlgo)msg->offer.hash_algo);
+	} catch (const std::system_error& e) {
+		return fileError(msg, e);
+	}
+	if (file && this->chunk_store &&
+			file->getNextMissingChunk() != UINT64_MAX) {
+		// Deduplicated storage, start (or resume) with the recipe
+		auto recipe = this->chunk_store->openRecipe(file_path,
+				msg->offer.file_hash, msg->offer.file_size);
+		response = requestRecipeOrChunk(conn, msg, file, recipe, 0);
+	} else if (file) {
+		// A file already transferred is verified before completing it
+		response = completeOrRequest(conn, msg, file,
+				getTuner(conn, msg->client_uuid));
+	}
+
+	return response;
+}
+
+void ServerRequestHandler::handleManifest(ft::netwrk::ConnectionPtr conn,
+		ft::proto::MessagePtr msg)
+{
+	std::filesystem::path client_path = to_string(msg->client_uuid);
+
+	auto status = ft::proto::MessageFactory::buildMsgManifestStatus(
+			msg->seq_number, msg->client_uuid);
+	std::vector<ft::proto::MessagePtr> offers;
+
+	size_t n_complete = 0;
+	for (const auto& entry : msg->manifest.files) {
+		// Only plain file names are accepted
+		std::filesystem::path file_name = entry.file_name;
+		if (entry.file_name.empty() || file_name.filename() != file_name ||
+				entry.file_name == "." || entry.file_name == ".." ||
+				entry.file_hash.size() != ft::proto::HASH_SIZE ||
+				entry.hash_algo >= ft::proto::HASH_ALGO_MAX) {
+			ft::proto::MessageFactory::addManifestFileStatus(status,
+					entry.file_name, ft::proto::MANIFEST_FILE_REJECTED,
+					ft::file::FilePtr(), 0);
+			continue;
+		}
+
+		// Files already transferred, and not modified since
+		bool modified = false;
+		if (this->catalog && this->catalog->isComplete(client_path / file_name,
+				(ft::proto::HashAlgo)entry.hash_algo, entry.file_hash,
+				entry.file_size, modified)) {
+			ft::proto::MessageFactory::addManifestFileStatus(status,
+					entry.file_name, ft::proto::MANIFEST_FILE_COMPLETE,
+					ft::file::FilePtr(), 0);
+			n_complete++;
+			continue;
+		}
+
+		// Small files come within the manifest, so they are completed at once
+		if (entry.has_inline && saveInline(msg, client_path / file_name,
+				entry.file_hash, entry.hash_algo, entry.inline_data)) {
+			ft::proto::MessageFactory::addManifestFileStatus(status,
+					entry.file_name, ft::proto::MANIFEST_FILE_COMPLETE,
+					ft::file::FilePtr(), 0);
+			n_complete++;
+			continue;
+		}
+
+		// Only the stored files of the same version keep their progress
+		auto file = ft::file::File::makeRemoteFile(client_path / file_name);
+		if (file && file->hash != entry.file_hash) {
+			file.reset();
+		}
+		if (file && modified) {
+			file->rehash();
+		}
+
+		// Files with all their chunks received are reported as missing none,
+		// and completed once verified by the HashPool, as when offered alone
+		ft::proto::MessageFactory::addManifestFileStatus(status,
+				entry.file_name, ft::proto::MANIFEST_FILE_MISSING, file,
+				entry.file_n_chunks);
+
+		// The transfer is started as if the file was offered alone
+		auto offer = std::make_shared<ft::proto::Message>();
+		offer->msg_type            = ft::proto::MSGTYPE_FILE_OFFER;
+		offer->seq_number          = msg->seq_number;
+		offer->client_uuid         = msg->client_uuid;
+		offer->file_name           = entry.file_name;
+		offer->offer.file_size     = entry.file_size;
+		offer->offer.file_n_chunks = entry.file_n_chunks;
+		offer->offer.file_hash     = entry.file_hash;
+		offer->offer.hash_algo     = entry.hash_algo;
+		offer->offer.has_inline    = false;
+		offers.push_back(offer);
+	}
+
+	std::cout << "FT SERVER | Manifest: CID:"
+		<< boost::uuids::to_string(msg->client_uuid) << " - "
+		<< msg->manifest.files.size() << " files from "
+		<< msg->manifest.idx_first << " of " << msg->manifest.n_total << ", "
+		<< n_complete << " completed" << std::endl;
+
+	std::vector<uint8_t> buf;
+	status->serialize(buf);
+	conn->sendBuffer(buf);
+
+	{
+		std::lock_guard<std::mutex> lock(this->manifests_mutex);
+
+		// Forget the schedules of the closed connections
+		for (auto it = this->manifests.begin(); it != this->manifests.end();) {
+			it = it->first.expired() ? this->manifests.erase(it) :
+					std::next(it);
+		}
+
+		// By connection, as the clients on the same host share their UUID. The
+		// first files of a manifest replace the ones sent before on it.
+		auto& schedule = this->manifests[conn];
+		if (msg->manifest.idx_first == 0) {
+			schedule = ManifestSchedule();
+		}
+		schedule.pending.insert(schedule.pending.end(), offers.begin(),
+				offers.end());
+	}
+
+	scheduleManifest(conn, msg->client_uuid, std::string());
+}
+
+void ServerRequestHandler::scheduleManifest(ft::netwrk::ConnectionPtr conn,
+		const boost::uuids::uuid& client_uuid, const std::string& file_name)
+{
+	std::string completed = file_name;
+
+	while (true) {
+		ft::proto::MessagePtr offer;
+		{
+			std::lock_guard<std::mutex> lock(this->manifests_mutex);
+
+			auto it = this->manifests.find(conn);
+			if (it == this->manifests.end()) {
+				return;
+			}
+
+			auto& schedule = it->second;
+			if (!completed.empty() && schedule.active.erase(completed) == 0) {
+				// Not a file of the manifest
+				return;
+			}
+
+			if (schedule.pending.empty() && schedule.active.empty()) {
+				this->manifests.erase(it);
+				return;
+			}
+
+			if (schedule.pending.empty() ||
+					schedule.active.size() >= MAX_MANIFEST_ACTIVE_FILES) {
+				return;
+			}
+
+			offer = schedule.pending.front();
+			schedule.pending.pop_front();
+			schedule.active.insert(offer->file_name);
+		}
+
+		auto response = handleOffer(conn, offer);
+		if (response) {
+			std::vector<uint8_t> buf;
+			response->serialize(buf);
+			conn->sendBuffer(buf);
+		}
+
+		// Files completed at once also let the next one start, but not the
+		// ones being verified, which are completed by verified()
+		completed.clear();
+		std::filesystem::path file_path = to_string(client_uuid);
+		file_path /= offer->file_name;
+		if ((!response && !isVerifying(file_path)) || (response &&
+				(response->msg_type == ft::proto::MSGTYPE_FILE_COMPLETE ||
+				response->msg_type == ft::proto::MSGTYPE_FILE_ERROR))) {
+			completed = offer->file_name;
+		}
+	}
+}
+
+ft::proto::MessagePtr ServerRequestHandler::saveInline(
+		ft::proto::MessagePtr msg, const std::filesystem::path& file_path,
+		const std::vector<uint8_t>& hash, uint8_t hash_algo,
+		const std::vector<uint8_t>& data)
+{
+	auto file = ft::file::File::saveRemoteFile(file_path, hash,
+			(ft::proto::HashAlgo)hash_algo, data);
+	if (!file) {
+		std::cout << "Invalid inline data: " << file_path.filename() <<
+				std::endl;
+		return ft::proto::MessagePtr();
+	}
+
+	if (this->catalog) {
+		this->catalog->add(file->path, file->hash_algo, file->hash);
+	}
+	std::cout << "FT SERVER | File transferred inline: " <<
+			file_path.filename() << std::endl;
+
+	return ft::proto::MessageFactory::buildMsgComplete(msg->seq_number,
+			msg->client_uuid, file);
+}
+
+ft::file::FilePtr ServerRequestHandler::getTransfer(
+		const std::filesystem::path& file_path)
+{
+	auto file = this->transfers->get(file_path);
+	if (!file) {
+		// Chunks of a delta transfer in progress go to the rebuilt file
+		file = ft::file::File::makeRemoteDeltaFile(file_path);
+		if (!file) {
+			file = ft::file::File::makeRemoteFile(file_path);
+		}
+		if (file) {
+			this->transfers->put(file_path, file);
+		}
+	}
+
+	return file;
+}
+
+ft::file::FilePtr ServerRequestHandler::getDeltaTransfer(
+		const std::filesystem::path& file_path, ft::file::FilePtr& basis_out)
+{
+	auto file = this->transfers->get(file_path, basis_out);
+	if (file && basis_out) {
+		return file;
+	}
+
+	// Not kept yet, or kept by a FILE CHUNK DATA without its basis. The
+	// delta transfer may be over too (committed or replaced).
+	auto delta = ft::file::File::makeRemoteDeltaFile(file_path);
+	basis_out = ft::file::File::makeRemoteFile(file_path);
+	if (!delta || !basis_out) {
+		basis_out.reset();
+		return ft::file::FilePtr();
+	}
+
+	// A file kept while the delta file exists is the one rebuilt
+	if (!file) {
+		file = delta;
+	}
+	this->transfers->put(file_path, file, basis_out);
+
+	return file;
+}
+
+bool ServerRequestHandler::verifyChunks(ft::proto::MessagePtr msg,
+		ft::file::FilePtr file)
+{
+	// Cheap check of the data on the wire first
+	if (ft::proto::crc32c(msg->chunk_data.data.data(),
+			msg->chunk_data.data.size()) != msg->chunk_data.crc) {
+		return false;
+	}
+
+	if (file->hash_algo != ft::proto::HASH_ALGO_BLAKE2B_TREE) {
+		// Only verified once the file is complete
+		return true;
+	}
+
+	std::vector<uint8_t> leaves;
+	if (msg->chunk_data.n_zero > 0) {
+		ft::file::FileTree::calcZeroLeaves(file->size, msg->chunk_data.idx,
+				msg->chunk_data.n_zero, leaves);
+	} else {
+		ft::file::FileTree::calcLeaves(msg->chunk_data.data.data(),
+				msg->chunk_data.data.size(), leaves);
+	}
+
+	return ft::file::FileTree::verify(file->size, file->hash,
+			msg->chunk_data.idx, leaves, msg->chunk_data.proof);
+}
+
+ft::proto::MessagePtr ServerRequestHandler::fileError(
+		ft::proto::MessagePtr msg, const std::system_error& error)
+{
+	bool no_space = error.code() == std::errc::no_space_on_device;
+	std::cout << "FT SERVER | " << (no_space ? "No space for file: " :
+			"Failed to create file: ") << msg->file_name << " (" <<
+			error.what() << ")" << std::endl;
+
+	return ft::proto::MessageFactory::buildMsgError(msg->seq_number,
+			msg->client_uuid, msg->file_name,
+			no_space ? ft::proto::FILE_ERROR_NO_SPACE : ft::proto::FILE_ERROR_IO);
+}
+
+ft::proto::MessagePtr ServerRequestHandler::offerDelta(
+		ft::netwrk::ConnectionPtr conn, ft::proto::MessagePtr msg,
+		const std::filesystem::path& file_path, ft::file::FilePtr basis)
+{
+	// Discard a previous delta transfer of another version
+	auto file = ft::file::File::makeRemoteDeltaFile(file_path);
+	if (file && file->hash != msg->offer.file_hash) {
+		file->discard();
+		file.reset();
+	}
+
+	if (!file) {
+		try {
+			file = ft::file::File::makeRemoteDeltaFile(file_path,
+					msg->offer.file_hash, msg->offer.file_size,
+					(ft::proto::HashAlgo)msg->offer.hash_algo);
+		} catch (const std::system_error& e) {
+			return fileError(msg, e);
+		}
+	}
+
+	if (file->getNextMissingChunk() == UINT64_MAX) {
+		// Rebuilt, but still to be verified and committed
+		verify(conn, msg, file, nullptr, ft::file::FileRecipePtr());
+		return ft::proto::MessagePtr();
+	}
+
+	std::cout << "FT SERVER | Delta transfer: CID:"
+		<< boost::uuids::to_string(msg->client_uuid)
+		<< " - " << file_path.filename() << std::endl;
+
+	// Start sending the signatures of the stored version
+	return ft::proto::MessageFactory::buildMsgDeltaSigs(msg->seq_number + 1,
+			msg->client_uuid, basis, 0);
+}
+
+void ServerRequestHandler::saveDelta(ft::proto::MessagePtr msg,
+		ft::file::FilePtr basis, ft::file::FilePtr file)
+{
+	size_t offset = (size_t)msg->delta_data.chunk_first *
+			ft::file::CHUNK_SIZE;
+	if (offset >= file->size || msg->delta_data.n_chunks >
+			file->getNumOfChunks() - msg->delta_data.chunk_first) {
+		std::cout << "Try to save delta outside file length range" <<
+				std::endl;
+		return;
+	}
+
+	// Rebuild the data of the chunks
+	std::vector<uint8_t> data;
+	size_t expected_len = std::min(file->size - offset,
+			(size_t)msg->delta_data.n_chunks * ft::file::CHUNK_SIZE);
+	if (!ft::file::FileDelta::patch(basis, msg->delta_data.ops, expected_len,
+			data) ||
+			data.size() != expected_len) {
+		std::cout << "Invalid delta data: " << msg->file_name << std::endl;
+		return;
+	}
+
+	// Then, save them as regular chunks
+	for (size_t i = 0; i < msg->delta_data.n_chunks; i++) {
+		size_t start = i * ft::file::CHUNK_SIZE;
+		size_t end = std::min(start + ft::file::CHUNK_SIZE, data.size());
+		auto fchunk = std::make_shared<ft::file::FileChunk>(file,
+				msg->delta_data.chunk_first + i,
+				std::vector<uint8_t>(data.begin() + start, data.begin() + end),
+				std::vector<uint8_t>());
+		file->saveChunk(fchunk);
+	}
+}
+
+ft::proto::MessagePtr ServerRequestHandler::completeOrRequest(
+		ft::netwrk::ConnectionPtr conn, ft::proto::MessagePtr msg,
+		ft::file::FilePtr file, ft::request::ChunkTunerPtr tuner)
+{
+	ft::proto::MessagePtr response;
+
+	size_t req_chunk_idx = file->getNextMissingChunk();
+	if (req_chunk_idx == UINT64_MAX) {
+		// All the chunks are received, so the hash is verified
+		verify(conn, msg, file, tuner, ft::file::FileRecipePtr());
+	} else {
+		// Request the tuned number of chunks, as long as they are all missing
+		size_t n_chunks = tuner ? tuner->getNumOfChunks() : 1U;
+		n_chunks = std::min(n_chunks, file->getNumOfChunks() - req_chunk_idx);
+		n_chunks = std::min(n_chunks,
+				file->getNextReceivedChunk(req_chunk_idx) - req_chunk_idx);
+
+		response = ft::proto::MessageFactory::buildMsgChunkReq(
+				msg->seq_number + 1, msg->client_uuid, file, req_chunk_idx,
+				req_chunk_idx + n_chunks - 1);
+		if (tuner) {
+			tuner->requestSent(msg->file_name, n_chunks);
+		}
+
+		// Reduce the log frequency to speed up the transfer
+		if (file->getNumOfChunks() > 100 && ((req_chunk_idx % 10) == 0 ||
+				(req_chunk_idx % 10) + n_chunks > 10)) {
+			std::cout << "FT SERVER | Request chunk: CID:"
+				<< boost::uuids::to_string(msg->client_uuid)
+				<< " - " << file->path.filename()
+				<< "[" << req_chunk_idx << "-"
+				<< (req_chunk_idx + n_chunks - 1) << "]" << std::endl;
+		}
+	}
+
+	return response;
+}
+
+ft::proto::MessagePtr ServerRequestHandler::requestRecipeOrChunk(
+		ft::netwrk::ConnectionPtr conn, ft::proto::MessagePtr msg,
+		ft::file::FilePtr file, ft::file::FileRecipePtr recipe,
+		size_t from_idx)
+{
+	if (!recipe->isReceived()) {
+		return ft::proto::MessageFactory::buildMsgCdcReq(msg->seq_number + 1,
+				msg->client_uuid, file, ft::proto::CDC_REQ_RECIPE,
+				recipe->getNumOfReceived());
+	}
+
+	size_t req_idx = recipe->nextMissingChunk(*this->chunk_store, from_idx);
+	if (req_idx != UINT64_MAX) {
+		return ft::proto::MessageFactory::buildMsgCdcReq(msg->seq_number + 1,
+				msg->client_uuid, file, ft::proto::CDC_REQ_CHUNK, req_idx);
+	}
+
+	// All the chunks are in the store, so the file can be rebuilt
+	verify(conn, msg, file, nullptr, recipe);
+	return ft::proto::MessagePtr();
+}
+
+void ServerRequestHandler::verify(ft::netwrk::ConnectionPtr conn,
+		ft::proto::MessagePtr msg, ft::file::FilePtr file,
+		ft::request::ChunkTunerPtr tuner, ft::file::FileRecipePtr recipe)
+{
+	{
+		std::lock_guard<std::mutex> lock(this->verifying_mutex);
+
+		// If already being verified, the reply goes to this request
+		auto& verification = this->verifying[file->path];
+		bool in_progress = (bool)verification.msg;
+		verification = { conn, msg, tuner };
+		if (in_progress) {
+			return;
+		}
+	}
+
+	auto chunk_store = this->chunk_store;
+	this->hash_pool->submit(file->size,
+		[file, recipe, chunk_store]() {
+			return (!recipe || recipe->rebuild(*chunk_store, file)) &&
+					file->isComplete();
+		},
+		[this, file, recipe](bool complete) {
+			verified(file, recipe, complete);
+		});
+}
+
+void ServerRequestHandler::verified(ft::file::FilePtr file,
+		ft::file::FileRecipePtr recipe, bool complete)
+{
+	Verification verification;
+	{
+		std::lock_guard<std::mutex> lock(this->verifying_mutex);
+		auto it = this->verifying.find(file->path);
+		if (it == this->verifying.end()) {
+			return;
+		}
+		verification = it->second;
+		this->verifying.erase(it);
+	}
+
+	auto conn = verification.conn.lock();
+	auto msg  = verification.msg;
+	ft::proto::MessagePtr response;
+
+	if (complete) {
+		// If the file was rebuilt by a delta transfer, replace the stored one
+		if (recipe) {
+			recipe->remove();
+		}
+		this->transfers->remove(file->path);
+		file->commit();
+		if (this->catalog) {
+			this->catalog->add(file->path, file->hash_algo, file->hash);
+		}
+		std::cout << "FT SERVER | File transferred: " <<
+			file->path.filename() << std::endl;
+
+		response = ft::proto::MessageFactory::buildMsgComplete(
+				msg->seq_number, msg->client_uuid, file);
+	} else {
+		// All the chunks are received but the hash does not match
+		std::cout << "FT SERVER | File corrupted, restarting transfer: " <<
+			file->path.filename() << std::endl;
+		file->restart();
+
+		if (recipe) {
+			recipe->remove();
+			this->chunk_store->openRecipe(file->path, file->hash, file->size);
+			response = ft::proto::MessageFactory::buildMsgCdcReq(
+					msg->seq_number + 1, msg->client_uuid, file,
+					ft::proto::CDC_REQ_RECIPE, 0);
+		} else {
+			response = completeOrRequest(conn, msg, file, verification.tuner);
+		}
+	}
+	this->hash_pool->logStats();
+	this->transfers->logStats();
+
+	if (response && conn) {
+		std::vector<uint8_t> buf;
+		response->serialize(buf);
+		conn->sendBuffer(buf);
+	}
+
+	// A completed file may let the next one of a manifest start
+	if (complete && conn) {
+		scheduleManifest(conn, msg->client_uuid, msg->file_name);
+	}
+}
+
+bool ServerRequestHandler::isVerifying(const std::filesystem::path& file_path)
+{
+	std::lock_guard<std::mutex> lock(this->verifying_mutex);
+	return this->verifying.count(file_path) > 0;
+}
+
+ft::request::ChunkTunerPtr ServerRequestHandler::getTuner(
+		ft::netwrk::ConnectionPtr conn, const boost::uuids::uuid& client_uuid)
+{
+	std::lock_guard<std::mutex> lock(this->tuners_mutex);
+
+	// Forget the tuners of the closed connections
+	for (auto it = this->tuners.begin(); it != this->tuners.end();) {
+		it = it->first.expired() ? this->tuners.erase(it) : std::next(it);
+	}
+
+	auto& tuner = this->tuners[conn];
+	if (!tuner) {
+		tuner = std::make_shared<ft::request::ChunkTuner>(
+				"CID:" + boost::uuids::to_string(client_uuid));
+	}
+	return tuner;
 }
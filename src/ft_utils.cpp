@@ -7,6 +7,7 @@
 #include <fstream>
 #include <iostream>
 #include <iomanip>
+#include <sstream>
 #include <vector>
 
 #include <boost/uuid/uuid.hpp>
@@ -43,4 +44,32 @@ boost::uuids::uuid getClientUUID(const std::filesystem::path& uuid_file)
 	return ret;
 }
 
+std::string toHex(const std::vector<uint8_t>& data)
+{
+	std::ostringstream ss;
+	ss << std::hex << std::setfill('0');
+	for (auto b : data) {
+		ss << std::setw(2) << (int)b;
+	}
+	return ss.str();
+}
+
+bool fromHex(const std::string& hex, std::vector<uint8_t>& data_out)
+{
+	if (hex.size() % 2 != 0) {
+		return false;
+	}
+	data_out.clear();
+	for (size_t i = 0; i < hex.size(); i += 2) {
+		char* end;
+		std::string byte = hex.substr(i, 2);
+		long v = strtol(byte.c_str(), &end, 16);
+		if (*end != '\0') {
+			return false;
+		}
+		data_out.push_back((uint8_t)v);
+	}
+	return true;
+}
+
 } // ft
\ No newline at end of file
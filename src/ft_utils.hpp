@@ -9,6 +9,8 @@
 
 #include <filesystem>
 #include <memory>
+#include <string>
+#include <vector>
 
 #include <boost/uuid/uuid.hpp>
 
@@ -22,5 +24,11 @@ namespace ft {
 
 boost::uuids::uuid getClientUUID(const std::filesystem::path& uuid_file);
 
+/// @brief Lowercase hexadecimal text of the data
+std::string toHex(const std::vector<uint8_t>& data);
+
+/// @brief Data of an hexadecimal text, false if it is not valid
+bool fromHex(const std::string& hex, std::vector<uint8_t>& data_out);
+
 } // ft
 #endif // FT_UTILS_H
\ No newline at end of file
@@ -19,6 +19,10 @@
 
 namespace ft { namespace loop {
 
+// Milliseconds a poll waits for events, unless a Pollable has something due
+// before
+static const int POLL_TIMEOUT_MS = 500;
+
 PollGroup::PollGroup(uint16_t max_pollables)
 : max_pollables(max_pollables)
 {}
@@ -60,8 +64,18 @@ void PollGroup::remove(PollablePtr pollable)
 
 bool PollGroup::pollAndHandle()
 {
-	// Block and wait until there is something to process
-	int ret = poll(this->cached_pollfd.data(), this->cached_pollfd.size(), 500);
+	// Block and wait until there is something to process, or something is
+	// due in time
+	int timeout = POLL_TIMEOUT_MS;
+	for (const auto& pollable : this->pollables) {
+		int pollable_timeout = pollable->getTimeout();
+		if (pollable_timeout >= 0) {
+			timeout = std::min(timeout, pollable_timeout);
+		}
+	}
+
+	int ret = poll(this->cached_pollfd.data(), this->cached_pollfd.size(),
+			timeout);
 	if (ret < 0) {
 		throw std::system_error(
 				std::make_error_code(static_cast<std::errc>(errno)),
@@ -95,6 +109,18 @@ bool PollGroup::pollAndHandle()
 		}
 	}
 
+	// The ones removed above are left out
+	for (const auto& pollable : this->pollables) {
+		if (pollable->getTimeout() < 0) {
+			continue;
+		}
+		try {
+			pollable->handleTimeout();
+		} catch(std::exception& e) {
+			std::cout << e.what() << std::endl;
+		}
+	}
+
 	return true;
 }
 
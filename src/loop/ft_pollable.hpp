@@ -24,7 +24,8 @@ FT_DECLARE_CLASS(Pollable)
 /// time with other objects.
 ///
 /// Whenever an event is available in the fd, the handleEvent() method is
-/// invoked.
+/// invoked. A Pollable with something to do in time (see getTimeout()) also
+/// gets handleTimeout() invoked after each poll.
 class Pollable {
 protected:
 	int fd;
@@ -39,6 +40,15 @@ public:
 
 	/// @brief Handle events available associated with the fd
 	virtual void handleEvent() = 0;
+
+	/// @brief Milliseconds the poll may wait before handleTimeout() is due
+	///
+	/// Negative (the default) if the Pollable has nothing to do in time.
+	virtual int getTimeout() const { return -1; }
+
+	/// @brief Does what is due in time, called after each poll if getTimeout()
+	/// was not negative
+	virtual void handleTimeout() {}
 };
 
 } // loop
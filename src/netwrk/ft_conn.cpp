@@ -15,6 +15,7 @@
 #include <netinet/in.h>
 #include <netinet/ip.h>
 #include <netinet/tcp.h>
+#include <poll.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -31,10 +32,28 @@
 
 namespace ft { namespace netwrk {
 
+// Held messages are written once they reach this length, even if Requests
+// are still being handled
+static const size_t COALESCE_MAX_BYTES = 64U * 1024U;
+
+// Held messages are also written once the first of them waited this long, so
+// a long series of Requests does not delay the first replies
+static const std::chrono::milliseconds COALESCE_MAX_DELAY(5);
+
+// Milliseconds a send waits for the peer to read before closing the connection
+static const int SEND_TIMEOUT_MS = 30000;
+
 request::RequestBrokerPtr    Connection::sm_request_broker;
+std::atomic<uint64_t>        Connection::sm_msgs_sent(0);
+std::atomic<uint64_t>        Connection::sm_writes(0);
 
 Connection::Connection(int fd)
 : Pollable(fd)
+, out_msgs(0)
+, corked(false)
+, n_handling(0)
+, n_msgs_sent(0)
+, n_writes(0)
 {
 	// This Constructor handles the connection on server side after return by
 	// accept()
@@ -48,6 +67,11 @@ Connection::Connection(int fd)
 
 Connection::Connection(const std::string& host, const uint16_t port)
 : Pollable(-1)
+, out_msgs(0)
+, corked(false)
+, n_handling(0)
+, n_msgs_sent(0)
+, n_writes(0)
 {
 	// This constructor handles the connection from the client to the server
 
@@ -108,7 +132,15 @@ Connection::Connection(const std::string& host, const uint16_t port)
 
 Connection::~Connection()
 {
-	std::cout << "FT        | connection end" << std::endl;
+	try {
+		flush();
+	} catch (...) {
+		// The peer may be already gone
+	}
+
+	std::cout << "FT        | connection end - " << this->n_msgs_sent <<
+			" messages sent, " << getMsgsPerWrite() << " per write" <<
+			std::endl;
 	if (this->fd >= 0) {
 		(void)shutdown(this->fd, SHUT_RDWR);
 		(void)close(this->fd);
@@ -204,20 +236,130 @@ void Connection::handleMessage()
 
 	// Handle the request over to the RequestBroker
 	if (sm_request_broker) {
+		this->n_handling++;
 		sm_request_broker->queueRequest(req);
 	}
 }
 
 void Connection::sendBuffer(const std::vector<uint8_t>& buf)
 {
-	// TODO: handle concurrent access
-	if (send(this->fd, (const void*)buf.data(), (size_t)buf.size(), 0) < 0) {
-		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+	std::lock_guard<std::mutex> lock(this->send_mutex);
+
+	auto now = std::chrono::steady_clock::now();
+	if (this->out_buf.empty() && !this->corked) {
+		this->out_since = now;
+	}
+	this->out_buf.insert(this->out_buf.end(), buf.begin(), buf.end());
+	this->out_msgs++;
+
+	// Hold the message while more replies to the pending Requests may follow.
+	// Once held for too long, nothing more is waited for.
+	bool pending = this->n_handling > 0;
+	if (!pending || now - this->out_since >= COALESCE_MAX_DELAY) {
+		flushLocked(false);
+	} else if (this->out_buf.size() >= COALESCE_MAX_BYTES) {
+		flushLocked(true);
+	}
+}
+
+int Connection::getTimeout() const
+{
+	// Messages are only held while Requests are handled
+	return this->n_handling > 0 ? (int)COALESCE_MAX_DELAY.count() : -1;
+}
+
+void Connection::handleTimeout()
+{
+	std::unique_lock<std::mutex> lock(this->send_mutex, std::try_to_lock);
+	if (lock.owns_lock() && (!this->out_buf.empty() || this->corked) &&
+			std::chrono::steady_clock::now() - this->out_since >=
+				COALESCE_MAX_DELAY) {
+		flushLocked(false);
+	}
+}
+
+void Connection::flush()
+{
+	std::lock_guard<std::mutex> lock(this->send_mutex);
+	flushLocked(false);
+}
+
+void Connection::requestHandled()
+{
+	if (--this->n_handling == 0) {
+		flush();
+	}
+}
+
+double Connection::getMsgsPerWrite() const
+{
+	return this->n_writes > 0 ? (double)this->n_msgs_sent / this->n_writes : 0;
+}
+
+double Connection::getTotalMsgsPerWrite()
+{
+	uint64_t writes = sm_writes;
+	return writes > 0 ? (double)sm_msgs_sent / writes : 0;
+}
+
+void Connection::flushLocked(bool more)
+{
+	if (this->out_buf.empty()) {
+		if (this->corked && !more) {
+			// The tail of the last write (less than a segment) is held by the
+			// kernel after MSG_MORE until more data is sent. Setting
+			// TCP_NODELAY again pushes it, as an empty send() does not.
+			int no_delay = 1;
+			(void)setsockopt(this->fd, IPPROTO_TCP, TCP_NODELAY, &no_delay,
+					sizeof(int));
+			this->corked = false;
+		}
+		return;
+	}
+
+	size_t sent = 0;
+	size_t n_writes = 0;
+	while (sent < this->out_buf.size()) {
+		ssize_t ret = send(this->fd, (const void*)(this->out_buf.data() + sent),
+				this->out_buf.size() - sent,
+				MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+		if (ret >= 0) {
+			sent += ret;
+			n_writes++;
+		} else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			// Socket buffer full, wait until the peer reads some data. A peer
+			// not reading is dropped, not to hold the thread sending (and the
+			// ones waiting for send_mutex) for ever. The PollGroup removes the
+			// connection once shut down.
+			struct pollfd pfd = { this->fd, POLLOUT, 0 };
+			if (poll(&pfd, 1, SEND_TIMEOUT_MS) == 0) {
+				(void)shutdown(this->fd, SHUT_RDWR);
+				this->out_buf.clear();
+				this->out_msgs = 0;
+				throw std::system_error(
+						std::make_error_code(std::errc::timed_out),
+						"Peer not reading from the socket");
+			}
+		} else if (errno != EINTR) {
+			this->out_buf.clear();
+			this->out_msgs = 0;
 			throw std::system_error(
 					std::make_error_code(static_cast<std::errc>(errno)),
 					"Failed sending data through the socket");
 		}
 	}
+
+	// The tail held by the kernel is timed from now
+	this->corked = more;
+	this->out_since = std::chrono::steady_clock::now();
+
+	this->n_msgs_sent += this->out_msgs;
+	this->n_writes    += n_writes;
+	sm_msgs_sent      += this->out_msgs;
+	sm_writes         += n_writes;
+
+	this->out_buf.clear();
+	this->out_msgs = 0;
 }
 
 void Connection::setRequestBroker(request::RequestBrokerPtr req_broker)
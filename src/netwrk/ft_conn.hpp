@@ -7,6 +7,10 @@
 #ifndef FT_NETWRK_CONN_H
 #define FT_NETWRK_CONN_H
 
+#include <atomic>
+#include <chrono>
+#include <mutex>
+
 #include "ft_utils.hpp"
 #include "request/ft_req_brkr.hpp"
 #include "loop/ft_pollable.hpp"
@@ -32,6 +36,15 @@ FT_DECLARE_CLASS(Connection)
 /// The RequestHandler may use the method sendBuffer() in the Connection to
 /// reply to the Request.
 ///
+/// Outgoing messages are coalesced: while Requests received from the
+/// Connection are still queued or being handled, the messages sent are
+/// collected and written at once when the last of them is handled (or when
+/// COALESCE_MAX_BYTES are collected, or the first of them was held for
+/// COALESCE_MAX_DELAY). This way the replies to all the messages read in one
+/// loop iteration usually go out in a single send(). The delay is checked by
+/// the PollGroup too (see getTimeout()), so the messages held are written
+/// even if the Requests being handled are blocked.
+///
 /// The Connection implements the Pollable interface, making it possible to be
 /// added to a PollGroup.
 class Connection : virtual public loop::Pollable,
@@ -43,6 +56,32 @@ private:
 	/// Buffer to collect bytes until completing the message to be parsed
 	std::vector<uint8_t>    msg_buf;
 	size_t                  msg_len;
+
+	/// Serializes the messages sent from several RequestBroker threads
+	std::mutex              send_mutex;
+
+	/// Messages waiting to be written, and how many there are
+	std::vector<uint8_t>    out_buf;
+	size_t                  out_msgs;
+
+	/// When the first of the messages waiting to be written (or the tail
+	/// held by the kernel) was held
+	std::chrono::steady_clock::time_point out_since;
+
+	/// True if the last data was written with MSG_MORE, so the kernel may
+	/// still hold its tail
+	bool                    corked;
+
+	/// Requests from this Connection queued or being handled
+	std::atomic<uint32_t>   n_handling;
+
+	/// Number of messages sent and of send() calls used to write them
+	uint64_t                n_msgs_sent;
+	uint64_t                n_writes;
+
+	/// Same as above, for all the Connections
+	static std::atomic<uint64_t> sm_msgs_sent;
+	static std::atomic<uint64_t> sm_writes;
 public:
 	/// @brief Used to build Connections from sockets obtained from accept()
 	Connection(int fd);
@@ -57,12 +96,54 @@ public:
 	/// This is part of the Pollable interface
 	virtual void handleEvent();
 
+	/// @brief COALESCE_MAX_DELAY while Requests are being handled, so the
+	/// PollGroup checks the messages held in time
+	///
+	/// This is part of the Pollable interface
+	virtual int getTimeout() const;
+
+	/// @brief Writes the messages held for COALESCE_MAX_DELAY
+	///
+	/// This is part of the Pollable interface. Does nothing if another thread
+	/// is sending, not to block the PollGroup.
+	virtual void handleTimeout();
+
+	/// @brief Sends the whole buffer through the socket
+	///
+	/// Thread safe. If the socket buffer is full, waits until it can be
+	/// written, so messages are never truncated nor interleaved. If the peer
+	/// does not read for SEND_TIMEOUT_MS, the connection is shut down and
+	/// std::system_error (ETIMEDOUT) is thrown.
+	///
+	/// The buffer may be held to be coalesced with the next ones until the
+	/// Requests being handled from this Connection are completed.
 	virtual void sendBuffer(const std::vector<uint8_t>& buf);
 
+	/// @brief Writes the messages held for coalescing
+	void flush();
+
+	/// @brief Notifies a Request from this Connection is handled
+	///
+	/// Called from the RequestBroker. Once all the Requests are handled, the
+	/// messages held are written.
+	void requestHandled();
+
+	/// @brief Average number of messages written per send() call
+	double getMsgsPerWrite() const;
+
+	/// @brief Same as above, for all the Connections
+	static double getTotalMsgsPerWrite();
+
 	static void setRequestBroker(request::RequestBrokerPtr req_broker);
 
 private:
 	virtual void handleMessage();
+
+	/// @brief Writes out_buf, send_mutex must be locked
+	///
+	/// If more is set, the kernel is told more data follows (MSG_MORE).
+	/// Otherwise, any tail held from a previous write is pushed too.
+	void flushLocked(bool more);
 };
 
 } // netwrk
@@ -39,8 +39,14 @@ void setup_socket_options(int fd)
 				"Failed to set socket flags to non block");
 	}
 
-	//int no_delay = 1;
-	//setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &no_delay, sizeof(int));
+	// Messages are coalesced by the Connection before being written, so there
+	// is no need to wait for more data to fill the segments
+	int no_delay = 1;
+	if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &no_delay, sizeof(int)) < 0) {
+		throw std::system_error(
+				std::make_error_code(static_cast<std::errc>(errno)),
+				"Failed to set socket no delay flag");
+	}
 
 	// Set the TCP keep alive setting for the connection.
 	// The connection will be dropped after 10s of non-response to keep alive
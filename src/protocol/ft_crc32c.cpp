@@ -0,0 +1,155 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+// Released under MIT License
+// Copyright (c) 2020 Hernan Perrone (hernan.perrone@gmail.com)
+//////////////////////////////////////////////////////////////////////////////
+
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define FT_CRC32C_SSE42
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define FT_CRC32C_ARMV8
+#endif
+
+#include "protocol/ft_crc32c.hpp"
+
+namespace ft { namespace proto {
+
+// CRC32C polynomial (reversed)
+static const uint32_t CRC32C_POLY = 0x82F63B78U;
+
+typedef uint32_t (*Crc32cFn)(const uint8_t* data, size_t len, uint32_t crc);
+
+/// Tables for the slicing-by-8 software implementation
+///
+/// table[0] is the classic byte-wise table, table[k] gives the CRC of a byte
+/// followed by k zero bytes, so 8 bytes are processed per iteration.
+class Crc32cTables {
+public:
+	uint32_t table[8][256];
+
+	Crc32cTables() {
+		for (uint32_t i = 0; i < 256; i++) {
+			uint32_t crc = i;
+			for (int bit = 0; bit < 8; bit++) {
+				crc = (crc >> 1) ^ ((crc & 1U) ? CRC32C_POLY : 0U);
+			}
+			this->table[0][i] = crc;
+		}
+
+		for (uint32_t i = 0; i < 256; i++) {
+			for (int k = 1; k < 8; k++) {
+				uint32_t prev = this->table[k - 1][i];
+				this->table[k][i] = (prev >> 8) ^ this->table[0][prev & 0xff];
+			}
+		}
+	}
+};
+
+static uint32_t crc32c_sw(const uint8_t* data, size_t len, uint32_t crc)
+{
+	static const Crc32cTables tables;
+	const auto& t = tables.table;
+
+	crc = ~crc;
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	while (len >= 8) {
+		uint64_t v;
+		memcpy(&v, data, sizeof(v));
+		v ^= crc;
+		crc = t[7][v & 0xff] ^ t[6][(v >> 8) & 0xff] ^
+				t[5][(v >> 16) & 0xff] ^ t[4][(v >> 24) & 0xff] ^
+				t[3][(v >> 32) & 0xff] ^ t[2][(v >> 40) & 0xff] ^
+				t[1][(v >> 48) & 0xff] ^ t[0][v >> 56];
+		data += 8;
+		len -= 8;
+	}
+#endif
+
+	while (len-- > 0) {
+		crc = t[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+	}
+
+	return ~crc;
+}
+
+#if defined(FT_CRC32C_SSE42)
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(const uint8_t* data, size_t len, uint32_t crc)
+{
+	crc = ~crc;
+
+#if defined(__x86_64__)
+	uint64_t crc64 = crc;
+	while (len >= 8) {
+		uint64_t v;
+		memcpy(&v, data, sizeof(v));
+		crc64 = _mm_crc32_u64(crc64, v);
+		data += 8;
+		len -= 8;
+	}
+	crc = (uint32_t)crc64;
+#endif
+
+	while (len-- > 0) {
+		crc = _mm_crc32_u8(crc, *data++);
+	}
+
+	return ~crc;
+}
+
+static Crc32cFn select_crc32c()
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse4.2") ? crc32c_hw : crc32c_sw;
+}
+
+#elif defined(FT_CRC32C_ARMV8)
+
+static uint32_t crc32c_hw(const uint8_t* data, size_t len, uint32_t crc)
+{
+	crc = ~crc;
+
+	while (len >= 8) {
+		uint64_t v;
+		memcpy(&v, data, sizeof(v));
+		crc = __crc32cd(crc, v);
+		data += 8;
+		len -= 8;
+	}
+
+	while (len-- > 0) {
+		crc = __crc32cb(crc, *data++);
+	}
+
+	return ~crc;
+}
+
+static Crc32cFn select_crc32c()
+{
+	// Built for a CPU with the CRC extension
+	return crc32c_hw;
+}
+
+#else
+
+static Crc32cFn select_crc32c()
+{
+	return crc32c_sw;
+}
+
+#endif
+
+uint32_t crc32c(const uint8_t* data, size_t len, uint32_t crc)
+{
+	static const Crc32cFn impl = select_crc32c();
+	return impl(data, len, crc);
+}
+
+} // proto
+} // ft
@@ -0,0 +1,28 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+// Released under MIT License
+// Copyright (c) 2020 Hernan Perrone (hernan.perrone@gmail.com)
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef FT_PROTO_CRC32C_H
+#define FT_PROTO_CRC32C_H
+
+#include <cstddef>
+#include <cstdint>
+
+namespace ft { namespace proto {
+
+/// @brief CRC32C (Castagnoli) of the data
+///
+/// Used to check the integrity of the file chunks on the wire. Uses the CRC
+/// instructions of the CPU when available (SSE4.2 on x86, CRC extension on
+/// ARMv8), or a slicing-by-8 table otherwise.
+///
+/// The CRC of several pieces of data can be calculated passing the CRC of the
+/// previous pieces as crc.
+uint32_t crc32c(const uint8_t* data, size_t len, uint32_t crc = 0U);
+
+} // proto
+} // ft
+
+#endif // FT_PROTO_CRC32C_H
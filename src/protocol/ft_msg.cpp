@@ -16,18 +16,27 @@ namespace ft { namespace proto {
 // -- Helper functions for writing and parsing raw messages -- //
 // -- Every numeric type is in network byte order           -- //
 
+static uint64_t getU64(std::vector<uint8_t>::const_iterator& it);
 static uint32_t getU32(std::vector<uint8_t>::const_iterator& it);
 static uint16_t getU16(std::vector<uint8_t>::const_iterator& it);
+static void putU64(std::back_insert_iterator<std::vector<uint8_t>>& it,
+		uint64_t val);
 static void putU32(std::back_insert_iterator<std::vector<uint8_t>>& it,
 		uint32_t val);
 static void putU16(std::back_insert_iterator<std::vector<uint8_t>>& it,
 		uint16_t val);
+static std::string getStr(std::vector<uint8_t>::const_iterator& it);
+static void checkLeft(const std::vector<uint8_t>& buf,
+		std::vector<uint8_t>::const_iterator it, size_t len);
+static void putStr(std::back_insert_iterator<std::vector<uint8_t>>& it,
+		const std::string& val);
 
 Message::Message(const std::vector<uint8_t>& buf)
 {
 	// -- Parses the raw message buffer and fills the class members -- //
 
 	auto it           = buf.begin();
+	checkLeft(buf, it, 4U + 2U + 2U + this->client_uuid.size() + 1U);
 	this->msg_type    = (MessageType)getU32(it);
 	this->msg_len     = getU16(it);
 	this->seq_number  = getU16(it);
@@ -39,30 +48,182 @@ Message::Message(const std::vector<uint8_t>& buf)
 
 	// File name
 	int file_name_len = *it; it++;
+	checkLeft(buf, it, file_name_len);
 	std::copy_n(it, file_name_len, std::back_inserter(this->file_name));
 	std::advance(it, file_name_len);
 
 	// Parse variable part, depending on the message type
 	uint16_t chunk_len;
+	uint16_t n_items;
 	switch(this->msg_type) {
 	case MSGTYPE_FILE_OFFER:
+		checkLeft(buf, it, 9U + HASH_SIZE);
 		this->offer.file_size     = getU32(it);
 		this->offer.file_n_chunks = getU32(it);
 		std::copy_n(it, HASH_SIZE, std::back_inserter(this->offer.file_hash));
+		std::advance(it, HASH_SIZE);
+		this->offer.hash_algo     = *it; it++;
+
+		// Small files may have their contents after the hash
+		this->offer.has_inline = (it != buf.end());
+		if (this->offer.has_inline) {
+			checkLeft(buf, it, 2);
+			chunk_len = getU16(it);
+			checkLeft(buf, it, chunk_len);
+			std::copy_n(it, chunk_len,
+					std::back_inserter(this->offer.inline_data));
+		}
 		break;
 	case MSGTYPE_FILE_CHUNK_REQ:
+		checkLeft(buf, it, 8);
 		this->chunk_req.chunk_idx_first = getU32(it);
 		this->chunk_req.chunk_idx_last  = getU32(it);
 		break;
 	case MSGTYPE_FILE_CHUNK_DATA:
-		this->chunk_data.idx  = getU32(it);
-		chunk_len             = getU16(it);
+		checkLeft(buf, it, 6);
+		this->chunk_data.idx    = getU32(it);
+		chunk_len               = getU16(it);
+		checkLeft(buf, it, chunk_len + (chunk_len == 0 ? 8U : 4U));
 		std::copy_n(it, chunk_len, std::back_inserter(this->chunk_data.data));
-		this->chunk_data.hash.resize(CHUNK_HASH_SIZE);
+		std::advance(it, chunk_len);
+
+		// Zero chunks have no data, but the number of them instead
+		this->chunk_data.n_zero = (chunk_len == 0) ? getU32(it) : 0;
+		this->chunk_data.crc    = getU32(it);
+
+		// Chunks of files hashed as a tree have the proof after the data
+		if (it != buf.end()) {
+			n_items = *it; it++;
+			if (n_items > MAX_PROOF_NODES) {
+				throw std::length_error("Invalid proof length");
+			}
+			checkLeft(buf, it, n_items * CHUNK_HASH_SIZE);
+			std::copy_n(it, n_items * CHUNK_HASH_SIZE,
+					std::back_inserter(this->chunk_data.proof));
+			std::advance(it, n_items * CHUNK_HASH_SIZE);
+		}
 		break;
 	case MSGTYPE_FILE_COMPLETE:
 		// no additional information in this king of message
 		break;
+	case MSGTYPE_FILE_DELTA_SIGS:
+		checkLeft(buf, it, 14);
+		this->delta_sigs.basis_size  = getU32(it);
+		this->delta_sigs.block_size  = getU32(it);
+		this->delta_sigs.block_first = getU32(it);
+		n_items                      = getU16(it);
+		checkLeft(buf, it, n_items * 12U);
+		this->delta_sigs.blocks.resize(n_items);
+		for (auto& block : this->delta_sigs.blocks) {
+			block.weak   = getU32(it);
+			block.strong = getU64(it);
+		}
+		break;
+	case MSGTYPE_FILE_DELTA_DATA:
+		checkLeft(buf, it, 8);
+		this->delta_data.chunk_first = getU32(it);
+		this->delta_data.n_chunks    = getU16(it);
+		n_items                      = getU16(it);
+
+		// The shortest op is an empty literal: its type and length
+		checkLeft(buf, it, n_items * 3U);
+		this->delta_data.ops.resize(n_items);
+		for (auto& op : this->delta_data.ops) {
+			checkLeft(buf, it, 3);
+			op.literal = (*it == DELTA_OP_LITERAL); it++;
+			if (op.literal) {
+				op.src_offset = 0;
+				op.len        = getU16(it);
+				checkLeft(buf, it, op.len);
+				std::copy_n(it, op.len, std::back_inserter(op.data));
+				std::advance(it, op.len);
+			} else {
+				checkLeft(buf, it, 8);
+				op.src_offset = getU32(it);
+				op.len        = getU32(it);
+			}
+		}
+		break;
+	case MSGTYPE_FILE_CDC_REQ:
+		checkLeft(buf, it, 5);
+		this->cdc_req.what = *it; it++;
+		this->cdc_req.idx  = getU32(it);
+		break;
+	case MSGTYPE_FILE_CDC_RECIPE:
+		checkLeft(buf, it, 10);
+		this->cdc_recipe.n_total   = getU32(it);
+		this->cdc_recipe.idx_first = getU32(it);
+		n_items                    = getU16(it);
+		checkLeft(buf, it, n_items * (2U + CHUNK_HASH_SIZE));
+		this->cdc_recipe.entries.resize(n_items);
+		for (auto& entry : this->cdc_recipe.entries) {
+			entry.len = getU16(it);
+			std::copy_n(it, CHUNK_HASH_SIZE, std::back_inserter(entry.hash));
+			std::advance(it, CHUNK_HASH_SIZE);
+		}
+		break;
+	case MSGTYPE_FILE_CDC_DATA:
+		checkLeft(buf, it, 6);
+		this->cdc_data.idx = getU32(it);
+		chunk_len          = getU16(it);
+		checkLeft(buf, it, chunk_len);
+		std::copy_n(it, chunk_len, std::back_inserter(this->cdc_data.data));
+		break;
+	case MSGTYPE_FILE_MANIFEST:
+		checkLeft(buf, it, 10);
+		this->manifest.n_total   = getU32(it);
+		this->manifest.idx_first = getU32(it);
+		n_items                  = getU16(it);
+
+		// The shortest entry has an empty name and no inline data
+		checkLeft(buf, it, n_items * (11U + HASH_SIZE));
+		this->manifest.files.resize(n_items);
+		for (auto& file : this->manifest.files) {
+			checkLeft(buf, it, 1);
+			checkLeft(buf, it, 1U + *it + 10U + HASH_SIZE);
+			file.file_name     = getStr(it);
+			file.file_size     = getU32(it);
+			file.file_n_chunks = getU32(it);
+			std::copy_n(it, HASH_SIZE, std::back_inserter(file.file_hash));
+			std::advance(it, HASH_SIZE);
+			file.hash_algo  = *it; it++;
+			file.has_inline = (*it != 0); it++;
+			if (file.has_inline) {
+				checkLeft(buf, it, 2);
+				chunk_len = getU16(it);
+				checkLeft(buf, it, chunk_len);
+				std::copy_n(it, chunk_len,
+						std::back_inserter(file.inline_data));
+				std::advance(it, chunk_len);
+			}
+		}
+		break;
+	case MSGTYPE_FILE_MANIFEST_STATUS:
+		checkLeft(buf, it, 2);
+		n_items = getU16(it);
+
+		// The shortest entry has an empty name and no ranges
+		checkLeft(buf, it, n_items * 8U);
+		this->manifest_status.files.resize(n_items);
+		for (auto& file : this->manifest_status.files) {
+			checkLeft(buf, it, 1);
+			checkLeft(buf, it, 1U + *it + 7U);
+			file.file_name = getStr(it);
+			file.status    = *it; it++;
+			file.n_missing = getU32(it);
+			n_items        = getU16(it);
+			checkLeft(buf, it, n_items * 8U);
+			file.ranges.resize(n_items);
+			for (auto& range : file.ranges) {
+				range.first = getU32(it);
+				range.last  = getU32(it);
+			}
+		}
+		break;
+	case MSGTYPE_FILE_ERROR:
+		checkLeft(buf, it, 1);
+		this->error.code = *it; it++;
+		break;
 	default:
 		throw std::runtime_error("Not supported Msg Type");
 	}
@@ -88,6 +249,16 @@ void Message::serialize(std::vector<uint8_t>& out)
 		putU32(tmpout, this->offer.file_size);
 		putU32(tmpout, this->offer.file_n_chunks);
 		std::copy_n(this->offer.file_hash.begin(), HASH_SIZE, tmpout);
+		*tmpout = this->offer.hash_algo;
+		if (this->offer.has_inline) {
+			if (this->offer.inline_data.size() > OFFER_INLINE_MAX_SIZE) {
+				throw std::length_error("Invalid inline data length");
+			}
+
+			putU16(tmpout, (uint16_t)this->offer.inline_data.size());
+			std::copy(this->offer.inline_data.begin(),
+					this->offer.inline_data.end(), tmpout);
+		}
 		break;
 	case MSGTYPE_FILE_CHUNK_REQ:
 		putU32(tmpout, this->chunk_req.chunk_idx_first);
@@ -95,21 +266,132 @@ void Message::serialize(std::vector<uint8_t>& out)
 		break;
 	case MSGTYPE_FILE_CHUNK_DATA:
 		putU32(tmpout, this->chunk_data.idx);
-		if (this->chunk_data.data.size() > MAX_MSG_PAYLOAD_SIZE ||
-				this->chunk_data.data.size() == 0) {
-			throw std::length_error("Invalid chunk length");
+		if (this->chunk_data.n_zero > 0) {
+			putU16(tmpout, 0);
+			putU32(tmpout, this->chunk_data.n_zero);
+		} else {
+			if (this->chunk_data.data.size() >
+					CHUNK_RANGE_MAX_CHUNKS * MAX_MSG_PAYLOAD_SIZE ||
+					this->chunk_data.data.size() == 0) {
+				throw std::length_error("Invalid chunk length");
+			}
+
+			putU16(tmpout, (uint16_t)this->chunk_data.data.size());
+			std::copy(this->chunk_data.data.begin(),
+					this->chunk_data.data.end(), tmpout);
 		}
+		putU32(tmpout, this->chunk_data.crc);
+
+		if (!this->chunk_data.proof.empty()) {
+			if (this->chunk_data.proof.size() >
+					MAX_PROOF_NODES * CHUNK_HASH_SIZE) {
+				throw std::length_error("Invalid proof length");
+			}
 
-		putU16(tmpout, (uint16_t)this->chunk_data.data.size());
-		std::copy(this->chunk_data.data.begin(),
-				this->chunk_data.data.end(), tmpout);
+			*tmpout = (uint8_t)(this->chunk_data.proof.size() /
+					CHUNK_HASH_SIZE);
+			std::copy(this->chunk_data.proof.begin(),
+					this->chunk_data.proof.end(), tmpout);
+		}
 		break;
 	case MSGTYPE_FILE_COMPLETE:
 		break;
+	case MSGTYPE_FILE_DELTA_SIGS:
+		putU32(tmpout, this->delta_sigs.basis_size);
+		putU32(tmpout, this->delta_sigs.block_size);
+		putU32(tmpout, this->delta_sigs.block_first);
+		putU16(tmpout, (uint16_t)this->delta_sigs.blocks.size());
+		for (const auto& block : this->delta_sigs.blocks) {
+			putU32(tmpout, block.weak);
+			putU64(tmpout, block.strong);
+		}
+		break;
+	case MSGTYPE_FILE_DELTA_DATA:
+		putU32(tmpout, this->delta_data.chunk_first);
+		putU16(tmpout, (uint16_t)this->delta_data.n_chunks);
+		putU16(tmpout, (uint16_t)this->delta_data.ops.size());
+		for (const auto& op : this->delta_data.ops) {
+			if (op.literal) {
+				*tmpout = DELTA_OP_LITERAL;
+				putU16(tmpout, (uint16_t)op.data.size());
+				std::copy(op.data.begin(), op.data.end(), tmpout);
+			} else {
+				*tmpout = DELTA_OP_COPY;
+				putU32(tmpout, op.src_offset);
+				putU32(tmpout, op.len);
+			}
+		}
+		break;
+	case MSGTYPE_FILE_CDC_REQ:
+		*tmpout = this->cdc_req.what;
+		putU32(tmpout, this->cdc_req.idx);
+		break;
+	case MSGTYPE_FILE_CDC_RECIPE:
+		putU32(tmpout, this->cdc_recipe.n_total);
+		putU32(tmpout, this->cdc_recipe.idx_first);
+		putU16(tmpout, (uint16_t)this->cdc_recipe.entries.size());
+		for (const auto& entry : this->cdc_recipe.entries) {
+			putU16(tmpout, (uint16_t)entry.len);
+			std::copy_n(entry.hash.begin(), CHUNK_HASH_SIZE, tmpout);
+		}
+		break;
+	case MSGTYPE_FILE_CDC_DATA:
+		putU32(tmpout, this->cdc_data.idx);
+		if (this->cdc_data.data.size() > UINT16_MAX ||
+				this->cdc_data.data.size() == 0) {
+			throw std::length_error("Invalid chunk length");
+		}
+
+		putU16(tmpout, (uint16_t)this->cdc_data.data.size());
+		std::copy(this->cdc_data.data.begin(), this->cdc_data.data.end(),
+				tmpout);
+		break;
+	case MSGTYPE_FILE_MANIFEST:
+		putU32(tmpout, this->manifest.n_total);
+		putU32(tmpout, this->manifest.idx_first);
+		putU16(tmpout, (uint16_t)this->manifest.files.size());
+		for (const auto& file : this->manifest.files) {
+			putStr(tmpout, file.file_name);
+			putU32(tmpout, file.file_size);
+			putU32(tmpout, file.file_n_chunks);
+			std::copy_n(file.file_hash.begin(), HASH_SIZE, tmpout);
+			*tmpout = file.hash_algo;
+			*tmpout = file.has_inline ? 1 : 0;
+			if (file.has_inline) {
+				if (file.inline_data.size() > OFFER_INLINE_MAX_SIZE) {
+					throw std::length_error("Invalid inline data length");
+				}
+
+				putU16(tmpout, (uint16_t)file.inline_data.size());
+				std::copy(file.inline_data.begin(), file.inline_data.end(),
+						tmpout);
+			}
+		}
+		break;
+	case MSGTYPE_FILE_MANIFEST_STATUS:
+		putU16(tmpout, (uint16_t)this->manifest_status.files.size());
+		for (const auto& file : this->manifest_status.files) {
+			putStr(tmpout, file.file_name);
+			*tmpout = file.status;
+			putU32(tmpout, file.n_missing);
+			putU16(tmpout, (uint16_t)file.ranges.size());
+			for (const auto& range : file.ranges) {
+				putU32(tmpout, range.first);
+				putU32(tmpout, range.last);
+			}
+		}
+		break;
+	case MSGTYPE_FILE_ERROR:
+		*tmpout = this->error.code;
+		break;
 	default:
 		throw std::invalid_argument("Invalid MessageType");
 	}
 
+	if (tmpbuf.size() > MAX_TCP_MSG_SIZE) {
+		throw std::length_error("Message too long");
+	}
+
 	// Once the contents are complete, write the message with the envelope
 	auto itout = std::back_inserter(out);
 	putU32(itout, this->msg_type);
@@ -117,6 +399,13 @@ void Message::serialize(std::vector<uint8_t>& out)
 	std::copy(tmpbuf.begin(), tmpbuf.end(), itout);
 }
 
+static uint64_t getU64(std::vector<uint8_t>::const_iterator& it)
+{
+	uint64_t ret = ((uint64_t)getU32(it)) << 32;
+	ret |= getU32(it);
+	return ret;
+}
+
 static uint32_t getU32(std::vector<uint8_t>::const_iterator& it)
 {
 	uint32_t ret = 0;
@@ -135,6 +424,13 @@ static uint16_t getU16(std::vector<uint8_t>::const_iterator& it)
 	return ret;
 }
 
+static void putU64(std::back_insert_iterator<std::vector<uint8_t>>& it,
+		uint64_t val)
+{
+	putU32(it, (uint32_t)((val >> 32) & 0xffffffff));
+	putU32(it, (uint32_t)((val      ) & 0xffffffff));
+}
+
 static void putU32(std::back_insert_iterator<std::vector<uint8_t>>& it,
 		uint32_t val)
 {
@@ -151,5 +447,30 @@ static void putU16(std::back_insert_iterator<std::vector<uint8_t>>& it,
 	*it = (uint8_t)((val      ) & 0xff); it++;
 }
 
+static std::string getStr(std::vector<uint8_t>::const_iterator& it)
+{
+	int len = *it; it++;
+	std::string ret(it, it + len);
+	std::advance(it, len);
+	return ret;
+}
+
+static void checkLeft(const std::vector<uint8_t>& buf,
+		std::vector<uint8_t>::const_iterator it, size_t len)
+{
+	// The counts and lengths come from the peer, so they are not trusted
+	if ((size_t)std::distance(it, buf.end()) < len) {
+		throw std::length_error("Invalid message length");
+	}
+}
+
+static void putStr(std::back_insert_iterator<std::vector<uint8_t>>& it,
+		const std::string& val)
+{
+	size_t len = val.length() < UINT8_MAX ? val.length() : UINT8_MAX;
+	*it = (uint8_t)(len & 0xff);
+	std::copy_n(val.begin(), len, it);
+}
+
 } // proto
 } // ft
\ No newline at end of file
@@ -34,18 +34,133 @@ static const size_t HASH_SIZE = 64U;
 // Using BLAKE2 for hashing chunks, but only 1 half of the digest
 static const size_t CHUNK_HASH_SIZE = 32U;
 
+// Delta transfer messages are only exchanged over TCP connections, so they may
+// use the whole range of the 16 bits message length field.
+static const size_t MAX_TCP_MSG_SIZE = UINT16_MAX;
+
+// Files up to this size are sent inline within the FILE OFFER (or the FILE
+// MANIFEST), so they are uploaded in a single round trip
+static const size_t OFFER_INLINE_MAX_SIZE = MAX_MSG_PAYLOAD_SIZE;
+
+// Maximum number of zero chunks reported in a single FILE CHUNK DATA message
+static const size_t ZERO_RUN_MAX_CHUNKS = 1U << 20;
+
+// Maximum number of consecutive chunks sent in a single FILE CHUNK DATA
+// message, so the data still fits in a TCP message
+static const size_t CHUNK_RANGE_MAX_CHUNKS = 16U;
+
+// Delta transfers use a truncated BLAKE2 digest as strong block checksum
+static const size_t DELTA_STRONG_HASH_SIZE = 8U;
+
 // MAGIC number used to tag the beginning of each message
 static const uint32_t MAGIC = 0x87FE7700;
 
 /// Message type, works also as a magic number
 typedef enum {
-	MSGTYPE_FILE_OFFER      = MAGIC | 0x01,
-	MSGTYPE_FILE_CHUNK_REQ  = MAGIC | 0x02,
-	MSGTYPE_FILE_CHUNK_DATA = MAGIC | 0x03,
-	MSGTYPE_FILE_COMPLETE   = MAGIC | 0x04,
+	MSGTYPE_FILE_OFFER           = MAGIC | 0x01,
+	MSGTYPE_FILE_CHUNK_REQ       = MAGIC | 0x02,
+	MSGTYPE_FILE_CHUNK_DATA      = MAGIC | 0x03,
+	MSGTYPE_FILE_COMPLETE        = MAGIC | 0x04,
+	MSGTYPE_FILE_DELTA_SIGS      = MAGIC | 0x05,
+	MSGTYPE_FILE_DELTA_DATA      = MAGIC | 0x06,
+	MSGTYPE_FILE_CDC_REQ         = MAGIC | 0x07,
+	MSGTYPE_FILE_CDC_RECIPE      = MAGIC | 0x08,
+	MSGTYPE_FILE_CDC_DATA        = MAGIC | 0x09,
+	MSGTYPE_FILE_MANIFEST        = MAGIC | 0x0A,
+	MSGTYPE_FILE_MANIFEST_STATUS = MAGIC | 0x0B,
+	MSGTYPE_FILE_ERROR           = MAGIC | 0x0C,
 	MSGTYPE_MAX
 } MessageType;
 
+/// Algorithm of the file hashes
+typedef enum {
+	HASH_ALGO_BLAKE2B      = 0x00, ///! BLAKE2b of the whole file
+	HASH_ALGO_BLAKE2B_TREE = 0x01, ///! Hash tree of the chunks (FileTree)
+	HASH_ALGO_BLAKE2BP     = 0x02, ///! BLAKE2bp of the whole file (Blake2bp)
+	HASH_ALGO_MAX
+} HashAlgo;
+
+// Maximum number of tree nodes in the proof of a FILE CHUNK DATA message. As
+// file sizes are 32 bits long, trees are at most 21 levels deep, and the proof
+// has at most 2 nodes per level.
+static const size_t MAX_PROOF_NODES = 48U;
+
+/// Delta instruction types (as encoded in FILE DELTA DATA messages)
+static const uint8_t DELTA_OP_COPY    = 0x01;
+static const uint8_t DELTA_OP_LITERAL = 0x02;
+
+/// Signature of a block of the file version already stored in the server
+struct DeltaBlockSig {
+	uint32_t weak;   ///! Rolling checksum of the block
+	uint64_t strong; ///! Truncated BLAKE2 digest [DELTA_STRONG_HASH_SIZE]
+};
+
+/// Delta instruction to rebuild a range of a file
+///
+/// Copy instructions take len bytes from the stored version at src_offset.
+/// Literal instructions carry the bytes in data.
+struct DeltaOp {
+	bool                 literal;    ///! True if data holds the bytes
+	uint32_t             src_offset; ///! Offset in the stored version (copy)
+	uint32_t             len;        ///! Number of bytes of the instruction
+	std::vector<uint8_t> data;       ///! Literal bytes (literal)
+};
+
+/// What is requested in FILE CDC REQUEST messages
+static const uint8_t CDC_REQ_RECIPE = 0x01;
+static const uint8_t CDC_REQ_CHUNK  = 0x02;
+
+/// Content defined chunk of a file, as listed in its recipe
+struct CdcEntry {
+	uint32_t             len;  ///! Length of the chunk
+	std::vector<uint8_t> hash; ///! Chunk fingerprint [CHUNK_HASH_SIZE]
+};
+
+/// File offered within a FILE MANIFEST message (same fields as FILE OFFER)
+struct ManifestEntry {
+	std::string          file_name;     ///! File name
+	uint32_t             file_size;     ///! Total file size
+	uint32_t             file_n_chunks; ///! Number of chunks
+	std::vector<uint8_t> file_hash;     ///! File hash [HASH_SIZE]
+	uint8_t              hash_algo;     ///! Algorithm of the hash (HashAlgo)
+	bool                 has_inline;    ///! True if the data is inline
+	std::vector<uint8_t> inline_data;   ///! Whole file contents (optional)
+};
+
+// Maximum number of files in a FILE MANIFEST message, and of ranges of missing
+// chunks per file in the FILE MANIFEST STATUS reply, so both fit in a message
+// even with the longest file names. Files are also added to a FILE MANIFEST
+// only while its length is below MANIFEST_MAX_MSG_SIZE (due to inline data).
+static const size_t MANIFEST_MAX_FILES_PER_MSG = 190U;
+static const size_t MANIFEST_MAX_RANGES        = 8U;
+static const size_t MANIFEST_MAX_MSG_SIZE      = MAX_TCP_MSG_SIZE - 1024U;
+
+/// Status of a file in FILE MANIFEST STATUS messages
+static const uint8_t MANIFEST_FILE_COMPLETE = 0x01;
+static const uint8_t MANIFEST_FILE_MISSING  = 0x02;
+static const uint8_t MANIFEST_FILE_REJECTED = 0x03;
+
+/// Why the server cannot receive a file, in FILE ERROR messages
+static const uint8_t FILE_ERROR_NO_SPACE = 0x01;
+static const uint8_t FILE_ERROR_IO       = 0x02;
+
+/// Range of chunks, both indexes included
+struct ChunkRange {
+	uint32_t first; ///! Index of the first chunk
+	uint32_t last;  ///! Index of the last chunk
+};
+
+/// Status of a file offered within a FILE MANIFEST message
+///
+/// For missing files, n_missing is the total number of chunks still missing
+/// and ranges lists the first ones of them.
+struct ManifestFileStatus {
+	std::string             file_name; ///! File name
+	uint8_t                 status;    ///! MANIFEST_FILE_*
+	uint32_t                n_missing; ///! Number of missing chunks
+	std::vector<ChunkRange> ranges;    ///! First ranges of missing chunks
+};
+
 /// @brief Message of the protocol
 ///
 /// Parses, serializes and holds the information of the messages that are used
@@ -63,21 +178,85 @@ public:
 		uint32_t             file_size;     ///! Total file size
 		uint32_t             file_n_chunks; ///! Number of chunks
 		std::vector<uint8_t> file_hash;     ///! File hash [FILE_HASH]
+		uint8_t              hash_algo;     ///! Algorithm of the hash (HashAlgo)
+		bool                 has_inline;    ///! True if the data is inline
+		std::vector<uint8_t> inline_data;   ///! Whole file contents (optional)
 	} offer;
 
 	/// Fields in FILE CHUNK REQUEST messages
 	struct {
-		uint32_t             chunk_idx_first; ///! Chunk index being requested
-		uint32_t             chunk_idx_last;  ///! (Not used)
+		uint32_t             chunk_idx_first; ///! First chunk index requested
+		uint32_t             chunk_idx_last;  ///! Last chunk index requested
 	} chunk_req;
 
 	/// Fields in FILE CHUNK DATA messages
+	///
+	/// The data may span up to CHUNK_RANGE_MAX_CHUNKS consecutive chunks from
+	/// idx. If n_zero is not 0, data is empty and the message reports n_zero
+	/// consecutive chunks, from idx, whose contents are all zeros.
+	///
+	/// crc is the CRC32C of the data, checked before saving it. For files
+	/// hashed as a tree, proof holds the nodes to verify the chunks against the
+	/// file hash.
 	struct {
-		uint32_t             idx;  ///! Chunk index
-		std::vector<uint8_t> data; ///! Chunk data [up to MAX_MSG_PAYLOAD_SIZE]
-		std::vector<uint8_t> hash; ///! Chunk hash [CHUNK_HASH_SIZE] (Not used)
+		uint32_t             idx;    ///! First chunk index
+		std::vector<uint8_t> data;   ///! Chunks data
+		uint32_t             crc;    ///! CRC32C of the data
+		uint32_t             n_zero; ///! Number of zero chunks from idx
+		std::vector<uint8_t> proof;  ///! Tree nodes [CHUNK_HASH_SIZE each]
 	} chunk_data;
 
+	/// Fields in FILE DELTA SIGNATURES messages
+	struct {
+		uint32_t                   basis_size;  ///! Size of the stored version
+		uint32_t                   block_size;  ///! Size of the signed blocks
+		uint32_t                   block_first; ///! Index of the first block
+		std::vector<DeltaBlockSig> blocks;      ///! Empty when requesting
+	} delta_sigs;
+
+	/// Fields in FILE DELTA DATA messages
+	struct {
+		uint32_t             chunk_first; ///! First chunk index rebuilt
+		uint32_t             n_chunks;    ///! Number of chunks rebuilt
+		std::vector<DeltaOp> ops;         ///! Instructions for those chunks
+	} delta_data;
+
+	/// Fields in FILE CDC REQUEST messages
+	struct {
+		uint8_t              what; ///! CDC_REQ_RECIPE or CDC_REQ_CHUNK
+		uint32_t             idx;  ///! First recipe entry or chunk index
+	} cdc_req;
+
+	/// Fields in FILE CDC RECIPE messages
+	struct {
+		uint32_t              n_total;   ///! Total number of entries
+		uint32_t              idx_first; ///! Index of the first entry
+		std::vector<CdcEntry> entries;   ///! Recipe entries
+	} cdc_recipe;
+
+	/// Fields in FILE CDC DATA messages
+	struct {
+		uint32_t             idx;  ///! Recipe entry index
+		std::vector<uint8_t> data; ///! Chunk data
+	} cdc_data;
+
+	/// Fields in FILE MANIFEST messages
+	struct {
+		uint32_t                   n_total;   ///! Total number of files
+		uint32_t                   idx_first; ///! Index of the first file
+		std::vector<ManifestEntry> files;     ///! Offered files
+	} manifest;
+
+	/// Fields in FILE MANIFEST STATUS messages
+	struct {
+		std::vector<ManifestFileStatus> files; ///! Status of the files
+	} manifest_status;
+
+	/// Fields in FILE ERROR messages
+	struct {
+		uint8_t              code; ///! FILE_ERROR_*
+	} error;
+
 public:
 	Message() {}
 	Message(const std::vector<uint8_t>& buf);
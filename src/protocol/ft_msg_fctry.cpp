@@ -4,8 +4,10 @@
 // Copyright (c) 2020 Hernan Perrone (hernan.perrone@gmail.com)
 //////////////////////////////////////////////////////////////////////////////
 
+#include <algorithm>
 #include <stdexcept>
 
+#include "protocol/ft_crc32c.hpp"
 #include "protocol/ft_msg_fctry.hpp"
 
 namespace ft { namespace proto {
@@ -22,12 +24,19 @@ MessagePtr MessageFactory::buildMsgOffer(uint16_t seq_number,
 	msg->offer.file_n_chunks = file->getNumOfChunks();
 	msg->offer.file_hash.resize(file->hash.size());
 	std::copy(file->hash.begin(), file->hash.end(), msg->offer.file_hash.begin());
+	msg->offer.hash_algo     = file->hash_algo;
+
+	// Small files are sent within the offer
+	msg->offer.has_inline    = file->size <= OFFER_INLINE_MAX_SIZE;
+	if (msg->offer.has_inline) {
+		file->readData(0, file->size, msg->offer.inline_data);
+	}
 	return msg;
 }
 
 MessagePtr MessageFactory::buildMsgChunkReq(uint16_t seq_number,
 		const boost::uuids::uuid& client_uuid, const file::FilePtr file,
-		const uint16_t chunk_idx_first, const uint16_t chunk_idx_last)
+		const uint32_t chunk_idx_first, const uint32_t chunk_idx_last)
 {
 	auto msg = std::make_shared<Message>();
 	msg->msg_type                  = MSGTYPE_FILE_CHUNK_REQ;
@@ -42,7 +51,7 @@ MessagePtr MessageFactory::buildMsgChunkReq(uint16_t seq_number,
 
 MessagePtr MessageFactory::buildMsgChunkData(uint16_t seq_number,
 		const boost::uuids::uuid& client_uuid, const file::FilePtr file,
-		const uint16_t chunk_idx)
+		const uint32_t chunk_idx, const uint32_t n_chunks)
 {
 	auto msg = std::make_shared<Message>();
 	msg->msg_type       = MSGTYPE_FILE_CHUNK_DATA;
@@ -50,27 +59,239 @@ MessagePtr MessageFactory::buildMsgChunkData(uint16_t seq_number,
 	msg->client_uuid    = client_uuid;
 	msg->file_name      = file->path.filename();
 	msg->chunk_data.idx = chunk_idx;
+	msg->chunk_data.n_zero = 0;
 	auto fchunk         = file->getChunk(chunk_idx);
 	if (!fchunk) {
 		throw std::runtime_error("Invalid chunk index");
+	} else if (fchunk->isZero()) {
+		// Report the chunk, and the following ones that are also all zeros,
+		// without their data
+		msg->chunk_data.n_zero = 1 + file->getZeroRun(chunk_idx + 1,
+				ZERO_RUN_MAX_CHUNKS - 1);
+	} else if (n_chunks > 1) {
+		// Range of chunks, read at once
+		file->readData((size_t)chunk_idx * file::CHUNK_SIZE,
+				std::min((size_t)n_chunks, CHUNK_RANGE_MAX_CHUNKS) *
+				file::CHUNK_SIZE, msg->chunk_data.data);
 	} else {
 		msg->chunk_data.data.resize(fchunk->data.size());
 		std::copy(fchunk->data.begin(), fchunk->data.end(),
 				msg->chunk_data.data.begin());
 	}
 
+	msg->chunk_data.crc = crc32c(msg->chunk_data.data.data(),
+			msg->chunk_data.data.size());
+
+	// The proof of the chunks sent, so they are verified on arrival
+	if (file->hash_algo == HASH_ALGO_BLAKE2B_TREE) {
+		size_t n_sent = msg->chunk_data.n_zero > 0 ? msg->chunk_data.n_zero :
+				msg->chunk_data.data.size() / file::CHUNK_SIZE +
+				(msg->chunk_data.data.size() % file::CHUNK_SIZE > 0 ? 1 : 0);
+		file->getProof(chunk_idx, n_sent, msg->chunk_data.proof);
+	}
+
 	return msg;
 }
 
 MessagePtr MessageFactory::buildMsgComplete(uint16_t seq_number,
 		const boost::uuids::uuid& client_uuid, const file::FilePtr file)
+{
+	return buildMsgComplete(seq_number, client_uuid, file->path.filename());
+}
+
+MessagePtr MessageFactory::buildMsgComplete(uint16_t seq_number,
+		const boost::uuids::uuid& client_uuid, const std::string& file_name)
 {
 	MessagePtr msg = std::make_shared<Message>();
 	msg->msg_type                  = MSGTYPE_FILE_COMPLETE;
 	msg->seq_number                = seq_number;
 	msg->client_uuid               = client_uuid;
-	msg->file_name                 = file->path.filename();
+	msg->file_name                 = file_name;
+
+	return msg;
+}
+
+MessagePtr MessageFactory::buildMsgDeltaSigs(uint16_t seq_number,
+		const boost::uuids::uuid& client_uuid, const file::FilePtr basis,
+		const uint32_t block_first)
+{
+	auto msg = std::make_shared<Message>();
+	msg->msg_type               = MSGTYPE_FILE_DELTA_SIGS;
+	msg->seq_number             = seq_number;
+	msg->client_uuid            = client_uuid;
+	msg->file_name              = basis->path.filename();
+	msg->delta_sigs.basis_size  = basis->size;
+	msg->delta_sigs.block_size  = file::DELTA_BLOCK_SIZE;
+	msg->delta_sigs.block_first = block_first;
+	file::FileDelta::calcSignatures(basis, block_first,
+			file::DELTA_MAX_SIGS_PER_MSG, msg->delta_sigs.blocks);
+
+	return msg;
+}
+
+MessagePtr MessageFactory::buildMsgDeltaSigsReq(uint16_t seq_number,
+		const boost::uuids::uuid& client_uuid, const file::FilePtr file,
+		const file::FileDeltaPtr delta)
+{
+	// Requests the signatures following the ones already received. When all
+	// have been received, requests the server to go on with the transfer.
+	auto msg = std::make_shared<Message>();
+	msg->msg_type               = MSGTYPE_FILE_DELTA_SIGS;
+	msg->seq_number             = seq_number;
+	msg->client_uuid            = client_uuid;
+	msg->file_name              = file->path.filename();
+	msg->delta_sigs.basis_size  = delta->getBasisSize();
+	msg->delta_sigs.block_size  = delta->getBlockSize();
+	msg->delta_sigs.block_first = delta->getNextMissingSignature();
+
+	return msg;
+}
+
+MessagePtr MessageFactory::buildMsgDeltaData(uint16_t seq_number,
+		const boost::uuids::uuid& client_uuid, const file::FilePtr file,
+		const file::FileDeltaPtr delta, const uint32_t chunk_first)
+{
+	auto msg = std::make_shared<Message>();
+	msg->msg_type               = MSGTYPE_FILE_DELTA_DATA;
+	msg->seq_number             = seq_number;
+	msg->client_uuid            = client_uuid;
+	msg->file_name              = file->path.filename();
+	msg->delta_data.chunk_first = chunk_first;
+	msg->delta_data.n_chunks    = delta->getOps(chunk_first,
+			msg->delta_data.ops);
+	if (msg->delta_data.n_chunks == 0) {
+		throw std::runtime_error("Invalid chunk index");
+	}
+
+	return msg;
+}
 
+MessagePtr MessageFactory::buildMsgCdcReq(uint16_t seq_number,
+		const boost::uuids::uuid& client_uuid, const file::FilePtr file,
+		const uint8_t what, const uint32_t idx)
+{
+	auto msg = std::make_shared<Message>();
+	msg->msg_type               = MSGTYPE_FILE_CDC_REQ;
+	msg->seq_number             = seq_number;
+	msg->client_uuid            = client_uuid;
+	msg->file_name              = file->path.filename();
+	msg->cdc_req.what           = what;
+	msg->cdc_req.idx            = idx;
+
+	return msg;
+}
+
+MessagePtr MessageFactory::buildMsgCdcRecipe(uint16_t seq_number,
+		const boost::uuids::uuid& client_uuid, const file::FilePtr file,
+		const file::FileCdcPtr cdc, const uint32_t idx_first)
+{
+	auto msg = std::make_shared<Message>();
+	msg->msg_type               = MSGTYPE_FILE_CDC_RECIPE;
+	msg->seq_number             = seq_number;
+	msg->client_uuid            = client_uuid;
+	msg->file_name              = file->path.filename();
+	msg->cdc_recipe.n_total     = cdc->getNumOfEntries();
+	msg->cdc_recipe.idx_first   = idx_first;
+	cdc->getEntries(idx_first, msg->cdc_recipe.entries);
+
+	return msg;
+}
+
+MessagePtr MessageFactory::buildMsgCdcData(uint16_t seq_number,
+		const boost::uuids::uuid& client_uuid, const file::FilePtr file,
+		const file::FileCdcPtr cdc, const uint32_t idx)
+{
+	auto msg = std::make_shared<Message>();
+	msg->msg_type               = MSGTYPE_FILE_CDC_DATA;
+	msg->seq_number             = seq_number;
+	msg->client_uuid            = client_uuid;
+	msg->file_name              = file->path.filename();
+	msg->cdc_data.idx           = idx;
+	cdc->getChunkData(idx, msg->cdc_data.data);
+
+	return msg;
+}
+
+MessagePtr MessageFactory::buildMsgManifest(uint16_t seq_number,
+		const boost::uuids::uuid& client_uuid,
+		const std::vector<file::FilePtr>& files, const uint32_t idx_first)
+{
+	auto msg = std::make_shared<Message>();
+	msg->msg_type           = MSGTYPE_FILE_MANIFEST;
+	msg->seq_number         = seq_number;
+	msg->client_uuid        = client_uuid;
+	msg->manifest.n_total   = files.size();
+	msg->manifest.idx_first = idx_first;
+
+	size_t msg_size = 0;
+	for (size_t i = idx_first; i < files.size() &&
+			msg->manifest.files.size() < MANIFEST_MAX_FILES_PER_MSG; i++) {
+		ManifestEntry entry;
+		entry.file_name     = files[i]->path.filename();
+		entry.file_size     = files[i]->size;
+		entry.file_n_chunks = files[i]->getNumOfChunks();
+		entry.file_hash     = files[i]->hash;
+		entry.hash_algo     = files[i]->hash_algo;
+
+		// Small files are sent within the manifest
+		entry.has_inline    = files[i]->size <= OFFER_INLINE_MAX_SIZE;
+		if (entry.has_inline) {
+			files[i]->readData(0, files[i]->size, entry.inline_data);
+		}
+
+		size_t entry_size = 1U + entry.file_name.size() + 8U + HASH_SIZE +
+				2U + (entry.has_inline ? 2U + entry.inline_data.size() : 0U);
+		if (!msg->manifest.files.empty() &&
+				msg_size + entry_size > MANIFEST_MAX_MSG_SIZE) {
+			break;
+		}
+
+		msg_size += entry_size;
+		msg->manifest.files.push_back(std::move(entry));
+	}
+	return msg;
+}
+
+MessagePtr MessageFactory::buildMsgManifestStatus(uint16_t seq_number,
+		const boost::uuids::uuid& client_uuid)
+{
+	auto msg = std::make_shared<Message>();
+	msg->msg_type    = MSGTYPE_FILE_MANIFEST_STATUS;
+	msg->seq_number  = seq_number;
+	msg->client_uuid = client_uuid;
+	return msg;
+}
+
+void MessageFactory::addManifestFileStatus(MessagePtr msg,
+		const std::string& file_name, const uint8_t status,
+		const file::FilePtr file, const uint32_t n_chunks)
+{
+	ManifestFileStatus file_status;
+	file_status.file_name = file_name;
+	file_status.status    = status;
+	file_status.n_missing = 0;
+
+	if (status == MANIFEST_FILE_MISSING && file) {
+		file_status.n_missing = file->getMissingRanges(MANIFEST_MAX_RANGES,
+				file_status.ranges);
+	} else if (status == MANIFEST_FILE_MISSING && n_chunks > 0) {
+		file_status.n_missing = n_chunks;
+		file_status.ranges.push_back({0, n_chunks - 1});
+	}
+
+	msg->manifest_status.files.push_back(std::move(file_status));
+}
+
+MessagePtr MessageFactory::buildMsgError(uint16_t seq_number,
+		const boost::uuids::uuid& client_uuid, const std::string& file_name,
+		const uint8_t code)
+{
+	auto msg = std::make_shared<Message>();
+	msg->msg_type    = MSGTYPE_FILE_ERROR;
+	msg->seq_number  = seq_number;
+	msg->client_uuid = client_uuid;
+	msg->file_name   = file_name;
+	msg->error.code  = code;
 	return msg;
 }
 
@@ -11,6 +11,8 @@
 
 #include "protocol/ft_msg.hpp"
 #include "file/ft_file.hpp"
+#include "file/ft_file_cdc.hpp"
+#include "file/ft_file_delta.hpp"
 #include "ft_utils.hpp"
 
 namespace ft { namespace proto {
@@ -24,15 +26,69 @@ public:
 
 	static MessagePtr buildMsgChunkReq(uint16_t seq_number,
 			const boost::uuids::uuid& client_uuid, const file::FilePtr file,
-			const uint16_t chunk_idx_first, const uint16_t chunk_idx_last);
+			const uint32_t chunk_idx_first, const uint32_t chunk_idx_last);
 
+	/// @brief Builds a FILE CHUNK DATA with up to n_chunks chunks from chunk_idx
+	///
+	/// If the first chunk is all zeros, the run of zero chunks is reported
+	/// instead, without data.
 	static MessagePtr buildMsgChunkData(uint16_t seq_number,
 			const boost::uuids::uuid& client_uuid, const file::FilePtr file,
-			const uint16_t chunk_idx);
+			const uint32_t chunk_idx, const uint32_t n_chunks = 1U);
 
 	static MessagePtr buildMsgComplete(uint16_t seq_number,
 			const boost::uuids::uuid& client_uuid, const file::FilePtr file);
 
+	static MessagePtr buildMsgComplete(uint16_t seq_number,
+			const boost::uuids::uuid& client_uuid, const std::string& file_name);
+
+	static MessagePtr buildMsgDeltaSigs(uint16_t seq_number,
+			const boost::uuids::uuid& client_uuid, const file::FilePtr basis,
+			const uint32_t block_first);
+
+	static MessagePtr buildMsgDeltaSigsReq(uint16_t seq_number,
+			const boost::uuids::uuid& client_uuid, const file::FilePtr file,
+			const file::FileDeltaPtr delta);
+
+	static MessagePtr buildMsgDeltaData(uint16_t seq_number,
+			const boost::uuids::uuid& client_uuid, const file::FilePtr file,
+			const file::FileDeltaPtr delta, const uint32_t chunk_first);
+
+	static MessagePtr buildMsgCdcReq(uint16_t seq_number,
+			const boost::uuids::uuid& client_uuid, const file::FilePtr file,
+			const uint8_t what, const uint32_t idx);
+
+	static MessagePtr buildMsgCdcRecipe(uint16_t seq_number,
+			const boost::uuids::uuid& client_uuid, const file::FilePtr file,
+			const file::FileCdcPtr cdc, const uint32_t idx_first);
+
+	static MessagePtr buildMsgCdcData(uint16_t seq_number,
+			const boost::uuids::uuid& client_uuid, const file::FilePtr file,
+			const file::FileCdcPtr cdc, const uint32_t idx);
+
+	/// @brief Offers up to MANIFEST_MAX_FILES_PER_MSG files from idx_first
+	static MessagePtr buildMsgManifest(uint16_t seq_number,
+			const boost::uuids::uuid& client_uuid,
+			const std::vector<file::FilePtr>& files, const uint32_t idx_first);
+
+	/// @brief Builds an empty status reply to a FILE MANIFEST message
+	///
+	/// The status of each file is added by addManifestFileStatus().
+	static MessagePtr buildMsgManifestStatus(uint16_t seq_number,
+			const boost::uuids::uuid& client_uuid);
+
+	/// @brief Adds the status of a file to a FILE MANIFEST STATUS message
+	///
+	/// The missing chunks are taken from file, if any. Otherwise, all the
+	/// n_chunks are missing.
+	static void addManifestFileStatus(MessagePtr msg,
+			const std::string& file_name, const uint8_t status,
+			const file::FilePtr file, const uint32_t n_chunks);
+
+	/// @brief Builds a FILE ERROR message, with a FILE_ERROR_* code
+	static MessagePtr buildMsgError(uint16_t seq_number,
+			const boost::uuids::uuid& client_uuid, const std::string& file_name,
+			const uint8_t code);
 };
 
 } // proto
@@ -0,0 +1,156 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+// Released under MIT License
+// Copyright (c) 2020 Hernan Perrone (hernan.perrone@gmail.com)
+//////////////////////////////////////////////////////////////////////////////
+
+#include <algorithm>
+#include <iostream>
+
+#include "request/ft_chunk_tuner.hpp"
+
+namespace ft { namespace request {
+
+// The round trip time is considered grown by congestion (or by the queues of a
+// slow link) when the average of a window is this times the minimum measured
+// and above TUNER_RTT_MIN_CONGESTED seconds. Both normalized by the number of
+// chunks, as bigger requests take longer anyway.
+static const double TUNER_RTT_CONGESTED_FACTOR = 4.0;
+static const double TUNER_RTT_MIN_CONGESTED    = 0.010;
+
+// A bigger size is reverted when its goodput is below this ratio of the
+// goodput of the previous size
+static const double TUNER_GOODPUT_DROP_RATIO   = 0.9;
+
+// Windows to wait before growing again, after shrinking
+static const size_t TUNER_HOLD_WINDOWS         = 8U;
+
+ChunkTuner::ChunkTuner(const std::string& name)
+: name(name)
+, n_chunks(TUNER_MIN_CHUNKS)
+, max_chunks(TUNER_MAX_CHUNKS)
+, prev_chunks(0)
+, prev_goodput(0.0)
+, min_rtt(0.0)
+, hold(0)
+, win_samples(0)
+, win_bytes(0)
+, win_rtt(0.0)
+{}
+
+size_t ChunkTuner::getNumOfChunks()
+{
+	std::lock_guard<std::mutex> lock(this->mtx);
+	return this->n_chunks;
+}
+
+void ChunkTuner::requestSent(const std::string& file_name, size_t n_chunks)
+{
+	std::lock_guard<std::mutex> lock(this->mtx);
+	this->pending[file_name] = { Clock::now(), n_chunks };
+}
+
+void ChunkTuner::dataReceived(const std::string& file_name, size_t n_chunks,
+		size_t n_bytes)
+{
+	auto now = Clock::now();
+
+	std::lock_guard<std::mutex> lock(this->mtx);
+
+	auto it = this->pending.find(file_name);
+	if (it == this->pending.end()) {
+		return;
+	}
+	Pending req = it->second;
+	this->pending.erase(it);
+
+	if (n_bytes == 0) {
+		// Nothing to measure
+		return;
+	}
+
+	// A shorter reply is the maximum the client sends at once
+	if (n_chunks < req.n_chunks && n_chunks < this->max_chunks) {
+		this->max_chunks = std::max(n_chunks, TUNER_MIN_CHUNKS);
+		if (this->n_chunks > this->max_chunks) {
+			setNumOfChunks(this->max_chunks, "client limit", 0.0, 0.0);
+		}
+		return;
+	}
+
+	// Only the requests of the current size are measured
+	if (req.n_chunks != this->n_chunks) {
+		return;
+	}
+
+	double rtt = std::chrono::duration<double>(now - req.sent).count();
+	if (this->min_rtt == 0.0 || rtt / req.n_chunks < this->min_rtt) {
+		this->min_rtt = rtt / req.n_chunks;
+	}
+
+	if (this->win_samples == 0) {
+		this->win_start = req.sent;
+	}
+	this->win_samples++;
+	this->win_bytes += n_bytes;
+	this->win_rtt   += rtt;
+
+	if (this->win_samples >= TUNER_WINDOW_SAMPLES) {
+		tune(now);
+	}
+}
+
+void ChunkTuner::tune(Clock::time_point now)
+{
+	double elapsed = std::chrono::duration<double>(now -
+			this->win_start).count();
+	double goodput = this->win_bytes / std::max(elapsed, 1e-6);
+	double avg_rtt = this->win_rtt / this->win_samples;
+
+	this->win_samples = 0;
+	this->win_bytes   = 0;
+	this->win_rtt     = 0.0;
+
+	// Size and goodput before the last growth, if it was in the last window
+	size_t grown_from    = this->prev_chunks;
+	double grown_goodput = this->prev_goodput;
+	this->prev_chunks  = 0;
+	this->prev_goodput = 0.0;
+
+	double avg_rtt_chunk = avg_rtt / this->n_chunks;
+	if (avg_rtt_chunk > TUNER_RTT_CONGESTED_FACTOR * this->min_rtt &&
+			avg_rtt > TUNER_RTT_MIN_CONGESTED &&
+			this->n_chunks > TUNER_MIN_CHUNKS) {
+		this->hold = TUNER_HOLD_WINDOWS;
+		setNumOfChunks(std::max(this->n_chunks / 2, TUNER_MIN_CHUNKS),
+				"rtt increased", goodput, avg_rtt);
+	} else if (grown_from > 0 &&
+			goodput < TUNER_GOODPUT_DROP_RATIO * grown_goodput) {
+		this->hold = TUNER_HOLD_WINDOWS;
+		setNumOfChunks(grown_from, "goodput dropped", goodput, avg_rtt);
+	} else if (this->hold > 0) {
+		this->hold--;
+	} else if (this->n_chunks < this->max_chunks) {
+		this->prev_chunks  = this->n_chunks;
+		this->prev_goodput = goodput;
+		setNumOfChunks(std::min(this->n_chunks * 2, this->max_chunks),
+				"probing", goodput, avg_rtt);
+	}
+}
+
+void ChunkTuner::setNumOfChunks(size_t new_n_chunks, const char* reason,
+		double goodput, double rtt)
+{
+	std::cout << "FT SERVER | Chunk tuning: " << this->name << " - "
+		<< this->n_chunks << " -> " << new_n_chunks << " chunks (" << reason;
+	if (goodput > 0.0) {
+		std::cout << ", goodput " << (goodput / 1024.0) << " KB/s, rtt "
+			<< (rtt * 1000.0) << " ms";
+	}
+	std::cout << ")" << std::endl;
+
+	this->n_chunks = new_n_chunks;
+}
+
+} // request
+} // ft
@@ -0,0 +1,105 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+// Released under MIT License
+// Copyright (c) 2020 Hernan Perrone (hernan.perrone@gmail.com)
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef FT_REQ_CHUNKTUNER_H
+#define FT_REQ_CHUNKTUNER_H
+
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string>
+
+#include "ft_utils.hpp"
+#include "protocol/ft_msg.hpp"
+
+namespace ft { namespace request {
+
+FT_DECLARE_CLASS(ChunkTuner)
+
+// Limits of the number of file chunks requested at once
+static const size_t TUNER_MIN_CHUNKS = 1U;
+static const size_t TUNER_MAX_CHUNKS = proto::CHUNK_RANGE_MAX_CHUNKS;
+
+// Number of replies measured before deciding the next size
+static const size_t TUNER_WINDOW_SAMPLES = 16U;
+
+/// @brief Tunes the size of the chunk requests sent on a connection
+///
+/// The server requests ranges of consecutive chunks, which the client sends
+/// in a single FILE CHUNK DATA message, so the number of chunks per request is
+/// the effective chunk size of the transfer.
+///
+/// The ChunkTuner measures the round trip time of each request and the
+/// goodput of the replies. After a window of samples with the same size:
+///   - if the round trip time per chunk grows well above the minimum measured,
+///     the link is considered congested and the size is halved;
+///   - if the goodput dropped compared to the previous (smaller) size, the
+///     previous size is restored and kept for a while;
+///   - otherwise, the size is doubled, up to the maximum.
+///
+/// The maximum is agreed with the client: if it replies fewer chunks than
+/// requested, that becomes the maximum for the connection.
+///
+/// Thread safe, the requests of a connection may be handled by different
+/// RequestBroker workers.
+class ChunkTuner {
+private:
+	typedef std::chrono::steady_clock Clock;
+
+	/// Request waiting for its reply
+	struct Pending {
+		Clock::time_point sent;      ///! When it was sent
+		size_t            n_chunks;  ///! Number of chunks requested
+	};
+
+	const std::string               name;
+	std::mutex                      mtx;
+	std::map<std::string, Pending>  pending;
+
+	size_t   n_chunks;     ///! Current number of chunks per request
+	size_t   max_chunks;   ///! Maximum agreed with the client
+	size_t   prev_chunks;  ///! Number of chunks of the previous window
+	double   prev_goodput; ///! Goodput of the previous window (B/s)
+	double   min_rtt;      ///! Minimum round trip time per chunk (s)
+	size_t   hold;         ///! Windows to wait before growing again
+
+	Clock::time_point win_start;   ///! Start of the current window
+	size_t            win_samples; ///! Samples in the current window
+	size_t            win_bytes;   ///! Bytes received in the current window
+	double            win_rtt;     ///! Sum of round trip times (s)
+
+public:
+	/// name is only used for logging
+	ChunkTuner(const std::string& name);
+
+	virtual ~ChunkTuner() {}
+
+	/// @brief Number of chunks to request in the next request
+	size_t getNumOfChunks();
+
+	/// @brief Records a request of n_chunks sent for the file
+	void requestSent(const std::string& file_name, size_t n_chunks);
+
+	/// @brief Records the reply to the last request sent for the file
+	///
+	/// n_chunks and n_bytes are the chunks and bytes of data received, both 0
+	/// if the reply had no data (e.g. a run of zero chunks).
+	void dataReceived(const std::string& file_name, size_t n_chunks,
+			size_t n_bytes);
+
+private:
+	/// @brief Decides the size for the next window, mtx must be locked
+	void tune(Clock::time_point now);
+
+	/// @brief Changes the current size and logs why, mtx must be locked
+	void setNumOfChunks(size_t new_n_chunks, const char* reason,
+			double goodput, double rtt);
+};
+
+} // request
+} // ft
+
+#endif // FT_REQ_CHUNKTUNER_H
@@ -0,0 +1,151 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+// Released under MIT License
+// Copyright (c) 2020 Hernan Perrone (hernan.perrone@gmail.com)
+//////////////////////////////////////////////////////////////////////////////
+
+#include <chrono>
+#include <iostream>
+
+#include "request/ft_hash_pool.hpp"
+
+namespace ft { namespace request {
+
+// The pool running the current thread, if any
+static thread_local const HashPool* tl_pool = nullptr;
+
+HashPool::HashPool(const std::string& name, size_t n_threads,
+		size_t max_queued)
+: name(name)
+, max_queued(max_queued)
+, stopped(false)
+, n_running(0)
+, n_jobs(0)
+, n_bytes(0)
+, busy_time(0.0)
+{
+	for (size_t i = 0; i < n_threads; i++) {
+		this->threads.emplace_back(&HashPool::run, this);
+	}
+}
+
+HashPool::~HashPool()
+{
+	stop();
+}
+
+void HashPool::submit(size_t n_bytes, HashFn hash, DoneFn done)
+{
+	std::unique_lock<std::mutex> lock(this->mtx);
+
+	// Block while the queue is full. The callbacks run by the pool (e.g. a
+	// file verified starting the transfer of the next one) would wait for
+	// themselves, so their jobs are queued past the limit.
+	bool in_pool = tl_pool == this;
+	while (this->queue.size() >= this->max_queued && !in_pool &&
+			!this->stopped) {
+		this->space_cv.wait(lock);
+	}
+	if (this->stopped) {
+		return;
+	}
+
+	this->queue.push_back({ n_bytes, hash, done });
+	this->queue_cv.notify_one();
+}
+
+void HashPool::stop()
+{
+	{
+		std::lock_guard<std::mutex> lock(this->mtx);
+		if (this->stopped) {
+			return;
+		}
+		this->stopped = true;
+		this->queue.clear();
+		this->queue_cv.notify_all();
+		this->space_cv.notify_all();
+	}
+
+	for (auto& thread : this->threads) {
+		thread.join();
+	}
+	this->threads.clear();
+}
+
+size_t HashPool::getQueueDepth() const
+{
+	std::lock_guard<std::mutex> lock(this->mtx);
+	return this->queue.size() + this->n_running;
+}
+
+double HashPool::getThroughput() const
+{
+	std::lock_guard<std::mutex> lock(this->mtx);
+	return this->busy_time > 0.0 ? this->n_bytes / this->busy_time : 0.0;
+}
+
+void HashPool::logStats() const
+{
+	size_t depth;
+	uint64_t n_jobs;
+	{
+		std::lock_guard<std::mutex> lock(this->mtx);
+		depth  = this->queue.size() + this->n_running;
+		n_jobs = this->n_jobs;
+	}
+
+	std::cout << this->name << " | Hash pool: " << depth << " queued, "
+		<< n_jobs << " done, " << (getThroughput() / (1024.0 * 1024.0))
+		<< " MB/s" << std::endl;
+}
+
+void HashPool::run()
+{
+	tl_pool = this;
+
+	while (true) {
+		Job job;
+		{
+			std::unique_lock<std::mutex> lock(this->mtx);
+			while (this->queue.empty() && !this->stopped) {
+				this->queue_cv.wait(lock);
+			}
+			if (this->stopped) {
+				return;
+			}
+
+			job = this->queue.front();
+			this->queue.pop_front();
+			this->n_running++;
+			this->space_cv.notify_one();
+		}
+
+		auto start = std::chrono::steady_clock::now();
+		bool result = false;
+		try {
+			result = job.hash();
+		} catch(std::exception& e) {
+			std::cout << e.what() << std::endl;
+		}
+		double elapsed = std::chrono::duration<double>(
+				std::chrono::steady_clock::now() - start).count();
+
+		{
+			std::lock_guard<std::mutex> lock(this->mtx);
+			this->n_running--;
+			this->n_jobs++;
+			this->n_bytes   += job.n_bytes;
+			this->busy_time += elapsed;
+		}
+
+		try {
+			job.done(result);
+		} catch(std::exception& e) {
+			std::cout << e.what() << std::endl;
+		}
+	}
+}
+
+} // request
+} // ft
@@ -0,0 +1,99 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+// Released under MIT License
+// Copyright (c) 2020 Hernan Perrone (hernan.perrone@gmail.com)
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef FT_REQ_HASHPOOL_H
+#define FT_REQ_HASHPOOL_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ft_utils.hpp"
+
+namespace ft { namespace request {
+
+FT_DECLARE_CLASS(HashPool)
+
+/// @brief Threads hashing files apart from the RequestBroker workers
+///
+/// Hashing a big file takes seconds, so it is not done by the RequestBroker
+/// workers, which would leave the requests of other clients waiting. A job
+/// is a hashing function, run by one of the threads of the pool, and a
+/// completion callback receiving its result (false if it threw), run by the
+/// same thread right after.
+///
+/// The pool has a limited number of threads and of queued jobs: submit()
+/// blocks while the queue is full, unless called from a completion callback
+/// (the threads of the pool are the only ones making room in the queue, so
+/// they never wait for it).
+///
+/// The queue depth and the throughput (bytes given to submit() per second of
+/// hashing) are exported by the getters, and logged by logStats().
+class HashPool {
+public:
+	typedef std::function<bool()>     HashFn;
+	typedef std::function<void(bool)> DoneFn;
+
+private:
+	struct Job {
+		size_t  n_bytes;
+		HashFn  hash;
+		DoneFn  done;
+	};
+
+	const std::string         name;
+	const size_t              max_queued;
+
+	mutable std::mutex        mtx;
+	std::condition_variable   queue_cv;    ///! Signals jobs queued or stop
+	std::condition_variable   space_cv;    ///! Signals room in the queue
+	std::deque<Job>           queue;
+	bool                      stopped;
+	std::vector<std::thread>  threads;
+
+	// Stats
+	size_t                    n_running;
+	uint64_t                  n_jobs;
+	uint64_t                  n_bytes;
+	double                    busy_time;   ///! Seconds hashing, all threads
+
+public:
+	HashPool(const std::string& name, size_t n_threads, size_t max_queued);
+
+	virtual ~HashPool();
+
+	/// @brief Queues a job hashing n_bytes
+	///
+	/// Blocks while the queue is full, unless called by a thread of the pool.
+	void submit(size_t n_bytes, HashFn hash, DoneFn done);
+
+	/// @brief Stops the threads, once their running jobs are done
+	///
+	/// Queued jobs are dropped.
+	void stop();
+
+	/// @brief Jobs queued or running
+	size_t getQueueDepth() const;
+
+	/// @brief Bytes hashed per second of hashing
+	double getThroughput() const;
+
+	/// @brief Logs the queue depth and the throughput
+	void logStats() const;
+
+private:
+	/// Thread loop
+	void run();
+};
+
+} // request
+} // ft
+
+#endif // FT_REQ_HASHPOOL_H
@@ -13,6 +13,7 @@
 
 #include "netwrk/ft_conn.hpp"
 #include "protocol/ft_msg_fctry.hpp"
+#include "request/ft_req.hpp"
 #include "request/ft_req_brkr.hpp"
 
 namespace ft { namespace request {
@@ -147,6 +148,16 @@ void RequestBrokerWorker::run()
 		} catch(std::exception& e) {
 			std::cout << e.what() << std::endl;
 		}
+
+		// Let the Connection write the replies held while handling it
+		auto conn = req->getConnection();
+		if (conn) {
+			try {
+				conn->requestHandled();
+			} catch(std::exception& e) {
+				std::cout << e.what() << std::endl;
+			}
+		}
 		
 	}
 
@@ -0,0 +1,182 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+// Released under MIT License
+// Copyright (c) 2020 Hernan Perrone (hernan.perrone@gmail.com)
+//////////////////////////////////////////////////////////////////////////////
+
+#include <iostream>
+
+#include "request/ft_transfer_table.hpp"
+
+namespace ft { namespace request {
+
+TransferTable::TransferTable(const std::string& name, size_t max_entries,
+		std::chrono::seconds idle_timeout)
+: name(name)
+, max_entries(max_entries)
+, idle_timeout(idle_timeout)
+, n_hits(0)
+, n_misses(0)
+{
+}
+
+file::FilePtr TransferTable::get(const std::filesystem::path& path)
+{
+	file::FilePtr basis;
+	return get(path, basis);
+}
+
+file::FilePtr TransferTable::get(const std::filesystem::path& path,
+		file::FilePtr& basis_out)
+{
+	auto now = Clock::now();
+	std::vector<file::FilePtr> dropped; // Destroyed once unlocked
+
+	std::lock_guard<std::mutex> lock(this->mtx);
+	evict(now, this->max_entries, dropped);
+
+	auto it = this->entries.find(path.string());
+	if (it == this->entries.end()) {
+		this->n_misses++;
+		basis_out.reset();
+		return file::FilePtr();
+	}
+
+	this->n_hits++;
+	it->second.last_used = now;
+	this->lru.splice(this->lru.begin(), this->lru, it->second.lru_pos);
+	basis_out = it->second.basis;
+	return it->second.file;
+}
+
+void TransferTable::put(const std::filesystem::path& path, file::FilePtr file,
+		file::FilePtr basis)
+{
+	auto now = Clock::now();
+	std::vector<file::FilePtr> dropped;
+
+	std::lock_guard<std::mutex> lock(this->mtx);
+
+	auto it = this->entries.find(path.string());
+	if (it != this->entries.end()) {
+		dropped.push_back(it->second.file);
+		dropped.push_back(it->second.basis);
+		it->second.file      = file;
+		it->second.basis     = basis;
+		it->second.last_used = now;
+		this->lru.splice(this->lru.begin(), this->lru, it->second.lru_pos);
+		return;
+	}
+
+	// Room for the new one
+	evict(now, this->max_entries - 1, dropped);
+
+	this->lru.push_front(path.string());
+	this->entries[path.string()] = { file, basis, now, this->lru.begin() };
+}
+
+void TransferTable::remove(const std::filesystem::path& path)
+{
+	file::FilePtr dropped, dropped_basis;
+
+	std::lock_guard<std::mutex> lock(this->mtx);
+
+	auto it = this->entries.find(path.string());
+	if (it != this->entries.end()) {
+		dropped       = it->second.file;
+		dropped_basis = it->second.basis;
+		this->lru.erase(it->second.lru_pos);
+		this->entries.erase(it);
+	}
+}
+
+void TransferTable::flushIdle(std::chrono::milliseconds idle)
+{
+	auto now = Clock::now();
+	std::vector<file::FilePtr> files;
+	{
+		std::lock_guard<std::mutex> lock(this->mtx);
+		for (auto it = this->lru.rbegin(); it != this->lru.rend(); it++) {
+			const auto& entry = this->entries.at(*it);
+			if (now - entry.last_used < idle) {
+				break;
+			}
+			files.push_back(entry.file);
+		}
+	}
+
+	for (const auto& file : files) {
+		try {
+			file->flush();
+		} catch (const std::exception& e) {
+			std::cout << this->name << " | Failed writing chunks of " <<
+				file->path.filename() << ": " << e.what() << std::endl;
+		}
+	}
+}
+
+void TransferTable::clear()
+{
+	std::vector<file::FilePtr> dropped;
+
+	std::lock_guard<std::mutex> lock(this->mtx);
+	for (auto& entry : this->entries) {
+		dropped.push_back(entry.second.file);
+		dropped.push_back(entry.second.basis);
+	}
+	this->entries.clear();
+	this->lru.clear();
+}
+
+size_t TransferTable::getSize() const
+{
+	std::lock_guard<std::mutex> lock(this->mtx);
+	return this->entries.size();
+}
+
+uint64_t TransferTable::getHits() const
+{
+	std::lock_guard<std::mutex> lock(this->mtx);
+	return this->n_hits;
+}
+
+uint64_t TransferTable::getMisses() const
+{
+	std::lock_guard<std::mutex> lock(this->mtx);
+	return this->n_misses;
+}
+
+void TransferTable::logStats() const
+{
+	size_t size;
+	uint64_t n_hits, n_misses;
+	{
+		std::lock_guard<std::mutex> lock(this->mtx);
+		size     = this->entries.size();
+		n_hits   = this->n_hits;
+		n_misses = this->n_misses;
+	}
+
+	std::cout << this->name << " | Transfer table: " << size << " open, "
+		<< n_hits << " hits, " << n_misses << " misses" << std::endl;
+}
+
+void TransferTable::evict(Clock::time_point now, size_t max_entries,
+		std::vector<file::FilePtr>& dropped_out)
+{
+	// The least recently used file is the one idle for longer
+	while (!this->lru.empty()) {
+		auto it = this->entries.find(this->lru.back());
+		if (this->entries.size() <= max_entries &&
+				now - it->second.last_used < this->idle_timeout) {
+			break;
+		}
+		dropped_out.push_back(it->second.file);
+		dropped_out.push_back(it->second.basis);
+		this->entries.erase(it);
+		this->lru.pop_back();
+	}
+}
+
+} // request
+} // ft
@@ -0,0 +1,120 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+// Released under MIT License
+// Copyright (c) 2020 Hernan Perrone (hernan.perrone@gmail.com)
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef FT_REQ_TRANSFERTABLE_H
+#define FT_REQ_TRANSFERTABLE_H
+
+#include <chrono>
+#include <filesystem>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "ft_utils.hpp"
+#include "file/ft_file.hpp"
+
+namespace ft { namespace request {
+
+FT_DECLARE_CLASS(TransferTable)
+
+/// @brief Bounded LRU table of the files in transfer
+///
+/// Loading a remote file reads its metadata header, and checks its directory
+/// and data file, so doing it for each FILE CHUNK DATA costs as much as saving
+/// the chunk. The table keeps the files (a FileRemote, whose data and metadata
+/// files stay open in the FdCache) between the messages of a transfer, by the
+/// path of the file (i.e. client UUID / file name).
+///
+/// Up to max_entries files are kept, dropping the least recently used ones,
+/// and the files not used for idle_timeout are dropped too. The file of a path
+/// must be removed when the transfer completes, or the file is replaced (e.g. a
+/// new version is offered).
+///
+/// The file rebuilt by a delta transfer is kept with its basis (the stored
+/// version it is rebuilt from), so neither is loaded for each FILE DELTA DATA.
+///
+/// The files keep the chunks received one after the other in memory, to write
+/// them at once. flushIdle() writes the ones of the files not used for a
+/// while (e.g. the client stopped sending), and the files dropped write
+/// theirs on destruction, outside the lock of the table.
+///
+/// The hits and misses of get() are exported by the getters, and logged by
+/// logStats().
+class TransferTable {
+private:
+	typedef std::chrono::steady_clock      Clock;
+	typedef std::list<std::string>         LruList;
+
+	struct Entry {
+		file::FilePtr      file;
+		file::FilePtr      basis;      ///! Of a delta transfer, if any
+		Clock::time_point  last_used;
+		LruList::iterator  lru_pos;
+	};
+
+	const std::string                       name;
+	const size_t                            max_entries;
+	const Clock::duration                   idle_timeout;
+
+	mutable std::mutex                      mtx;
+	LruList                                 lru;       ///! Most recent first
+	std::unordered_map<std::string, Entry>  entries;
+
+	// Stats
+	uint64_t                                n_hits;
+	uint64_t                                n_misses;
+
+public:
+	TransferTable(const std::string& name, size_t max_entries,
+			std::chrono::seconds idle_timeout);
+
+	virtual ~TransferTable() {}
+
+	/// @brief The file kept for the path, or nullptr if none
+	file::FilePtr get(const std::filesystem::path& path);
+
+	/// @brief Same as above, with the basis kept with the file, if any
+	file::FilePtr get(const std::filesystem::path& path,
+			file::FilePtr& basis_out);
+
+	/// @brief Keeps the file for the path, with the basis of a delta transfer
+	void put(const std::filesystem::path& path, file::FilePtr file,
+			file::FilePtr basis = file::FilePtr());
+
+	/// @brief Drops the file of the path, if any
+	void remove(const std::filesystem::path& path);
+
+	/// @brief Writes the chunks kept by the files not used for idle
+	void flushIdle(std::chrono::milliseconds idle);
+
+	/// @brief Drops all the files (e.g. on shutdown)
+	void clear();
+
+	/// @brief Number of files kept
+	size_t getSize() const;
+
+	uint64_t getHits() const;
+
+	uint64_t getMisses() const;
+
+	/// @brief Logs the number of files kept, hits and misses
+	void logStats() const;
+
+private:
+	/// @brief Drops the least recently used files, while idle or too many
+	///
+	/// Must be called with mtx locked. The files are moved to dropped_out, to
+	/// be destroyed once unlocked.
+	void evict(Clock::time_point now, size_t max_entries,
+			std::vector<file::FilePtr>& dropped_out);
+};
+
+} // request
+} // ft
+
+#endif // FT_REQ_TRANSFERTABLE_H
@@ -0,0 +1,131 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+// Released under MIT License
+// Copyright (c) 2020 Hernan Perrone (hernan.perrone@gmail.com)
+//////////////////////////////////////////////////////////////////////////////
+
+#include <random>
+#include <vector>
+
+#include "ft_test.hpp"
+#include "file/ft_chunk_bitmap.hpp"
+
+using namespace ft::file;
+
+// The ChunkBitmap is checked against a naive bitmap (a bit per chunk, scanned
+// one by one) under random marks and searches
+
+static const int RANDOM_OPS = 3000;
+
+static size_t naiveFind(const std::vector<bool>& naive, size_t from,
+		bool received)
+{
+	for (size_t i = from; i < naive.size(); i++) {
+		if (naive[i] == received) {
+			return i;
+		}
+	}
+	return UINT64_MAX;
+}
+
+static bool naiveFull(const std::vector<bool>& naive)
+{
+	return naiveFind(naive, 0, false) == UINT64_MAX;
+}
+
+static void naiveMark(std::vector<bool>& naive, size_t idx, size_t n,
+		bool valid)
+{
+	for (size_t i = idx; i < std::min(naive.size(), idx + n); i++) {
+		naive[i] = valid;
+	}
+}
+
+static bool bitSet(const std::vector<uint8_t>& bytes, size_t idx)
+{
+	return (bytes[idx / 8] & (0x80 >> (idx % 8))) != 0;
+}
+
+static void testRandom(size_t n_chunks, bool deferred, std::mt19937_64& rng)
+{
+	// Random chunks already received when loaded
+	std::vector<uint8_t> bytes(n_chunks / 8 + 1, 0);
+	std::vector<bool> naive(n_chunks, false);
+	for (size_t i = 0; i < n_chunks; i++) {
+		if (rng() % 3 == 0) {
+			naive[i] = true;
+			bytes[i / 8] |= (uint8_t)(0x80 >> (i % 8));
+		}
+	}
+	std::vector<bool> applied = naive;
+
+	ChunkBitmap bitmap(bytes.data(), n_chunks, deferred);
+	for (int op = 0; op < RANDOM_OPS; op++) {
+		int what = rng() % 5;
+		if (n_chunks > 0 && what < 2) {
+			// Single chunks, or ranges up to many groups of 64
+			size_t idx = rng() % n_chunks;
+			size_t n = 1 + (what == 0 ? rng() % 3 : rng() % 5000);
+			bool valid = rng() % 4 != 0;
+			bitmap.mark(idx, n, valid);
+			naiveMark(naive, idx, n, valid);
+		} else if (what < 4) {
+			size_t from = rng() % (n_chunks + 2);
+			bool received = rng() % 2;
+			FT_CHECK(bitmap.find(from, received) ==
+					naiveFind(naive, from, received));
+			FT_CHECK(bitmap.isFull() == naiveFull(naive));
+		} else if (deferred) {
+			// The marks reach the mapping only once applied, or are lost if
+			// discarded (their data failed to sync)
+			size_t first_byte;
+			std::vector<uint8_t> pending;
+			bool discard = rng() % 4 == 0;
+			if (bitmap.takePending(first_byte, pending)) {
+				if (discard) {
+					bitmap.discardPending(first_byte, pending);
+				} else {
+					bitmap.applyPending(first_byte, pending);
+				}
+			}
+			if (discard) {
+				for (size_t i = 0; i < n_chunks; i++) {
+					naive[i] = naive[i] && applied[i];
+				}
+			} else {
+				applied = naive;
+			}
+		}
+
+		if (op == RANDOM_OPS / 2 && n_chunks > 0) {
+			bitmap.mark(0, n_chunks, true);
+			naiveMark(naive, 0, n_chunks, true);
+			FT_CHECK(bitmap.isFull());
+			FT_CHECK(bitmap.find(0, false) == UINT64_MAX);
+		}
+	}
+
+	if (!deferred) {
+		applied = naive;
+	}
+	bool mapped_ok = true;
+	for (size_t i = 0; i < n_chunks; i++) {
+		mapped_ok = mapped_ok && bitSet(bytes, i) == applied[i];
+	}
+	FT_CHECK(mapped_ok);
+}
+
+int main()
+{
+	std::mt19937_64 rng(1);
+	const size_t sizes[] = { 0, 1, 7, 8, 63, 64, 65, 4095, 4096, 4097,
+			262143, 262145, 300000 };
+
+	for (bool deferred : { false, true }) {
+		for (size_t n_chunks : sizes) {
+			testRandom(n_chunks, deferred, rng);
+		}
+	}
+
+	return FT_TEST_RESULT();
+}
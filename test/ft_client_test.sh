@@ -10,7 +10,5 @@ FILES=$(find /files -type f)
 # Hostname as defined in docker compose script
 HOSTNAME=ft
 
-## Iterate over all files and send them to the server
-for f in $FILES; do
-    /ft_client -d ${HOSTNAME} ${f};
-done;
+## Offer all the files to the server at once, over a single connection
+/ft_client -d ${HOSTNAME} ${FILES};
@@ -0,0 +1,110 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+// Released under MIT License
+// Copyright (c) 2020 Hernan Perrone (hernan.perrone@gmail.com)
+//////////////////////////////////////////////////////////////////////////////
+
+#include <chrono>
+#include <future>
+#include <vector>
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "ft_test.hpp"
+#include "loop/ft_poll_grp.hpp"
+#include "netwrk/ft_conn.hpp"
+#include "protocol/ft_msg.hpp"
+#include "request/ft_req.hpp"
+#include "request/ft_req_brkr.hpp"
+#include "request/ft_req_hndlr.hpp"
+
+using namespace ft;
+
+/// Replies, then blocks until released (e.g. waiting for a sync)
+class BlockedHandler : public request::RequestHandler {
+public:
+	std::shared_future<void> released;
+
+	virtual void handleRequest(request::RequestPtr req)
+	{
+		std::vector<uint8_t> buf;
+		req->getMessage()->serialize(buf);
+		req->getConnection()->sendBuffer(buf);
+		this->released.wait();
+	}
+};
+
+/// Connects a socket to a listening one on the loopback, returning both ends
+static void connectPair(int& client_fd, int& server_fd)
+{
+	int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in addr = {};
+	addr.sin_family      = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t len = sizeof(addr);
+	FT_CHECK(bind(listen_fd, (struct sockaddr*)&addr, len) == 0);
+	FT_CHECK(listen(listen_fd, 1) == 0);
+	FT_CHECK(getsockname(listen_fd, (struct sockaddr*)&addr, &len) == 0);
+
+	client_fd = socket(AF_INET, SOCK_STREAM, 0);
+	FT_CHECK(connect(client_fd, (struct sockaddr*)&addr, len) == 0);
+	server_fd = accept(listen_fd, nullptr, nullptr);
+	FT_CHECK(server_fd >= 0);
+	close(listen_fd);
+}
+
+/// The reply of a Request still being handled is held for COALESCE_MAX_DELAY
+/// only, even if no other message is sent meanwhile
+static void testHeldReply()
+{
+	std::promise<void> release;
+	auto handler = std::make_shared<BlockedHandler>();
+	handler->released = release.get_future().share();
+	auto broker = std::make_shared<request::RequestBroker>(handler, 1);
+	netwrk::Connection::setRequestBroker(broker);
+
+	int client_fd, server_fd;
+	connectPair(client_fd, server_fd);
+	auto conn = std::make_shared<netwrk::Connection>(server_fd);
+	loop::PollGroup poll_group(2);
+	poll_group.add(conn);
+
+	proto::Message msg;
+	msg.msg_type    = proto::MSGTYPE_FILE_COMPLETE;
+	msg.seq_number  = 1;
+	msg.client_uuid = {};
+	msg.file_name   = "file.bin";
+	std::vector<uint8_t> buf;
+	msg.serialize(buf);
+	FT_CHECK(write(client_fd, buf.data(), buf.size()) == (ssize_t)buf.size());
+
+	// Well below the 500ms a poll waits with nothing due
+	auto start = std::chrono::steady_clock::now();
+	std::vector<uint8_t> reply(buf.size());
+	ssize_t received = 0;
+	while (received < (ssize_t)reply.size() &&
+			std::chrono::steady_clock::now() - start <
+				std::chrono::milliseconds(200)) {
+		poll_group.pollAndHandle();
+		ssize_t ret = recv(client_fd, reply.data() + received,
+				reply.size() - received, MSG_DONTWAIT);
+		received += ret > 0 ? ret : 0;
+	}
+	FT_CHECK(received == (ssize_t)reply.size());
+	FT_CHECK(reply == buf);
+
+	release.set_value();
+	broker.reset();
+	netwrk::Connection::setRequestBroker(nullptr);
+	poll_group.remove(conn);
+	close(client_fd);
+}
+
+int main()
+{
+	testHeldReply();
+
+	return FT_TEST_RESULT();
+}
@@ -0,0 +1,303 @@
+#!/bin/bash
+
+################################################################################
+###  End to end tests
+#
+# Runs a server and clients from the build directory, and checks the files
+# stored by the server are the ones sent.
+#
+# usage: ft_e2e_test.sh BUILD_DIR CASE [SERVER OPTIONS]
+#
+# The server stores the files in /in and the client keeps its state in
+# /.ft_client, so both are wiped: run it only in a container (or with
+# -DFT_E2E_TESTS=ON, by ctest).
+#
+###  # Released under MIT License
+###  Copyright (c) 2020 Hernan Perrone (hernan.perrone@gmail.com)
+################################################################################
+
+BUILD_DIR=$(realpath "$1")
+CASE=$2
+shift 2
+SERVER_ARGS="$@"
+
+FILES_DIR=$(dirname $(realpath "$0"))/files
+WORK_DIR=$(mktemp -d)
+SERVER_LOG=${WORK_DIR}/server.log
+CLIENT_LOG=${WORK_DIR}/client.log
+SERVER_PID=
+
+fail() {
+	echo "FAIL: $@"
+	echo "---- server log"; tail -20 ${SERVER_LOG}
+	echo "---- client log"; tail -20 ${CLIENT_LOG}
+	exit 1
+}
+
+cleanup() {
+	[ -n "${SERVER_PID}" ] && kill -9 ${SERVER_PID} 2>/dev/null
+	rm -rf ${WORK_DIR}
+}
+trap cleanup EXIT
+
+# Waits up to 60s until the log has the text (from the line, if given)
+wait_for() {
+	for i in $(seq 1 600); do
+		tail -n +${3:-1} $1 | grep -q "$2" && return 0
+		sleep 0.1
+	done
+	return 1
+}
+
+# Starts the server, appending to the log of the ones before
+start_server() {
+	local from=$(( $(cat ${SERVER_LOG} 2>/dev/null | wc -l) + 1 ))
+	${BUILD_DIR}/ft_server ${SERVER_ARGS} "$@" >> ${SERVER_LOG} 2>&1 &
+	SERVER_PID=$!
+	wait_for ${SERVER_LOG} "INIT COMPLETED" ${from} || fail "server not started"
+}
+
+stop_server() {
+	kill -9 ${SERVER_PID} 2>/dev/null
+	wait ${SERVER_PID} 2>/dev/null
+	SERVER_PID=
+}
+
+# Sends the files, waiting until the client is done
+run_client() {
+	> ${CLIENT_LOG}
+	${BUILD_DIR}/ft_client ${CLIENT_ARGS} "$@" > ${CLIENT_LOG} 2>&1 &
+	local pid=$!
+	for i in $(seq 1 1200); do
+		grep -q Terminating ${CLIENT_LOG} && break
+		kill -0 ${pid} 2>/dev/null || break
+		sleep 0.1
+	done
+	kill -9 ${pid} 2>/dev/null
+	wait ${pid} 2>/dev/null
+	grep -q Terminating ${CLIENT_LOG} || fail "client not done: $@"
+}
+
+# Checks the server stored the files sent
+check_files() {
+	local uuid=$(cat /.ft_client/.uuid)
+	for f in "$@"; do
+		cmp -s $f /in/${uuid}/$(basename $f) || fail "not stored: $f"
+	done
+}
+
+random_file() {
+	head -c $2 /dev/urandom > $1
+}
+
+rm -rf /in /.ft_client
+
+case ${CASE} in
+smoke)
+	# Each file on its own, all of them at once, and offered again
+	random_file ${WORK_DIR}/big.bin 3000000
+	FILES="${FILES_DIR}/* ${WORK_DIR}/big.bin"
+	start_server
+	for f in ${FILES}; do run_client $f; done
+	run_client ${FILES}
+	check_files ${FILES}
+	for f in ${FILES}; do run_client $f; done
+	;;
+resume)
+	# Client killed and server restarted in the middle of a transfer
+	random_file ${WORK_DIR}/r.bin 60000000
+	start_server
+	${BUILD_DIR}/ft_client ${WORK_DIR}/r.bin > ${CLIENT_LOG} 2>&1 &
+	CLIENT_PID=$!
+	wait_for ${SERVER_LOG} "Request chunk" || fail "transfer not started"
+	sleep 0.3
+	kill -9 ${CLIENT_PID}; wait ${CLIENT_PID} 2>/dev/null
+	${BUILD_DIR}/ft_client ${WORK_DIR}/r.bin > ${CLIENT_LOG} 2>&1 &
+	CLIENT_PID=$!
+	sleep 1
+	kill -TERM ${SERVER_PID}
+	wait_for ${SERVER_LOG} "Terminating"
+	stop_server
+	kill -9 ${CLIENT_PID}; wait ${CLIENT_PID} 2>/dev/null
+	start_server
+	run_client ${WORK_DIR}/r.bin
+	check_files ${WORK_DIR}/r.bin
+	grep -q "File transferred" ${SERVER_LOG} || fail "not transferred"
+	;;
+delta)
+	# A modified file sent again is rebuilt from the one stored
+	random_file ${WORK_DIR}/data.bin 8000000
+	start_server
+	run_client ${WORK_DIR}/data.bin
+	python3 - ${WORK_DIR}/data.bin <<-EOF
+		import os, sys
+		d = open(sys.argv[1], 'rb').read()
+		d = d[:1000000] + os.urandom(100) + d[1000000:5000000] + \
+				os.urandom(5000) + d[5005000:] + os.urandom(3000)
+		open(sys.argv[1], 'wb').write(d)
+	EOF
+	run_client ${WORK_DIR}/data.bin
+	check_files ${WORK_DIR}/data.bin
+	grep -q "Delta transfer" ${SERVER_LOG} || fail "no delta transfer"
+
+	# The rebuilt file is loaded once, and then kept between the messages
+	grep "Transfer table" ${SERVER_LOG} | awk '
+		NR == 1 { hits = $8; misses = $10 }
+		END { exit !($8 > hits && $10 == misses + 1) }' ||
+			fail "delta transfer not kept in the transfer table"
+	;;
+dedup)
+	# Files sharing most of their data, from two clients
+	random_file ${WORK_DIR}/d1.bin 8000000
+	start_server -c
+	run_client ${WORK_DIR}/d1.bin
+	check_files ${WORK_DIR}/d1.bin
+	rm /.ft_client/.uuid
+	python3 - ${WORK_DIR}/d1.bin ${WORK_DIR}/d2.bin <<-EOF
+		import sys
+		d = open(sys.argv[1], 'rb').read()
+		d = d[:100000] + b'x' * 100 + d[100000:4000000] + d[4005000:]
+		open(sys.argv[2], 'wb').write(d)
+	EOF
+	cp ${WORK_DIR}/d1.bin ${WORK_DIR}/d1copy.bin
+	run_client ${WORK_DIR}/d2.bin
+	run_client ${WORK_DIR}/d1copy.bin
+	check_files ${WORK_DIR}/d2.bin ${WORK_DIR}/d1copy.bin
+	grep -q "Dedup" ${SERVER_LOG} || fail "no deduplication"
+	;;
+manifest)
+	# Many files offered at once, and again with the catalog lost, so the
+	# ones stored are verified again
+	mkdir ${WORK_DIR}/many
+	for i in $(seq 1 100); do
+		random_file ${WORK_DIR}/many/f$i.bin $(( (i * 7919) % 200000 ))
+	done
+	start_server
+	run_client ${WORK_DIR}/many/*
+	check_files ${WORK_DIR}/many/*
+	stop_server
+	rm /in/.catalog
+	start_server
+	run_client ${WORK_DIR}/many/*
+	check_files ${WORK_DIR}/many/*
+	;;
+small)
+	# Many files sent inline within the manifest
+	mkdir ${WORK_DIR}/small
+	for i in $(seq 1 500); do
+		random_file ${WORK_DIR}/small/s$i.txt $(( i % 50 ))
+	done
+	start_server
+	run_client ${WORK_DIR}/small/*
+	check_files ${WORK_DIR}/small/*
+	;;
+sync)
+	# Chunks made durable by group commit, then by periodic rounds
+	random_file ${WORK_DIR}/g.bin 6000000
+	random_file ${WORK_DIR}/p.bin 6000000
+	start_server -d group
+	run_client ${WORK_DIR}/g.bin
+	stop_server
+	start_server -d periodic:20
+	run_client ${WORK_DIR}/p.bin
+	check_files ${WORK_DIR}/g.bin ${WORK_DIR}/p.bin
+	;;
+migrate)
+	# A transfer left with a metadata file, resumed with the state store
+	random_file ${WORK_DIR}/m.bin 60000000
+	start_server
+	${BUILD_DIR}/ft_client ${WORK_DIR}/m.bin > ${CLIENT_LOG} 2>&1 &
+	CLIENT_PID=$!
+	wait_for ${SERVER_LOG} "Request chunk" || fail "transfer not started"
+	sleep 0.5
+	kill -9 ${CLIENT_PID}; wait ${CLIENT_PID} 2>/dev/null
+	stop_server
+	ls -a /in/*/ | grep -q "\.meta$" || fail "no metadata file left"
+	start_server -m store
+	grep -q "Metadata files migrated: 1" ${SERVER_LOG} || fail "not migrated"
+	grep -q "Transfers in progress: 1" ${SERVER_LOG} || fail "not in the store"
+	ls -a /in/*/ | grep -q "\.meta$" && fail "metadata file not removed"
+	run_client ${WORK_DIR}/m.bin
+	check_files ${WORK_DIR}/m.bin
+	stop_server
+
+	# And loaded from the store, once done
+	start_server -m store
+	grep -q "Transfers in progress: 0" ${SERVER_LOG} || fail "not removed"
+	;;
+mem)
+	# Files kept in memory, or discarded: nothing is written to disk, and
+	# the options storing to disk are rejected
+	${BUILD_DIR}/ft_server -b ram -m store > /dev/null 2>&1 &&
+			fail "-m store taken with -b ram"
+	${BUILD_DIR}/ft_server -b null -d group > /dev/null 2>&1 &&
+			fail "-d group taken with -b null"
+	random_file ${WORK_DIR}/big.bin 3000000
+	FILES="${FILES_DIR}/* ${WORK_DIR}/big.bin"
+	for backend in ram null; do
+		start_server -b ${backend}
+		run_client ${FILES}
+		run_client ${FILES}
+		stop_server
+		[ -z "$(ls -A /in 2>/dev/null)" ] || fail "written to disk: ${backend}"
+	done
+	grep -q "File transferred" ${SERVER_LOG} || fail "not transferred"
+	grep -q "IO ENGINE: inline" ${SERVER_LOG} || fail "IO engine started"
+	grep -q "already transferred" ${SERVER_LOG} && fail "completed from catalog"
+	;;
+clients)
+	# Two clients of the same host (so the same UUID) sending their
+	# manifests at once
+	mkdir ${WORK_DIR}/a ${WORK_DIR}/b
+	for i in $(seq 1 30); do
+		random_file ${WORK_DIR}/a/a$i.bin $(( 100000 + i * 3001 ))
+		random_file ${WORK_DIR}/b/b$i.bin $(( 100000 + i * 2999 ))
+	done
+	start_server
+	run_client ${WORK_DIR}/a/a1.bin
+	${BUILD_DIR}/ft_client ${WORK_DIR}/a/* > ${WORK_DIR}/a.log 2>&1 &
+	PID_A=$!
+	${BUILD_DIR}/ft_client ${WORK_DIR}/b/* > ${WORK_DIR}/b.log 2>&1 &
+	PID_B=$!
+	wait_for ${WORK_DIR}/a.log Terminating; DONE_A=$?
+	wait_for ${WORK_DIR}/b.log Terminating; DONE_B=$?
+	kill -9 ${PID_A} ${PID_B}; wait ${PID_A} ${PID_B} 2>/dev/null
+	[ ${DONE_A} -eq 0 ] && [ ${DONE_B} -eq 0 ] || fail "clients not done"
+	check_files ${WORK_DIR}/a/* ${WORK_DIR}/b/*
+	;;
+legacy)
+	# A transfer left with a metadata file of the layout before hash_algo
+	# is resumed, with the metadata files and with the state store
+	random_file ${WORK_DIR}/l.bin 60000000
+	for metadata in files store; do
+		rm -rf /in
+		start_server
+		${BUILD_DIR}/ft_client ${WORK_DIR}/l.bin > ${CLIENT_LOG} 2>&1 &
+		CLIENT_PID=$!
+		wait_for ${SERVER_LOG} "Request chunk" || fail "transfer not started"
+		sleep 2
+		kill -9 ${CLIENT_PID}; wait ${CLIENT_PID} 2>/dev/null
+		stop_server
+		python3 - /in/*/.l.bin.meta <<-EOF || fail "no chunks received"
+			import sys
+			d = open(sys.argv[1], 'rb').read()
+			assert any(d[81:])
+			open(sys.argv[1], 'wb').write(d[:80] + d[81:])
+		EOF
+		FROM=$(( $(wc -l < ${SERVER_LOG}) + 1 ))
+		start_server -m ${metadata}
+		run_client ${WORK_DIR}/l.bin
+		check_files ${WORK_DIR}/l.bin
+		tail -n +${FROM} ${SERVER_LOG} | grep -m1 "Request chunk" |
+				grep -q '\[0-' && fail "restarted with ${metadata}"
+		stop_server
+	done
+	;;
+*)
+	echo "Unknown case: ${CASE}"
+	exit 1
+	;;
+esac
+
+stop_server
+echo "${CASE} OK"
@@ -0,0 +1,108 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+// Released under MIT License
+// Copyright (c) 2020 Hernan Perrone (hernan.perrone@gmail.com)
+//////////////////////////////////////////////////////////////////////////////
+
+#include <cstdio>
+#include <random>
+#include <vector>
+
+#include <unistd.h>
+
+#include "ft_test.hpp"
+#include "file/ft_blake2.hpp"
+#include "file/ft_file.hpp"
+#include "file/ft_file_hasher.hpp"
+#include "file/ft_file_tree.hpp"
+
+using namespace ft;
+
+static std::vector<uint8_t> expectedHash(proto::HashAlgo hash_algo,
+		const std::vector<uint8_t>& data)
+{
+	std::vector<uint8_t> hash(proto::HASH_SIZE);
+	if (hash_algo == proto::HASH_ALGO_BLAKE2B_TREE) {
+		return file::FileTree(data).getFileHash();
+	} else if (hash_algo == proto::HASH_ALGO_BLAKE2BP) {
+		file::Blake2bp blake2bp;
+		blake2bp.update(data.data(), data.size());
+		blake2bp.final(hash.data());
+	} else {
+		file::Blake2b blake2b;
+		blake2b.update(data.data(), data.size());
+		blake2b.final(hash.data());
+	}
+	return hash;
+}
+
+/// Hashes the data by whole chunks, in pieces of random length, resuming from
+/// the checkpoint after each one as a restarted server does
+static void testResume(proto::HashAlgo hash_algo, size_t size,
+		std::mt19937& rng)
+{
+	std::vector<uint8_t> data(size);
+	for (auto& b : data) {
+		b = (uint8_t)rng();
+	}
+	auto expected = expectedHash(hash_algo, data);
+
+	FILE* checkpoint = tmpfile();
+	int fd = fileno(checkpoint);
+	size_t offset = 0;
+	while (offset < size) {
+		file::FileHasher hasher(hash_algo, size, expected);
+		if (offset > 0) {
+			FT_CHECK(hasher.load(fd));
+		}
+		FT_CHECK(hasher.getOffset() == offset);
+
+		size_t len = std::min(size - offset,
+				(rng() % 5 + 1) * file::CHUNK_SIZE);
+		hasher.update(data.data() + offset, len);
+		offset += len;
+		hasher.save(fd);
+
+		if (offset == size) {
+			std::vector<uint8_t> hash;
+			hasher.final(hash);
+			FT_CHECK(hash == expected);
+		}
+	}
+
+	// The checkpoint is only valid for the same file, and intact
+	if (size > 0) {
+		std::vector<uint8_t> other_hash(proto::HASH_SIZE, 0xEE);
+		file::FileHasher other(hash_algo, size, other_hash);
+		FT_CHECK(!other.load(fd));
+		FT_CHECK(other.getOffset() == 0);
+
+		uint8_t b;
+		FT_CHECK(pread(fd, &b, 1, proto::HASH_SIZE + 1) == 1);
+		b ^= 0x01;
+		FT_CHECK(pwrite(fd, &b, 1, proto::HASH_SIZE + 1) == 1);
+		file::FileHasher corrupted(hash_algo, size, expected);
+		FT_CHECK(!corrupted.load(fd));
+		FT_CHECK(corrupted.getOffset() == 0);
+	}
+
+	fclose(checkpoint);
+}
+
+int main()
+{
+	std::mt19937 rng(1);
+	const size_t sizes[] = { 0, 1, 127, 128, 129, file::CHUNK_SIZE,
+			file::CHUNK_SIZE + 1, file::CHUNK_SIZE * 7 + 5,
+			file::CHUNK_SIZE * 64, 1000000 };
+	const proto::HashAlgo algos[] = { proto::HASH_ALGO_BLAKE2B,
+			proto::HASH_ALGO_BLAKE2B_TREE, proto::HASH_ALGO_BLAKE2BP };
+
+	for (auto hash_algo : algos) {
+		for (size_t size : sizes) {
+			testResume(hash_algo, size, rng);
+		}
+	}
+
+	return FT_TEST_RESULT();
+}
@@ -0,0 +1,64 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+// Released under MIT License
+// Copyright (c) 2020 Hernan Perrone (hernan.perrone@gmail.com)
+//////////////////////////////////////////////////////////////////////////////
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <vector>
+
+#include "file/ft_file_hasher.hpp"
+
+// Prints the hash of a file as calculated by the server: by FileHasher, in
+// pieces of the given length, resuming from its checkpoint after each one.
+// Used by ft_hashlib_test.py to check the hashes against Python's hashlib.
+//
+// usage: ft_hash_file blake2b|blake2bp PIECE_LEN FILE
+
+int main(int argc, char** argv)
+{
+	if (argc != 4) {
+		std::cerr << "usage: " << argv[0] << " blake2b|blake2bp PIECE_LEN FILE"
+				<< std::endl;
+		return 2;
+	}
+
+	auto hash_algo = std::string(argv[1]) == "blake2bp" ?
+			ft::proto::HASH_ALGO_BLAKE2BP : ft::proto::HASH_ALGO_BLAKE2B;
+	size_t piece_len = std::strtoul(argv[2], nullptr, 10);
+	std::ifstream in(argv[3], std::ios::binary);
+	std::vector<uint8_t> data((std::istreambuf_iterator<char>(in)),
+			std::istreambuf_iterator<char>());
+
+	std::vector<uint8_t> file_hash(ft::proto::HASH_SIZE, 0);
+	FILE* checkpoint = tmpfile();
+	int fd = fileno(checkpoint);
+	size_t offset = 0;
+	std::vector<uint8_t> hash;
+	do {
+		ft::file::FileHasher hasher(hash_algo, data.size(), file_hash);
+		if (offset > 0 && !hasher.load(fd)) {
+			std::cerr << "Invalid checkpoint at " << offset << std::endl;
+			return 1;
+		}
+
+		size_t len = std::min(piece_len, data.size() - offset);
+		hasher.update(data.data() + offset, len);
+		offset += len;
+		hasher.save(fd);
+		if (offset == data.size()) {
+			hasher.final(hash);
+		}
+	} while (offset < data.size());
+	fclose(checkpoint);
+
+	for (auto b : hash) {
+		printf("%02x", b);
+	}
+	printf("\n");
+	return 0;
+}
@@ -0,0 +1,74 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+// Released under MIT License
+// Copyright (c) 2020 Hernan Perrone (hernan.perrone@gmail.com)
+//////////////////////////////////////////////////////////////////////////////
+
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <thread>
+
+#include "ft_test.hpp"
+#include "request/ft_hash_pool.hpp"
+
+using namespace ft;
+
+/// A completion callback submitting jobs while the queue is full (e.g. a file
+/// verified starting the next ones of a manifest) does not wait for itself
+static void testSubmitFromCallback()
+{
+	request::HashPool pool("TEST", 1, 1);
+	std::atomic<int> n_done(0);
+	std::promise<void> release;
+	auto released = release.get_future().share();
+
+	pool.submit(0, [released]() { released.wait(); return true; },
+			[&pool, &n_done](bool) {
+				for (int i = 0; i < 3; i++) {
+					pool.submit(0, []() { return true; },
+							[&n_done](bool) { n_done++; });
+				}
+			});
+
+	// Queued behind the first one, filling the queue
+	pool.submit(0, []() { return true; }, [&n_done](bool) { n_done++; });
+	release.set_value();
+
+	for (int i = 0; i < 200 && n_done < 4; i++) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+	FT_CHECK(n_done == 4);
+	pool.stop();
+}
+
+/// Other threads wait for room in the queue
+static void testSubmitBlocks()
+{
+	request::HashPool pool("TEST", 1, 1);
+	std::promise<void> release;
+	auto released = release.get_future().share();
+
+	pool.submit(0, [released]() { released.wait(); return true; },
+			[](bool) {});
+	pool.submit(0, []() { return true; }, [](bool) {});
+
+	auto blocked = std::async(std::launch::async, [&pool]() {
+		pool.submit(0, []() { return true; }, [](bool) {});
+	});
+	FT_CHECK(blocked.wait_for(std::chrono::milliseconds(100)) ==
+			std::future_status::timeout);
+
+	release.set_value();
+	FT_CHECK(blocked.wait_for(std::chrono::seconds(2)) ==
+			std::future_status::ready);
+	pool.stop();
+}
+
+int main()
+{
+	testSubmitFromCallback();
+	testSubmitBlocks();
+
+	return FT_TEST_RESULT();
+}
@@ -0,0 +1,76 @@
+#!/usr/bin/env python3
+
+################################################################################
+###  Cross check of the file hashes against Python's hashlib
+#
+# The BLAKE2b of the server (ft::file::Blake2b, which can be checkpointed
+# unlike the one of Crypto++) is checked against hashlib.blake2b, for data
+# around the block boundaries and hashed in pieces of several lengths.
+#
+# BLAKE2bp is checked against its definition on top of hashlib.blake2b: the
+# data split in 4 lanes of interleaved blocks, each hashed as a leaf, and the
+# 4 digests hashed as the root.
+#
+# usage: ft_hashlib_test.py FT_HASH_FILE
+#
+###  # Released under MIT License
+###  Copyright (c) 2020 Hernan Perrone (hernan.perrone@gmail.com)
+################################################################################
+
+import hashlib
+import os
+import random
+import subprocess
+import sys
+import tempfile
+
+SIZES  = [0, 1, 127, 128, 129, 255, 256, 257, 511, 512, 513, 1023, 1024,
+          1025, 3968, 3969, 100000, 1048583]
+PIECES = [1, 3, 128, 500, 3968, 1 << 21]
+
+LANES = 4
+BLOCK = 128
+
+def blake2b(data):
+    return hashlib.blake2b(data).hexdigest()
+
+def blake2bp(data):
+    params = dict(digest_size=64, fanout=LANES, depth=2, leaf_size=0,
+                  inner_size=64)
+    lanes = [b''.join(data[j:j + BLOCK]
+                      for j in range(i * BLOCK, len(data), LANES * BLOCK))
+             for i in range(LANES)]
+    leaves = b''.join(hashlib.blake2b(lane, node_offset=i, node_depth=0,
+                                      last_node=(i == LANES - 1),
+                                      **params).digest()
+                      for i, lane in enumerate(lanes))
+    return hashlib.blake2b(leaves, node_offset=0, node_depth=1,
+                           last_node=True, **params).hexdigest()
+
+def main():
+    tool = sys.argv[1]
+    rng = random.Random(1)
+    bad = 0
+    with tempfile.NamedTemporaryFile() as tmp:
+        for size in SIZES:
+            data = bytes(rng.getrandbits(8) for _ in range(size))
+            tmp.seek(0)
+            tmp.truncate()
+            tmp.write(data)
+            tmp.flush()
+            expected = {'blake2b': blake2b(data), 'blake2bp': blake2bp(data)}
+            for algo in expected:
+                for piece in PIECES:
+                    # Pieces of a few bytes take too long on the large sizes
+                    if size > 100000 and piece < 500:
+                        continue
+                    out = subprocess.check_output(
+                            [tool, algo, str(piece), tmp.name]).decode().strip()
+                    if out != expected[algo]:
+                        print('MISMATCH', algo, 'size', size, 'piece', piece)
+                        bad += 1
+    print('FAIL' if bad else 'OK')
+    return 1 if bad else 0
+
+if __name__ == '__main__':
+    sys.exit(main())
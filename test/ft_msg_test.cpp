@@ -0,0 +1,217 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+// Released under MIT License
+// Copyright (c) 2020 Hernan Perrone (hernan.perrone@gmail.com)
+//////////////////////////////////////////////////////////////////////////////
+
+#include <stdexcept>
+#include <vector>
+
+#include "ft_test.hpp"
+#include "protocol/ft_msg.hpp"
+
+using namespace ft::proto;
+
+static Message makeMsg(MessageType msg_type)
+{
+	Message msg;
+	msg.msg_type   = msg_type;
+	msg.seq_number = 7;
+	msg.client_uuid = {};
+	msg.file_name  = "dir/file.bin";
+	return msg;
+}
+
+static std::vector<uint8_t> serialize(Message& msg)
+{
+	std::vector<uint8_t> buf;
+	msg.serialize(buf);
+	return buf;
+}
+
+/// Every prefix of a message must be parsed or rejected as too short
+static void checkTruncated(const std::vector<uint8_t>& buf)
+{
+	for (size_t len = 0; len < buf.size(); len++) {
+		std::vector<uint8_t> part(buf.begin(), buf.begin() + len);
+		try {
+			Message msg(part);
+		} catch (const std::length_error&) {
+		} catch (...) {
+			std::cout << "Unexpected exception parsing " << len << " of " <<
+					buf.size() << " bytes" << std::endl;
+			ft_test_failures++;
+		}
+	}
+}
+
+/// Message of the type with only the header, and then the given body
+static std::vector<uint8_t> rawMsg(MessageType msg_type,
+		const std::vector<uint8_t>& body)
+{
+	Message msg = makeMsg(MSGTYPE_FILE_COMPLETE);
+	std::vector<uint8_t> buf = serialize(msg);
+	buf[3] = (uint8_t)(msg_type & 0xff);
+	buf.insert(buf.end(), body.begin(), body.end());
+	return buf;
+}
+
+static void testOffer()
+{
+	Message msg = makeMsg(MSGTYPE_FILE_OFFER);
+	msg.offer.file_size     = 3;
+	msg.offer.file_n_chunks = 1;
+	msg.offer.file_hash.assign(HASH_SIZE, 0xAB);
+	msg.offer.hash_algo     = HASH_ALGO_BLAKE2B;
+	msg.offer.has_inline    = true;
+	msg.offer.inline_data   = { 1, 2, 3 };
+	auto buf = serialize(msg);
+
+	Message parsed(buf);
+	FT_CHECK(parsed.msg_type == MSGTYPE_FILE_OFFER);
+	FT_CHECK(parsed.seq_number == 7);
+	FT_CHECK(parsed.file_name == "dir/file.bin");
+	FT_CHECK(parsed.offer.file_size == 3);
+	FT_CHECK(parsed.offer.file_hash == msg.offer.file_hash);
+	FT_CHECK(parsed.offer.has_inline);
+	FT_CHECK(parsed.offer.inline_data == msg.offer.inline_data);
+	checkTruncated(buf);
+}
+
+static void testChunkData()
+{
+	Message msg = makeMsg(MSGTYPE_FILE_CHUNK_DATA);
+	msg.chunk_data.idx    = 5;
+	msg.chunk_data.data.assign(100, 0x5A);
+	msg.chunk_data.crc    = 0x12345678;
+	msg.chunk_data.n_zero = 0;
+	msg.chunk_data.proof.assign(2 * CHUNK_HASH_SIZE, 0x11);
+	auto buf = serialize(msg);
+
+	Message parsed(buf);
+	FT_CHECK(parsed.chunk_data.idx == 5);
+	FT_CHECK(parsed.chunk_data.data == msg.chunk_data.data);
+	FT_CHECK(parsed.chunk_data.crc == 0x12345678);
+	FT_CHECK(parsed.chunk_data.proof == msg.chunk_data.proof);
+	checkTruncated(buf);
+
+	// A chunk length past the end of the message
+	FT_CHECK_THROWS(Message(rawMsg(MSGTYPE_FILE_CHUNK_DATA,
+			{ 0, 0, 0, 0, 0xFF, 0xFF, 1, 2, 3, 4 })), std::length_error);
+}
+
+static void testDelta()
+{
+	Message msg = makeMsg(MSGTYPE_FILE_DELTA_DATA);
+	msg.delta_data.chunk_first = 2;
+	msg.delta_data.n_chunks    = 1;
+	DeltaOp copy    = { false, 64, 128, {} };
+	DeltaOp literal = { true, 0, 4, { 9, 8, 7, 6 } };
+	msg.delta_data.ops = { copy, literal };
+	auto buf = serialize(msg);
+
+	Message parsed(buf);
+	FT_CHECK(parsed.delta_data.ops.size() == 2);
+	FT_CHECK(!parsed.delta_data.ops[0].literal);
+	FT_CHECK(parsed.delta_data.ops[0].src_offset == 64);
+	FT_CHECK(parsed.delta_data.ops[0].len == 128);
+	FT_CHECK(parsed.delta_data.ops[1].data == literal.data);
+	checkTruncated(buf);
+
+	// 65535 signatures or ops, in a few bytes
+	FT_CHECK_THROWS(Message(rawMsg(MSGTYPE_FILE_DELTA_SIGS,
+			{ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xFF, 0xFF, 1, 2 })),
+			std::length_error);
+	FT_CHECK_THROWS(Message(rawMsg(MSGTYPE_FILE_DELTA_DATA,
+			{ 0, 0, 0, 0, 0, 1, 0xFF, 0xFF, 2, 0, 4 })), std::length_error);
+}
+
+static void testCdc()
+{
+	Message msg = makeMsg(MSGTYPE_FILE_CDC_RECIPE);
+	msg.cdc_recipe.n_total   = 10;
+	msg.cdc_recipe.idx_first = 0;
+	msg.cdc_recipe.entries   = { { 4096, std::vector<uint8_t>(
+			CHUNK_HASH_SIZE, 0x33) } };
+	auto buf = serialize(msg);
+
+	Message parsed(buf);
+	FT_CHECK(parsed.cdc_recipe.n_total == 10);
+	FT_CHECK(parsed.cdc_recipe.entries.size() == 1);
+	FT_CHECK(parsed.cdc_recipe.entries[0].len == 4096);
+	checkTruncated(buf);
+
+	FT_CHECK_THROWS(Message(rawMsg(MSGTYPE_FILE_CDC_RECIPE,
+			{ 0, 0, 0, 10, 0, 0, 0, 0, 0xFF, 0xFF })), std::length_error);
+	FT_CHECK_THROWS(Message(rawMsg(MSGTYPE_FILE_CDC_DATA,
+			{ 0, 0, 0, 0, 0xFF, 0xFF, 1 })), std::length_error);
+}
+
+static void testManifest()
+{
+	Message msg = makeMsg(MSGTYPE_FILE_MANIFEST);
+	msg.manifest.n_total   = 2;
+	msg.manifest.idx_first = 0;
+	ManifestEntry big   = { "big.bin", 1U << 20, 256,
+			std::vector<uint8_t>(HASH_SIZE, 1), HASH_ALGO_BLAKE2B_TREE, false,
+			{} };
+	ManifestEntry small = { "small.txt", 2, 1,
+			std::vector<uint8_t>(HASH_SIZE, 2), HASH_ALGO_BLAKE2B, true,
+			{ 'h', 'i' } };
+	msg.manifest.files = { big, small };
+	auto buf = serialize(msg);
+
+	Message parsed(buf);
+	FT_CHECK(parsed.manifest.files.size() == 2);
+	FT_CHECK(parsed.manifest.files[0].file_name == "big.bin");
+	FT_CHECK(parsed.manifest.files[0].file_n_chunks == 256);
+	FT_CHECK(!parsed.manifest.files[0].has_inline);
+	FT_CHECK(parsed.manifest.files[1].inline_data == small.inline_data);
+	checkTruncated(buf);
+
+	// 65535 files in a 20 bytes body
+	std::vector<uint8_t> body = { 0, 0, 0, 1, 0, 0, 0, 0, 0xFF, 0xFF };
+	body.resize(20, 0);
+	FT_CHECK_THROWS(Message(rawMsg(MSGTYPE_FILE_MANIFEST, body)),
+			std::length_error);
+}
+
+static void testManifestStatus()
+{
+	Message msg = makeMsg(MSGTYPE_FILE_MANIFEST_STATUS);
+	ManifestFileStatus missing = { "big.bin", MANIFEST_FILE_MISSING, 12,
+			{ { 0, 3 }, { 10, 17 } } };
+	ManifestFileStatus complete = { "small.txt", MANIFEST_FILE_COMPLETE, 0,
+			{} };
+	msg.manifest_status.files = { missing, complete };
+	auto buf = serialize(msg);
+
+	Message parsed(buf);
+	FT_CHECK(parsed.manifest_status.files.size() == 2);
+	FT_CHECK(parsed.manifest_status.files[0].n_missing == 12);
+	FT_CHECK(parsed.manifest_status.files[0].ranges.size() == 2);
+	FT_CHECK(parsed.manifest_status.files[0].ranges[1].last == 17);
+	FT_CHECK(parsed.manifest_status.files[1].status == MANIFEST_FILE_COMPLETE);
+	checkTruncated(buf);
+
+	// 65535 files, and then 65535 ranges of a file
+	FT_CHECK_THROWS(Message(rawMsg(MSGTYPE_FILE_MANIFEST_STATUS,
+			{ 0xFF, 0xFF, 0, 1, 0, 0, 0, 0 })), std::length_error);
+	FT_CHECK_THROWS(Message(rawMsg(MSGTYPE_FILE_MANIFEST_STATUS,
+			{ 0, 1, 0, 2, 0, 0, 0, 1, 0xFF, 0xFF })), std::length_error);
+}
+
+int main()
+{
+	testOffer();
+	testChunkData();
+	testDelta();
+	testCdc();
+	testManifest();
+	testManifestStatus();
+
+	// Headers shorter than the fixed fields
+	FT_CHECK_THROWS(Message(std::vector<uint8_t>(10, 0)), std::length_error);
+
+	return FT_TEST_RESULT();
+}
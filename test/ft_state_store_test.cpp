@@ -0,0 +1,250 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+// Released under MIT License
+// Copyright (c) 2020 Hernan Perrone (hernan.perrone@gmail.com)
+//////////////////////////////////////////////////////////////////////////////
+
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "ft_test.hpp"
+#include "file/ft_state_store.hpp"
+#include "protocol/ft_msg.hpp"
+
+using namespace ft;
+
+static const size_t CHUNK = 1024U;
+
+/// What a transfer in the store is expected to have
+struct Expected {
+	size_t               file_size;
+	std::vector<uint8_t> hash;
+	uint8_t              hash_algo;
+	std::vector<size_t>  received;
+};
+
+static std::vector<uint8_t> hashOf(std::mt19937& rng)
+{
+	std::vector<uint8_t> hash(proto::HASH_SIZE);
+	for (auto& b : hash) {
+		b = (uint8_t)rng();
+	}
+	return hash;
+}
+
+static size_t countLines(const std::filesystem::path& file)
+{
+	std::ifstream is(file);
+	std::string line;
+	size_t n = 0;
+	while (std::getline(is, line)) {
+		n++;
+	}
+	return n;
+}
+
+static void add(file::StateStore& store, const std::filesystem::path& base,
+		std::map<std::string, Expected>& expected, const std::string& path,
+		size_t file_size, std::mt19937& rng)
+{
+	Expected transfer = { file_size, hashOf(rng), proto::HASH_ALGO_BLAKE2B,
+			{} };
+	store.create(base / path, file_size, CHUNK, transfer.hash,
+			transfer.hash_algo);
+
+	auto bitmap = store.bitmap(base / path, false);
+	size_t n_chunks = (file_size + CHUNK - 1) / CHUNK;
+	for (size_t idx = 0; idx < n_chunks; idx++) {
+		if (rng() % 3 == 0) {
+			bitmap->mark(idx, 1, true);
+			transfer.received.push_back(idx);
+		}
+	}
+	expected[path] = transfer;
+}
+
+/// Checks the store has the transfers expected, and no other
+static void check(file::StateStore& store, const std::filesystem::path& base,
+		const std::map<std::string, Expected>& expected)
+{
+	auto transfers = store.list();
+	FT_CHECK(transfers.size() == expected.size());
+	for (const auto& transfer : transfers) {
+		auto it = expected.find(transfer.path.generic_string());
+		FT_CHECK(it != expected.end());
+		if (it == expected.end()) {
+			continue;
+		}
+		FT_CHECK(transfer.n_received == it->second.received.size());
+
+		size_t file_size, chunk_size;
+		std::vector<uint8_t> hash;
+		uint8_t hash_algo;
+		FT_CHECK(store.readHeader(base / it->first, file_size, chunk_size, hash,
+				hash_algo));
+		FT_CHECK(file_size == it->second.file_size && chunk_size == CHUNK &&
+				hash == it->second.hash && hash_algo == it->second.hash_algo);
+
+		auto bitmap = store.bitmap(base / it->first, false);
+		size_t idx = bitmap->find(0, true);
+		for (size_t received : it->second.received) {
+			FT_CHECK(idx == received);
+			idx = bitmap->find(idx + 1, true);
+		}
+		FT_CHECK(idx == UINT64_MAX);
+	}
+}
+
+/// Records added, replaced, renamed and removed are found when loaded again
+static void testReload(const std::filesystem::path& base, std::mt19937& rng)
+{
+	std::map<std::string, Expected> expected;
+	{
+		file::StateStore store("TEST", base, true);
+		FT_CHECK(store.isNew());
+		for (int i = 0; i < 20; i++) {
+			add(store, base, expected, "dir" + std::to_string(i % 3) + "/f" +
+					std::to_string(i), 1 + rng() % (300 * CHUNK), rng);
+		}
+		check(store, base, expected);
+
+		// Created again with the same header, it is kept with its chunks
+		const auto& same = expected["dir0/f0"];
+		store.create(base / "dir0/f0", same.file_size, CHUNK, same.hash,
+				same.hash_algo);
+
+		// With another one, it is replaced with none
+		add(store, base, expected, "dir1/f1", 5 * CHUNK, rng);
+		store.bitmap(base / "dir1/f1", false)->mark(0, 5, false);
+		expected["dir1/f1"].received.clear();
+
+		store.remove(base / "dir2/f2");
+		expected.erase("dir2/f2");
+
+		// Renamed over another one, and to a new path
+		store.rename(base / "dir0/f3", base / "dir0/f6");
+		expected["dir0/f6"] = expected["dir0/f3"];
+		expected.erase("dir0/f3");
+		store.rename(base / "dir1/f4", base / "new/f4");
+		expected["new/f4"] = expected["dir1/f4"];
+		expected.erase("dir1/f4");
+
+		FT_CHECK(!store.exists(base / "dir0/f3"));
+		FT_CHECK(store.exists(base / "new/f4"));
+		FT_CHECK_THROWS(store.bitmap(base / "dir2/f2", false),
+				std::out_of_range);
+		check(store, base, expected);
+	}
+
+	file::StateStore store("TEST", base, true);
+	FT_CHECK(!store.isNew());
+	check(store, base, expected);
+
+	// The journal is compacted when loaded: a line per record
+	FT_CHECK(countLines(base / ".state.journal") == expected.size());
+
+	// The space of the records removed is reused
+	add(store, base, expected, "reused", CHUNK, rng);
+	check(store, base, expected);
+}
+
+/// A line whose record is not in the index (e.g. not written before a crash),
+/// or partially written, is dropped
+static void testTorn(const std::filesystem::path& base, std::mt19937& rng)
+{
+	std::map<std::string, Expected> expected;
+	{
+		file::StateStore store("TEST", base, false);
+		add(store, base, expected, "kept", 10 * CHUNK, rng);
+		add(store, base, expected, "torn", 10 * CHUNK, rng);
+		add(store, base, expected, "last", 10 * CHUNK, rng);
+	}
+
+	// The magic of the record of "torn" is cleared in the index
+	std::ifstream is(base / ".state.journal");
+	std::string line;
+	while (std::getline(is, line)) {
+		if (line.size() > 5 && line.substr(line.size() - 5) == " torn") {
+			std::istringstream ss(line);
+			std::string op;
+			uint64_t serial;
+			off_t offset;
+			ss >> op >> serial >> offset;
+			int fd = open((base / ".state.index").c_str(), O_WRONLY);
+			uint8_t zero = 0;
+			FT_CHECK(pwrite(fd, &zero, 1, offset) == 1);
+			close(fd);
+		}
+	}
+	is.close();
+	expected.erase("torn");
+
+	std::ofstream os(base / ".state.journal", std::ios::app);
+	os << "+ 99 64 10" << std::endl << "- " << std::endl;
+	os.close();
+
+	file::StateStore store("TEST", base, false);
+	check(store, base, expected);
+}
+
+/// The journal is compacted by the thread, once it has many removed lines
+static void testCompaction(const std::filesystem::path& base,
+		std::mt19937& rng)
+{
+	std::map<std::string, Expected> expected;
+	file::StateStore store("TEST", base, false);
+	add(store, base, expected, "first", 100 * CHUNK, rng);
+	for (int i = 0; i < 1000; i++) {
+		std::string path = "tmp/t" + std::to_string(i);
+		add(store, base, expected, path, 1 + rng() % (10 * CHUNK), rng);
+		if (i % 10 != 0) {
+			store.remove(base / path);
+			expected.erase(path);
+		}
+	}
+
+	// Without it, a line per record added and removed
+	size_t n_appended = 1 + 1000 + 900;
+	size_t n_lines = countLines(base / ".state.journal");
+	for (int i = 0; i < 100 && n_lines >= n_appended / 2; i++) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(20));
+		n_lines = countLines(base / ".state.journal");
+	}
+	FT_CHECK(n_lines < n_appended / 2);
+	check(store, base, expected);
+
+	// Added after the journal was compacted
+	add(store, base, expected, "after", CHUNK, rng);
+	store.stop();
+
+	file::StateStore loaded("TEST", base, false);
+	check(loaded, base, expected);
+}
+
+int main()
+{
+	std::mt19937 rng(1);
+	char dir[] = "/tmp/ft_state_store_testXXXXXX";
+	if (mkdtemp(dir) == nullptr) {
+		return 1;
+	}
+	std::filesystem::path tmp(dir);
+
+	testReload(tmp / "reload", rng);
+	testTorn(tmp / "torn", rng);
+	testCompaction(tmp / "compaction", rng);
+
+	std::filesystem::remove_all(tmp);
+	return FT_TEST_RESULT();
+}
@@ -0,0 +1,41 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+// Released under MIT License
+// Copyright (c) 2020 Hernan Perrone (hernan.perrone@gmail.com)
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef FT_TEST_H
+#define FT_TEST_H
+
+#include <iostream>
+
+// Minimal checks for the unit tests. Each test is an executable run by ctest,
+// which fails if any check fails (exit code is the number of failed checks).
+
+static int ft_test_failures = 0;
+
+#define FT_CHECK(cond) do { \
+	if (!(cond)) { \
+		std::cout << __FILE__ << ":" << __LINE__ << ": check failed: " \
+				<< #cond << std::endl; \
+		ft_test_failures++; \
+	} \
+} while (0)
+
+#define FT_CHECK_THROWS(expr, exc) do { \
+	bool thrown = false; \
+	try { \
+		expr; \
+	} catch (const exc&) { \
+		thrown = true; \
+	} \
+	if (!thrown) { \
+		std::cout << __FILE__ << ":" << __LINE__ << ": not thrown: " \
+				<< #exc << " by " << #expr << std::endl; \
+		ft_test_failures++; \
+	} \
+} while (0)
+
+#define FT_TEST_RESULT() (ft_test_failures > 0 ? 1 : 0)
+
+#endif // FT_TEST_H